@@ -0,0 +1,175 @@
+/*
+ * The metadata storm of bench.sh: create, stat, list and unlink a number of
+ * files, timing every call, and print the results as one line of JSON.
+ *
+ *	./bench-meta [-U] <dir> <files> [files-per-directory]
+ *
+ * The files are spread over the existing subdirectories d00000, d00001...
+ * of <dir>, files-per-directory (15 by default) in each. That is as many
+ * as a newly made simplefs directory has room for, so the same tree works
+ * on simplefs and on the filesystems it is compared with.
+ *
+ * Every phase runs over all the files even when some calls fail, and
+ * reports how many did. -U leaves out the unlink phase, for filesystems
+ * that have none, like simplefs.
+ *
+ * License: Creative Commons Zero License - http://creativecommons.org/publicdomain/zero/1.0/
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+struct phase {
+	const char *name;
+	uint64_t ops;
+	uint64_t errors;
+	uint64_t total_ns;
+	/* One entry per call, sorted for the percentiles at the end */
+	uint64_t *ns;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record(struct phase *p, uint64_t start, int failed)
+{
+	uint64_t ns = now_ns() - start;
+
+	p->ns[p->ops++] = ns;
+	p->total_ns += ns;
+	if (failed)
+		p->errors++;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const struct phase *p, unsigned int pct)
+{
+	return p->ops ? p->ns[(p->ops - 1) * pct / 100] : 0;
+}
+
+static void print_phase(const struct phase *p, int last)
+{
+	qsort(p->ns, p->ops, sizeof(*p->ns), cmp_u64);
+	printf("\"%s\":{\"ops\":%llu,\"errors\":%llu,\"total_ns\":%llu,"
+	       "\"ns_per_op\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu}%s",
+	       p->name, (unsigned long long)p->ops,
+	       (unsigned long long)p->errors, (unsigned long long)p->total_ns,
+	       (unsigned long long)(p->ops ? p->total_ns / p->ops : 0),
+	       (unsigned long long)percentile(p, 50),
+	       (unsigned long long)percentile(p, 99),
+	       (unsigned long long)percentile(p, 100), last ? "" : ",");
+}
+
+static void file_path(char *path, size_t size, const char *dir,
+		      uint64_t i, uint64_t per_dir)
+{
+	snprintf(path, size, "%s/d%05llu/f%llu", dir,
+		 (unsigned long long)(i / per_dir), (unsigned long long)i);
+}
+
+int main(int argc, char *argv[])
+{
+	struct phase create = { .name = "create" }, stat_ = { .name = "stat" },
+		     readdir_ = { .name = "readdir" }, unlink_ = { .name = "unlink" };
+	struct phase *phases[] = { &create, &stat_, &readdir_, &unlink_ };
+	uint64_t files, per_dir = 15, dirs, i, start, nphases = 4;
+	char path[4096];
+	struct stat st;
+	struct dirent *de;
+	DIR *d;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "U")) != -1) {
+		switch (opt) {
+		case 'U':
+			nphases = 3;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc < 3) {
+usage:
+		fprintf(stderr, "Usage: bench-meta [-U] <dir> <files> [files-per-directory]\n");
+		return 1;
+	}
+	files = strtoull(argv[2], NULL, 0);
+	if (argc > 3)
+		per_dir = strtoull(argv[3], NULL, 0);
+	if (!files || !per_dir) {
+		fprintf(stderr, "The number of files must not be 0\n");
+		return 1;
+	}
+	dirs = (files + per_dir - 1) / per_dir;
+
+	for (i = 0; i < nphases; i++) {
+		phases[i]->ns = calloc(files, sizeof(uint64_t));
+		if (!phases[i]->ns) {
+			perror("calloc");
+			return 1;
+		}
+	}
+
+	for (i = 0; i < files; i++) {
+		file_path(path, sizeof(path), argv[1], i, per_dir);
+		start = now_ns();
+		fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if (fd >= 0)
+			close(fd);
+		record(&create, start, fd < 0);
+	}
+
+	for (i = 0; i < files; i++) {
+		file_path(path, sizeof(path), argv[1], i, per_dir);
+		start = now_ns();
+		record(&stat_, start, stat(path, &st) < 0);
+	}
+
+	/* One op per directory, listing all of it */
+	for (i = 0; i < dirs; i++) {
+		snprintf(path, sizeof(path), "%s/d%05llu", argv[1],
+			 (unsigned long long)i);
+		start = now_ns();
+		d = opendir(path);
+		if (d) {
+			while ((de = readdir(d)))
+				;
+			closedir(d);
+		}
+		record(&readdir_, start, !d);
+	}
+
+	for (i = 0; i < files && nphases > 3; i++) {
+		file_path(path, sizeof(path), argv[1], i, per_dir);
+		start = now_ns();
+		record(&unlink_, start, unlink(path) < 0);
+	}
+
+	printf("{\"files\":%llu,\"files_per_directory\":%llu,",
+	       (unsigned long long)files, (unsigned long long)per_dir);
+	for (i = 0; i < nphases; i++)
+		print_phase(phases[i], i == nphases - 1);
+	printf("}\n");
+
+	return 0;
+}
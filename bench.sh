@@ -0,0 +1,223 @@
+#!/usr/bin/env bash
+
+#
+# Benchmark simplefs against ext4 in a QEMU guest, without root on the host
+#
+# The guest boots the given kernel with an initramfs holding busybox, fio,
+# bench-meta and the modules. It gets two virtio disks: a simplefs image,
+# with the internal journal mkfs-simplefs lays out, and an ext4 image of the
+# same size made from the same tree. On each filesystem it runs:
+#
+# - fio sequential (1M) and random (4K) reads and writes, buffered, on a
+#   file made by mkfs, so that the reads find the same data on both
+# - a metadata storm: create, stat, readdir and unlink of N files, spread
+#   over directories of 15 (see bench-meta.c). simplefs has no unlink, so
+#   it skips that phase.
+# - a sync write latency test: 4K random writes with O_SYNC. Every write
+#   to simplefs goes through its journal synchronously anyway, so this is
+#   what it costs.
+#
+# The report is JSON: one object per filesystem, holding the fio JSON
+# output of each job and the bench-meta output.
+#
+# Usage: ./bench.sh -k <kernel image> -m <module> [-m <module>...] [options]
+#
+#   -k kernel   the kernel to boot, with virtio-blk, devtmpfs and ext4 built in
+#   -m module   a module to load, in the order given (jbd2.ko before simplefs.ko,
+#               when jbd2 is a module too)
+#   -s MiB      size of each image (1024)
+#   -f MiB      size of the fio file (256)
+#   -n files    number of files in the metadata storm (10000)
+#   -t seconds  how long each fio job runs (30)
+#   -o report   where the report goes (bench-report.json)
+#
+# Needs qemu-system-x86_64, busybox, fio, mke2fs and cpio on the host.
+# KVM is used when /dev/kvm can be opened, TCG otherwise.
+#
+
+set -e
+
+root_pwd="$PWD"
+kernel=""
+modules=()
+image_mib=1024
+fio_mib=256
+files=10000
+runtime=30
+report="bench-report.json"
+
+function usage()
+{
+    sed -n '/^# Usage/,/^# KVM/p' "$0" | sed 's/^# \{0,1\}//' >&2
+    exit 1
+}
+
+function copy_binary()
+{
+    local bin="$1" lib
+
+    [ -x "$bin" ] || bin="$(command -v "$1")"
+    cp "$bin" "$initramfs/bin/"
+
+    # And the shared libraries, for a binary that is not static
+    for lib in $(ldd "$bin" 2>/dev/null | grep -o '/[^ ]*'); do
+        mkdir -p "$initramfs$(dirname "$lib")"
+        cp -L "$lib" "$initramfs$lib"
+    done
+}
+
+function create_images()
+{
+    local tree="$work/tree"
+
+    mkdir -p "$tree/fio" "$tree/storm"
+    # Not zeroes, so that a filesystem cannot get away with less I/O
+    head -c "${fio_mib}M" /dev/urandom > "$tree/fio/data"
+    seq -f "$tree/storm/d%05g" 0 $(( (files + 14) / 15 - 1 )) | xargs mkdir
+
+    truncate -s "${image_mib}M" "$work/simplefs.img"
+    ./mkfs-simplefs -d "$tree" "$work/simplefs.img" > /dev/null
+
+    truncate -s "${image_mib}M" "$work/ext4.img"
+    mke2fs -q -F -t ext4 -d "$tree" "$work/ext4.img"
+
+    rm -rf "$tree"
+}
+
+function create_initramfs()
+{
+    local i=0 module
+
+    initramfs="$work/initramfs"
+    mkdir -p "$initramfs"/{bin,dev,proc,sys,mnt,tmp,modules}
+
+    copy_binary busybox
+    copy_binary fio
+    copy_binary ./bench-meta
+
+    for module in "${modules[@]}"; do
+        cp "$module" "$initramfs/modules/$(printf %02d $i)-$(basename "$module")"
+        i=$((i + 1))
+    done
+
+    cat > "$initramfs/bench.conf" <<EOF
+fio_mib=$fio_mib
+files=$files
+runtime=$runtime
+EOF
+    cat > "$initramfs/init" <<'EOF'
+#!/bin/busybox sh
+
+/bin/busybox --install -s /bin
+mount -t proc proc /proc
+mount -t sysfs sys /sys
+mount -t devtmpfs dev /dev
+. /bench.conf
+
+for module in /modules/*.ko; do
+    insmod "$module"
+done
+
+# fio_job <name> <rw> <block size> [fio options...]
+fio_job()
+{
+    local name="$1" rw="$2" bs="$3"
+
+    shift 3
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+    fio --name="$name" --filename=/mnt/fio/data --size="${fio_mib}M" \
+        --rw="$rw" --bs="$bs" --ioengine=psync --fallocate=none \
+        --runtime="$runtime" --time_based --output-format=json \
+        --output="/tmp/$name.json" "$@" > /dev/null 2>&1 ||
+        echo '{"error":"fio failed"}' > "/tmp/$name.json"
+    printf '"%s":%s' "$name" "$(tr -d '\n' < "/tmp/$name.json")"
+}
+
+# run <fs> <bench-meta options> <mount options...>
+run()
+{
+    local fs="$1" meta_opts="$2" fio meta
+
+    shift 2
+    if ! mount "$@" /mnt; then
+        echo "BENCH-RESULT {\"fs\":\"$fs\",\"error\":\"mount failed\"}"
+        return
+    fi
+
+    fio="$(fio_job seqread read 1M),$(fio_job seqwrite write 1M)"
+    fio="$fio,$(fio_job randread randread 4K),$(fio_job randwrite randwrite 4K)"
+    fio="$fio,$(fio_job sync_write randwrite 4K --sync=1)"
+    meta="$(bench-meta $meta_opts /mnt/storm "$files")"
+
+    umount /mnt
+    echo "BENCH-RESULT {\"fs\":\"$fs\",\"kernel\":\"$(uname -r)\",\"fio\":{$fio},\"meta\":$meta}"
+}
+
+run simplefs -U -t simplefs /dev/vda
+run ext4 "" -t ext4 /dev/vdb
+
+poweroff -f
+EOF
+    chmod +x "$initramfs/init"
+
+    (cd "$initramfs" && find . | cpio -o -H newc --quiet) | gzip > "$work/initramfs.gz"
+}
+
+function boot_guest()
+{
+    local accel="-accel tcg"
+
+    [ -r /dev/kvm ] && [ -w /dev/kvm ] && accel="-accel kvm -cpu host"
+
+    # shellcheck disable=SC2086
+    qemu-system-x86_64 $accel -m 2G -smp 2 -nographic -no-reboot \
+        -kernel "$kernel" -initrd "$work/initramfs.gz" \
+        -append "console=ttyS0 quiet panic=-1" \
+        -drive file="$work/simplefs.img",if=virtio,format=raw,cache=unsafe \
+        -drive file="$work/ext4.img",if=virtio,format=raw,cache=unsafe \
+        > "$work/console.log" 2>&1
+}
+
+function write_report()
+{
+    local results
+
+    results="$(grep '^BENCH-RESULT ' "$work/console.log" | tr -d '\r' |
+               sed 's/^BENCH-RESULT //' | paste -sd, -)"
+    if [ -z "$results" ]; then
+        echo "The guest did not report any results:" >&2
+        tail -n 40 "$work/console.log" >&2
+        exit 1
+    fi
+
+    printf '{"image_mib":%s,"fio_mib":%s,"files":%s,"fio_runtime":%s,"results":[%s]}\n' \
+           "$image_mib" "$fio_mib" "$files" "$runtime" "$results" > "$report"
+    echo "Report written to $report"
+}
+
+while getopts "k:m:s:f:n:t:o:h" opt; do
+    case "$opt" in
+        k) kernel="$(realpath "$OPTARG")" ;;
+        m) modules+=("$(realpath "$OPTARG")") ;;
+        s) image_mib="$OPTARG" ;;
+        f) fio_mib="$OPTARG" ;;
+        n) files="$OPTARG" ;;
+        t) runtime="$OPTARG" ;;
+        o) report="$(realpath -m "$OPTARG")" ;;
+        *) usage ;;
+    esac
+done
+[ -n "$kernel" ] && [ ${#modules[@]} -gt 0 ] || usage
+
+cd "$(dirname "$0")"
+make mkfs-simplefs bench-meta > /dev/null
+
+work="$(mktemp -d)"
+trap 'rm -rf "$work"' EXIT
+
+create_images
+create_initramfs
+boot_guest
+cd "$root_pwd"
+write_report
@@ -0,0 +1,223 @@
+/*
+ * Report how fragmented a mounted simplefs is, and compact it.
+ *
+ *	./defrag-simplefs [-n] <path>...
+ *
+ * Every file of simplefs is a single run of blocks, so a file is never
+ * fragmented itself. What is fragmented is the free space in between:
+ * a file can only be created, or rewritten somewhere else (see
+ * simplefs_unshare and simplefs_compress_repack), where there is a free
+ * run of its whole length. Each file under the given paths is moved down
+ * into the lowest free run it fits in (SIMPLEFS_IOC_DEFRAG), from the
+ * first one on the device to the last, which leaves the free space in
+ * fewer, longer runs at the end.
+ *
+ * The report has one line per file, with its run of blocks and where it
+ * would go, and then the runs of free blocks of the whole filesystem by
+ * length, from /sys/fs/simplefs/<dev>/free_extents, before and after.
+ * With -n nothing is moved, so it can be run at any time to decide when
+ * a defrag is worth it.
+ *
+ * Moving a file takes its inode lock, so writes to it wait in the
+ * meantime, and copies all of it. Files shared with others (reflinks)
+ * stay where they are.
+ *
+ * License: Creative Commons Zero License - http://creativecommons.org/publicdomain/zero/1.0/
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "simple.h"
+
+struct file_run {
+	char *path;
+	struct simplefs_defrag frag;
+};
+
+static struct file_run *files;
+static size_t files_count, files_max;
+static int errors;
+
+static int collect(const char *path, const struct stat *st, int type,
+		   struct FTW *ftw)
+{
+	struct simplefs_defrag frag;
+	int fd;
+
+	(void)ftw;
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || ioctl(fd, SIMPLEFS_IOC_GETFRAG, &frag)) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		errors++;
+		if (fd != -1)
+			close(fd);
+		return 0;
+	}
+	close(fd);
+
+	if (files_count == files_max) {
+		files_max = files_max ? files_max * 2 : 256;
+		files = realloc(files, files_max * sizeof(*files));
+		if (!files) {
+			fprintf(stderr, "Not enough memory\n");
+			return -1;
+		}
+	}
+	files[files_count].path = strdup(path);
+	files[files_count].frag = frag;
+	if (!files[files_count].path) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+	files_count++;
+	return 0;
+}
+
+static int cmp_start(const void *a, const void *b)
+{
+	uint64_t x = ((const struct file_run *)a)->frag.start;
+	uint64_t y = ((const struct file_run *)b)->frag.start;
+
+	return x < y ? -1 : x > y;
+}
+
+/* The runs of free blocks of the filesystem a path is on, from sysfs.
+ * The directory there is named after the device. */
+static void print_free_extents(const char *path, const char *when)
+{
+	char link[64], target[PATH_MAX], file[PATH_MAX];
+	unsigned long long blocks, count, runs = 0, least = 0;
+	struct stat st;
+	ssize_t len;
+	FILE *f;
+
+	if (stat(path, &st))
+		return;
+	snprintf(link, sizeof(link), "/sys/dev/block/%u:%u",
+		 major(st.st_dev), minor(st.st_dev));
+	len = readlink(link, target, sizeof(target) - 1);
+	if (len == -1)
+		return;
+	target[len] = '\0';
+	snprintf(file, sizeof(file), "/sys/fs/simplefs/%s/free_extents",
+		 basename(target));
+
+	f = fopen(file, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		return;
+	}
+	printf("Free space %s, runs of free blocks by length:\n", when);
+	while (fscanf(f, "%llu %llu", &blocks, &count) == 2) {
+		if (count)
+			printf("  %8llu-%-8llu %llu\n", blocks, blocks * 2 - 1, count);
+		runs += count;
+		least += blocks * count;
+	}
+	printf("  %llu runs, at least %llu free blocks in all\n", runs, least);
+	fclose(f);
+}
+
+static void usage(void)
+{
+	printf("Usage: defrag-simplefs [-n] <path>...\n"
+	       "  -n  only report, do not move anything\n");
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t blocks = 0, movable = 0, moved = 0, old;
+	struct file_run *run;
+	int opt, dry_run = 0, fd, i;
+	size_t n;
+
+	while ((opt = getopt(argc, argv, "n")) != -1) {
+		switch (opt) {
+		case 'n':
+			dry_run = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind == argc) {
+		usage();
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++)
+		if (nftw(argv[i], collect, 64, FTW_PHYS | FTW_MOUNT))
+			return 1;
+
+	/* Moving the first files first makes room for the later ones */
+	qsort(files, files_count, sizeof(*files), cmp_start);
+
+	print_free_extents(argv[optind], "before");
+	for (n = 0; n < files_count; n++) {
+		run = &files[n];
+		blocks += run->frag.blocks;
+		if (run->frag.flags & SIMPLEFS_DEFRAG_SHARED) {
+			printf("%s: %llu blocks at %llu, shared\n", run->path,
+			       (unsigned long long)run->frag.blocks,
+			       (unsigned long long)run->frag.start);
+			continue;
+		}
+
+		old = run->frag.start;
+		if (!dry_run) {
+			fd = open(run->path, O_RDWR);
+			if (fd == -1 || ioctl(fd, SIMPLEFS_IOC_DEFRAG, &run->frag)) {
+				fprintf(stderr, "%s: %s\n", run->path, strerror(errno));
+				errors++;
+			}
+			if (fd != -1)
+				close(fd);
+		}
+
+		if (run->frag.start != old) {
+			printf("%s: %llu blocks moved from %llu to %llu\n", run->path,
+			       (unsigned long long)run->frag.blocks,
+			       (unsigned long long)old,
+			       (unsigned long long)run->frag.start);
+			moved++;
+		} else if (run->frag.goal != run->frag.start) {
+			printf("%s: %llu blocks at %llu, fits at %llu\n", run->path,
+			       (unsigned long long)run->frag.blocks,
+			       (unsigned long long)run->frag.start,
+			       (unsigned long long)run->frag.goal);
+			movable++;
+		} else {
+			printf("%s: %llu blocks at %llu\n", run->path,
+			       (unsigned long long)run->frag.blocks,
+			       (unsigned long long)run->frag.start);
+		}
+	}
+	if (!dry_run)
+		print_free_extents(argv[optind], "after");
+
+	printf("%zu files, %llu blocks, %llu moved, %llu could move\n",
+	       files_count, (unsigned long long)blocks,
+	       (unsigned long long)moved, (unsigned long long)movable);
+
+	for (n = 0; n < files_count; n++)
+		free(files[n].path);
+	free(files);
+	return errors ? 1 : 0;
+}
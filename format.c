@@ -0,0 +1,860 @@
+/*
+ * The simplefs on-disk format, shared by the kernel module and the
+ * userspace tools. See format.h.
+ *
+ * License: Creative Commons Zero License - http://creativecommons.org/publicdomain/zero/1.0/
+ */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <asm/byteorder.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/stat.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+#include <linux/crc32.h>
+#else
+#include <linux/crc32c.h>
+#endif
+#else
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#endif
+
+#include "format.h"
+
+static uint64_t div_round_up(uint64_t n, uint64_t d)
+{
+	return (n + d - 1) / d;
+}
+
+int simplefs_block_size_valid(uint64_t block_size)
+{
+	return block_size >= SIMPLEFS_MIN_BLOCK_SIZE &&
+	       block_size <= SIMPLEFS_MAX_BLOCK_SIZE &&
+	       !(block_size & (block_size - 1));
+}
+
+const char *simplefs_sb_init(struct simplefs_super_block *sb, uint64_t bytes,
+			     const struct simplefs_geometry *geometry)
+{
+	uint64_t inodes_per_block, group_desc_blocks, meta_blocks;
+
+	if (!simplefs_block_size_valid(geometry->block_size))
+		return "The block size must be a power of two between 1024 and 65536";
+
+	memset(sb, 0, sizeof(*sb));
+	sb->version = SIMPLEFS_VERSION;
+	sb->magic = SIMPLEFS_MAGIC;
+	sb->block_size = geometry->block_size;
+	sb->blocks_count = bytes / sb->block_size;
+
+	sb->group_blocks = geometry->group_blocks;
+	if (!sb->group_blocks)
+		sb->group_blocks = sb->block_size * 8;
+	if (sb->group_blocks > sb->block_size * 8)
+		return "A group cannot have more blocks than there are bits in a block";
+
+	/* The metadata device starts a group of its own, so that no run of
+	 * blocks is ever split between the two */
+	if (geometry->meta_bytes) {
+		meta_blocks = geometry->meta_bytes / sb->block_size;
+		if (!meta_blocks)
+			return "The metadata device is too small";
+		/* The data device needs room for a file besides the super block */
+		if (sb->blocks_count <= SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER + 1)
+			return "The device is too small";
+		sb->data_dev_blocks = sb->blocks_count;
+		sb->meta_block = div_round_up(sb->data_dev_blocks, sb->group_blocks) *
+				 sb->group_blocks;
+		sb->blocks_count = sb->meta_block + meta_blocks;
+	}
+	sb->groups_count = div_round_up(sb->blocks_count, sb->group_blocks);
+
+	/* New images have checksums */
+	sb->feature_incompat = SIMPLEFS_FEATURE_INCOMPAT_CSUM;
+	inodes_per_block = simplefs_inodes_per_block(sb);
+	sb->inodes_max = geometry->inodes;
+	if (!sb->inodes_max) {
+		sb->inodes_max = bytes / SIMPLEFS_DEFAULT_INODE_RATIO;
+		if (sb->inodes_max < SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+			sb->inodes_max = SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+	}
+	sb->inode_table_blocks = div_round_up(sb->inodes_max, inodes_per_block);
+	/* Round up, as the rest of the last block would be wasted anyway */
+	sb->inodes_max = sb->inode_table_blocks * inodes_per_block;
+
+	sb->journal_blocks = geometry->journal_blocks;
+	if (!sb->journal_blocks) {
+		sb->journal_blocks = bytes / sb->block_size / SIMPLEFS_DEFAULT_JOURNAL_RATIO;
+		if (sb->journal_blocks < SIMPLEFS_MIN_JOURNAL_BLOCKS)
+			sb->journal_blocks = SIMPLEFS_MIN_JOURNAL_BLOCKS;
+		if (sb->journal_blocks > SIMPLEFS_MAX_JOURNAL_BLOCKS)
+			sb->journal_blocks = SIMPLEFS_MAX_JOURNAL_BLOCKS;
+	}
+
+	group_desc_blocks = div_round_up(sb->groups_count *
+					 sizeof(struct simplefs_group_desc),
+					 sb->block_size);
+
+	sb->group_desc_block = sb->meta_block + SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER + 1;
+	sb->bitmap_block = sb->group_desc_block + group_desc_blocks;
+	sb->refcount_block = sb->bitmap_block + sb->groups_count;
+	sb->refcount_blocks = sb->groups_count * simplefs_refcount_group_blocks(sb);
+	sb->inode_table_block = sb->refcount_block + sb->refcount_blocks;
+	sb->journal_block = sb->inode_table_block + sb->inode_table_blocks;
+	sb->data_block = sb->journal_block + sb->journal_blocks;
+
+	/* The root directory needs a block */
+	if (sb->data_block >= sb->blocks_count)
+		return sb->meta_block ? "The metadata device is too small" :
+					"The device is too small";
+
+	sb->free_blocks_count = sb->blocks_count - sb->data_block;
+	if (sb->meta_block)
+		sb->free_blocks_count += sb->data_dev_blocks - simplefs_sb_file_block(sb);
+	sb->inode_table_initialized = sb->inode_table_blocks;
+
+	sb->feature_ro_compat = SIMPLEFS_FEATURE_RO_COMPAT_REFCOUNT;
+	if (sb->meta_block)
+		sb->feature_incompat |= SIMPLEFS_FEATURE_INCOMPAT_META_DEV;
+	return NULL;
+}
+
+void simplefs_sb_legacy_geometry(struct simplefs_super_block *sb)
+{
+	sb->blocks_count = SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+	sb->inodes_max = SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
+	sb->inode_table_block = SIMPLEFS_INODESTORE_BLOCK_NUMBER;
+	sb->inode_table_blocks = 1;
+	sb->inode_table_initialized = 1;
+	sb->journal_block = SIMPLEFS_JOURNAL_BLOCK_NUMBER;
+	sb->journal_blocks = SIMPLEFS_JOURNAL_BLOCKS;
+	sb->data_block = SIMPLEFS_ROOTDIR_DATABLOCK_NUMBER;
+}
+
+void simplefs_sb_load(const void *disk, struct simplefs_super_block *sb)
+{
+	const struct simplefs_super_block_disk *d = disk;
+
+	sb->version = le64_to_cpu(d->version);
+	sb->magic = le64_to_cpu(d->magic);
+	sb->block_size = le64_to_cpu(d->block_size);
+	sb->inodes_count = le64_to_cpu(d->inodes_count);
+	sb->free_blocks = le64_to_cpu(d->free_blocks);
+	sb->cbt_block = le64_to_cpu(d->cbt_block);
+	sb->blocks_count = le64_to_cpu(d->blocks_count);
+	sb->free_blocks_count = le64_to_cpu(d->free_blocks_count);
+	sb->inodes_max = le64_to_cpu(d->inodes_max);
+	sb->inode_table_block = le64_to_cpu(d->inode_table_block);
+	sb->inode_table_blocks = le64_to_cpu(d->inode_table_blocks);
+	sb->inode_table_initialized = le64_to_cpu(d->inode_table_initialized);
+	sb->journal_block = le64_to_cpu(d->journal_block);
+	sb->journal_blocks = le64_to_cpu(d->journal_blocks);
+	sb->group_blocks = le64_to_cpu(d->group_blocks);
+	sb->groups_count = le64_to_cpu(d->groups_count);
+	sb->group_desc_block = le64_to_cpu(d->group_desc_block);
+	sb->bitmap_block = le64_to_cpu(d->bitmap_block);
+	sb->data_block = le64_to_cpu(d->data_block);
+	sb->refcount_block = le64_to_cpu(d->refcount_block);
+	sb->refcount_blocks = le64_to_cpu(d->refcount_blocks);
+	sb->meta_block = le64_to_cpu(d->meta_block);
+	sb->data_dev_blocks = le64_to_cpu(d->data_dev_blocks);
+	sb->dedup_block = le64_to_cpu(d->dedup_block);
+	sb->feature_compat = le64_to_cpu(d->feature_compat);
+	sb->feature_ro_compat = le64_to_cpu(d->feature_ro_compat);
+	sb->feature_incompat = le64_to_cpu(d->feature_incompat);
+	sb->checksum = le64_to_cpu(d->checksum);
+}
+
+/* What is in the padding is left as it is */
+void simplefs_sb_store(void *disk, const struct simplefs_super_block *sb)
+{
+	struct simplefs_super_block_disk *d = disk;
+
+	d->version = cpu_to_le64(sb->version);
+	d->magic = cpu_to_le64(sb->magic);
+	d->block_size = cpu_to_le64(sb->block_size);
+	d->inodes_count = cpu_to_le64(sb->inodes_count);
+	d->free_blocks = cpu_to_le64(sb->free_blocks);
+	d->cbt_block = cpu_to_le64(sb->cbt_block);
+	d->blocks_count = cpu_to_le64(sb->blocks_count);
+	d->free_blocks_count = cpu_to_le64(sb->free_blocks_count);
+	d->inodes_max = cpu_to_le64(sb->inodes_max);
+	d->inode_table_block = cpu_to_le64(sb->inode_table_block);
+	d->inode_table_blocks = cpu_to_le64(sb->inode_table_blocks);
+	d->inode_table_initialized = cpu_to_le64(sb->inode_table_initialized);
+	d->journal_block = cpu_to_le64(sb->journal_block);
+	d->journal_blocks = cpu_to_le64(sb->journal_blocks);
+	d->group_blocks = cpu_to_le64(sb->group_blocks);
+	d->groups_count = cpu_to_le64(sb->groups_count);
+	d->group_desc_block = cpu_to_le64(sb->group_desc_block);
+	d->bitmap_block = cpu_to_le64(sb->bitmap_block);
+	d->data_block = cpu_to_le64(sb->data_block);
+	d->refcount_block = cpu_to_le64(sb->refcount_block);
+	d->refcount_blocks = cpu_to_le64(sb->refcount_blocks);
+	d->meta_block = cpu_to_le64(sb->meta_block);
+	d->data_dev_blocks = cpu_to_le64(sb->data_dev_blocks);
+	d->dedup_block = cpu_to_le64(sb->dedup_block);
+	d->feature_compat = cpu_to_le64(sb->feature_compat);
+	d->feature_ro_compat = cpu_to_le64(sb->feature_ro_compat);
+	d->feature_incompat = cpu_to_le64(sb->feature_incompat);
+	d->checksum = cpu_to_le64(sb->checksum);
+	simplefs_sb_csum_set(sb, disk);
+}
+
+/* jbd2 keeps its super block big endian */
+static void simplefs_put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+void simplefs_journal_sb_init(void *block, uint64_t block_size, uint64_t blocks)
+{
+	unsigned char *p = block;
+
+	memset(p, 0, block_size);
+	simplefs_put_be32(p + SIMPLEFS_JSB_MAGIC, SIMPLEFS_JBD2_MAGIC);
+	simplefs_put_be32(p + SIMPLEFS_JSB_BLOCKTYPE, SIMPLEFS_JBD2_SUPERBLOCK_V2);
+	simplefs_put_be32(p + SIMPLEFS_JSB_BLOCKSIZE, block_size);
+	simplefs_put_be32(p + SIMPLEFS_JSB_MAXLEN, blocks);
+	/* The log starts right after the super block, and is empty:
+	 * s_start stays zero, so there is nothing to replay */
+	simplefs_put_be32(p + SIMPLEFS_JSB_FIRST, 1);
+	simplefs_put_be32(p + SIMPLEFS_JSB_SEQUENCE, 1);
+	/* The file system it is inside of */
+	simplefs_put_be32(p + SIMPLEFS_JSB_NR_USERS, 1);
+}
+
+uint64_t simplefs_sb_free_blocks(const struct simplefs_super_block *sb)
+{
+	uint64_t mask, count = 0;
+
+	if (sb->groups_count)
+		return sb->free_blocks_count;
+
+	/* The legacy allocator never hands out the blocks below 3 */
+	for (mask = sb->free_blocks & ~7ULL; mask; mask &= mask - 1)
+		count++;
+	return count;
+}
+
+const char *simplefs_sb_check(const struct simplefs_super_block *sb)
+{
+	uint64_t per_block;
+
+	if (sb->magic != SIMPLEFS_MAGIC)
+		return "Magic number mismatch, this is not a simplefs image";
+
+	if (sb->version != SIMPLEFS_VERSION_1 && sb->version != SIMPLEFS_VERSION_2)
+		return "Unknown version of the format";
+	if (sb->version >= SIMPLEFS_VERSION_2) {
+		if (sb->feature_incompat & ~SIMPLEFS_FEATURE_INCOMPAT_SUPP)
+			return "The image has features this version does not know";
+		if (!sb->groups_count ||
+		    !(sb->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_META_DEV) != !sb->meta_block ||
+		    !(sb->feature_ro_compat & SIMPLEFS_FEATURE_RO_COMPAT_REFCOUNT) != !sb->refcount_blocks ||
+		    !(sb->feature_ro_compat & SIMPLEFS_FEATURE_RO_COMPAT_CBT) != !sb->cbt_block ||
+		    !(sb->feature_ro_compat & SIMPLEFS_FEATURE_RO_COMPAT_DEDUP) != !sb->dedup_block)
+			return "The features do not match the geometry";
+	}
+
+	if (!simplefs_block_size_valid(sb->block_size))
+		return "The block size is not a power of two between 1024 and 65536";
+
+	if (sb->groups_count) {
+		if (!sb->group_blocks || sb->group_blocks > sb->block_size * 8 ||
+		    sb->groups_count != div_round_up(sb->blocks_count, sb->group_blocks))
+			return "Invalid allocation group geometry";
+
+		per_block = sb->block_size / sizeof(struct simplefs_group_desc);
+		if (sb->refcount_blocks &&
+		    (sb->refcount_blocks != sb->groups_count * simplefs_refcount_group_blocks(sb) ||
+		     sb->bitmap_block + sb->groups_count > sb->refcount_block ||
+		     sb->refcount_block + sb->refcount_blocks > sb->inode_table_block))
+			return "The reference count table does not fit between the bitmaps and the inode store";
+		if (sb->group_desc_block + div_round_up(sb->groups_count, per_block) > sb->bitmap_block ||
+		    sb->bitmap_block + sb->groups_count > sb->inode_table_block ||
+		    sb->inode_table_block + sb->inode_table_blocks > sb->journal_block ||
+		    sb->journal_block + sb->journal_blocks > sb->data_block ||
+		    sb->data_block > sb->blocks_count)
+			return "The metadata areas overlap or run past the end of the device";
+		if (sb->meta_block ?
+		    sb->meta_block % sb->group_blocks ||
+		    sb->data_dev_blocks <= simplefs_sb_file_block(sb) ||
+		    sb->data_dev_blocks > sb->meta_block ||
+		    sb->group_desc_block <= sb->meta_block :
+		    sb->data_dev_blocks != 0)
+			return "Invalid metadata device geometry";
+		if (simplefs_sb_cbt_block(sb) &&
+		    (sb->cbt_block < simplefs_sb_file_block(sb) ||
+		     sb->cbt_block + simplefs_cbt_blocks(sb) > simplefs_sb_file_end(sb)))
+			return "The changed block tracking run is not where file contents go";
+		if (simplefs_sb_dedup_block(sb) &&
+		    (sb->dedup_block < simplefs_sb_file_block(sb) ||
+		     sb->dedup_block + simplefs_dedup_blocks(sb) > simplefs_sb_file_end(sb)))
+			return "The dedup index is not where file contents go";
+	}
+
+	per_block = simplefs_inodes_per_block(sb);
+	if (sb->inodes_max > sb->inode_table_blocks * per_block ||
+	    sb->inodes_count > sb->inodes_max ||
+	    sb->inodes_count < SIMPLEFS_RESERVED_INODES ||
+	    sb->inodes_count > sb->inode_table_initialized * per_block)
+		return "Invalid inode count";
+
+	return NULL;
+}
+
+#ifndef __KERNEL__
+/* crc32c over a nibble at a time, for CPUs without an instruction for it */
+static const uint32_t crc32c_nibbles[16] = {
+	0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1,
+	0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+	0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9,
+	0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75,
+};
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len--) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ crc32c_nibbles[crc & 15];
+		crc = (crc >> 4) ^ crc32c_nibbles[crc & 15];
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+/* SSE4.2 has crc32c as an instruction, eight bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t crc64 = crc, word;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc64 = _mm_crc32_u8(crc64, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&word, p, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	for (; len; len--)
+		crc64 = _mm_crc32_u8(crc64, *p++);
+	return crc64;
+}
+#endif
+#endif
+
+uint32_t simplefs_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+#ifdef __KERNEL__
+	/* Goes to the instruction for it where the CPU has one */
+	return crc32c(crc, buf, len);
+#else
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32c_sse42(crc, buf, len);
+#endif
+	return crc32c_sw(crc, buf, len);
+#endif
+}
+
+void simplefs_sb_csum_set(const struct simplefs_super_block *sb, void *disk)
+{
+	struct simplefs_super_block_disk *d = disk;
+
+	if (simplefs_sb_has_csum(sb))
+		d->checksum = cpu_to_le64(simplefs_crc32c(~0U, d,
+				offsetof(struct simplefs_super_block_disk, checksum)));
+}
+
+int simplefs_sb_csum_verify(const struct simplefs_super_block *sb,
+			    const void *disk)
+{
+	const struct simplefs_super_block_disk *d = disk;
+
+	return !simplefs_sb_has_csum(sb) ||
+	       le64_to_cpu(d->checksum) == simplefs_crc32c(~0U, d,
+				offsetof(struct simplefs_super_block_disk, checksum));
+}
+
+void simplefs_block_csum_set(const struct simplefs_super_block *sb, void *block)
+{
+	__le32 crc;
+
+	if (!simplefs_sb_has_csum(sb))
+		return;
+	crc = cpu_to_le32(simplefs_crc32c(~0U, block, sb->block_size - sizeof(crc)));
+	memcpy((char *)block + sb->block_size - sizeof(crc), &crc, sizeof(crc));
+}
+
+int simplefs_block_csum_verify(const struct simplefs_super_block *sb,
+			       const void *block)
+{
+	__le32 crc;
+
+	if (!simplefs_sb_has_csum(sb))
+		return 1;
+	memcpy(&crc, (const char *)block + sb->block_size - sizeof(crc), sizeof(crc));
+	return le32_to_cpu(crc) == simplefs_crc32c(~0U, block, sb->block_size - sizeof(crc));
+}
+
+void simplefs_bitmap_csum_set(const struct simplefs_super_block *sb,
+			      struct simplefs_group_desc *desc,
+			      const unsigned char *bitmap)
+{
+	if (simplefs_sb_has_csum(sb))
+		desc->bitmap_checksum = cpu_to_le32(simplefs_crc32c(~0U, bitmap,
+								    sb->block_size));
+}
+
+int simplefs_bitmap_csum_verify(const struct simplefs_super_block *sb,
+				const struct simplefs_group_desc *desc,
+				const unsigned char *bitmap)
+{
+	return !simplefs_sb_has_csum(sb) ||
+	       le32_to_cpu(desc->flags) & SIMPLEFS_GROUP_BLOCK_UNINIT ||
+	       le32_to_cpu(desc->bitmap_checksum) ==
+	       simplefs_crc32c(~0U, bitmap, sb->block_size);
+}
+
+void simplefs_inode_locate(const struct simplefs_super_block *sb, uint64_t slot,
+			   uint64_t *block, uint64_t *offset)
+{
+	uint64_t per_block = simplefs_inodes_per_block(sb);
+
+	*block = sb->inode_table_block + slot / per_block;
+	*offset = (slot % per_block) * simplefs_inode_size(sb);
+}
+
+_Static_assert(sizeof(struct simplefs_inode_v2) == SIMPLEFS_INODE_SIZE,
+	       "The inode of version 2 images is a cache line");
+_Static_assert(sizeof(struct simplefs_super_block_disk) == SIMPLEFS_MIN_BLOCK_SIZE,
+	       "The super block fits in the smallest block size");
+
+void simplefs_inode_load(const struct simplefs_super_block *sb, const void *disk,
+			 struct simplefs_inode *inode)
+{
+	const struct simplefs_inode_v1 *v1 = disk;
+	const struct simplefs_inode_v2 *v2 = disk;
+
+	memset(inode, 0, sizeof(*inode));
+	if (sb->version >= SIMPLEFS_VERSION_2) {
+		inode->mode = le32_to_cpu(v2->mode);
+		inode->links_count = le32_to_cpu(v2->links_count);
+		inode->inode_no = le64_to_cpu(v2->inode_no);
+		inode->data_block_number = le64_to_cpu(v2->data_block_number);
+		inode->file_size = le64_to_cpu(v2->file_size);
+		inode->atime = le64_to_cpu(v2->atime);
+		inode->mtime = le64_to_cpu(v2->mtime);
+		inode->ctime = le64_to_cpu(v2->ctime);
+		inode->run_first = le32_to_cpu(v2->run_first);
+		inode->run_blocks = le32_to_cpu(v2->run_blocks);
+		return;
+	}
+
+	inode->mode = le32_to_cpu(v1->mode);
+	inode->links_count = 1;
+	inode->inode_no = le64_to_cpu(v1->inode_no);
+	inode->data_block_number = le64_to_cpu(v1->data_block_number);
+	inode->file_size = le64_to_cpu(v1->file_size);
+}
+
+void simplefs_inode_store(const struct simplefs_super_block *sb, void *disk,
+			  const struct simplefs_inode *inode)
+{
+	struct simplefs_inode_v1 *v1 = disk;
+	struct simplefs_inode_v2 *v2 = disk;
+
+	if (sb->version >= SIMPLEFS_VERSION_2) {
+		v2->mode = cpu_to_le32(inode->mode);
+		v2->links_count = cpu_to_le32(inode->links_count);
+		v2->inode_no = cpu_to_le64(inode->inode_no);
+		v2->data_block_number = cpu_to_le64(inode->data_block_number);
+		v2->file_size = cpu_to_le64(inode->file_size);
+		v2->atime = cpu_to_le64(inode->atime);
+		v2->mtime = cpu_to_le64(inode->mtime);
+		v2->ctime = cpu_to_le64(inode->ctime);
+		v2->run_first = cpu_to_le32(inode->run_first);
+		v2->run_blocks = cpu_to_le32(inode->run_blocks);
+		return;
+	}
+
+	v1->mode = cpu_to_le32(inode->mode);
+	v1->inode_no = cpu_to_le64(inode->inode_no);
+	v1->data_block_number = cpu_to_le64(inode->data_block_number);
+	v1->file_size = cpu_to_le64(inode->file_size);
+}
+
+int simplefs_run_extend(const struct simplefs_super_block *sb,
+			const struct simplefs_inode *inode, uint64_t first,
+			uint64_t last, uint64_t *new_first, uint64_t *new_count)
+{
+	uint64_t count = simplefs_inode_blocks(inode, sb->block_size);
+	uint64_t run_first = simplefs_inode_run_first(inode);
+	/* As far as run_first and run_blocks go */
+	uint64_t end = last + 1, limit = 0xffffffffULL;
+
+	if (!simplefs_sparse_ok(sb))
+		return -ENOSPC;
+
+	if (count) {
+		if (first > run_first)
+			first = run_first;
+		if (end < run_first + count)
+			end = run_first + count;
+	}
+	if (end - first > sb->group_blocks || end > limit)
+		return -EFBIG;
+	if (end > run_first + count) {
+		end += (end - first) / 8;
+		if (end > first + sb->group_blocks)
+			end = first + sb->group_blocks;
+		if (end > limit)
+			end = limit;
+	}
+
+	*new_first = first;
+	*new_count = end - first;
+	return 0;
+}
+
+void simplefs_inode_set_run(struct simplefs_inode *inode, uint64_t block_size,
+			    uint64_t start, uint64_t first, uint64_t count)
+{
+	if (first != simplefs_inode_run_first(inode) ||
+	    count != simplefs_inode_blocks(inode, block_size)) {
+		inode->mode |= SIMPLEFS_INODE_SPARSE;
+		inode->run_first = first;
+		inode->run_blocks = count;
+	}
+	inode->data_block_number = start;
+}
+
+void simplefs_inode_resize(struct simplefs_inode *inode, uint64_t block_size,
+			   uint64_t size)
+{
+	uint64_t blocks = simplefs_inode_blocks(inode, block_size);
+	uint64_t first = simplefs_inode_run_first(inode);
+	uint64_t end = div_round_up(size, block_size);
+
+	if (end > first + blocks && !(inode->mode & SIMPLEFS_INODE_SPARSE)) {
+		inode->mode |= SIMPLEFS_INODE_SPARSE;
+		inode->run_first = 0;
+		inode->run_blocks = blocks;
+	}
+	if (inode->mode & SIMPLEFS_INODE_SPARSE && end < first + blocks) {
+		inode->run_blocks = end > first ? end - first : 0;
+		if (!inode->run_blocks)
+			inode->data_block_number = 0;
+	}
+	inode->file_size = size;
+}
+
+void simplefs_dir_record_locate(const struct simplefs_super_block *sb,
+				const struct simplefs_inode *dir, uint64_t index,
+				uint64_t *block, uint64_t *offset)
+{
+	uint64_t per_block = simplefs_dir_records_per_block(sb->block_size);
+
+	*block = dir->data_block_number + index / per_block;
+	*offset = (index % per_block) * sizeof(struct simplefs_dir_record);
+}
+
+uint64_t simplefs_dir_capacity(const struct simplefs_super_block *sb,
+			       const struct simplefs_inode *dir)
+{
+	return simplefs_inode_blocks(dir, sb->block_size) *
+	       simplefs_dir_records_per_block(sb->block_size);
+}
+
+uint64_t simplefs_dir_pos_index(const struct simplefs_inode *dir, uint64_t pos)
+{
+	uint64_t index = pos / sizeof(struct simplefs_dir_record);
+
+	return index < dir->dir_children_count ? index : dir->dir_children_count;
+}
+
+/* Names are stored NUL terminated, so the longest one is a byte
+ * shorter than the filename field */
+int simplefs_dir_record_init(struct simplefs_dir_record *record,
+			     const char *name, size_t len, uint64_t inode_no)
+{
+	if (!len || len >= SIMPLEFS_FILENAME_MAXLEN)
+		return -ENAMETOOLONG;
+
+	memset(record, 0, sizeof(*record));
+	memcpy(record->filename, name, len);
+	record->inode_no = cpu_to_le64(inode_no);
+	return 0;
+}
+
+int simplefs_dir_record_match(const struct simplefs_dir_record *record,
+			      const char *name, size_t len)
+{
+	return len < SIMPLEFS_FILENAME_MAXLEN &&
+	       !memcmp(record->filename, name, len) && !record->filename[len];
+}
+
+void simplefs_group_desc_locate(const struct simplefs_super_block *sb,
+				uint64_t group, uint64_t *block, uint64_t *offset)
+{
+	uint64_t per_block = sb->block_size / sizeof(struct simplefs_group_desc);
+
+	*block = sb->group_desc_block + group / per_block;
+	*offset = (group % per_block) * sizeof(struct simplefs_group_desc);
+}
+
+int simplefs_group_alloc(struct simplefs_super_block *sb, uint64_t group,
+			 struct simplefs_group_desc *desc, unsigned char *bitmap,
+			 uint64_t *out)
+{
+	return simplefs_group_alloc_run(sb, group, desc, bitmap, 0, 1, out);
+}
+
+int simplefs_group_find_run(const struct simplefs_super_block *sb, uint64_t group,
+			    const unsigned char *bitmap, uint64_t from,
+			    uint64_t count, uint64_t *out)
+{
+	uint64_t first = 0, byte, bit, run = 0;
+
+	if (!count)
+		return -ENOSPC;
+
+	if (from > group * sb->group_blocks)
+		first = from - group * sb->group_blocks;
+
+	/* Skip over the full bytes first, most of a busy group is in use */
+	for (byte = first / 8; byte < sb->group_blocks / 8; byte++)
+		if (bitmap[byte] != 0xff)
+			break;
+
+	for (bit = byte * 8 > first ? byte * 8 : first;
+	     bit < sb->group_blocks && run < count; bit++) {
+		if (bitmap[bit / 8] & (1 << (bit % 8)))
+			run = 0;
+		else
+			run++;
+	}
+
+	if (run < count)
+		return -ENOSPC;
+
+	*out = group * sb->group_blocks + bit - count;
+	return 0;
+}
+
+int simplefs_group_alloc_run(struct simplefs_super_block *sb, uint64_t group,
+			     struct simplefs_group_desc *desc, unsigned char *bitmap,
+			     uint64_t from, uint64_t count, uint64_t *out)
+{
+	uint64_t bit, i;
+
+	if (!count || le64_to_cpu(desc->free_blocks_count) < count)
+		return -ENOSPC;
+
+	/* For a single block, the descriptor claims free blocks the bitmap
+	 * does not have. A longer run may just not fit in between. */
+	if (simplefs_group_find_run(sb, group, bitmap, from, count, out))
+		return count == 1 ? -EIO : -ENOSPC;
+
+	for (i = 0, bit = *out - group * sb->group_blocks; i < count; i++, bit++)
+		bitmap[bit / 8] |= 1 << (bit % 8);
+	le64_add_cpu(&desc->free_blocks_count, -count);
+	sb->free_blocks_count -= count;
+
+	return 0;
+}
+
+int simplefs_group_alloc_run_below(struct simplefs_super_block *sb, uint64_t group,
+				   struct simplefs_group_desc *desc, unsigned char *bitmap,
+				   uint64_t from, uint64_t below, uint64_t count,
+				   uint64_t *out)
+{
+	uint64_t block;
+	int ret;
+
+	ret = simplefs_group_alloc_run(sb, group, desc, bitmap, from, count, out);
+	if (ret || *out < below)
+		return ret;
+
+	/* Too late: given back before any of it goes out */
+	for (block = *out; block < *out + count; block++)
+		simplefs_group_free(sb, group, desc, bitmap, block);
+	return -ENOSPC;
+}
+
+void simplefs_group_free_extents(const struct simplefs_super_block *sb,
+				 const unsigned char *bitmap, uint64_t *counts)
+{
+	uint64_t bit, run = 0;
+	unsigned int bucket;
+
+	for (bit = 0; bit <= sb->group_blocks; bit++) {
+		if (bit < sb->group_blocks && !(bitmap[bit / 8] & (1 << (bit % 8)))) {
+			run++;
+			continue;
+		}
+
+		if (run) {
+			for (bucket = 0; run >> (bucket + 1); bucket++)
+				;
+			counts[bucket]++;
+			run = 0;
+		}
+
+		/* Skip over the rest of a byte that is all in use */
+		if (bit % 8 == 0 && bit + 8 <= sb->group_blocks && bitmap[bit / 8] == 0xff)
+			bit += 7;
+	}
+}
+
+int simplefs_group_free(struct simplefs_super_block *sb, uint64_t group,
+			struct simplefs_group_desc *desc, unsigned char *bitmap,
+			uint64_t block)
+{
+	uint64_t bit = block - group * sb->group_blocks;
+
+	if (simplefs_block_reserved(sb, block) ||
+	    block / sb->group_blocks != group ||
+	    !(bitmap[bit / 8] & (1 << (bit % 8))))
+		return -EINVAL;
+
+	bitmap[bit / 8] &= ~(1 << (bit % 8));
+	le64_add_cpu(&desc->free_blocks_count, 1);
+	sb->free_blocks_count++;
+	return 0;
+}
+
+uint64_t simplefs_refcount_group_blocks(const struct simplefs_super_block *sb)
+{
+	return div_round_up(sb->group_blocks * sizeof(__le16), sb->block_size);
+}
+
+void simplefs_refcount_locate(const struct simplefs_super_block *sb, uint64_t block,
+			      uint64_t *table_block, uint64_t *offset)
+{
+	uint64_t per_block = sb->block_size / sizeof(__le16);
+	uint64_t group = block / sb->group_blocks, index = block % sb->group_blocks;
+
+	*table_block = sb->refcount_block + group * simplefs_refcount_group_blocks(sb) +
+		       index / per_block;
+	*offset = (index % per_block) * sizeof(__le16);
+}
+
+int simplefs_compress_fit(struct simplefs_compress_cluster *table,
+			  uint64_t old_clusters, uint64_t clusters,
+			  uint64_t first, uint64_t run_bytes)
+{
+	uint64_t i, end;
+
+	/* A longer table must not run into the first cluster */
+	if (simplefs_compress_table_size(clusters) >
+	    (old_clusters && clusters ? table[0].offset : run_bytes))
+		return 0;
+
+	for (i = first; i < clusters; i++) {
+		if (i >= old_clusters)
+			table[i].offset = i ? table[i - 1].offset + table[i - 1].length :
+					      simplefs_compress_table_size(clusters);
+
+		end = i + 1 < old_clusters && i + 1 < clusters ?
+		      table[i + 1].offset : run_bytes;
+		if (table[i].offset + table[i].length > end)
+			return 0;
+	}
+
+	return 1;
+}
+
+uint64_t simplefs_compress_pack(struct simplefs_compress_cluster *table,
+				uint64_t clusters, uint64_t start)
+{
+	uint64_t i, end = start;
+
+	for (i = 0; i < clusters; i++) {
+		table[i].offset = end;
+		end += table[i].length;
+	}
+
+	return end;
+}
+
+uint64_t simplefs_compress_layout(struct simplefs_compress_cluster *table,
+				  uint64_t clusters, uint64_t block_size)
+{
+	uint64_t end;
+
+	end = div_round_up(simplefs_compress_table_size(clusters + clusters / 8),
+			   block_size) * block_size;
+	end = simplefs_compress_pack(table, clusters, end);
+	return div_round_up(end + end / 8, block_size);
+}
+
+uint64_t simplefs_compress_used_blocks(const struct simplefs_compress_cluster *table,
+				       uint64_t clusters, uint64_t block_size)
+{
+	return div_round_up(clusters ? table[clusters - 1].offset + table[clusters - 1].length :
+				       simplefs_compress_table_size(0), block_size);
+}
+
+void simplefs_compress_table_load(struct simplefs_compress_cluster *table,
+				  uint64_t clusters)
+{
+	__le64 disk[2];
+	uint64_t i;
+
+	for (i = 0; i < clusters; i++) {
+		memcpy(disk, &table[i], sizeof(disk));
+		table[i].offset = le64_to_cpu(disk[0]);
+		table[i].length = le64_to_cpu(disk[1]);
+	}
+}
+
+void simplefs_compress_table_store(struct simplefs_compress_cluster *table,
+				   uint64_t clusters)
+{
+	__le64 disk[2];
+	uint64_t i;
+
+	for (i = 0; i < clusters; i++) {
+		disk[0] = cpu_to_le64(table[i].offset);
+		disk[1] = cpu_to_le64(table[i].length);
+		memcpy(&table[i], disk, sizeof(disk));
+	}
+}
+
+int simplefs_legacy_alloc(struct simplefs_super_block *sb, uint64_t *out)
+{
+	int i;
+
+	/* Loop until we find a free block. We start the loop from 3,
+	 * as all prior blocks will always be in use */
+	for (i = 3; i < SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
+		if (sb->free_blocks & (1ULL << i))
+			break;
+
+	if (i == SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+		return -ENOSPC;
+
+	/* Remove the identified block from the free list */
+	sb->free_blocks &= ~(1ULL << i);
+
+	*out = i;
+	return 0;
+}
+
+#ifdef CONFIG_SIMPLEFS_KUNIT_TEST
+#include "format_test.c"
+#endif
@@ -0,0 +1,366 @@
+#ifndef SIMPLEFS_FORMAT_H
+#define SIMPLEFS_FORMAT_H
+
+#include "simple.h"
+
+/* The on-disk format logic, shared by the kernel module and the userspace
+ * tools (mkfs-simplefs, fsck-simplefs and simplefs-fuse).
+ *
+ * Nothing in here reads or writes the device: the caller brings the blocks
+ * in, in whatever way it reads blocks (buffer heads, pread, mmap), and these
+ * functions work on their contents. Locking is up to the caller too. */
+
+/* What mkfs-simplefs was asked for. Zeroes are derived from the size of
+ * the device. */
+struct simplefs_geometry {
+	uint64_t block_size;
+	uint64_t inodes;
+	uint64_t group_blocks;
+	uint64_t journal_blocks;
+	/* The size of the metadata device, if there is one */
+	uint64_t meta_bytes;
+};
+
+int simplefs_block_size_valid(uint64_t block_size);
+
+/* Lay out a device of the given size: super block, group descriptors,
+ * block bitmaps, reference count table, inode store and journal, in that
+ * order. With a metadata device, all but the super block go there
+ * instead, after a copy of the super block (see
+ * simplefs_super_block.meta_block). Returns why that is not possible, or
+ * NULL. */
+const char *simplefs_sb_init(struct simplefs_super_block *sb, uint64_t bytes,
+			     const struct simplefs_geometry *geometry);
+
+/* Images made before mkfs-simplefs chose the geometry have it all zeroed.
+ * Fill in the fixed layout they were made with. */
+void simplefs_sb_legacy_geometry(struct simplefs_super_block *sb);
+
+/* Copy the super block in from the disk (a simplefs_super_block_disk),
+ * or out to it, with its checksum */
+void simplefs_sb_load(const void *disk, struct simplefs_super_block *sb);
+void simplefs_sb_store(void *disk, const struct simplefs_super_block *sb);
+
+/* The fields of the jbd2 super block simplefs_journal_sb_init sets, by
+ * offset. All of them are big endian 32 bit integers. */
+#define SIMPLEFS_JBD2_MAGIC 0xc03b3998U
+#define SIMPLEFS_JBD2_SUPERBLOCK_V2 4
+#define SIMPLEFS_JSB_MAGIC 0x0
+#define SIMPLEFS_JSB_BLOCKTYPE 0x4
+#define SIMPLEFS_JSB_BLOCKSIZE 0xc
+#define SIMPLEFS_JSB_MAXLEN 0x10
+#define SIMPLEFS_JSB_FIRST 0x14
+#define SIMPLEFS_JSB_SEQUENCE 0x18
+#define SIMPLEFS_JSB_START 0x1c
+#define SIMPLEFS_JSB_NR_USERS 0x40
+
+/* The first block of an empty internal journal of the given length, as
+ * mke2fs makes it, for jbd2 to load: the journal then needs no device
+ * of its own */
+void simplefs_journal_sb_init(void *block, uint64_t block_size, uint64_t blocks);
+
+/* Where file contents can go: from the first block after the super
+ * block and the metadata, up to the end of the data device */
+static inline uint64_t simplefs_sb_file_block(const struct simplefs_super_block *sb)
+{
+	return sb->meta_block ? SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER + 1 : sb->data_block;
+}
+
+static inline uint64_t simplefs_sb_file_end(const struct simplefs_super_block *sb)
+{
+	return sb->meta_block ? sb->data_dev_blocks : sb->blocks_count;
+}
+
+/* How many blocks are left to hand out */
+uint64_t simplefs_sb_free_blocks(const struct simplefs_super_block *sb);
+
+/* Check that the super block describes a layout that makes sense. Old
+ * images must have had their geometry filled in first. Returns what is
+ * wrong with it, or NULL. */
+const char *simplefs_sb_check(const struct simplefs_super_block *sb);
+
+/* The size of an inode in the inode store */
+static inline uint64_t simplefs_inode_size(const struct simplefs_super_block *sb)
+{
+	return sb->version >= SIMPLEFS_VERSION_2 ? sizeof(struct simplefs_inode_v2) :
+						   sizeof(struct simplefs_inode_v1);
+}
+
+/* Whether the metadata of the image has checksums */
+static inline int simplefs_sb_has_csum(const struct simplefs_super_block *sb)
+{
+	return sb->version >= SIMPLEFS_VERSION_2 &&
+	       (sb->feature_incompat & SIMPLEFS_FEATURE_INCOMPAT_CSUM);
+}
+
+/* How many inodes a block of the inode store holds. With checksums, the
+ * last slot of each block has the checksum of the block instead. */
+static inline uint64_t simplefs_inodes_per_block(const struct simplefs_super_block *sb)
+{
+	return sb->block_size / simplefs_inode_size(sb) - !!simplefs_sb_has_csum(sb);
+}
+
+/* Whether the image has ro_compat features this version does not know,
+ * and must then only be read */
+static inline int simplefs_sb_read_only(const struct simplefs_super_block *sb)
+{
+	return sb->version >= SIMPLEFS_VERSION_2 &&
+	       (sb->feature_ro_compat & ~SIMPLEFS_FEATURE_RO_COMPAT_SUPP);
+}
+
+/* The first block of the run of changed block tracking (see
+ * simplefs_cbt_header), 0 on images without it */
+static inline uint64_t simplefs_sb_cbt_block(const struct simplefs_super_block *sb)
+{
+	return sb->version >= SIMPLEFS_VERSION_2 &&
+	       (sb->feature_ro_compat & SIMPLEFS_FEATURE_RO_COMPAT_CBT) ?
+	       sb->cbt_block : 0;
+}
+
+/* The first block of the run of the dedup index (see
+ * simplefs_dedup_header), 0 on images without it */
+static inline uint64_t simplefs_sb_dedup_block(const struct simplefs_super_block *sb)
+{
+	return sb->version >= SIMPLEFS_VERSION_2 &&
+	       (sb->feature_ro_compat & SIMPLEFS_FEATURE_RO_COMPAT_DEDUP) ?
+	       sb->dedup_block : 0;
+}
+
+/* The blocks of that run: the header, and the slots */
+static inline uint64_t simplefs_dedup_blocks(const struct simplefs_super_block *sb)
+{
+	return 1 + ((sizeof(struct simplefs_dedup_disk_entry) << SIMPLEFS_DEDUP_BITS) +
+		    sb->block_size - 1) / sb->block_size;
+}
+
+/* The blocks each of its bitmaps takes, with a bit for every block */
+static inline uint64_t simplefs_cbt_bitmap_blocks(const struct simplefs_super_block *sb)
+{
+	return (sb->blocks_count + sb->block_size * 8 - 1) / (sb->block_size * 8);
+}
+
+/* The blocks of the whole run: the header, and the two bitmaps */
+static inline uint64_t simplefs_cbt_blocks(const struct simplefs_super_block *sb)
+{
+	return 1 + 2 * simplefs_cbt_bitmap_blocks(sb);
+}
+
+/* crc32c (Castagnoli) of len bytes, carried on from crc, without the
+ * inversions before and after, like the crc32c() of the kernel. The
+ * checksums of the metadata start from ~0. */
+uint32_t simplefs_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* The checksums of the metadata, on images with checksums. Set them
+ * right before the block goes out, and check them (1 if it matches)
+ * when it comes in. On other images nothing is set, and everything
+ * matches. The one of the super block covers it up to its checksum, as
+ * it is on the disk (simplefs_sb_store sets it), and sb is what was
+ * loaded from there. */
+void simplefs_sb_csum_set(const struct simplefs_super_block *sb, void *disk);
+int simplefs_sb_csum_verify(const struct simplefs_super_block *sb,
+			    const void *disk);
+
+/* A block of the inode store or of a directory has its checksum in its
+ * last four bytes, over all the others */
+void simplefs_block_csum_set(const struct simplefs_super_block *sb, void *block);
+int simplefs_block_csum_verify(const struct simplefs_super_block *sb,
+			       const void *block);
+
+/* A block bitmap has its checksum in the descriptor of its group. The
+ * bitmap of a group with SIMPLEFS_GROUP_BLOCK_UNINIT is not on the disk,
+ * and always matches. */
+void simplefs_bitmap_csum_set(const struct simplefs_super_block *sb,
+			      struct simplefs_group_desc *desc,
+			      const unsigned char *bitmap);
+int simplefs_bitmap_csum_verify(const struct simplefs_super_block *sb,
+				const struct simplefs_group_desc *desc,
+				const unsigned char *bitmap);
+
+/* The block of the inode store holding the inode in the given slot, and
+ * the offset of the inode in there */
+void simplefs_inode_locate(const struct simplefs_super_block *sb, uint64_t slot,
+			   uint64_t *block, uint64_t *offset);
+
+/* Copy an inode in from the inode store, or out to it, in the layout
+ * of the version of the image. Version 1 inodes come in with one link
+ * and no times, and go out without them. */
+void simplefs_inode_load(const struct simplefs_super_block *sb, const void *disk,
+			 struct simplefs_inode *inode);
+void simplefs_inode_store(const struct simplefs_super_block *sb, void *disk,
+			  const struct simplefs_inode *inode);
+
+/* Whether files can have holes, see SIMPLEFS_INODE_SPARSE. That needs
+ * the fields of version 2 inodes, and runs taken from the block groups. */
+static inline int simplefs_sparse_ok(const struct simplefs_super_block *sb)
+{
+	return sb->version >= SIMPLEFS_VERSION_2 && sb->groups_count;
+}
+
+/* A file is a single run of blocks, so a write to a hole of a sparse
+ * file, or past the run of any file, moves the file to a longer run that
+ * covers both, from blocks first to last of its contents on. The run
+ * gets an eighth more room at its end, as simplefs_compress_layout
+ * leaves, so that appending does not move the file every time. It can
+ * be no longer than a group. Sets where that run starts in the contents
+ * and how long it is, or returns -ENOSPC on images without holes, and
+ * -EFBIG when it would be too long. */
+int simplefs_run_extend(const struct simplefs_super_block *sb,
+			const struct simplefs_inode *inode, uint64_t first,
+			uint64_t last, uint64_t *new_first, uint64_t *new_count);
+
+/* Point a file to the run at start, which holds count blocks of its
+ * contents from first on. A run that is not all of the contents makes
+ * the file sparse. */
+void simplefs_inode_set_run(struct simplefs_inode *inode, uint64_t block_size,
+			    uint64_t start, uint64_t first, uint64_t count);
+
+/* Set the size of a file that is not compressed. What is past its run of
+ * blocks is a hole, which makes it sparse: the caller checks that the
+ * image can have those (simplefs_sparse_ok). Blocks of the run past the
+ * new end are no longer counted, and are the caller's to give back. */
+void simplefs_inode_resize(struct simplefs_inode *inode, uint64_t block_size,
+			   uint64_t size);
+
+/* The number the next inode created gets */
+static inline uint64_t simplefs_inode_next_no(const struct simplefs_super_block *sb)
+{
+	return simplefs_inode_no(sb->inodes_count);
+}
+
+/* The block and offset of the index-th record of a directory */
+void simplefs_dir_record_locate(const struct simplefs_super_block *sb,
+				const struct simplefs_inode *dir, uint64_t index,
+				uint64_t *block, uint64_t *offset);
+
+/* How many records a directory has room for in its run of blocks */
+uint64_t simplefs_dir_capacity(const struct simplefs_super_block *sb,
+			       const struct simplefs_inode *dir);
+
+/* readdir positions are byte offsets into the directory records. The
+ * index of the record at a position, or the number of children when the
+ * position is past the last one. */
+uint64_t simplefs_dir_pos_index(const struct simplefs_inode *dir, uint64_t pos);
+
+static inline uint64_t simplefs_dir_index_pos(uint64_t index)
+{
+	return index * sizeof(struct simplefs_dir_record);
+}
+
+int simplefs_dir_record_init(struct simplefs_dir_record *record,
+			     const char *name, size_t len, uint64_t inode_no);
+int simplefs_dir_record_match(const struct simplefs_dir_record *record,
+			      const char *name, size_t len);
+
+/* The block of the group descriptor table holding the descriptor of a
+ * group, and the offset of the descriptor in there */
+void simplefs_group_desc_locate(const struct simplefs_super_block *sb,
+				uint64_t group, uint64_t *block, uint64_t *offset);
+
+/* Take the first free block of a group, given its descriptor and bitmap.
+ * Updates both and the free block count of the super block. */
+int simplefs_group_alloc(struct simplefs_super_block *sb, uint64_t group,
+			 struct simplefs_group_desc *desc, unsigned char *bitmap,
+			 uint64_t *out);
+
+/* Find the first run of count free blocks of a group that starts at
+ * block from or after it, without taking it. A from before the group
+ * means its start. */
+int simplefs_group_find_run(const struct simplefs_super_block *sb, uint64_t group,
+			    const unsigned char *bitmap, uint64_t from,
+			    uint64_t count, uint64_t *out);
+
+/* Take the first run of count free blocks of a group, in the same way */
+int simplefs_group_alloc_run(struct simplefs_super_block *sb, uint64_t group,
+			     struct simplefs_group_desc *desc, unsigned char *bitmap,
+			     uint64_t from, uint64_t count, uint64_t *out);
+
+/* The same, as long as the run starts before the block below. A run
+ * found past it is given back, and -ENOSPC returned, as the groups after
+ * this one only have later blocks. */
+int simplefs_group_alloc_run_below(struct simplefs_super_block *sb, uint64_t group,
+				   struct simplefs_group_desc *desc, unsigned char *bitmap,
+				   uint64_t from, uint64_t below, uint64_t count,
+				   uint64_t *out);
+
+/* Give a block of a group back. Fails if it was not in use, or is not
+ * a data block of the group. */
+int simplefs_group_free(struct simplefs_super_block *sb, uint64_t group,
+			struct simplefs_group_desc *desc, unsigned char *bitmap,
+			uint64_t block);
+
+/* Free space is counted in runs of free blocks, by length, in this many
+ * log2 buckets: bucket n has the runs of [2^n, 2^(n+1)) blocks */
+#define SIMPLEFS_FREE_EXTENT_BUCKETS 64
+
+/* Add the runs of free blocks in the bitmap of a group to counts. A run
+ * never goes on into the next group, as files do not either. */
+void simplefs_group_free_extents(const struct simplefs_super_block *sb,
+				 const unsigned char *bitmap, uint64_t *counts);
+
+/* The reference count table has the counts of each group in a part of
+ * its own, this many blocks long */
+uint64_t simplefs_refcount_group_blocks(const struct simplefs_super_block *sb);
+
+/* The block of the reference count table holding the count of a block,
+ * and the offset of the count in there */
+void simplefs_refcount_locate(const struct simplefs_super_block *sb, uint64_t block,
+			      uint64_t *table_block, uint64_t *offset);
+
+/* The most clusters of a compressed file rewritten at once, which is
+ * also the most a write to one takes per call */
+#define SIMPLEFS_COMPRESS_MAX_CLUSTERS 16
+
+/* How many clusters the contents of a compressed file are split into */
+static inline uint64_t simplefs_compress_clusters(uint64_t size)
+{
+	return (size + SIMPLEFS_COMPRESS_CLUSTER_SIZE - 1) / SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+}
+
+/* The bytes taken by the header and the cluster table of a compressed
+ * file, which its first cluster must not start before */
+static inline uint64_t simplefs_compress_table_size(uint64_t clusters)
+{
+	return sizeof(struct simplefs_compress_header) +
+	       clusters * sizeof(struct simplefs_compress_cluster);
+}
+
+/* The clusters from first on of a compressed file were rewritten, and
+ * table has their new lengths. Those also before old_clusters keep their
+ * offset if they still fit before the next one, the others go right
+ * after the one before them. Fills in those offsets and returns 1 if
+ * all of it fits in a run of run_bytes, 0 if the file must be packed
+ * into a new run instead. */
+int simplefs_compress_fit(struct simplefs_compress_cluster *table,
+			  uint64_t old_clusters, uint64_t clusters,
+			  uint64_t first, uint64_t run_bytes);
+
+/* Lay the clusters out back to back from start on, which must leave
+ * room for the table. Returns the bytes taken by all of it. */
+uint64_t simplefs_compress_pack(struct simplefs_compress_cluster *table,
+				uint64_t clusters, uint64_t start);
+
+/* Lay a compressed file out for a new run, with an eighth more room
+ * than it needs for both the table and the clusters, so that a file that
+ * keeps being appended to does not move every time. Fills in the offsets
+ * and returns how many blocks the run takes. */
+uint64_t simplefs_compress_layout(struct simplefs_compress_cluster *table,
+				  uint64_t clusters, uint64_t block_size);
+
+/* The blocks of its run a compressed file needs, up to the end of its
+ * last cluster */
+uint64_t simplefs_compress_used_blocks(const struct simplefs_compress_cluster *table,
+				       uint64_t clusters, uint64_t block_size);
+
+/* Turn the cluster table, in place, from the byte order of the disk
+ * into that of the host once it is read, and back before it is
+ * written */
+void simplefs_compress_table_load(struct simplefs_compress_cluster *table,
+				  uint64_t clusters);
+void simplefs_compress_table_store(struct simplefs_compress_cluster *table,
+				   uint64_t clusters);
+
+/* Take a free block from the free_blocks mask of an image made before
+ * the block bitmap existed */
+int simplefs_legacy_alloc(struct simplefs_super_block *sb, uint64_t *out);
+
+#endif
@@ -0,0 +1,1168 @@
+/*
+ * KUnit tests and microbenchmarks for the on-disk format code in format.c,
+ * which includes this file when CONFIG_SIMPLEFS_KUNIT_TEST is set.
+ *
+ * The image is an in-memory device: every block up to sb.data_block
+ * (super block, group descriptors, bitmaps, reference counts and inode
+ * store) is backed by
+ * memory, the data blocks are not, as nothing here reads them. Directory
+ * contents get a buffer of their own.
+ *
+ * Run them under User-Mode Linux with ./kunit.sh, see the README. The
+ * benchmarks print how long each operation took with kunit_info.
+ *
+ * License: Creative Commons Zero License - http://creativecommons.org/publicdomain/zero/1.0/
+ */
+
+#include <kunit/test.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+
+struct simplefs_test_image {
+	struct simplefs_super_block sb;
+	unsigned char *blocks;
+};
+
+static void *simplefs_test_block(struct simplefs_test_image *img, uint64_t block)
+{
+	return img->blocks + block * img->sb.block_size;
+}
+
+static struct simplefs_group_desc *simplefs_test_desc(struct simplefs_test_image *img,
+						      uint64_t group)
+{
+	uint64_t block, offset;
+
+	simplefs_group_desc_locate(&img->sb, group, &block, &offset);
+	return simplefs_test_block(img, block) + offset;
+}
+
+/* A freshly made image of the given number of 4K blocks, with every
+ * bitmap already built (as mkfs-simplefs does without -l). Some of the
+ * blocks go to the metadata, about one in 64 for the default inode count. */
+static void simplefs_test_image_init(struct kunit *test,
+				     struct simplefs_test_image *img,
+				     uint64_t blocks, uint64_t inodes)
+{
+	struct simplefs_geometry geometry = {
+		.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE,
+		.inodes = inodes,
+		.journal_blocks = SIMPLEFS_JOURNAL_BLOCKS,
+	};
+	const char *err;
+	uint64_t group;
+
+	err = simplefs_sb_init(&img->sb, blocks * geometry.block_size, &geometry);
+	KUNIT_ASSERT_TRUE_MSG(test, !err, "%s", err);
+	img->sb.inodes_count = SIMPLEFS_RESERVED_INODES;
+
+	img->blocks = vzalloc(img->sb.data_block * img->sb.block_size);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, img->blocks);
+
+	for (group = 0; group < img->sb.groups_count; group++)
+		simplefs_test_desc(img, group)->free_blocks_count =
+			cpu_to_le64(img->sb.group_blocks -
+				    simplefs_group_bitmap_init(&img->sb, group,
+					simplefs_test_block(img, img->sb.bitmap_block + group)));
+}
+
+static void simplefs_test_image_exit(struct simplefs_test_image *img)
+{
+	vfree(img->blocks);
+}
+
+/* The first fit over the groups of simplefs_group_get_a_freeblock */
+static int simplefs_test_alloc(struct simplefs_test_image *img, uint64_t *out)
+{
+	struct simplefs_group_desc *desc;
+	uint64_t group;
+
+	for (group = 0; group < img->sb.groups_count; group++) {
+		desc = simplefs_test_desc(img, group);
+		if (le64_to_cpu(desc->free_blocks_count))
+			return simplefs_group_alloc(&img->sb, group, desc,
+				simplefs_test_block(img, img->sb.bitmap_block + group),
+				out);
+	}
+	return -ENOSPC;
+}
+
+static void simplefs_test_sb_init(struct kunit *test)
+{
+	struct simplefs_test_image img;
+	struct simplefs_super_block *sb = &img.sb;
+
+	simplefs_test_image_init(test, &img, 100000, 0);
+
+	/* The metadata areas follow each other in this order */
+	KUNIT_EXPECT_EQ(test, sb->group_desc_block, (uint64_t)1);
+	KUNIT_EXPECT_EQ(test, sb->groups_count, (uint64_t)4);
+	KUNIT_EXPECT_EQ(test, sb->bitmap_block, sb->group_desc_block + 1);
+	KUNIT_EXPECT_EQ(test, sb->refcount_block, sb->bitmap_block + sb->groups_count);
+	KUNIT_EXPECT_EQ(test, sb->refcount_blocks,
+			sb->groups_count * simplefs_refcount_group_blocks(sb));
+	KUNIT_EXPECT_EQ(test, sb->inode_table_block, sb->refcount_block + sb->refcount_blocks);
+	KUNIT_EXPECT_EQ(test, sb->journal_block, sb->inode_table_block + sb->inode_table_blocks);
+	KUNIT_EXPECT_EQ(test, sb->data_block, sb->journal_block + sb->journal_blocks);
+	KUNIT_EXPECT_EQ(test, sb->free_blocks_count, sb->blocks_count - sb->data_block);
+	KUNIT_EXPECT_EQ(test, simplefs_sb_free_blocks(sb), sb->free_blocks_count);
+	KUNIT_EXPECT_PTR_EQ(test, simplefs_sb_check(sb), (const char *)NULL);
+
+	simplefs_test_image_exit(&img);
+}
+
+static void simplefs_test_sb_init_invalid(struct kunit *test)
+{
+	struct simplefs_geometry geometry = { .block_size = 3000 };
+	struct simplefs_super_block sb;
+
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_init(&sb, 1 << 20, &geometry), (const char *)NULL);
+
+	geometry.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_init(&sb, 4 * 4096, &geometry), (const char *)NULL);
+
+	geometry.group_blocks = 4096 * 8 + 1;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_init(&sb, 1 << 20, &geometry), (const char *)NULL);
+}
+
+static void simplefs_test_sb_check(struct kunit *test)
+{
+	struct simplefs_geometry geometry = { .block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE };
+	struct simplefs_super_block *sb, *bad;
+
+	sb = kunit_kzalloc(test, sizeof(*sb), GFP_KERNEL);
+	bad = kunit_kzalloc(test, sizeof(*bad), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, sb);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bad);
+
+	KUNIT_ASSERT_PTR_EQ(test, simplefs_sb_init(sb, 8 << 20, &geometry), (const char *)NULL);
+	sb->inodes_count = SIMPLEFS_RESERVED_INODES;
+	KUNIT_EXPECT_PTR_EQ(test, simplefs_sb_check(sb), (const char *)NULL);
+
+	*bad = *sb;
+	bad->magic++;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+
+	*bad = *sb;
+	bad->inodes_count = bad->inodes_max + 1;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+
+	*bad = *sb;
+	bad->journal_block--;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+
+	*bad = *sb;
+	bad->data_block = bad->blocks_count + 1;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+
+	*bad = *sb;
+	bad->refcount_blocks--;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+
+	/* Images made before the reference count table have none, and
+	 * are all version 1 */
+	*bad = *sb;
+	bad->refcount_block = bad->refcount_blocks = 0;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+	bad->version = SIMPLEFS_VERSION_1;
+	KUNIT_EXPECT_PTR_EQ(test, simplefs_sb_check(bad), (const char *)NULL);
+
+	/* Changed block tracking has its run where file contents go.
+	 * Version 1 images may have anything in the field. */
+	*bad = *sb;
+	bad->cbt_block = bad->data_block;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+	bad->feature_ro_compat |= SIMPLEFS_FEATURE_RO_COMPAT_CBT;
+	KUNIT_EXPECT_PTR_EQ(test, simplefs_sb_check(bad), (const char *)NULL);
+	KUNIT_EXPECT_EQ(test, simplefs_sb_cbt_block(bad), bad->data_block);
+	bad->cbt_block = bad->blocks_count - simplefs_cbt_blocks(bad) + 1;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+	bad->cbt_block = bad->data_block - 1;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+	*bad = *sb;
+	bad->version = SIMPLEFS_VERSION_1;
+	bad->cbt_block = 1;
+	KUNIT_EXPECT_PTR_EQ(test, simplefs_sb_check(bad), (const char *)NULL);
+	KUNIT_EXPECT_EQ(test, simplefs_sb_cbt_block(bad), 0);
+
+	/* So does the dedup index, on version 2 images only */
+	*bad = *sb;
+	bad->dedup_block = bad->data_block;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+	bad->feature_ro_compat |= SIMPLEFS_FEATURE_RO_COMPAT_DEDUP;
+	KUNIT_EXPECT_PTR_EQ(test, simplefs_sb_check(bad), (const char *)NULL);
+	KUNIT_EXPECT_EQ(test, simplefs_sb_dedup_block(bad), bad->data_block);
+	bad->dedup_block = bad->blocks_count - simplefs_dedup_blocks(bad) + 1;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+	bad->dedup_block = bad->data_block - 1;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+	bad->version = SIMPLEFS_VERSION_1;
+	KUNIT_EXPECT_EQ(test, simplefs_sb_dedup_block(bad), 0);
+
+	/* Features from a later version */
+	*bad = *sb;
+	bad->feature_incompat |= 1ULL << 63;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+	*bad = *sb;
+	bad->feature_ro_compat |= 1ULL << 63;
+	bad->feature_compat |= 1ULL << 63;
+	KUNIT_EXPECT_PTR_EQ(test, simplefs_sb_check(bad), (const char *)NULL);
+	KUNIT_EXPECT_TRUE(test, simplefs_sb_read_only(bad));
+	KUNIT_EXPECT_FALSE(test, simplefs_sb_read_only(sb));
+
+	/* Legacy images get their geometry filled in before the check */
+	memset(bad, 0, sizeof(*bad));
+	bad->version = SIMPLEFS_VERSION_1;
+	bad->magic = SIMPLEFS_MAGIC;
+	bad->block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE;
+	bad->inodes_count = SIMPLEFS_RESERVED_INODES;
+	simplefs_sb_legacy_geometry(bad);
+	KUNIT_EXPECT_PTR_EQ(test, simplefs_sb_check(bad), (const char *)NULL);
+}
+
+/* The metadata on a device of its own, after the blocks of the data
+ * device and the hole up to the next group */
+static void simplefs_test_sb_init_meta(struct kunit *test)
+{
+	struct simplefs_geometry geometry = {
+		.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE,
+		.group_blocks = 1024,
+		.meta_bytes = 2048 * 4096,
+	};
+	struct simplefs_super_block *sb, *bad;
+	struct simplefs_group_desc desc = { 0 };
+	unsigned char *bitmap;
+	uint64_t group, used = 0;
+
+	sb = kunit_kzalloc(test, sizeof(*sb), GFP_KERNEL);
+	bad = kunit_kzalloc(test, sizeof(*bad), GFP_KERNEL);
+	bitmap = kunit_kzalloc(test, SIMPLEFS_DEFAULT_BLOCK_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, sb);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bad);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bitmap);
+
+	KUNIT_ASSERT_PTR_EQ(test, simplefs_sb_init(sb, 3000 * 4096, &geometry),
+			    (const char *)NULL);
+	sb->inodes_count = SIMPLEFS_RESERVED_INODES;
+	KUNIT_EXPECT_EQ(test, sb->data_dev_blocks, (uint64_t)3000);
+	KUNIT_EXPECT_EQ(test, sb->meta_block, (uint64_t)3072);
+	KUNIT_EXPECT_EQ(test, sb->blocks_count, (uint64_t)3072 + 2048);
+	KUNIT_EXPECT_EQ(test, sb->group_desc_block, sb->meta_block + 1);
+	KUNIT_EXPECT_EQ(test, simplefs_sb_file_block(sb), (uint64_t)1);
+	KUNIT_EXPECT_EQ(test, simplefs_sb_file_end(sb), (uint64_t)3000);
+	KUNIT_EXPECT_EQ(test, sb->free_blocks_count,
+			sb->blocks_count - sb->data_block + 3000 - 1);
+	KUNIT_EXPECT_PTR_EQ(test, simplefs_sb_check(sb), (const char *)NULL);
+
+	/* Only the super block, the hole and the metadata are reserved */
+	KUNIT_EXPECT_TRUE(test, simplefs_block_reserved(sb, 0));
+	KUNIT_EXPECT_FALSE(test, simplefs_block_reserved(sb, 1));
+	KUNIT_EXPECT_FALSE(test, simplefs_block_reserved(sb, 2999));
+	KUNIT_EXPECT_TRUE(test, simplefs_block_reserved(sb, 3000));
+	KUNIT_EXPECT_TRUE(test, simplefs_block_reserved(sb, sb->data_block - 1));
+	KUNIT_EXPECT_FALSE(test, simplefs_block_reserved(sb, sb->data_block));
+	KUNIT_EXPECT_TRUE(test, simplefs_block_reserved(sb, sb->blocks_count));
+
+	for (group = 0; group < sb->groups_count; group++)
+		used += simplefs_group_bitmap_init(sb, group, bitmap);
+	KUNIT_EXPECT_EQ(test, sb->groups_count * sb->group_blocks - used,
+			sb->free_blocks_count);
+
+	/* The bitmap of the last group of the data device has the hole in use */
+	used = simplefs_group_bitmap_init(sb, 2, bitmap);
+	KUNIT_EXPECT_EQ(test, used, (uint64_t)(3072 - 3000));
+	KUNIT_EXPECT_EQ(test, simplefs_group_free(sb, 2, &desc, bitmap, 3000), -EINVAL);
+	KUNIT_EXPECT_EQ(test, simplefs_group_free(sb, 0, &desc, bitmap, 0), -EINVAL);
+
+	*bad = *sb;
+	bad->meta_block++;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+
+	*bad = *sb;
+	bad->data_dev_blocks = bad->meta_block + 1;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+
+	*bad = *sb;
+	bad->meta_block = 0;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_check(bad), (const char *)NULL);
+
+	/* Room for a file besides the super block on the data device, and
+	 * for the metadata on the metadata device */
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_init(bad, 4096, &geometry), (const char *)NULL);
+	geometry.meta_bytes = 4 * 4096;
+	KUNIT_EXPECT_PTR_NE(test, simplefs_sb_init(bad, 3000 * 4096, &geometry),
+			    (const char *)NULL);
+}
+
+static void simplefs_test_journal_sb(struct kunit *test)
+{
+	struct simplefs_geometry geometry = { .block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE };
+	struct simplefs_super_block *sb;
+	unsigned char *block;
+
+	sb = kunit_kzalloc(test, sizeof(*sb), GFP_KERNEL);
+	block = kunit_kzalloc(test, SIMPLEFS_DEFAULT_BLOCK_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, sb);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, block);
+
+	/* Even a small device gets a journal jbd2 can load */
+	KUNIT_ASSERT_PTR_EQ(test, simplefs_sb_init(sb, 8 << 20, &geometry), (const char *)NULL);
+	KUNIT_EXPECT_EQ(test, sb->journal_blocks, (uint64_t)SIMPLEFS_MIN_JOURNAL_BLOCKS);
+
+	memset(block, 0xff, SIMPLEFS_DEFAULT_BLOCK_SIZE);
+	simplefs_journal_sb_init(block, sb->block_size, sb->journal_blocks);
+	KUNIT_EXPECT_EQ(test, block[SIMPLEFS_JSB_MAGIC], (unsigned char)0xc0);
+	KUNIT_EXPECT_EQ(test, block[SIMPLEFS_JSB_MAGIC + 3], (unsigned char)0x98);
+	KUNIT_EXPECT_EQ(test, block[SIMPLEFS_JSB_BLOCKTYPE + 3],
+			(unsigned char)SIMPLEFS_JBD2_SUPERBLOCK_V2);
+	/* 4096 and 1024, big endian */
+	KUNIT_EXPECT_EQ(test, block[SIMPLEFS_JSB_BLOCKSIZE + 2], (unsigned char)0x10);
+	KUNIT_EXPECT_EQ(test, block[SIMPLEFS_JSB_MAXLEN + 2], (unsigned char)0x04);
+	KUNIT_EXPECT_EQ(test, block[SIMPLEFS_JSB_FIRST + 3], (unsigned char)1);
+	/* Clean: nothing to replay */
+	KUNIT_EXPECT_EQ(test, block[SIMPLEFS_JSB_START + 3], (unsigned char)0);
+	KUNIT_EXPECT_EQ(test, block[SIMPLEFS_DEFAULT_BLOCK_SIZE - 1], (unsigned char)0);
+}
+
+static void simplefs_test_group_alloc(struct kunit *test)
+{
+	struct simplefs_super_block sb = { .group_blocks = 4096 * 8, .free_blocks_count = 100 };
+	struct simplefs_group_desc desc = { .free_blocks_count = cpu_to_le64(10) };
+	unsigned char *bitmap;
+	uint64_t out;
+
+	bitmap = kunit_kzalloc(test, 4096, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bitmap);
+
+	/* The full bytes are skipped, then the first clear bit wins */
+	memset(bitmap, 0xff, 100);
+	bitmap[100] = 0x0b;
+	KUNIT_ASSERT_EQ(test, simplefs_group_alloc(&sb, 2, &desc, bitmap, &out), 0);
+	KUNIT_EXPECT_EQ(test, out, 2 * sb.group_blocks + 100 * 8 + 2);
+	KUNIT_EXPECT_EQ(test, bitmap[100], (unsigned char)0x0f);
+	KUNIT_EXPECT_EQ(test, le64_to_cpu(desc.free_blocks_count), (uint64_t)9);
+	KUNIT_EXPECT_EQ(test, sb.free_blocks_count, (uint64_t)99);
+
+	KUNIT_ASSERT_EQ(test, simplefs_group_alloc(&sb, 2, &desc, bitmap, &out), 0);
+	KUNIT_EXPECT_EQ(test, out, 2 * sb.group_blocks + 100 * 8 + 4);
+}
+
+static void simplefs_test_group_alloc_full(struct kunit *test)
+{
+	struct simplefs_super_block sb = { .group_blocks = 4096 * 8, .free_blocks_count = 1 };
+	struct simplefs_group_desc desc = { 0 };
+	unsigned char *bitmap;
+	uint64_t out;
+
+	bitmap = kunit_kmalloc(test, 4096, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bitmap);
+	memset(bitmap, 0xff, 4096);
+	KUNIT_EXPECT_EQ(test, simplefs_group_alloc(&sb, 0, &desc, bitmap, &out), -ENOSPC);
+
+	/* A descriptor claiming blocks that the bitmap does not have */
+	desc.free_blocks_count = cpu_to_le64(1);
+	KUNIT_EXPECT_EQ(test, simplefs_group_alloc(&sb, 0, &desc, bitmap, &out), -EIO);
+	KUNIT_EXPECT_EQ(test, le64_to_cpu(desc.free_blocks_count), (uint64_t)1);
+	KUNIT_EXPECT_EQ(test, sb.free_blocks_count, (uint64_t)1);
+}
+
+static void simplefs_test_group_alloc_run(struct kunit *test)
+{
+	struct simplefs_super_block sb = { .group_blocks = 4096 * 8, .free_blocks_count = 100 };
+	struct simplefs_group_desc desc = { .free_blocks_count = cpu_to_le64(10) };
+	unsigned char *bitmap;
+	uint64_t out;
+
+	bitmap = kunit_kzalloc(test, 4096, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bitmap);
+
+	/* Holes of 2 and 3 blocks, the run of 4 only fits after both */
+	bitmap[0] = 0x73;
+	KUNIT_ASSERT_EQ(test, simplefs_group_alloc_run(&sb, 1, &desc, bitmap, 0, 4, &out), 0);
+	KUNIT_EXPECT_EQ(test, out, sb.group_blocks + 7);
+	KUNIT_EXPECT_EQ(test, bitmap[0], (unsigned char)0xf3);
+	KUNIT_EXPECT_EQ(test, bitmap[1], (unsigned char)0x07);
+	KUNIT_EXPECT_EQ(test, le64_to_cpu(desc.free_blocks_count), (uint64_t)6);
+	KUNIT_EXPECT_EQ(test, sb.free_blocks_count, (uint64_t)96);
+
+	KUNIT_ASSERT_EQ(test, simplefs_group_alloc_run(&sb, 1, &desc, bitmap, 0, 2, &out), 0);
+	KUNIT_EXPECT_EQ(test, out, sb.group_blocks + 2);
+
+
+	/* Enough free blocks, but not next to each other */
+	memset(bitmap, 0x55, 4096);
+	desc.free_blocks_count = cpu_to_le64(4096 * 4);
+	KUNIT_EXPECT_EQ(test, simplefs_group_alloc_run(&sb, 1, &desc, bitmap, 0, 2, &out),
+			-ENOSPC);
+	KUNIT_EXPECT_EQ(test, le64_to_cpu(desc.free_blocks_count), (uint64_t)4096 * 4);
+}
+
+static void simplefs_test_group_free_extents(struct kunit *test)
+{
+	struct simplefs_super_block sb = { .group_blocks = 64 };
+	uint64_t counts[SIMPLEFS_FREE_EXTENT_BUCKETS] = { 0 };
+	unsigned char bitmap[8] = { 0x73, 0x07, 0, 0xff, 0, 0, 0, 0x80 };
+	uint64_t out;
+
+	/* Free runs of 2, 1, 13 and 31 blocks */
+	simplefs_group_free_extents(&sb, bitmap, counts);
+	KUNIT_EXPECT_EQ(test, counts[0], (uint64_t)1);
+	KUNIT_EXPECT_EQ(test, counts[1], (uint64_t)1);
+	KUNIT_EXPECT_EQ(test, counts[2], (uint64_t)0);
+	KUNIT_EXPECT_EQ(test, counts[3], (uint64_t)1);
+	KUNIT_EXPECT_EQ(test, counts[4], (uint64_t)1);
+	KUNIT_EXPECT_EQ(test, counts[5], (uint64_t)0);
+
+	/* Looking for a run leaves the bitmap alone */
+	KUNIT_ASSERT_EQ(test, simplefs_group_find_run(&sb, 2, bitmap, 0, 13, &out), 0);
+	KUNIT_EXPECT_EQ(test, out, 2 * sb.group_blocks + 11);
+	KUNIT_ASSERT_EQ(test, simplefs_group_find_run(&sb, 2, bitmap, 0, 14, &out), 0);
+	KUNIT_EXPECT_EQ(test, out, 2 * sb.group_blocks + 32);
+	KUNIT_EXPECT_EQ(test, simplefs_group_find_run(&sb, 2, bitmap, 0, 32, &out), -ENOSPC);
+
+	/* From a block on, as the log does, even in the middle of a byte */
+	KUNIT_ASSERT_EQ(test, simplefs_group_find_run(&sb, 2, bitmap,
+						      2 * sb.group_blocks + 13, 1, &out), 0);
+	KUNIT_EXPECT_EQ(test, out, 2 * sb.group_blocks + 13);
+	KUNIT_ASSERT_EQ(test, simplefs_group_find_run(&sb, 2, bitmap,
+						      2 * sb.group_blocks + 24, 2, &out), 0);
+	KUNIT_EXPECT_EQ(test, out, 2 * sb.group_blocks + 32);
+	KUNIT_EXPECT_EQ(test, simplefs_group_find_run(&sb, 2, bitmap,
+						      2 * sb.group_blocks + 63, 1, &out), -ENOSPC);
+	KUNIT_EXPECT_EQ(test, bitmap[1], (unsigned char)0x07);
+
+	/* A group with nothing in use is one run */
+	memset(bitmap, 0, sizeof(bitmap));
+	memset(counts, 0, sizeof(counts));
+	simplefs_group_free_extents(&sb, bitmap, counts);
+	KUNIT_EXPECT_EQ(test, counts[6], (uint64_t)1);
+	KUNIT_EXPECT_EQ(test, counts[4], (uint64_t)0);
+}
+
+static void simplefs_test_group_free(struct kunit *test)
+{
+	struct simplefs_test_image img;
+	struct simplefs_group_desc *desc;
+	unsigned char *bitmap;
+	uint64_t free, out;
+
+	simplefs_test_image_init(test, &img, 3 * 4096 * 8, 0);
+	free = img.sb.free_blocks_count;
+	desc = simplefs_test_desc(&img, 0);
+	bitmap = simplefs_test_block(&img, img.sb.bitmap_block);
+
+	KUNIT_ASSERT_EQ(test, simplefs_test_alloc(&img, &out), 0);
+	KUNIT_ASSERT_EQ(test, simplefs_group_free(&img.sb, 0, desc, bitmap, out), 0);
+	KUNIT_EXPECT_EQ(test, img.sb.free_blocks_count, free);
+	KUNIT_EXPECT_EQ(test, simplefs_group_free(&img.sb, 0, desc, bitmap, out), -EINVAL);
+
+	/* Metadata, and blocks of another group, are never given back */
+	KUNIT_EXPECT_EQ(test, simplefs_group_free(&img.sb, 0, desc, bitmap,
+						  img.sb.bitmap_block), -EINVAL);
+	KUNIT_EXPECT_EQ(test, simplefs_group_free(&img.sb, 0, desc, bitmap,
+						  img.sb.group_blocks), -EINVAL);
+	KUNIT_EXPECT_EQ(test, img.sb.free_blocks_count, free);
+
+	/* The block it handed out is the first one again */
+	KUNIT_ASSERT_EQ(test, simplefs_test_alloc(&img, &out), 0);
+	KUNIT_EXPECT_EQ(test, out, img.sb.data_block);
+
+	/* A run that ends up past the block below is given back */
+	free = img.sb.free_blocks_count;
+	KUNIT_EXPECT_EQ(test, simplefs_group_alloc_run_below(&img.sb, 0, desc, bitmap, 0,
+							     out + 1, 2, &out), -ENOSPC);
+	KUNIT_EXPECT_EQ(test, img.sb.free_blocks_count, free);
+	KUNIT_ASSERT_EQ(test, simplefs_group_alloc_run_below(&img.sb, 0, desc, bitmap, 0,
+							     img.sb.data_block + 2, 1, &out), 0);
+	KUNIT_EXPECT_EQ(test, out, img.sb.data_block + 1);
+
+	simplefs_test_image_exit(&img);
+}
+
+static void simplefs_test_refcount_locate(struct kunit *test)
+{
+	struct simplefs_test_image img;
+	uint64_t block, offset;
+
+	simplefs_test_image_init(test, &img, 3 * 4096 * 8, 0);
+
+	/* Two bytes a block, 2048 to a table block, 16 table blocks a group */
+	KUNIT_EXPECT_EQ(test, simplefs_refcount_group_blocks(&img.sb), (uint64_t)16);
+	simplefs_refcount_locate(&img.sb, 0, &block, &offset);
+	KUNIT_EXPECT_EQ(test, block, img.sb.refcount_block);
+	KUNIT_EXPECT_EQ(test, offset, (uint64_t)0);
+	simplefs_refcount_locate(&img.sb, 2049, &block, &offset);
+	KUNIT_EXPECT_EQ(test, block, img.sb.refcount_block + 1);
+	KUNIT_EXPECT_EQ(test, offset, (uint64_t)2);
+	simplefs_refcount_locate(&img.sb, 2 * img.sb.group_blocks + 5, &block, &offset);
+	KUNIT_EXPECT_EQ(test, block, img.sb.refcount_block + 32);
+	KUNIT_EXPECT_EQ(test, offset, (uint64_t)10);
+
+	/* The last count of the table is in its last block */
+	simplefs_refcount_locate(&img.sb, img.sb.blocks_count - 1, &block, &offset);
+	KUNIT_EXPECT_EQ(test, block, img.sb.refcount_block + img.sb.refcount_blocks - 1);
+	KUNIT_EXPECT_EQ(test, offset, img.sb.block_size - sizeof(__le16));
+
+	simplefs_test_image_exit(&img);
+}
+
+static void simplefs_test_compress_pack(struct kunit *test)
+{
+	struct simplefs_compress_cluster table[3] = {
+		{ .length = 100 }, { .length = 16384 }, { .length = 7 },
+	};
+
+	/* The header and three entries take 64 bytes */
+	KUNIT_EXPECT_EQ(test, simplefs_compress_table_size(3), (uint64_t)64);
+	KUNIT_EXPECT_EQ(test, simplefs_compress_pack(table, 3, 64), (uint64_t)64 + 100 + 16384 + 7);
+	KUNIT_EXPECT_EQ(test, table[0].offset, (uint64_t)64);
+	KUNIT_EXPECT_EQ(test, table[1].offset, (uint64_t)164);
+	KUNIT_EXPECT_EQ(test, table[2].offset, (uint64_t)164 + 16384);
+
+	KUNIT_EXPECT_EQ(test, simplefs_compress_pack(table, 3, 4096), (uint64_t)4096 + 16491);
+	KUNIT_EXPECT_EQ(test, table[0].offset, (uint64_t)4096);
+	KUNIT_EXPECT_EQ(test, simplefs_compress_pack(table, 0, 16), (uint64_t)16);
+}
+
+static void simplefs_test_compress_fit(struct kunit *test)
+{
+	struct simplefs_compress_cluster table[4] = {
+		{ .length = 100 }, { .length = 200 }, { .length = 300 },
+	};
+	uint64_t run = 4096;
+
+	simplefs_compress_pack(table, 3, simplefs_compress_table_size(3));
+
+	/* A cluster that got smaller, or no bigger than the room up to the
+	 * next one, stays where it is */
+	table[1].length = 150;
+	KUNIT_EXPECT_TRUE(test, simplefs_compress_fit(table, 3, 3, 1, run));
+	KUNIT_EXPECT_EQ(test, table[1].offset, (uint64_t)64 + 100);
+	table[1].length = 201;
+	KUNIT_EXPECT_FALSE(test, simplefs_compress_fit(table, 3, 3, 1, run));
+	table[1].length = 200;
+
+	/* The last one has the rest of the run */
+	table[2].length = run - table[2].offset;
+	KUNIT_EXPECT_TRUE(test, simplefs_compress_fit(table, 3, 3, 2, run));
+	table[2].length++;
+	KUNIT_EXPECT_FALSE(test, simplefs_compress_fit(table, 3, 3, 2, run));
+	table[2].length = 300;
+
+	/* A new cluster goes right after the last one, but the table must
+	 * not grow into the first cluster either */
+	table[3].length = 50;
+	KUNIT_EXPECT_FALSE(test, simplefs_compress_fit(table, 3, 4, 3, run));
+	simplefs_compress_pack(table, 4, simplefs_compress_table_size(4));
+	table[3].offset = 0;
+	KUNIT_EXPECT_TRUE(test, simplefs_compress_fit(table, 3, 4, 3, run));
+	KUNIT_EXPECT_EQ(test, table[3].offset, table[2].offset + 300);
+
+	/* An empty file fits in any run, and its first cluster goes right
+	 * after the table */
+	KUNIT_EXPECT_TRUE(test, simplefs_compress_fit(table, 0, 0, 0, run));
+	table[0].length = 1000;
+	KUNIT_EXPECT_TRUE(test, simplefs_compress_fit(table, 0, 1, 0, run));
+	KUNIT_EXPECT_EQ(test, table[0].offset, (uint64_t)32);
+	table[0].length = run - 31;
+	KUNIT_EXPECT_FALSE(test, simplefs_compress_fit(table, 0, 1, 0, run));
+}
+
+/* Every block of the image is handed out once, in order, and then no more */
+static void simplefs_test_alloc_all(struct kunit *test)
+{
+	struct simplefs_test_image img;
+	uint64_t free, expected, out;
+
+	simplefs_test_image_init(test, &img, 3 * 4096 * 8 + 100, 0);
+	free = img.sb.free_blocks_count;
+
+	for (expected = img.sb.data_block; expected < img.sb.blocks_count; expected++) {
+		KUNIT_ASSERT_EQ(test, simplefs_test_alloc(&img, &out), 0);
+		KUNIT_ASSERT_EQ(test, out, expected);
+	}
+	KUNIT_EXPECT_EQ(test, expected - img.sb.data_block, free);
+	KUNIT_EXPECT_EQ(test, img.sb.free_blocks_count, (uint64_t)0);
+	KUNIT_EXPECT_EQ(test, simplefs_test_alloc(&img, &out), -ENOSPC);
+
+	simplefs_test_image_exit(&img);
+}
+
+static void simplefs_test_legacy_alloc(struct kunit *test)
+{
+	struct simplefs_super_block sb = { .free_blocks = ~0ULL };
+	uint64_t out;
+
+	/* Blocks 0 to 2 are never handed out, whatever the mask says */
+	KUNIT_EXPECT_EQ(test, simplefs_sb_free_blocks(&sb), (uint64_t)61);
+	KUNIT_ASSERT_EQ(test, simplefs_legacy_alloc(&sb, &out), 0);
+	KUNIT_EXPECT_EQ(test, out, (uint64_t)3);
+	KUNIT_EXPECT_EQ(test, simplefs_sb_free_blocks(&sb), (uint64_t)60);
+
+	sb.free_blocks = 1ULL << 63;
+	KUNIT_ASSERT_EQ(test, simplefs_legacy_alloc(&sb, &out), 0);
+	KUNIT_EXPECT_EQ(test, out, (uint64_t)63);
+	KUNIT_EXPECT_EQ(test, simplefs_legacy_alloc(&sb, &out), -ENOSPC);
+}
+
+static void simplefs_test_inode_locate(struct kunit *test)
+{
+	struct simplefs_super_block sb = {
+		.version = SIMPLEFS_VERSION,
+		.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE,
+		.inode_table_block = 7,
+	};
+	uint64_t per_block = sb.block_size / SIMPLEFS_INODE_SIZE;
+	uint64_t block, offset, slot;
+
+	/* The reserved inodes take the first slots, the others follow */
+	KUNIT_EXPECT_EQ(test, simplefs_inode_slot(SIMPLEFS_ROOTDIR_INODE_NUMBER), (uint64_t)0);
+	KUNIT_EXPECT_GT(test, simplefs_inode_no(SIMPLEFS_RESERVED_INODES), (uint64_t)SIMPLEFS_START_INO);
+	for (slot = 0; slot < 3 * per_block; slot++)
+		KUNIT_EXPECT_EQ(test, simplefs_inode_slot(simplefs_inode_no(slot)), slot);
+
+	simplefs_inode_locate(&sb, per_block - 1, &block, &offset);
+	KUNIT_EXPECT_EQ(test, block, (uint64_t)7);
+	KUNIT_EXPECT_EQ(test, offset, (per_block - 1) * sizeof(struct simplefs_inode));
+
+	simplefs_inode_locate(&sb, per_block, &block, &offset);
+	KUNIT_EXPECT_EQ(test, block, (uint64_t)8);
+	KUNIT_EXPECT_EQ(test, offset, (uint64_t)0);
+}
+
+/* With checksums, the last slot of each block of the inode store has
+ * the checksum of the block */
+static void simplefs_test_inode_locate_csum(struct kunit *test)
+{
+	struct simplefs_super_block sb = {
+		.version = SIMPLEFS_VERSION,
+		.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE,
+		.inode_table_block = 7,
+		.feature_incompat = SIMPLEFS_FEATURE_INCOMPAT_CSUM,
+	};
+	uint64_t per_block = sb.block_size / SIMPLEFS_INODE_SIZE - 1;
+	uint64_t block, offset;
+
+	KUNIT_EXPECT_EQ(test, simplefs_inodes_per_block(&sb), per_block);
+	simplefs_inode_locate(&sb, per_block - 1, &block, &offset);
+	KUNIT_EXPECT_EQ(test, block, (uint64_t)7);
+	KUNIT_EXPECT_LE(test, offset + SIMPLEFS_INODE_SIZE, sb.block_size - sizeof(uint32_t));
+
+	simplefs_inode_locate(&sb, per_block, &block, &offset);
+	KUNIT_EXPECT_EQ(test, block, (uint64_t)8);
+	KUNIT_EXPECT_EQ(test, offset, (uint64_t)0);
+
+	/* Version 1 images never have any */
+	sb.version = SIMPLEFS_VERSION_1;
+	KUNIT_EXPECT_EQ(test, simplefs_inodes_per_block(&sb),
+			sb.block_size / sizeof(struct simplefs_inode_v1));
+}
+
+/* The checksums are those of the crc32c() of the kernel */
+static void simplefs_test_crc32c(struct kunit *test)
+{
+	static const char check[] = "123456789";
+	unsigned char *buf;
+	uint32_t crc;
+	int i;
+
+	/* The check value of CRC-32C, which inverts before and after */
+	KUNIT_EXPECT_EQ(test, ~simplefs_crc32c(~0U, check, 9), (uint32_t)0xe3069283);
+	KUNIT_EXPECT_EQ(test, simplefs_crc32c(0x1234, check, 0), (uint32_t)0x1234);
+
+	/* Whatever the alignment, and in pieces */
+	buf = kunit_kzalloc(test, 64, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+	for (i = 0; i < 8; i++) {
+		memcpy(buf + i, check, 9);
+		KUNIT_EXPECT_EQ(test, ~simplefs_crc32c(~0U, buf + i, 9), (uint32_t)0xe3069283);
+	}
+	crc = simplefs_crc32c(~0U, check, 4);
+	KUNIT_EXPECT_EQ(test, ~simplefs_crc32c(crc, check + 4, 5), (uint32_t)0xe3069283);
+}
+
+static void simplefs_test_csum(struct kunit *test)
+{
+	struct simplefs_test_image img;
+	struct simplefs_super_block *sb = &img.sb;
+	struct simplefs_super_block_disk *disk;
+	struct simplefs_group_desc *desc;
+	unsigned char *block, *bitmap;
+
+	simplefs_test_image_init(test, &img, 1000, 0);
+	KUNIT_EXPECT_TRUE(test, simplefs_sb_has_csum(sb));
+	disk = kunit_kzalloc(test, sizeof(*disk), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, disk);
+
+	/* The super block, as it is on the disk */
+	simplefs_sb_store(disk, sb);
+	KUNIT_EXPECT_TRUE(test, simplefs_sb_csum_verify(sb, disk));
+	disk->checksum = 0;
+	KUNIT_EXPECT_FALSE(test, simplefs_sb_csum_verify(sb, disk));
+	simplefs_sb_csum_set(sb, disk);
+	le64_add_cpu(&disk->free_blocks_count, -1);
+	KUNIT_EXPECT_FALSE(test, simplefs_sb_csum_verify(sb, disk));
+	simplefs_sb_csum_set(sb, disk);
+	KUNIT_EXPECT_TRUE(test, simplefs_sb_csum_verify(sb, disk));
+	/* What comes after the checksum is not covered */
+	disk->padding[0] ^= 1;
+	KUNIT_EXPECT_TRUE(test, simplefs_sb_csum_verify(sb, disk));
+
+	/* A block of the inode store, down to its last bit */
+	block = simplefs_test_block(&img, sb->inode_table_block);
+	simplefs_block_csum_set(sb, block);
+	KUNIT_EXPECT_TRUE(test, simplefs_block_csum_verify(sb, block));
+	block[sb->block_size - 5] ^= 0x80;
+	KUNIT_EXPECT_FALSE(test, simplefs_block_csum_verify(sb, block));
+	block[sb->block_size - 5] ^= 0x80;
+	block[sb->block_size - 1] ^= 0x80;
+	KUNIT_EXPECT_FALSE(test, simplefs_block_csum_verify(sb, block));
+
+	/* A bitmap, which is not checked until it is on the disk */
+	desc = simplefs_test_desc(&img, 0);
+	bitmap = simplefs_test_block(&img, sb->bitmap_block);
+	KUNIT_EXPECT_FALSE(test, simplefs_bitmap_csum_verify(sb, desc, bitmap));
+	desc->flags |= cpu_to_le32(SIMPLEFS_GROUP_BLOCK_UNINIT);
+	KUNIT_EXPECT_TRUE(test, simplefs_bitmap_csum_verify(sb, desc, bitmap));
+	desc->flags &= ~cpu_to_le32(SIMPLEFS_GROUP_BLOCK_UNINIT);
+	simplefs_bitmap_csum_set(sb, desc, bitmap);
+	KUNIT_EXPECT_TRUE(test, simplefs_bitmap_csum_verify(sb, desc, bitmap));
+	bitmap[sb->block_size - 1] ^= 1;
+	KUNIT_EXPECT_FALSE(test, simplefs_bitmap_csum_verify(sb, desc, bitmap));
+
+	/* Nothing is set, and everything matches, without the feature */
+	sb->feature_incompat &= ~SIMPLEFS_FEATURE_INCOMPAT_CSUM;
+	KUNIT_EXPECT_TRUE(test, simplefs_bitmap_csum_verify(sb, desc, bitmap));
+	KUNIT_EXPECT_TRUE(test, simplefs_block_csum_verify(sb, block));
+	le64_add_cpu(&disk->inodes_count, 1);
+	KUNIT_EXPECT_TRUE(test, simplefs_sb_csum_verify(sb, disk));
+
+	simplefs_test_image_exit(&img);
+}
+
+/* Version 1 images keep their smaller inodes, translated on the way in
+ * and out */
+static void simplefs_test_inode_v1(struct kunit *test)
+{
+	struct simplefs_super_block sb = {
+		.version = SIMPLEFS_VERSION_1,
+		.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE,
+		.inode_table_block = 7,
+	};
+	struct simplefs_inode_v1 disk[2] = {
+		{ .mode = cpu_to_le32(S_IFREG | 0644), .inode_no = cpu_to_le64(11),
+		  .data_block_number = cpu_to_le64(5), .file_size = cpu_to_le64(100) },
+	};
+	struct simplefs_inode inode;
+	uint64_t block, offset;
+
+	simplefs_inode_locate(&sb, 1, &block, &offset);
+	KUNIT_EXPECT_EQ(test, offset, (uint64_t)sizeof(struct simplefs_inode_v1));
+
+	simplefs_inode_load(&sb, &disk[0], &inode);
+	KUNIT_EXPECT_EQ(test, inode.mode, (uint32_t)(S_IFREG | 0644));
+	KUNIT_EXPECT_EQ(test, inode.links_count, (uint32_t)1);
+	KUNIT_EXPECT_EQ(test, inode.inode_no, (uint64_t)11);
+	KUNIT_EXPECT_EQ(test, inode.data_block_number, (uint64_t)5);
+	KUNIT_EXPECT_EQ(test, inode.file_size, (uint64_t)100);
+	KUNIT_EXPECT_EQ(test, inode.mtime, (int64_t)0);
+
+	/* Nothing is written past the inode */
+	inode.file_size = 200;
+	inode.mtime = 1;
+	simplefs_inode_store(&sb, &disk[0], &inode);
+	KUNIT_EXPECT_EQ(test, le64_to_cpu(disk[0].file_size), (uint64_t)200);
+	KUNIT_EXPECT_EQ(test, le64_to_cpu(disk[1].inode_no), (uint64_t)0);
+
+	sb.version = SIMPLEFS_VERSION_2;
+	KUNIT_EXPECT_EQ(test, simplefs_inode_size(&sb), (uint64_t)SIMPLEFS_INODE_SIZE);
+}
+
+/* The super block and the inodes are little endian on the disk, whatever
+ * the host */
+static void simplefs_test_byte_order(struct kunit *test)
+{
+	struct simplefs_test_image img;
+	struct simplefs_super_block loaded;
+	struct simplefs_inode inode = {
+		.mode = S_IFREG | 0644, .links_count = 1,
+		.inode_no = 0x0102030405060708ULL, .file_size = 0x1234,
+	}, back;
+	unsigned char *disk;
+
+	simplefs_test_image_init(test, &img, 1000, 0);
+	disk = kunit_kzalloc(test, img.sb.block_size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, disk);
+
+	simplefs_sb_store(disk, &img.sb);
+	KUNIT_EXPECT_EQ(test, disk[offsetof(struct simplefs_super_block_disk, magic)],
+			(unsigned char)(SIMPLEFS_MAGIC & 0xff));
+	KUNIT_EXPECT_EQ(test, disk[offsetof(struct simplefs_super_block_disk, magic) + 3],
+			(unsigned char)(SIMPLEFS_MAGIC >> 24));
+	simplefs_sb_load(disk, &loaded);
+	/* The checksum is the only member that the store makes up */
+	KUNIT_EXPECT_NE(test, loaded.checksum, (uint64_t)0);
+	img.sb.checksum = loaded.checksum;
+	KUNIT_EXPECT_EQ(test, memcmp(&loaded, &img.sb, sizeof(loaded)), 0);
+
+	simplefs_inode_store(&img.sb, disk, &inode);
+	KUNIT_EXPECT_EQ(test, disk[offsetof(struct simplefs_inode_v2, inode_no)],
+			(unsigned char)0x08);
+	KUNIT_EXPECT_EQ(test, disk[offsetof(struct simplefs_inode_v2, inode_no) + 7],
+			(unsigned char)0x01);
+	simplefs_inode_load(&img.sb, disk, &back);
+	KUNIT_EXPECT_EQ(test, back.inode_no, inode.inode_no);
+	KUNIT_EXPECT_EQ(test, back.file_size, inode.file_size);
+	KUNIT_EXPECT_EQ(test, back.mode, inode.mode);
+
+	simplefs_test_image_exit(&img);
+}
+
+/* Every object has at least a block, except files that were created with
+ * delayed allocation and never written out */
+static void simplefs_test_inode_blocks(struct kunit *test)
+{
+	struct simplefs_inode file = {
+		.mode = S_IFREG | 0644,
+		.data_block_number = 42,
+	};
+
+	KUNIT_EXPECT_EQ(test, simplefs_inode_blocks(&file, 4096), (uint64_t)1);
+	file.file_size = 4097;
+	KUNIT_EXPECT_EQ(test, simplefs_inode_blocks(&file, 4096), (uint64_t)2);
+
+	file.file_size = 0;
+	file.data_block_number = 0;
+	KUNIT_EXPECT_EQ(test, simplefs_inode_blocks(&file, 4096), (uint64_t)0);
+
+	/* A sparse file has its run where the inode says, whatever its size */
+	KUNIT_EXPECT_EQ(test, simplefs_inode_run_first(&file), (uint64_t)0);
+	file.mode |= SIMPLEFS_INODE_SPARSE;
+	file.file_size = 1ULL << 30;
+	file.run_first = 100;
+	file.run_blocks = 3;
+	KUNIT_EXPECT_EQ(test, simplefs_inode_blocks(&file, 4096), (uint64_t)0);
+	file.data_block_number = 42;
+	KUNIT_EXPECT_EQ(test, simplefs_inode_blocks(&file, 4096), (uint64_t)3);
+	KUNIT_EXPECT_EQ(test, simplefs_inode_run_first(&file), (uint64_t)100);
+}
+
+static void simplefs_test_run_extend(struct kunit *test)
+{
+	struct simplefs_super_block sb = {
+		.version = SIMPLEFS_VERSION_2,
+		.block_size = 4096,
+		.group_blocks = 1000,
+		.groups_count = 4,
+	};
+	struct simplefs_inode file = {
+		.mode = S_IFREG | 0644,
+		.data_block_number = 42,
+		.file_size = 3 * 4096,
+	};
+	uint64_t first, count;
+
+	/* Appending leaves an eighth more room */
+	KUNIT_ASSERT_EQ(test, simplefs_run_extend(&sb, &file, 3, 7, &first, &count), 0);
+	KUNIT_EXPECT_EQ(test, first, (uint64_t)0);
+	KUNIT_EXPECT_EQ(test, count, (uint64_t)9);
+
+	/* A write before the run of a sparse file covers both, and only
+	 * what a write after it adds is rounded up */
+	file.mode |= SIMPLEFS_INODE_SPARSE;
+	file.run_first = 500;
+	file.run_blocks = 10;
+	KUNIT_ASSERT_EQ(test, simplefs_run_extend(&sb, &file, 400, 400, &first, &count), 0);
+	KUNIT_EXPECT_EQ(test, first, (uint64_t)400);
+	KUNIT_EXPECT_EQ(test, count, (uint64_t)110);
+
+	/* The slack stops at the length of a group, and so does the run */
+	KUNIT_ASSERT_EQ(test, simplefs_run_extend(&sb, &file, 500, 1450, &first, &count), 0);
+	KUNIT_EXPECT_EQ(test, count, (uint64_t)1000);
+	KUNIT_EXPECT_EQ(test, simplefs_run_extend(&sb, &file, 400, 1400, &first, &count),
+			-EFBIG);
+	file.run_first = 0xffffff00;
+	KUNIT_EXPECT_EQ(test, simplefs_run_extend(&sb, &file, 0xffffff00, 0xffffffff,
+						  &first, &count), -EFBIG);
+
+	/* Without holes, files do not grow */
+	sb.version = SIMPLEFS_VERSION_1;
+	KUNIT_EXPECT_EQ(test, simplefs_run_extend(&sb, &file, 3, 7, &first, &count), -ENOSPC);
+}
+
+static void simplefs_test_inode_resize(struct kunit *test)
+{
+	struct simplefs_inode file = {
+		.mode = S_IFREG | 0644,
+		.data_block_number = 42,
+		.file_size = 3 * 4096,
+	};
+
+	/* Growing past the run leaves a hole after it */
+	simplefs_inode_resize(&file, 4096, 10 * 4096);
+	KUNIT_EXPECT_TRUE(test, file.mode & SIMPLEFS_INODE_SPARSE);
+	KUNIT_EXPECT_EQ(test, simplefs_inode_run_first(&file), (uint64_t)0);
+	KUNIT_EXPECT_EQ(test, simplefs_inode_blocks(&file, 4096), (uint64_t)3);
+	KUNIT_EXPECT_EQ(test, file.file_size, (uint64_t)10 * 4096);
+
+	/* Shrinking cuts the run short, and then away */
+	simplefs_inode_resize(&file, 4096, 4097);
+	KUNIT_EXPECT_EQ(test, simplefs_inode_blocks(&file, 4096), (uint64_t)2);
+	simplefs_inode_set_run(&file, 4096, 50, 5, 2);
+	KUNIT_EXPECT_EQ(test, simplefs_inode_run_first(&file), (uint64_t)5);
+	simplefs_inode_resize(&file, 4096, 4096);
+	KUNIT_EXPECT_EQ(test, simplefs_inode_blocks(&file, 4096), (uint64_t)0);
+	KUNIT_EXPECT_EQ(test, file.data_block_number, (uint64_t)0);
+
+	/* A file that is not sparse stays so when moved as a whole */
+	file.mode &= ~SIMPLEFS_INODE_SPARSE;
+	file.data_block_number = 42;
+	file.file_size = 4096;
+	simplefs_inode_set_run(&file, 4096, 60, 0, 1);
+	KUNIT_EXPECT_FALSE(test, file.mode & SIMPLEFS_INODE_SPARSE);
+	KUNIT_EXPECT_EQ(test, file.data_block_number, (uint64_t)60);
+}
+
+static void simplefs_test_dir_record(struct kunit *test)
+{
+	struct simplefs_dir_record record;
+	char name[SIMPLEFS_FILENAME_MAXLEN + 1];
+
+	KUNIT_ASSERT_EQ(test, simplefs_dir_record_init(&record, "hello", 5, 42), 0);
+	KUNIT_EXPECT_EQ(test, le64_to_cpu(record.inode_no), (uint64_t)42);
+	KUNIT_EXPECT_TRUE(test, simplefs_dir_record_match(&record, "hello", 5));
+	KUNIT_EXPECT_FALSE(test, simplefs_dir_record_match(&record, "hell", 4));
+	KUNIT_EXPECT_FALSE(test, simplefs_dir_record_match(&record, "hello!", 6));
+
+	/* The name is not NUL terminated in the dentry */
+	KUNIT_EXPECT_TRUE(test, simplefs_dir_record_match(&record, "hellothere", 5));
+
+	memset(name, 'a', sizeof(name));
+	KUNIT_EXPECT_EQ(test, simplefs_dir_record_init(&record, name, 0, 42), -ENAMETOOLONG);
+	KUNIT_EXPECT_EQ(test, simplefs_dir_record_init(&record, name, SIMPLEFS_FILENAME_MAXLEN, 42),
+			-ENAMETOOLONG);
+	KUNIT_ASSERT_EQ(test, simplefs_dir_record_init(&record, name, SIMPLEFS_FILENAME_MAXLEN - 1, 42),
+			0);
+	KUNIT_EXPECT_TRUE(test, simplefs_dir_record_match(&record, name, SIMPLEFS_FILENAME_MAXLEN - 1));
+	KUNIT_EXPECT_FALSE(test, simplefs_dir_record_match(&record, name, SIMPLEFS_FILENAME_MAXLEN));
+}
+
+static void simplefs_test_dir_layout(struct kunit *test)
+{
+	struct simplefs_super_block sb = { .block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE };
+	struct simplefs_inode dir = {
+		.mode = S_IFDIR,
+		.data_block_number = 100,
+		.dir_children_count = 16,
+	};
+	uint64_t per_block = simplefs_dir_records_per_block(sb.block_size);
+	uint64_t block, offset;
+
+	/* Records never straddle two blocks */
+	KUNIT_EXPECT_EQ(test, per_block, (uint64_t)15);
+	simplefs_dir_record_locate(&sb, &dir, per_block - 1, &block, &offset);
+	KUNIT_EXPECT_EQ(test, block, (uint64_t)100);
+	KUNIT_EXPECT_EQ(test, offset, (per_block - 1) * sizeof(struct simplefs_dir_record));
+	simplefs_dir_record_locate(&sb, &dir, per_block, &block, &offset);
+	KUNIT_EXPECT_EQ(test, block, (uint64_t)101);
+	KUNIT_EXPECT_EQ(test, offset, (uint64_t)0);
+
+	/* 16 children take two blocks, which have room for 30 */
+	KUNIT_EXPECT_EQ(test, simplefs_dir_capacity(&sb, &dir), 2 * per_block);
+	dir.dir_children_count = 0;
+	KUNIT_EXPECT_EQ(test, simplefs_dir_capacity(&sb, &dir), per_block);
+}
+
+/* readdir picks up from the record the last call stopped at */
+static void simplefs_test_dir_pos(struct kunit *test)
+{
+	struct simplefs_inode dir = { .mode = S_IFDIR, .dir_children_count = 20 };
+	uint64_t i;
+
+	for (i = 0; i <= dir.dir_children_count; i++)
+		KUNIT_EXPECT_EQ(test, simplefs_dir_pos_index(&dir, simplefs_dir_index_pos(i)), i);
+
+	/* Past the end, or not on a record boundary */
+	KUNIT_EXPECT_EQ(test, simplefs_dir_pos_index(&dir, simplefs_dir_index_pos(100)), (uint64_t)20);
+	KUNIT_EXPECT_EQ(test, simplefs_dir_pos_index(&dir, simplefs_dir_index_pos(3) + 1), (uint64_t)3);
+	KUNIT_EXPECT_EQ(test, simplefs_dir_pos_index(&dir, (uint64_t)-1), (uint64_t)20);
+}
+
+static struct kunit_case simplefs_format_test_cases[] = {
+	KUNIT_CASE(simplefs_test_sb_init),
+	KUNIT_CASE(simplefs_test_sb_init_invalid),
+	KUNIT_CASE(simplefs_test_sb_check),
+	KUNIT_CASE(simplefs_test_sb_init_meta),
+	KUNIT_CASE(simplefs_test_journal_sb),
+	KUNIT_CASE(simplefs_test_group_alloc),
+	KUNIT_CASE(simplefs_test_group_alloc_full),
+	KUNIT_CASE(simplefs_test_group_alloc_run),
+	KUNIT_CASE(simplefs_test_group_free_extents),
+	KUNIT_CASE(simplefs_test_group_free),
+	KUNIT_CASE(simplefs_test_refcount_locate),
+	KUNIT_CASE(simplefs_test_compress_pack),
+	KUNIT_CASE(simplefs_test_compress_fit),
+	KUNIT_CASE(simplefs_test_alloc_all),
+	KUNIT_CASE(simplefs_test_legacy_alloc),
+	KUNIT_CASE(simplefs_test_inode_locate),
+	KUNIT_CASE(simplefs_test_inode_locate_csum),
+	KUNIT_CASE(simplefs_test_crc32c),
+	KUNIT_CASE(simplefs_test_csum),
+	KUNIT_CASE(simplefs_test_inode_v1),
+	KUNIT_CASE(simplefs_test_byte_order),
+	KUNIT_CASE(simplefs_test_inode_blocks),
+	KUNIT_CASE(simplefs_test_run_extend),
+	KUNIT_CASE(simplefs_test_inode_resize),
+	KUNIT_CASE(simplefs_test_dir_record),
+	KUNIT_CASE(simplefs_test_dir_layout),
+	KUNIT_CASE(simplefs_test_dir_pos),
+	{}
+};
+
+static struct kunit_suite simplefs_format_test_suite = {
+	.name = "simplefs_format",
+	.test_cases = simplefs_format_test_cases,
+};
+
+/* The microbenchmarks, each run for 10^3 up to 10^6 objects */
+
+static const uint64_t simplefs_bench_sizes[] = { 1000, 10000, 100000, 1000000 };
+
+static void simplefs_bench_size_desc(const uint64_t *size, char *desc)
+{
+	snprintf(desc, KUNIT_PARAM_DESC_SIZE, "%llu", *size);
+}
+
+KUNIT_ARRAY_PARAM(simplefs_bench_size, simplefs_bench_sizes, simplefs_bench_size_desc);
+
+static void simplefs_bench_report(struct kunit *test, const char *what,
+				  uint64_t count, uint64_t start)
+{
+	uint64_t ns = ktime_get_ns() - start;
+
+	kunit_info(test, "%llu %s in %llu us, %llu ns each\n", count, what,
+		   div64_u64(ns, 1000), div64_u64(ns, count));
+}
+
+/* Fill a device of n data blocks, one block at a time */
+static void simplefs_bench_alloc(struct kunit *test)
+{
+	uint64_t n = *(const uint64_t *)test->param_value;
+	struct simplefs_test_image img;
+	uint64_t i, out, start;
+
+	simplefs_test_image_init(test, &img, n + n / 64 + 1024, 0);
+
+	start = ktime_get_ns();
+	for (i = 0; i < n; i++)
+		if (simplefs_test_alloc(&img, &out))
+			break;
+	simplefs_bench_report(test, "allocations", n, start);
+	KUNIT_EXPECT_EQ(test, i, n);
+
+	simplefs_test_image_exit(&img);
+}
+
+/* What simplefs_create_fs_object does to the format: take a block, append
+ * an inode to the inode store and a record to the parent directory. The
+ * parents have 1000 children each and share one buffer. */
+static void simplefs_bench_create(struct kunit *test)
+{
+	uint64_t n = *(const uint64_t *)test->param_value;
+	struct simplefs_test_image img;
+	struct simplefs_inode dir = { .mode = S_IFDIR, .dir_children_count = 1000 };
+	struct simplefs_inode inode = { .mode = S_IFREG };
+	struct simplefs_dir_record *records;
+	uint64_t i, block, offset, start;
+	char name[24];
+	int len;
+
+	simplefs_test_image_init(test, &img, n + n / 64 + 1024,
+				 n + SIMPLEFS_RESERVED_INODES);
+	records = vzalloc(simplefs_inode_blocks(&dir, img.sb.block_size) *
+			  img.sb.block_size);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, records);
+
+	start = ktime_get_ns();
+	for (i = 0; i < n; i++) {
+		if (simplefs_test_alloc(&img, &inode.data_block_number))
+			break;
+
+		inode.inode_no = simplefs_inode_next_no(&img.sb);
+		simplefs_inode_locate(&img.sb, img.sb.inodes_count, &block, &offset);
+		simplefs_inode_store(&img.sb, simplefs_test_block(&img, block) + offset, &inode);
+		img.sb.inodes_count++;
+
+		if (dir.dir_children_count == 1000)
+			dir.dir_children_count = 0;
+		simplefs_dir_record_locate(&img.sb, &dir, dir.dir_children_count,
+					   &block, &offset);
+		len = snprintf(name, sizeof(name), "file%llu", i);
+		simplefs_dir_record_init((void *)records + block * img.sb.block_size + offset,
+					 name, len, inode.inode_no);
+		dir.dir_children_count++;
+	}
+	simplefs_bench_report(test, "creates", n, start);
+	KUNIT_EXPECT_EQ(test, i, n);
+
+	vfree(records);
+	simplefs_test_image_exit(&img);
+}
+
+/* The linear scan of simplefs_lookup, through a directory of n children,
+ * for 100 names spread evenly over it and one that is not there */
+static void simplefs_bench_lookup(struct kunit *test)
+{
+	uint64_t n = *(const uint64_t *)test->param_value;
+	struct simplefs_super_block sb = { .block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE };
+	struct simplefs_inode dir = { .mode = S_IFDIR, .dir_children_count = n };
+	struct simplefs_dir_record *record;
+	unsigned char *records;
+	uint64_t i, j, block, offset, start, found = 0;
+	char name[24];
+	int len;
+
+	records = vzalloc(simplefs_inode_blocks(&dir, sb.block_size) * sb.block_size);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, records);
+
+	for (i = 0; i < n; i++) {
+		simplefs_dir_record_locate(&sb, &dir, i, &block, &offset);
+		len = snprintf(name, sizeof(name), "file%llu", i);
+		simplefs_dir_record_init((void *)records + block * sb.block_size + offset,
+					 name, len, simplefs_inode_no(i + SIMPLEFS_RESERVED_INODES));
+	}
+
+	start = ktime_get_ns();
+	for (j = 0; j <= 100; j++) {
+		len = snprintf(name, sizeof(name), "file%llu", div64_u64(j * n, 100));
+		for (i = 0; i < n; i++) {
+			simplefs_dir_record_locate(&sb, &dir, i, &block, &offset);
+			record = (void *)records + block * sb.block_size + offset;
+			if (simplefs_dir_record_match(record, name, len)) {
+				found++;
+				break;
+			}
+		}
+		cond_resched();
+	}
+	simplefs_bench_report(test, "lookups", 101, start);
+	KUNIT_EXPECT_EQ(test, found, (uint64_t)100);
+
+	vfree(records);
+}
+
+static struct kunit_case simplefs_bench_cases[] = {
+	KUNIT_CASE_PARAM(simplefs_bench_alloc, simplefs_bench_size_gen_params),
+	KUNIT_CASE_PARAM(simplefs_bench_create, simplefs_bench_size_gen_params),
+	KUNIT_CASE_PARAM(simplefs_bench_lookup, simplefs_bench_size_gen_params),
+	{}
+};
+
+static struct kunit_suite simplefs_bench_suite = {
+	.name = "simplefs_bench",
+	.test_cases = simplefs_bench_cases,
+};
+
+kunit_test_suites(&simplefs_format_test_suite, &simplefs_bench_suite);
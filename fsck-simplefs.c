@@ -0,0 +1,895 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdarg.h>
+
+#include "format.h"
+
+/* Exit codes, the same as e2fsck */
+#define FSCK_OK 0
+#define FSCK_NONDESTRUCT 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+/* Images without a block bitmap handed out blocks from 3 onwards,
+ * even though the journal was supposed to be there */
+#define LEGACY_FIRST_FREE_BLOCK 3
+
+struct fsck {
+	struct simplefs_super_block *sb;
+	unsigned char *image;
+	uint64_t image_size;
+	/* The metadata device, with -m, which the blocks from
+	 * sb->meta_block on are on */
+	unsigned char *meta_image;
+	uint64_t meta_size;
+	int repair;
+	int threads;
+
+	/* The first block files and directories may use */
+	uint64_t first_data_block;
+
+	/* One bit per block, set for every block that is reachable
+	 * from the root directory (or is metadata) */
+	unsigned char *used;
+	/* For images with a reference count table, the number of inodes
+	 * found using each block besides the first */
+	uint16_t *shared;
+	/* Number of directory entries pointing at each slot */
+	uint32_t *links;
+
+	/* Directories waiting to be checked, by slot */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t *queue;
+	uint64_t queued, queue_capacity;
+	/* Directories queued or being checked */
+	uint64_t pending;
+	int failed;
+
+	uint64_t errors;
+	uint64_t fixed;
+};
+
+static void problem(struct fsck *f, int fixable, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* Report an inconsistency. Fixable ones are fixed by the caller when
+ * running with -y, everything else is left for a human to look at. */
+static void problem(struct fsck *f, int fixable, const char *fmt, ...)
+{
+	char message[512];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(message, sizeof(message), fmt, args);
+	va_end(args);
+
+	if (fixable && f->repair) {
+		printf("%s. Fixed.\n", message);
+		__atomic_fetch_add(&f->fixed, 1, __ATOMIC_RELAXED);
+	} else {
+		printf("%s.\n", message);
+		__atomic_fetch_add(&f->errors, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void *block_at(struct fsck *f, uint64_t block)
+{
+	if (f->sb->meta_block && block >= f->sb->meta_block)
+		return f->meta_image + (block - f->sb->meta_block) * f->sb->block_size;
+	return f->image + block * f->sb->block_size;
+}
+
+/* The inode in a slot as it is on the disk, see simplefs_inode_load */
+static void *inode_at(struct fsck *f, uint64_t slot)
+{
+	uint64_t block, offset;
+
+	simplefs_inode_locate(f->sb, slot, &block, &offset);
+	return (char *)block_at(f, block) + offset;
+}
+
+static void inode_get(struct fsck *f, uint64_t slot, struct simplefs_inode *inode)
+{
+	simplefs_inode_load(f->sb, inode_at(f, slot), inode);
+}
+
+static void inode_clear(struct fsck *f, uint64_t slot)
+{
+	memset(inode_at(f, slot), 0, simplefs_inode_size(f->sb));
+}
+
+static int device_size(int fd, uint64_t *out)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -1;
+
+	if (S_ISBLK(st.st_mode))
+		return ioctl(fd, BLKGETSIZE64, out);
+
+	*out = st.st_size;
+	return 0;
+}
+
+/* Anything wrong here means the rest of the image cannot be trusted */
+static int check_superblock(struct fsck *f)
+{
+	struct simplefs_super_block *sb = f->sb;
+	struct simplefs_super_block_disk *copy;
+	struct simplefs_cbt_header *header;
+	const char *invalid;
+
+	if (!sb->groups_count) {
+		simplefs_sb_legacy_geometry(sb);
+		f->first_data_block = LEGACY_FIRST_FREE_BLOCK;
+	} else {
+		f->first_data_block = simplefs_sb_file_block(sb);
+	}
+
+	invalid = simplefs_sb_check(sb);
+	if (invalid) {
+		printf("%s\n", invalid);
+		return -1;
+	}
+	if (f->repair && simplefs_sb_read_only(sb)) {
+		printf("The filesystem has features this version can only check, run without -y\n");
+		return -1;
+	}
+
+	/* The rest of it made sense, so only the checksum is wrong */
+	if (!simplefs_sb_csum_verify(sb, f->image))
+		problem(f, 1, "The super block has a wrong checksum");
+
+	if (!sb->meta_block != !f->meta_image) {
+		printf(sb->meta_block ?
+		       "The metadata of the filesystem is on another device, give it with -m\n" :
+		       "The filesystem has no metadata device\n");
+		return -1;
+	}
+
+	if (simplefs_sb_file_end(sb) * sb->block_size > f->image_size) {
+		printf("The filesystem has %llu blocks but the device only has room for %llu\n",
+		       (unsigned long long)simplefs_sb_file_end(sb),
+		       (unsigned long long)(f->image_size / sb->block_size));
+		return -1;
+	}
+
+	if (sb->meta_block) {
+		if ((sb->blocks_count - sb->meta_block) * sb->block_size > f->meta_size) {
+			printf("The filesystem has %llu blocks on the metadata device but it only has room for %llu\n",
+			       (unsigned long long)(sb->blocks_count - sb->meta_block),
+			       (unsigned long long)(f->meta_size / sb->block_size));
+			return -1;
+		}
+		/* What the kernel recognizes the device by. The counts in the
+		 * copy are those of mkfs. */
+		copy = (struct simplefs_super_block_disk *)f->meta_image;
+		if (le64_to_cpu(copy->magic) != sb->magic ||
+		    le64_to_cpu(copy->blocks_count) != sb->blocks_count ||
+		    le64_to_cpu(copy->meta_block) != sb->meta_block ||
+		    le64_to_cpu(copy->data_dev_blocks) != sb->data_dev_blocks ||
+		    le64_to_cpu(copy->group_desc_block) != sb->group_desc_block) {
+			printf("This is not the metadata device of the filesystem\n");
+			return -1;
+		}
+	}
+
+	if (simplefs_sb_cbt_block(sb)) {
+		header = block_at(f, sb->cbt_block);
+		if (le64_to_cpu(header->magic) != SIMPLEFS_CBT_MAGIC ||
+		    le64_to_cpu(header->current_bitmap) > 1 ||
+		    le64_to_cpu(header->bitmap_blocks) != simplefs_cbt_bitmap_blocks(sb))
+			problem(f, 0, "The changed block tracking header is invalid");
+	}
+
+	if (simplefs_sb_dedup_block(sb) &&
+	    le64_to_cpu(((struct simplefs_dedup_header *)block_at(f, sb->dedup_block))->magic) !=
+	    SIMPLEFS_DEDUP_MAGIC)
+		problem(f, 0, "The dedup index header is invalid");
+
+	return 0;
+}
+
+static void mark_used(struct fsck *f, uint64_t block)
+{
+	__atomic_fetch_or(&f->used[block / 8], 1 << (block % 8), __ATOMIC_RELAXED);
+}
+
+/* Whether a run of blocks is all in the data area: on images with a
+ * metadata device, all on the data device or all after the metadata */
+static int run_in_data_area(struct fsck *f, uint64_t start, uint64_t count)
+{
+	struct simplefs_super_block *sb = f->sb;
+
+	if (start < f->first_data_block || start + count > sb->blocks_count ||
+	    start + count < start)
+		return 0;
+	return !sb->meta_block || start + count <= sb->data_dev_blocks ||
+	       start >= sb->data_block;
+}
+
+/* Claim the run of blocks of an object. Fails if the run is outside of
+ * the data area, or overlaps with something claimed before. Only files
+ * can share blocks, on images with a reference count table. */
+static int claim_run(struct fsck *f, const struct simplefs_inode *inode)
+{
+	uint64_t start = inode->data_block_number;
+	uint64_t count = simplefs_inode_blocks(inode, f->sb->block_size);
+	uint64_t block;
+	unsigned char old;
+
+	/* Files created with delayed allocation that never got written
+	 * out, and sparse files that are all holes */
+	if (!start) {
+		if (S_ISREG(inode->mode) &&
+		    (!inode->file_size || inode->mode & SIMPLEFS_INODE_SPARSE))
+			return 0;
+		problem(f, 0, "Inode %llu has no blocks",
+			(unsigned long long)inode->inode_no);
+		return -1;
+	}
+
+	if (!run_in_data_area(f, start, count)) {
+		problem(f, 0, "Inode %llu has blocks %llu-%llu outside of the data area",
+			(unsigned long long)inode->inode_no, (unsigned long long)start,
+			(unsigned long long)(start + count - 1));
+		return -1;
+	}
+
+	for (block = start; block < start + count; block++) {
+		old = __atomic_fetch_or(&f->used[block / 8], 1 << (block % 8),
+					__ATOMIC_RELAXED);
+		if (!(old & (1 << (block % 8))))
+			continue;
+		if (!f->shared || S_ISDIR(inode->mode)) {
+			problem(f, 0, "Block %llu of inode %llu is also used by another inode",
+				(unsigned long long)block,
+				(unsigned long long)inode->inode_no);
+			return -1;
+		}
+		if (__atomic_fetch_add(&f->shared[block], 1, __ATOMIC_RELAXED) ==
+		    SIMPLEFS_REFCOUNT_MAX) {
+			problem(f, 0, "Block %llu is shared by more inodes than can be counted",
+				(unsigned long long)block);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void enqueue(struct fsck *f, uint64_t slot)
+{
+	uint64_t *queue;
+
+	pthread_mutex_lock(&f->lock);
+	if (f->queued == f->queue_capacity) {
+		f->queue_capacity = f->queue_capacity ? f->queue_capacity * 2 : 1024;
+		queue = realloc(f->queue, f->queue_capacity * sizeof(*queue));
+		if (!queue) {
+			f->failed = 1;
+			pthread_cond_broadcast(&f->cond);
+			pthread_mutex_unlock(&f->lock);
+			return;
+		}
+		f->queue = queue;
+	}
+	f->queue[f->queued++] = slot;
+	f->pending++;
+	pthread_cond_signal(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+}
+
+static struct simplefs_dir_record *record_at(struct fsck *f,
+					     const struct simplefs_inode *dir,
+					     uint64_t i)
+{
+	uint64_t block, offset;
+
+	simplefs_dir_record_locate(f->sb, dir, i, &block, &offset);
+	return (struct simplefs_dir_record *)((char *)block_at(f, block) + offset);
+}
+
+/* Check the checksums of the blocks of a directory that hold its first
+ * children records, or set them again after a repair */
+static int dir_csums_verify(struct fsck *f, const struct simplefs_inode *dir,
+			    uint64_t children)
+{
+	uint64_t per_block = simplefs_dir_records_per_block(f->sb->block_size);
+	uint64_t i;
+
+	for (i = 0; i * per_block < children; i++)
+		if (!simplefs_block_csum_verify(f->sb, block_at(f, dir->data_block_number + i)))
+			return 0;
+	return 1;
+}
+
+static void dir_csums_set(struct fsck *f, const struct simplefs_inode *dir,
+			  uint64_t children)
+{
+	uint64_t per_block = simplefs_dir_records_per_block(f->sb->block_size);
+	uint64_t i;
+
+	for (i = 0; i * per_block < children; i++)
+		simplefs_block_csum_set(f->sb, block_at(f, dir->data_block_number + i));
+}
+
+/* Drop entry i of a directory by moving the last entry in its place */
+static void remove_record(struct fsck *f, struct simplefs_inode *dir, uint64_t i)
+{
+	uint64_t last = dir->dir_children_count - 1;
+
+	if (i != last)
+		memcpy(record_at(f, dir, i), record_at(f, dir, last),
+		       sizeof(struct simplefs_dir_record));
+	memset(record_at(f, dir, last), 0, sizeof(struct simplefs_dir_record));
+	dir->dir_children_count--;
+}
+
+/* Check the entries of one directory. Subdirectories are queued, so that
+ * different subtrees are checked by different threads. */
+static void check_dir(struct fsck *f, uint64_t slot)
+{
+	struct simplefs_inode dir_inode, child_inode;
+	struct simplefs_inode *dir = &dir_inode, *child;
+	struct simplefs_dir_record *record;
+	uint64_t i, child_slot, children, ino;
+	uint32_t links;
+	const char *why;
+	int csum_ok;
+
+	inode_get(f, slot, dir);
+	/* The run is only claimed once the entries that get removed below
+	 * are, as it is as long as the count of children left says. Until
+	 * then, it only has to be where the records can be read. */
+	if (!dir->data_block_number ||
+	    !run_in_data_area(f, dir->data_block_number,
+			      simplefs_inode_blocks(dir, f->sb->block_size))) {
+		claim_run(f, dir);
+		return;
+	}
+	children = dir->dir_children_count;
+
+	csum_ok = dir_csums_verify(f, dir, children);
+	if (!csum_ok)
+		problem(f, 1, "Directory inode %llu has blocks with a wrong checksum",
+			(unsigned long long)dir->inode_no);
+
+	for (i = 0; i < dir->dir_children_count; i++) {
+		record = record_at(f, dir, i);
+		ino = le64_to_cpu(record->inode_no);
+		child = NULL;
+		why = NULL;
+
+		if (!memchr(record->filename, '\0', sizeof(record->filename)) ||
+		    !record->filename[0]) {
+			why = "has an invalid name";
+		} else if ((child_slot = simplefs_inode_slot(ino)) >= f->sb->inodes_count ||
+			   ino == SIMPLEFS_JOURNAL_INODE_NUMBER ||
+			   ino == SIMPLEFS_ROOTDIR_INODE_NUMBER) {
+			why = "points to an invalid inode";
+		} else {
+			child = &child_inode;
+			inode_get(f, child_slot, child);
+			/* The FIXME in simplefs_lookup: the slot was
+			 * counted but the inode never written */
+			if (child->inode_no != ino)
+				why = "points to an inode that was never written";
+			else if (!S_ISDIR(child->mode) && !S_ISREG(child->mode))
+				why = "points to an inode that is neither a file nor a directory";
+		}
+
+		if (!why) {
+			links = __atomic_fetch_add(&f->links[child_slot], 1, __ATOMIC_RELAXED);
+			if (links)
+				why = "is a second link to an inode";
+		}
+
+		if (why) {
+			problem(f, 1, "Entry %llu of directory inode %llu (inode %llu) %s",
+				(unsigned long long)i, (unsigned long long)dir->inode_no,
+				(unsigned long long)ino, why);
+			if (f->repair) {
+				remove_record(f, dir, i);
+				i--;
+			}
+			continue;
+		}
+
+		if (S_ISDIR(child->mode))
+			enqueue(f, child_slot);
+		else
+			claim_run(f, child);
+	}
+
+	claim_run(f, dir);
+	if (dir->dir_children_count != children)
+		simplefs_inode_store(f->sb, inode_at(f, slot), dir);
+	if (f->repair && (dir->dir_children_count != children || !csum_ok))
+		dir_csums_set(f, dir, children);
+}
+
+static void *check_dirs_worker(void *arg)
+{
+	struct fsck *f = arg;
+	uint64_t slot;
+
+	pthread_mutex_lock(&f->lock);
+	for (;;) {
+		while (!f->queued && f->pending && !f->failed)
+			pthread_cond_wait(&f->cond, &f->lock);
+		if (!f->queued)
+			break;
+
+		slot = f->queue[--f->queued];
+		pthread_mutex_unlock(&f->lock);
+
+		check_dir(f, slot);
+
+		pthread_mutex_lock(&f->lock);
+		if (!--f->pending)
+			pthread_cond_broadcast(&f->cond);
+	}
+	pthread_mutex_unlock(&f->lock);
+	return NULL;
+}
+
+static int run_workers(struct fsck *f, void *(*worker)(void *))
+{
+	pthread_t *workers;
+	int i;
+
+	workers = calloc(f->threads, sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	for (i = 0; i < f->threads; i++)
+		if (pthread_create(&workers[i], NULL, worker, f))
+			break;
+	if (i == 0)
+		worker(f);
+	while (i--)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+	return 0;
+}
+
+/* The checksums of the blocks of the inode store, before any repair
+ * changes what is in them. After repairs, all of them are set again by
+ * inode_store_csums_set. */
+static void check_inode_store_csums(struct fsck *f)
+{
+	struct simplefs_super_block *sb = f->sb;
+	uint64_t block;
+
+	for (block = 0; block < sb->inode_table_initialized; block++)
+		if (!simplefs_block_csum_verify(sb, block_at(f, sb->inode_table_block + block)))
+			problem(f, 1, "Block %llu of the inode store has a wrong checksum",
+				(unsigned long long)block);
+}
+
+static void inode_store_csums_set(struct fsck *f)
+{
+	struct simplefs_super_block *sb = f->sb;
+	uint64_t block;
+
+	for (block = 0; block < sb->inode_table_initialized; block++)
+		simplefs_block_csum_set(sb, block_at(f, sb->inode_table_block + block));
+}
+
+/* Pass 1: walk the tree from the root directory */
+static int check_tree(struct fsck *f)
+{
+	struct simplefs_inode root_inode, *root = &root_inode;
+	uint64_t block;
+
+	inode_get(f, SIMPLEFS_ROOTDIR_INODE_NUMBER - 1, root);
+	if (root->inode_no != SIMPLEFS_ROOTDIR_INODE_NUMBER || !S_ISDIR(root->mode)) {
+		printf("The root directory inode is invalid\n");
+		return -1;
+	}
+	check_inode_store_csums(f);
+
+	for (block = 0; block < f->first_data_block; block++)
+		mark_used(f, block);
+	if (f->sb->meta_block)
+		for (block = f->sb->data_dev_blocks; block < f->sb->data_block; block++)
+			mark_used(f, block);
+	/* Changed block tracking has a run of its own */
+	if (simplefs_sb_cbt_block(f->sb))
+		for (block = f->sb->cbt_block;
+		     block < f->sb->cbt_block + simplefs_cbt_blocks(f->sb); block++)
+			mark_used(f, block);
+	/* And so does the dedup index */
+	if (simplefs_sb_dedup_block(f->sb))
+		for (block = f->sb->dedup_block;
+		     block < f->sb->dedup_block + simplefs_dedup_blocks(f->sb); block++)
+			mark_used(f, block);
+	f->links[SIMPLEFS_ROOTDIR_INODE_NUMBER - 1] = 1;
+	f->links[SIMPLEFS_JOURNAL_INODE_NUMBER - 1] = 1;
+
+	enqueue(f, SIMPLEFS_ROOTDIR_INODE_NUMBER - 1);
+	if (run_workers(f, check_dirs_worker) || f->failed)
+		return -1;
+	return 0;
+}
+
+/* Pass 2: inodes no directory points to. Their blocks are given back
+ * by pass 3. Unlinked inodes at the end of the inode store are given
+ * back too, by lowering the inode count. */
+static void check_inodes(struct fsck *f)
+{
+	uint64_t slot, count = SIMPLEFS_RESERVED_INODES;
+	struct simplefs_inode inode;
+
+	for (slot = SIMPLEFS_RESERVED_INODES; slot < f->sb->inodes_count; slot++)
+		if (f->links[slot])
+			count = slot + 1;
+
+	for (slot = SIMPLEFS_RESERVED_INODES - 1; slot < count; slot++) {
+		if (f->links[slot])
+			continue;
+		inode_get(f, slot, &inode);
+		/* Cleared by an earlier run */
+		if (!inode.inode_no)
+			continue;
+		problem(f, 1, "Inode %llu is not linked from any directory",
+			(unsigned long long)simplefs_inode_no(slot));
+		if (f->repair)
+			inode_clear(f, slot);
+	}
+
+	if (count != f->sb->inodes_count) {
+		problem(f, 1, "Inode count is %llu, should be %llu",
+			(unsigned long long)f->sb->inodes_count,
+			(unsigned long long)count);
+		if (f->repair) {
+			for (slot = count; slot < f->sb->inodes_count; slot++)
+				inode_clear(f, slot);
+			f->sb->inodes_count = count;
+		}
+	}
+}
+
+/* Pass 3: compare the block bitmaps and reference counts with what
+ * pass 1 found in use */
+static uint64_t group_next;
+static uint64_t free_total;
+
+/* The reference counts of a group against how many inodes pass 1 found
+ * sharing each block */
+static void check_group_refcounts(struct fsck *f, uint64_t group,
+				  struct simplefs_group_desc *desc)
+{
+	struct simplefs_super_block *sb = f->sb;
+	uint64_t start = group * sb->group_blocks, bit, block, offset, wrong = 0;
+	__le16 *count;
+
+	for (bit = 0; bit < sb->group_blocks && start + bit < sb->blocks_count; bit++) {
+		simplefs_refcount_locate(sb, start + bit, &block, &offset);
+		count = (__le16 *)((char *)block_at(f, block) + offset);
+		if (le32_to_cpu(desc->flags) & SIMPLEFS_GROUP_REFCOUNT_UNINIT) {
+			if (f->shared[start + bit])
+				wrong++;
+		} else if (le16_to_cpu(*count) != f->shared[start + bit]) {
+			wrong++;
+		}
+	}
+
+	if (!wrong)
+		return;
+	problem(f, 1, "Group %llu has %llu blocks with the wrong reference count",
+		(unsigned long long)group, (unsigned long long)wrong);
+	if (!f->repair)
+		return;
+
+	for (bit = 0; bit < sb->group_blocks; bit++) {
+		simplefs_refcount_locate(sb, start + bit, &block, &offset);
+		count = (__le16 *)((char *)block_at(f, block) + offset);
+		*count = cpu_to_le16(start + bit < sb->blocks_count ? f->shared[start + bit] : 0);
+	}
+	desc->flags &= ~cpu_to_le32(SIMPLEFS_GROUP_REFCOUNT_UNINIT);
+}
+
+static void check_group(struct fsck *f, uint64_t group, unsigned char *expected)
+{
+	struct simplefs_super_block *sb = f->sb;
+	struct simplefs_group_desc *desc;
+	unsigned char *bitmap = block_at(f, sb->bitmap_block + group);
+	uint64_t start = group * sb->group_blocks, bit, used, leaked = 0, lost = 0;
+	uint64_t block, offset;
+	int on_disk, in_use, csum_ok;
+
+	simplefs_group_desc_locate(sb, group, &block, &offset);
+	desc = (struct simplefs_group_desc *)((char *)block_at(f, block) + offset);
+
+	csum_ok = simplefs_bitmap_csum_verify(sb, desc, bitmap);
+	if (!csum_ok)
+		problem(f, 1, "Group %llu has a block bitmap with a wrong checksum",
+			(unsigned long long)group);
+
+	used = simplefs_group_bitmap_init(sb, group, expected);
+	for (bit = 0; bit < sb->group_blocks && start + bit < sb->blocks_count; bit++) {
+		if (simplefs_block_reserved(sb, start + bit))
+			continue;
+		if (f->used[(start + bit) / 8] & (1 << ((start + bit) % 8))) {
+			expected[bit / 8] |= 1 << (bit % 8);
+			used++;
+		}
+	}
+
+	for (bit = 0; bit < sb->group_blocks; bit++) {
+		/* A group never brought into use has only its metadata in use */
+		if (le32_to_cpu(desc->flags) & SIMPLEFS_GROUP_BLOCK_UNINIT)
+			on_disk = simplefs_block_reserved(sb, start + bit);
+		else
+			on_disk = !!(bitmap[bit / 8] & (1 << (bit % 8)));
+		in_use = !!(expected[bit / 8] & (1 << (bit % 8)));
+
+		if (on_disk && !in_use)
+			leaked++;
+		else if (!on_disk && in_use)
+			lost++;
+	}
+
+	if (leaked)
+		problem(f, 1, "Group %llu has %llu blocks marked in use that nothing uses",
+			(unsigned long long)group, (unsigned long long)leaked);
+	if (lost)
+		problem(f, 1, "Group %llu has %llu blocks in use that are marked free",
+			(unsigned long long)group, (unsigned long long)lost);
+	if ((leaked || lost) && f->repair) {
+		memcpy(bitmap, expected, sb->block_size);
+		desc->flags &= ~cpu_to_le32(SIMPLEFS_GROUP_BLOCK_UNINIT);
+	}
+	if ((leaked || lost || !csum_ok) && f->repair)
+		simplefs_bitmap_csum_set(sb, desc, bitmap);
+
+	if (le64_to_cpu(desc->free_blocks_count) != sb->group_blocks - used) {
+		problem(f, 1, "Group %llu free block count is %llu, should be %llu",
+			(unsigned long long)group,
+			(unsigned long long)le64_to_cpu(desc->free_blocks_count),
+			(unsigned long long)(sb->group_blocks - used));
+		if (f->repair)
+			desc->free_blocks_count = cpu_to_le64(sb->group_blocks - used);
+	}
+
+	__atomic_fetch_add(&free_total, sb->group_blocks - used, __ATOMIC_RELAXED);
+
+	if (f->shared)
+		check_group_refcounts(f, group, desc);
+}
+
+static void *check_groups_worker(void *arg)
+{
+	struct fsck *f = arg;
+	unsigned char *expected;
+	uint64_t group;
+
+	expected = malloc(f->sb->block_size);
+	if (!expected) {
+		f->failed = 1;
+		return NULL;
+	}
+
+	while ((group = __atomic_fetch_add(&group_next, 1, __ATOMIC_RELAXED)) <
+	       f->sb->groups_count)
+		check_group(f, group, expected);
+
+	free(expected);
+	return NULL;
+}
+
+/* Images without a block bitmap track their 64 blocks in free_blocks */
+static void check_legacy_free_blocks(struct fsck *f)
+{
+	uint64_t expected = f->sb->free_blocks, block;
+
+	for (block = LEGACY_FIRST_FREE_BLOCK; block < f->sb->blocks_count; block++) {
+		if (f->used[block / 8] & (1 << (block % 8)))
+			expected &= ~(1ULL << block);
+		else
+			expected |= 1ULL << block;
+	}
+
+	if (expected != f->sb->free_blocks) {
+		problem(f, 1, "Free blocks mask is 0x%llx, should be 0x%llx",
+			(unsigned long long)f->sb->free_blocks,
+			(unsigned long long)expected);
+		if (f->repair)
+			f->sb->free_blocks = expected;
+	}
+}
+
+static int check_free_blocks(struct fsck *f)
+{
+	if (!f->sb->groups_count) {
+		check_legacy_free_blocks(f);
+		return 0;
+	}
+
+	if (run_workers(f, check_groups_worker) || f->failed)
+		return -1;
+
+	if (f->sb->free_blocks_count != free_total) {
+		problem(f, 1, "Free block count is %llu, should be %llu",
+			(unsigned long long)f->sb->free_blocks_count,
+			(unsigned long long)free_total);
+		if (f->repair)
+			f->sb->free_blocks_count = free_total;
+	}
+	return 0;
+}
+
+static void usage(void)
+{
+	printf("Usage: fsck-simplefs [-y] [-j threads] [-m metadata-device] <device>\n"
+	       "  -y  repair the problems found, instead of only reporting them\n"
+	       "  -j  number of threads (default: one per CPU)\n"
+	       "  -m  the metadata device of an image made with mkfs-simplefs -m\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct simplefs_super_block sb;
+	struct simplefs_super_block_disk *disk;
+	struct fsck f = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	const char *meta_dev = NULL;
+	int fd, meta_fd = -1, opt, ret = FSCK_ERROR;
+
+	f.threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "yj:m:")) != -1) {
+		switch (opt) {
+		case 'm':
+			meta_dev = optarg;
+			break;
+		case 'y':
+			f.repair = 1;
+			break;
+		case 'j':
+			f.threads = atoi(optarg);
+			break;
+		default:
+			usage();
+			return FSCK_ERROR;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage();
+		return FSCK_ERROR;
+	}
+	if (f.threads < 1)
+		f.threads = 1;
+
+	fd = open(argv[optind], f.repair ? O_RDWR : O_RDONLY);
+	if (fd == -1) {
+		perror("Error opening the device");
+		return FSCK_ERROR;
+	}
+
+	if (device_size(fd, &f.image_size) || f.image_size < sizeof(*disk)) {
+		printf("Error getting the size of the device\n");
+		goto out;
+	}
+
+	/* The whole image is mapped, so that the kernel can read ahead in
+	 * large sequential chunks and the threads share one copy of it */
+	f.image = mmap(NULL, f.image_size,
+		       f.repair ? PROT_READ | PROT_WRITE : PROT_READ,
+		       MAP_SHARED, fd, 0);
+	if (f.image == MAP_FAILED) {
+		perror("Error mapping the device");
+		goto out;
+	}
+	madvise(f.image, f.image_size, MADV_WILLNEED);
+
+	if (meta_dev) {
+		meta_fd = open(meta_dev, f.repair ? O_RDWR : O_RDONLY);
+		if (meta_fd == -1 || device_size(meta_fd, &f.meta_size) ||
+		    f.meta_size < sizeof(*disk)) {
+			perror("Error opening the metadata device");
+			goto unmap;
+		}
+		f.meta_image = mmap(NULL, f.meta_size,
+				    f.repair ? PROT_READ | PROT_WRITE : PROT_READ,
+				    MAP_SHARED, meta_fd, 0);
+		if (f.meta_image == MAP_FAILED) {
+			f.meta_image = NULL;
+			perror("Error mapping the metadata device");
+			goto unmap;
+		}
+		madvise(f.meta_image, f.meta_size, MADV_WILLNEED);
+	}
+
+	/* The super block is checked on a copy, so that filling in the
+	 * geometry of an old image does not change it on the disk */
+	simplefs_sb_load(f.image, &sb);
+	f.sb = &sb;
+	if (check_superblock(&f))
+		goto unmap;
+
+	f.used = calloc((sb.blocks_count + 7) / 8, 1);
+	f.links = calloc(sb.inodes_count, sizeof(*f.links));
+	if (sb.refcount_blocks)
+		f.shared = calloc(sb.blocks_count, sizeof(*f.shared));
+	if (!f.used || !f.links || (sb.refcount_blocks && !f.shared)) {
+		printf("Not enough memory\n");
+		goto unmap;
+	}
+
+	printf("Pass 1: checking directories and the blocks they use\n");
+	if (check_tree(&f))
+		goto unmap;
+	printf("Pass 2: checking the inode store\n");
+	check_inodes(&f);
+	printf("Pass 3: checking the free block map and reference counts\n");
+	if (check_free_blocks(&f))
+		goto unmap;
+
+	if (f.repair && f.fixed) {
+		/* Only the members a repair may change go back to the disk */
+		disk = (struct simplefs_super_block_disk *)f.image;
+		disk->inodes_count = cpu_to_le64(sb.inodes_count);
+		disk->free_blocks = cpu_to_le64(sb.free_blocks);
+		if (sb.groups_count)
+			disk->free_blocks_count = cpu_to_le64(sb.free_blocks_count);
+		simplefs_sb_csum_set(&sb, disk);
+		/* Changed block tracking does not know what was repaired */
+		if (simplefs_sb_cbt_block(&sb))
+			((struct simplefs_cbt_header *)block_at(&f, sb.cbt_block))->flags |=
+				cpu_to_le64(SIMPLEFS_CBT_INCOMPLETE);
+		/* Nor can the dedup index trust its slots any more */
+		if (simplefs_sb_dedup_block(&sb))
+			((struct simplefs_dedup_header *)block_at(&f, sb.dedup_block))->flags &=
+				~cpu_to_le64(SIMPLEFS_DEDUP_CLEAN);
+		if (simplefs_sb_has_csum(&sb))
+			inode_store_csums_set(&f);
+		if (msync(f.image, f.image_size, MS_SYNC) ||
+		    (f.meta_image && msync(f.meta_image, f.meta_size, MS_SYNC))) {
+			perror("Error writing the repairs");
+			goto unmap;
+		}
+	}
+
+	printf("%llu inodes, %llu blocks, %llu errors fixed, %llu errors left\n",
+	       (unsigned long long)sb.inodes_count,
+	       (unsigned long long)sb.blocks_count,
+	       (unsigned long long)f.fixed, (unsigned long long)f.errors);
+
+	ret = FSCK_OK;
+	if (f.fixed)
+		ret |= FSCK_NONDESTRUCT;
+	if (f.errors)
+		ret |= FSCK_UNCORRECTED;
+unmap:
+	if (f.meta_image)
+		munmap(f.meta_image, f.meta_size);
+	munmap(f.image, f.image_size);
+	free(f.used);
+	free(f.shared);
+	free(f.links);
+	free(f.queue);
+out:
+	if (meta_fd != -1)
+		close(meta_fd);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,33 @@
+#!/usr/bin/env bash
+
+#
+# Run the KUnit tests and microbenchmarks (format_test.c) under User-Mode
+# Linux, without root or a VM:
+#
+#   ./kunit.sh <kernel source tree> [kunit.py run options]
+#
+# kunit.py only builds code that is part of the kernel tree, so this links
+# the checkout in as fs/simplefs and adds it to fs/Kconfig and fs/Makefile,
+# once. Pass a suite name to run only that one, e.g. simplefs_format to
+# leave out the benchmarks.
+#
+
+set -e
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <kernel source tree> [kunit.py run options]" >&2
+    exit 1
+fi
+
+simplefs_dir="$(cd "$(dirname "$0")" && pwd)"
+linux_dir="$1"
+shift
+
+ln -sfn "$simplefs_dir" "$linux_dir/fs/simplefs"
+grep -q 'fs/simplefs/Kconfig' "$linux_dir/fs/Kconfig" ||
+    echo 'source "fs/simplefs/Kconfig"' >> "$linux_dir/fs/Kconfig"
+grep -q 'simplefs/' "$linux_dir/fs/Makefile" ||
+    echo 'obj-$(CONFIG_SIMPLEFS_FS) += simplefs/' >> "$linux_dir/fs/Makefile"
+
+cd "$linux_dir"
+exec ./tools/testing/kunit/kunit.py run --kunitconfig=fs/simplefs "$@"
@@ -2,208 +2,1302 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
-#include "simple.h"
+#include "format.h"
 
-#define WELCOMEFILE_DATABLOCK_NUMBER (SIMPLEFS_LAST_RESERVED_BLOCK + 1)
 #define WELCOMEFILE_INODE_NUMBER (SIMPLEFS_LAST_RESERVED_INODE + 1)
 
-static int write_superblock(int fd)
+/* Zeroing is done in chunks of this size, so that formatting
+ * without lazy initialization does not do one write per block */
+#define ZERO_CHUNK_SIZE (1 << 20)
+
+struct mkfs_options {
+	uint64_t block_size;
+	uint64_t inodes;
+	uint64_t group_blocks;
+	uint64_t journal_blocks;
+	int lazy_init;
+
+	/* Put the metadata and the directories on this device */
+	const char *meta_dev;
+
+	/* Populate the image from a directory tree or a tar stream on stdin */
+	const char *source_dir;
+	int source_tar;
+};
+
+/* The metadata device, with -m. The blocks from sb->meta_block on are
+ * written there instead. */
+static int meta_fd = -1;
+
+/* Nanoseconds since the epoch, for the times of the inodes */
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int write_at(int fd, const void *buf, size_t len, uint64_t block,
+		    const struct simplefs_super_block *sb)
 {
-	struct simplefs_super_block sb = {
-		.version = 1,
-		.magic = SIMPLEFS_MAGIC,
-		.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE,
-		.inodes_count = WELCOMEFILE_INODE_NUMBER,
-		/* FIXME: Free blocks management is not implemented yet */
-		.free_blocks = (~0) & ~(1 << SIMPLEFS_LAST_RESERVED_BLOCK),
-	};
 	ssize_t ret;
 
-	ret = write(fd, &sb, sizeof(sb));
-	if (ret != SIMPLEFS_DEFAULT_BLOCK_SIZE) {
-		printf
-		    ("bytes written [%d] are not equal to the default block size\n",
-		     (int)ret);
+	if (sb->meta_block && block >= sb->meta_block) {
+		fd = meta_fd;
+		block -= sb->meta_block;
+	}
+	ret = pwrite(fd, buf, len, block * sb->block_size);
+	if (ret != (ssize_t)len)
+		return -1;
+	return 0;
+}
+
+static int zero_blocks(int fd, uint64_t block, uint64_t count,
+		       const struct simplefs_super_block *sb)
+{
+	uint64_t chunk_blocks = ZERO_CHUNK_SIZE / sb->block_size;
+	uint64_t n;
+	char *zeroes;
+	int ret = 0;
+
+	zeroes = calloc(1, ZERO_CHUNK_SIZE);
+	if (!zeroes)
 		return -1;
+
+	while (count && !ret) {
+		n = count < chunk_blocks ? count : chunk_blocks;
+		ret = write_at(fd, zeroes, n * sb->block_size, block, sb);
+		block += n;
+		count -= n;
 	}
 
-	printf("Super block written succesfully\n");
+	free(zeroes);
+	return ret;
+}
+
+static int device_size(int fd, uint64_t *out)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -1;
+
+	if (S_ISBLK(st.st_mode))
+		return ioctl(fd, BLKGETSIZE64, out);
+
+	*out = st.st_size;
 	return 0;
 }
 
-static int write_root_inode(int fd)
+/* Whatever is not given on the command line is derived
+ * from the size of the device by simplefs_sb_init */
+static int compute_geometry(uint64_t bytes, uint64_t meta_bytes,
+			    const struct mkfs_options *opts,
+			    struct simplefs_super_block *sb)
 {
-	ssize_t ret;
+	struct simplefs_geometry geometry = {
+		.block_size = opts->block_size,
+		.inodes = opts->inodes,
+		.group_blocks = opts->group_blocks,
+		.journal_blocks = opts->journal_blocks,
+		.meta_bytes = meta_bytes,
+	};
+	const char *invalid;
+	uint64_t needed;
+
+	invalid = simplefs_sb_init(sb, bytes, &geometry);
+	if (invalid) {
+		printf("%s\n", invalid);
+		return -1;
+	}
+
+	/* The root directory and the welcome file take one block each.
+	 * With a metadata device, simplefs_sb_init already left room for
+	 * the welcome file on the data device. */
+	needed = sb->data_block + (sb->meta_block ? 1 : 2);
+	if (needed > sb->blocks_count) {
+		printf("The device is too small: %llu blocks needed, %llu available\n",
+		       (unsigned long long)needed,
+		       (unsigned long long)sb->blocks_count);
+		return -1;
+	}
+
+	/* jbd2 does not load a shorter one */
+	if (sb->journal_blocks < SIMPLEFS_MIN_JOURNAL_BLOCKS) {
+		printf("The journal must be at least %d blocks long\n",
+		       SIMPLEFS_MIN_JOURNAL_BLOCKS);
+		return -1;
+	}
 
-	struct simplefs_inode root_inode;
+	printf("%llu blocks of %llu bytes, %llu groups, %llu inodes, %llu journal blocks\n",
+	       (unsigned long long)sb->blocks_count,
+	       (unsigned long long)sb->block_size,
+	       (unsigned long long)sb->groups_count,
+	       (unsigned long long)sb->inodes_max,
+	       (unsigned long long)sb->journal_blocks);
+	if (sb->meta_block)
+		printf("%llu blocks on the data device, the metadata device from block %llu on\n",
+		       (unsigned long long)sb->data_dev_blocks,
+		       (unsigned long long)sb->meta_block);
+	return 0;
+}
+
+static int write_superblock(int fd, struct simplefs_super_block *sb)
+{
+	struct simplefs_super_block_disk disk = { 0 };
+	ssize_t ret;
 
-	root_inode.mode = S_IFDIR;
-	root_inode.inode_no = SIMPLEFS_ROOTDIR_INODE_NUMBER;
-	root_inode.data_block_number = SIMPLEFS_ROOTDIR_DATABLOCK_NUMBER;
-	root_inode.dir_children_count = 1;
+	simplefs_sb_store(&disk, sb);
 
-	ret = write(fd, &root_inode, sizeof(root_inode));
+	/* The copy the kernel recognizes the metadata device by */
+	if (sb->meta_block && write_at(fd, &disk, sizeof(disk), sb->meta_block, sb)) {
+		printf("Writing the super block to the metadata device has failed\n");
+		return -1;
+	}
 
-	if (ret != sizeof(root_inode)) {
+	ret = pwrite(fd, &disk, sizeof(disk), 0);
+	if (ret != sizeof(disk)) {
 		printf
-		    ("The inode store was not written properly. Retry your mkfs\n");
+		    ("bytes written [%d] are not equal to the super block size\n",
+		     (int)ret);
 		return -1;
 	}
 
-	printf("root directory inode written succesfully\n");
+	printf("Super block written succesfully\n");
 	return 0;
 }
-static int write_journal_inode(int fd)
+
+/* The blocks handed out to the files, and those handed out to the
+ * directories after them, which start over at data_block with a
+ * metadata device */
+struct used_runs {
+	uint64_t files_end;
+	uint64_t dirs_end;
+};
+
+static uint64_t used_dirs_start(const struct simplefs_super_block *sb,
+				const struct used_runs *runs)
 {
-	ssize_t ret;
+	return sb->meta_block ? sb->data_block : runs->files_end;
+}
+
+static uint64_t used_blocks(const struct simplefs_super_block *sb,
+			    const struct used_runs *runs)
+{
+	return runs->files_end - simplefs_sb_file_block(sb) +
+	       runs->dirs_end - used_dirs_start(sb, runs);
+}
+
+/* Write the group descriptors, the block bitmaps and the (zeroed)
+ * reference count table. With lazy_init only the bitmaps of the groups
+ * holding the used runs are written, and the rest, as well as the whole
+ * reference count table, are left for the kernel. */
+static int write_groups(int fd, const struct simplefs_super_block *sb,
+			const struct used_runs *runs, int lazy_init)
+{
+	struct simplefs_group_desc *descs;
+	unsigned char *bitmap;
+	uint64_t group, used, start, end, block, bit, i;
+	uint64_t starts[2] = { simplefs_sb_file_block(sb), used_dirs_start(sb, runs) };
+	uint64_t ends[2] = { runs->files_end, runs->dirs_end };
+	int ret = -1, touched;
 
-	struct simplefs_inode journal;
+	descs = calloc(sb->groups_count, sizeof(*descs));
+	bitmap = malloc(sb->block_size);
+	if (!descs || !bitmap)
+		goto out;
 
-	journal.inode_no = SIMPLEFS_JOURNAL_INODE_NUMBER;
-	journal.data_block_number = SIMPLEFS_JOURNAL_BLOCK_NUMBER;
+	for (group = 0; group < sb->groups_count; group++) {
+		used = simplefs_group_bitmap_init(sb, group, bitmap);
+		start = group * sb->group_blocks;
+		end = start + sb->group_blocks;
 
-	ret = write(fd, &journal, sizeof(journal));
+		touched = 0;
+		for (i = 0; i < 2; i++) {
+			block = starts[i] > start ? starts[i] : start;
+			for (; block < ends[i] && block < end; block++) {
+				bit = block - start;
+				bitmap[bit / 8] |= 1 << (bit % 8);
+				used++;
+				touched = 1;
+			}
+		}
+		if (!touched && lazy_init)
+			descs[group].flags = cpu_to_le32(SIMPLEFS_GROUP_BLOCK_UNINIT);
+		if (lazy_init)
+			descs[group].flags |= cpu_to_le32(SIMPLEFS_GROUP_REFCOUNT_UNINIT);
 
-	if (ret != sizeof(journal)) {
-		printf("Error while writing journal inode. Retry your mkfs\n");
+		descs[group].free_blocks_count = cpu_to_le64(sb->group_blocks - used);
+
+		if (le32_to_cpu(descs[group].flags) & SIMPLEFS_GROUP_BLOCK_UNINIT)
+			continue;
+
+		simplefs_bitmap_csum_set(sb, &descs[group], bitmap);
+		if (write_at(fd, bitmap, sb->block_size,
+			     sb->bitmap_block + group, sb)) {
+			printf("Writing the bitmap of group %llu has failed\n",
+			       (unsigned long long)group);
+			goto out;
+		}
+	}
+
+	if (!lazy_init && zero_blocks(fd, sb->refcount_block, sb->refcount_blocks, sb)) {
+		printf("Writing the reference count table has failed\n");
+		goto out;
+	}
+
+	if (write_at(fd, descs, sb->groups_count * sizeof(*descs),
+		     sb->group_desc_block, sb)) {
+		printf("Writing the group descriptors has failed\n");
+		goto out;
+	}
+
+	printf("group descriptors, block bitmaps and reference counts written succesfully\n");
+	ret = 0;
+out:
+	free(bitmap);
+	free(descs);
+	return ret;
+}
+
+/* The journal is contiguous, right after the inode store, and starts
+ * with a jbd2 super block, so that the kernel loads it from there. The
+ * rest of it is zeroed, unless init is lazy: an empty journal has nothing
+ * to replay, whatever its blocks hold. */
+static int write_journal(int fd, const struct simplefs_super_block *sb, int lazy_init)
+{
+	char *block;
+	int ret;
+
+	block = malloc(sb->block_size);
+	if (!block)
 		return -1;
+	simplefs_journal_sb_init(block, sb->block_size, sb->journal_blocks);
+	ret = write_at(fd, block, sb->block_size, sb->journal_block, sb);
+	free(block);
+
+	if (!ret && !lazy_init)
+		ret = zero_blocks(fd, sb->journal_block + 1, sb->journal_blocks - 1, sb);
+	if (ret) {
+		printf("Writing the journal has failed\n");
+		return ret;
 	}
 
-	printf("journal inode written succesfully\n");
+	printf("journal written succesfully\n");
 	return 0;
 }
-static int write_welcome_inode(int fd, const struct simplefs_inode *i)
+
+/* The inodes go into the first blocks of the inode store. The remaining
+ * blocks are zeroed, unless their initialization is left to the kernel.
+ * With checksums, even the empty ones need theirs, so they are built
+ * here a chunk at a time rather than written from zeroes. */
+static int write_inode_store(int fd, const struct simplefs_super_block *sb,
+			     const struct simplefs_inode *inodes, uint64_t count)
 {
-	off_t nbytes;
-	ssize_t ret;
+	uint64_t per_block = simplefs_inodes_per_block(sb);
+	uint64_t blocks = (count + per_block - 1) / per_block;
+	uint64_t chunk_blocks = ZERO_CHUNK_SIZE / sb->block_size;
+	uint64_t block, slot, n, i;
+	uint64_t written = simplefs_sb_has_csum(sb) ? sb->inode_table_initialized : blocks;
+	char *buffer;
+	int ret = 0;
 
-	ret = write(fd, i, sizeof(*i));
-	if (ret != sizeof(*i)) {
+	buffer = malloc(ZERO_CHUNK_SIZE);
+	if (!buffer)
+		return -1;
+	for (block = 0; block < written && !ret; block += n) {
+		n = written - block < chunk_blocks ? written - block : chunk_blocks;
+		memset(buffer, 0, n * sb->block_size);
+		for (i = 0; i < n; i++) {
+			for (slot = (block + i) * per_block;
+			     slot < (block + i + 1) * per_block && slot < count; slot++)
+				simplefs_inode_store(sb, buffer + i * sb->block_size +
+						     (slot % per_block) * simplefs_inode_size(sb),
+						     &inodes[slot]);
+			simplefs_block_csum_set(sb, buffer + i * sb->block_size);
+		}
+		ret = write_at(fd, buffer, n * sb->block_size, sb->inode_table_block + block, sb);
+	}
+	free(buffer);
+	if (ret) {
 		printf
-		    ("The welcomefile inode was not written properly. Retry your mkfs\n");
+		    ("The inode store was not written properly. Retry your mkfs\n");
 		return -1;
 	}
-	printf("welcomefile inode written succesfully\n");
+	printf("%llu inodes written succesfully\n", (unsigned long long)count);
 
-	nbytes = SIMPLEFS_DEFAULT_BLOCK_SIZE - (sizeof(*i) * 3);
-	ret = lseek(fd, nbytes, SEEK_CUR);
-	if (ret == (off_t)-1) {
+	if (zero_blocks(fd, sb->inode_table_block + written,
+			sb->inode_table_initialized - written, sb)) {
 		printf
-		    ("The padding bytes are not written properly. Retry your mkfs\n");
+		    ("The inode store padding was not written properly. Retry your mkfs\n");
 		return -1;
 	}
 
-	printf
-	    ("inode store padding bytes (after the three inodes) written sucessfully\n");
+	printf("inode store padding blocks (%llu) written sucessfully\n",
+	       (unsigned long long)sb->inode_table_initialized - blocks);
 	return 0;
 }
 
-int write_journal(int fd)
+int write_dirent(int fd, const struct simplefs_super_block *sb,
+		 uint64_t block, const struct simplefs_dir_record *record)
 {
-	ssize_t ret;
-	ret = lseek(fd, SIMPLEFS_DEFAULT_BLOCK_SIZE * SIMPLEFS_JOURNAL_BLOCKS, SEEK_CUR);
-	if (ret == (off_t)-1) {
-		printf("Can't write journal. Retry you mkfs\n");
+	char *buffer;
+	int ret;
+
+	buffer = calloc(1, sb->block_size);
+	if (!buffer)
+		return -1;
+	memcpy(buffer, record, sizeof(*record));
+	simplefs_block_csum_set(sb, buffer);
+
+	ret = write_at(fd, buffer, sb->block_size, block, sb);
+	free(buffer);
+	if (ret) {
+		printf
+		    ("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed\n");
 		return -1;
 	}
+	printf
+	    ("root directory datablocks (name+inode_no pair for welcomefile) written succesfully\n");
+	return 0;
+}
 
-	printf("Journal written successfully\n");
+int write_block(int fd, const struct simplefs_super_block *sb,
+		uint64_t block, char *body, size_t len)
+{
+	if (write_at(fd, body, len, block, sb)) {
+		printf("Writing file body has failed\n");
+		return -1;
+	}
+	printf("block has been written succesfully\n");
 	return 0;
 }
 
-int write_dirent(int fd, const struct simplefs_dir_record *record)
+/*
+ * The image builder: with -d or -t, the image is populated from a
+ * directory tree or a tar stream instead of getting the welcome file.
+ *
+ * Everything is laid out back to back in one pass: inodes take
+ * consecutive slots of the inode store, file contents take consecutive
+ * runs of blocks from data_block on, and the directories follow them.
+ */
+
+/* Contents are written out in chunks of this size */
+#define OUT_CHUNK_SIZE (4 << 20)
+
+#define TAR_BLOCK_SIZE 512
+
+struct node {
+	struct simplefs_inode inode;
+	char name[SIMPLEFS_FILENAME_MAXLEN];
+	/* Where the contents come from, when building from a directory */
+	char *path;
+	struct node *parent;
+	struct node **children;
+	uint64_t children_capacity;
+	struct node *hash_next;
+};
+
+struct builder {
+	int fd;
+	struct simplefs_super_block *sb;
+
+	/* Indexed by the slot in the inode store */
+	struct node **nodes;
+	uint64_t nodes_count, nodes_capacity;
+
+	/* (parent, name) -> node, to find the parents of tar members */
+	struct node **hash;
+	uint64_t hash_size;
+
+	/* The first block not handed out yet, and the end of the file
+	 * contents once the directories get theirs */
+	uint64_t next_block;
+	uint64_t files_end;
+
+	/* Buffered sequential writes, out_len bytes going to out_block */
+	char *out;
+	size_t out_len;
+	uint64_t out_block;
+
+	/* Regular files of a directory tree, in the order of their blocks */
+	struct node **files;
+	uint64_t files_count, files_capacity;
+	uint64_t next_file;
+	int failed;
+};
+
+static int grow(void **array, uint64_t *capacity, uint64_t count, size_t size)
 {
-	ssize_t nbytes = sizeof(*record), ret;
+	void *p;
 
-	ret = write(fd, record, nbytes);
-	if (ret != nbytes) {
-		printf
-		    ("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed\n");
+	if (count < *capacity)
+		return 0;
+
+	*capacity = *capacity ? *capacity * 2 : 16;
+	p = realloc(*array, *capacity * size);
+	if (!p)
 		return -1;
+	*array = p;
+	return 0;
+}
+
+static uint64_t hash_name(const struct node *parent, const char *name)
+{
+	uint64_t h = (uintptr_t)parent;
+
+	while (*name)
+		h = h * 31 + (unsigned char)*name++;
+	return h;
+}
+
+static struct node *find_child(struct builder *b, struct node *parent,
+			       const char *name)
+{
+	struct node *n;
+
+	n = b->hash[hash_name(parent, name) % b->hash_size];
+	for (; n; n = n->hash_next)
+		if (n->parent == parent && !strcmp(n->name, name))
+			return n;
+	return NULL;
+}
+
+/* Give the next slot of the inode store to a new object. Regular files
+ * also get their run of blocks here, directories only once all of their
+ * children are known (see write_dirs). */
+static struct node *add_node(struct builder *b, struct node *parent,
+			     const char *name, mode_t mode, uint64_t size)
+{
+	struct node *n;
+	uint64_t h;
+
+	if (b->nodes_count >= b->sb->inodes_max) {
+		printf("More than %llu files and directories. Use -i to have more inodes\n",
+		       (unsigned long long)b->sb->inodes_max);
+		return NULL;
 	}
-	printf
-	    ("root directory datablocks (name+inode_no pair for welcomefile) written succesfully\n");
+	if (strlen(name) >= SIMPLEFS_FILENAME_MAXLEN) {
+		printf("The name [%s] is too long\n", name);
+		return NULL;
+	}
+	if (grow((void **)&b->nodes, &b->nodes_capacity, b->nodes_count,
+		 sizeof(*b->nodes)))
+		return NULL;
 
-	nbytes = SIMPLEFS_DEFAULT_BLOCK_SIZE - sizeof(*record);
-	ret = lseek(fd, nbytes, SEEK_CUR);
-	if (ret == (off_t)-1) {
-		printf
-		    ("Writing the padding for rootdirectory children datablock has failed\n");
+	n = calloc(1, sizeof(*n));
+	if (!n)
+		return NULL;
+
+	strcpy(n->name, name);
+	n->parent = parent;
+	n->inode.mode = mode;
+	n->inode.links_count = 1;
+	n->inode.inode_no = simplefs_inode_no(b->nodes_count);
+	n->inode.atime = n->inode.mtime = n->inode.ctime = now_ns();
+
+	if (S_ISREG(mode)) {
+		n->inode.file_size = size;
+		n->inode.data_block_number = b->next_block;
+		b->next_block += simplefs_inode_blocks(&n->inode, b->sb->block_size);
+		if (b->next_block > simplefs_sb_file_end(b->sb)) {
+			printf("The device is too small for the contents of [%s]\n", name);
+			free(n);
+			return NULL;
+		}
+	}
+
+	if (parent) {
+		if (grow((void **)&parent->children, &parent->children_capacity,
+			 parent->inode.dir_children_count, sizeof(*parent->children))) {
+			free(n);
+			return NULL;
+		}
+		parent->children[parent->inode.dir_children_count++] = n;
+
+		h = hash_name(parent, name) % b->hash_size;
+		n->hash_next = b->hash[h];
+		b->hash[h] = n;
+	}
+
+	b->nodes[b->nodes_count++] = n;
+	return n;
+}
+
+static int out_flush(struct builder *b)
+{
+	if (!b->out_len)
+		return 0;
+
+	if (write_at(b->fd, b->out, b->out_len, b->out_block, b->sb)) {
+		printf("Writing the contents at block %llu has failed\n",
+		       (unsigned long long)b->out_block);
 		return -1;
 	}
-	printf
-	    ("padding after the rootdirectory children written succesfully\n");
+
+	b->out_block += b->out_len / b->sb->block_size;
+	b->out_len = 0;
+	return 0;
+}
+
+/* Reserve room for len bytes in the output buffer */
+static char *out_reserve(struct builder *b, size_t *len)
+{
+	if (b->out_len == OUT_CHUNK_SIZE && out_flush(b))
+		return NULL;
+
+	if (*len > OUT_CHUNK_SIZE - b->out_len)
+		*len = OUT_CHUNK_SIZE - b->out_len;
+	b->out_len += *len;
+	return b->out + b->out_len - *len;
+}
+
+/* Zero fill the output up to the start of the given block */
+static int out_pad_to(struct builder *b, uint64_t block)
+{
+	uint64_t end = (block - b->out_block) * b->sb->block_size;
+	size_t len;
+	char *p;
+
+	while (b->out_len < end) {
+		len = end - b->out_len;
+		p = out_reserve(b, &len);
+		if (!p)
+			return -1;
+		memset(p, 0, len);
+		end = (block - b->out_block) * b->sb->block_size;
+	}
 	return 0;
 }
-int write_block(int fd, char *block, size_t len)
+
+static int read_full(int fd, void *buf, size_t len)
 {
 	ssize_t ret;
 
-	ret = write(fd, block, len);
-	if (ret != len) {
-		printf("Writing file body has failed\n");
+	while (len) {
+		ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int copy_file(struct builder *b, struct node *n, char *buffer)
+{
+	uint64_t remaining = n->inode.file_size;
+	off_t offset = n->inode.data_block_number * b->sb->block_size;
+	size_t len;
+	int fd, ret = 0;
+
+	fd = open(n->path, O_RDONLY);
+	if (fd == -1) {
+		perror(n->path);
 		return -1;
 	}
-	printf("block has been written succesfully\n");
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while (remaining && !ret) {
+		len = remaining < OUT_CHUNK_SIZE ? remaining : OUT_CHUNK_SIZE;
+		if (read_full(fd, buffer, len)) {
+			printf("[%s] changed or could not be read while building the image\n",
+			       n->path);
+			ret = -1;
+		} else if (pwrite(b->fd, buffer, len, offset) != (ssize_t)len) {
+			printf("Writing the contents of [%s] has failed\n", n->path);
+			ret = -1;
+		}
+		offset += len;
+		remaining -= len;
+	}
+
+	close(fd);
+	return ret;
+}
+
+/* Files are read in parallel, each worker taking the next file in the
+ * order of their blocks, so the image is still written mostly in order */
+static void *copy_files_worker(void *arg)
+{
+	struct builder *b = arg;
+	uint64_t i;
+	char *buffer;
+
+	buffer = malloc(OUT_CHUNK_SIZE);
+	if (!buffer) {
+		b->failed = 1;
+		return NULL;
+	}
+
+	while (!b->failed) {
+		i = __atomic_fetch_add(&b->next_file, 1, __ATOMIC_RELAXED);
+		if (i >= b->files_count)
+			break;
+		if (copy_file(b, b->files[i], buffer))
+			b->failed = 1;
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+static int copy_files(struct builder *b)
+{
+	long i, threads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t *workers;
+
+	if (threads < 1)
+		threads = 1;
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&workers[i], NULL, copy_files_worker, b))
+			break;
+	if (i == 0)
+		copy_files_worker(b);
+	while (i--)
+		pthread_join(workers[i], NULL);
+
+	free(workers);
+	return b->failed ? -1 : 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Add the entries of a directory, sorted by name so that the same tree
+ * always gives the same image */
+static int scan_dir(struct builder *b, struct node *dir)
+{
+	struct dirent *entry;
+	struct stat st;
+	struct node *n;
+	char **names = NULL, *path;
+	uint64_t count = 0, capacity = 0, i;
+	int ret = -1;
+	DIR *d;
+
+	d = opendir(dir->path);
+	if (!d) {
+		perror(dir->path);
+		return -1;
+	}
+
+	while ((entry = readdir(d))) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		if (grow((void **)&names, &capacity, count, sizeof(*names)))
+			goto out;
+		names[count] = strdup(entry->d_name);
+		if (!names[count])
+			goto out;
+		count++;
+	}
+	qsort(names, count, sizeof(*names), compare_names);
+
+	for (i = 0; i < count; i++) {
+		path = malloc(strlen(dir->path) + strlen(names[i]) + 2);
+		if (!path)
+			goto out;
+		sprintf(path, "%s/%s", dir->path, names[i]);
+
+		if (lstat(path, &st)) {
+			perror(path);
+			free(path);
+			goto out;
+		}
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+			printf("Skipping [%s], simplefs only has files and directories\n", path);
+			free(path);
+			continue;
+		}
+
+		n = add_node(b, dir, names[i], st.st_mode, st.st_size);
+		if (!n) {
+			free(path);
+			goto out;
+		}
+		n->path = path;
+		n->inode.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+		if (S_ISREG(st.st_mode)) {
+			if (grow((void **)&b->files, &b->files_capacity,
+				 b->files_count, sizeof(*b->files)))
+				goto out;
+			b->files[b->files_count++] = n;
+		}
+	}
+	ret = 0;
+out:
+	for (i = 0; i < count; i++)
+		free(names[i]);
+	free(names);
+	closedir(d);
+	return ret;
+}
+
+static int populate_dir(struct builder *b, const char *source)
+{
+	uint64_t i;
+
+	b->nodes[SIMPLEFS_ROOTDIR_INODE_NUMBER - 1]->path = strdup(source);
+
+	/* New directories are appended to the nodes as they are found,
+	 * so this walks the tree breadth first */
+	for (i = 0; i < b->nodes_count; i++) {
+		if (!S_ISDIR(b->nodes[i]->inode.mode))
+			continue;
+		if (scan_dir(b, b->nodes[i]))
+			return -1;
+	}
+
+	if (copy_files(b))
+		return -1;
+
+	b->out_block = b->next_block;
+	return 0;
+}
+
+static uint64_t tar_number(const char *field, size_t len)
+{
+	uint64_t n = 0;
+	size_t i;
+
+	/* GNU tar stores large sizes in base-256 */
+	if ((unsigned char)field[0] & 0x80) {
+		n = (unsigned char)field[0] & 0x7f;
+		for (i = 1; i < len; i++)
+			n = (n << 8) | (unsigned char)field[i];
+		return n;
+	}
+
+	for (i = 0; i < len && (field[i] == ' ' || field[i] == '\0'); i++)
+		;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		n = n * 8 + field[i] - '0';
+	return n;
+}
+
+/* Read the contents of a tar member into a freshly allocated string */
+static char *tar_read_string(uint64_t size)
+{
+	uint64_t padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+	char *s;
+
+	s = calloc(1, padded + 1);
+	if (s && read_full(STDIN_FILENO, s, padded)) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+/* The path is the only pax extended header that matters to simplefs */
+static char *tar_pax_path(const char *records, uint64_t size)
+{
+	const char *p = records, *end = records + size, *key;
+	unsigned long len;
+	char *next;
+
+	while (p < end) {
+		len = strtoul(p, &next, 10);
+		if (!len || next >= end || *next != ' ')
+			break;
+		key = next + 1;
+		if (!strncmp(key, "path=", 5))
+			return strndup(key + 5, p + len - (key + 5) - 1);
+		p += len;
+	}
+	return NULL;
+}
+
+static int tar_skip(uint64_t size)
+{
+	char block[TAR_BLOCK_SIZE];
+
+	for (size = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE; size; size--)
+		if (read_full(STDIN_FILENO, block, sizeof(block)))
+			return -1;
+	return 0;
+}
+
+/* Stream the contents of a member straight into the output buffer */
+static int tar_copy(struct builder *b, struct node *n)
+{
+	uint64_t remaining = n->inode.file_size;
+	char padding[TAR_BLOCK_SIZE];
+	size_t len;
+	char *p;
+
+	if (out_pad_to(b, n->inode.data_block_number))
+		return -1;
+
+	while (remaining) {
+		len = remaining;
+		p = out_reserve(b, &len);
+		if (!p || read_full(STDIN_FILENO, p, len))
+			return -1;
+		remaining -= len;
+	}
+
+	if (out_pad_to(b, b->next_block))
+		return -1;
+
+	/* The contents are padded up to a whole tar block */
+	len = (TAR_BLOCK_SIZE - n->inode.file_size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+	return read_full(STDIN_FILENO, padding, len);
+}
+
+/* Find the directory a member goes into, creating any missing parents.
+ * On return, *name points to the last component of the path. */
+static struct node *tar_parent(struct builder *b, char *path, char **name)
+{
+	struct node *dir = b->nodes[SIMPLEFS_ROOTDIR_INODE_NUMBER - 1], *n;
+	char *slash;
+
+	while (*path == '/' || (path[0] == '.' && path[1] == '/'))
+		path += *path == '/' ? 1 : 2;
+
+	while ((slash = strchr(path, '/'))) {
+		*slash = '\0';
+		if (slash[1] == '\0')
+			break;
+		if (*path && strcmp(path, ".")) {
+			n = find_child(b, dir, path);
+			if (!n)
+				n = add_node(b, dir, path, S_IFDIR | 0755, 0);
+			if (!n)
+				return NULL;
+			if (!S_ISDIR(n->inode.mode)) {
+				printf("[%s] is not a directory\n", path);
+				return NULL;
+			}
+			dir = n;
+		}
+		path = slash + 1;
+	}
+
+	*name = path;
+	return dir;
+}
+
+static int populate_tar(struct builder *b)
+{
+	char header[TAR_BLOCK_SIZE], path[256 + 155];
+	char *long_name = NULL, *name, *records;
+	struct node *dir, *n;
+	uint64_t size;
+	mode_t mode;
+	int ret = -1;
+
+	for (;;) {
+		if (read_full(STDIN_FILENO, header, sizeof(header))) {
+			printf("The tar stream ended early\n");
+			goto out;
+		}
+		/* The archive ends with zeroed blocks */
+		if (!header[0])
+			break;
+
+		size = tar_number(header + 124, 12);
+		mode = tar_number(header + 100, 8) & 07777;
+
+		switch (header[156]) {
+		case 'L':
+			free(long_name);
+			long_name = tar_read_string(size);
+			if (!long_name)
+				goto out;
+			continue;
+		case 'x':
+			records = tar_read_string(size);
+			if (!records)
+				goto out;
+			free(long_name);
+			long_name = tar_pax_path(records, size);
+			free(records);
+			continue;
+		case '0':
+		case '\0':
+			mode |= S_IFREG;
+			break;
+		case '5':
+			mode |= S_IFDIR;
+			break;
+		default:
+			printf("Skipping [%.100s], simplefs only has files and directories\n",
+			       header);
+			free(long_name);
+			long_name = NULL;
+			if (tar_skip(size))
+				goto out;
+			continue;
+		}
+
+		if (long_name) {
+			snprintf(path, sizeof(path), "%s", long_name);
+			free(long_name);
+			long_name = NULL;
+		} else if (!memcmp(header + 257, "ustar", 5) && header[345]) {
+			snprintf(path, sizeof(path), "%.155s/%.100s",
+				 header + 345, header);
+		} else {
+			snprintf(path, sizeof(path), "%.100s", header);
+		}
+
+		dir = tar_parent(b, path, &name);
+		if (!dir)
+			goto out;
+		/* The root directory itself */
+		if (!*name || !strcmp(name, "."))
+			continue;
+
+		n = find_child(b, dir, name);
+		if (n && S_ISDIR(n->inode.mode) && S_ISDIR(mode))
+			continue;
+		if (n) {
+			printf("[%s] appears twice in the tar stream\n", path);
+			goto out;
+		}
+
+		n = add_node(b, dir, name, mode, size);
+		if (!n)
+			goto out;
+		if (S_ISREG(mode) && tar_copy(b, n))
+			goto out;
+	}
+
+	ret = out_flush(b);
+out:
+	free(long_name);
+	return ret;
+}
+
+/* Now that all of their children are known, give the directories
+ * their runs of blocks right after the file contents, or after the
+ * metadata on the metadata device, if there is one */
+static int write_dirs(struct builder *b)
+{
+	uint64_t per_block = simplefs_dir_records_per_block(b->sb->block_size);
+	struct simplefs_dir_record *records;
+	struct node *dir;
+	uint64_t i, block, blocks, child, n;
+	size_t len;
+
+	/* The file contents were all flushed out already */
+	b->files_end = b->next_block;
+	if (b->sb->meta_block)
+		b->next_block = b->out_block = b->sb->data_block;
+
+	for (i = 0; i < b->nodes_count; i++) {
+		dir = b->nodes[i];
+		if (!S_ISDIR(dir->inode.mode))
+			continue;
+
+		dir->inode.data_block_number = b->next_block;
+		blocks = simplefs_inode_blocks(&dir->inode, b->sb->block_size);
+		b->next_block += blocks;
+		if (b->next_block > b->sb->blocks_count) {
+			printf("The device is too small for the directories\n");
+			return -1;
+		}
+
+		if (out_pad_to(b, dir->inode.data_block_number))
+			return -1;
+		/* A block at a time, for its checksum */
+		for (block = 0, child = 0; block < blocks; block++) {
+			len = b->sb->block_size;
+			records = (struct simplefs_dir_record *)out_reserve(b, &len);
+			if (!records)
+				return -1;
+			/* A chunk always holds a whole number of blocks,
+			 * so a block is never split between two of them */
+			memset(records, 0, len);
+			for (n = 0; n < per_block && child < dir->inode.dir_children_count;
+			     n++, child++)
+				simplefs_dir_record_init(&records[n], dir->children[child]->name,
+							 strlen(dir->children[child]->name),
+							 dir->children[child]->inode.inode_no);
+			simplefs_block_csum_set(b->sb, records);
+		}
+	}
+
+	if (out_pad_to(b, b->next_block))
+		return -1;
+	if (out_flush(b))
+		return -1;
+
+	printf("%llu files and directories written succesfully\n",
+	       (unsigned long long)b->nodes_count - 1);
 	return 0;
 }
 
+/* Build the contents of the image. On success, the inode store is
+ * returned in *inodes and the blocks in use in *runs. */
+static int populate(int fd, struct simplefs_super_block *sb,
+		    const struct mkfs_options *opts,
+		    struct simplefs_inode **inodes, uint64_t *count,
+		    struct used_runs *runs)
+{
+	struct builder b = {
+		.fd = fd,
+		.sb = sb,
+		.next_block = simplefs_sb_file_block(sb),
+		.out_block = simplefs_sb_file_block(sb),
+	};
+	struct stat st;
+	struct node *root, *journal;
+	uint64_t i;
+	int ret = -1;
+
+	b.hash_size = sb->inodes_max < (1 << 20) ? sb->inodes_max : (1 << 20);
+	b.hash = calloc(b.hash_size, sizeof(*b.hash));
+	b.out = malloc(OUT_CHUNK_SIZE);
+	if (!b.hash || !b.out)
+		goto out;
+
+	if (opts->source_dir && stat(opts->source_dir, &st)) {
+		perror(opts->source_dir);
+		goto out;
+	}
+
+	root = add_node(&b, NULL, "", opts->source_dir ? st.st_mode : S_IFDIR | 0755, 0);
+	journal = add_node(&b, NULL, "", 0, 0);
+	if (!root || !journal)
+		goto out;
+	journal->inode.data_block_number = sb->journal_block;
+	journal->inode.file_size = sb->journal_blocks * sb->block_size;
+
+	if (opts->source_dir)
+		ret = populate_dir(&b, opts->source_dir);
+	else
+		ret = populate_tar(&b);
+	if (ret || (ret = write_dirs(&b)))
+		goto out;
+
+	ret = -1;
+	*inodes = calloc(b.nodes_count, sizeof(**inodes));
+	if (!*inodes)
+		goto out;
+	for (i = 0; i < b.nodes_count; i++)
+		(*inodes)[i] = b.nodes[i]->inode;
+	*count = b.nodes_count;
+	runs->files_end = b.files_end;
+	runs->dirs_end = b.next_block;
+	ret = 0;
+out:
+	for (i = 0; i < b.nodes_count; i++) {
+		free(b.nodes[i]->path);
+		free(b.nodes[i]->children);
+		free(b.nodes[i]);
+	}
+	free(b.nodes);
+	free(b.files);
+	free(b.hash);
+	free(b.out);
+	return ret;
+}
+
+static void usage(void)
+{
+	printf("Usage: mkfs-simplefs [-b block-size] [-i inodes] [-g blocks-per-group]\n"
+	       "                     [-j journal-blocks] [-l] [-m metadata-device]\n"
+	       "                     [-d dir | -t] <device>\n"
+	       "  -b  block size, a power of two from 1024 up to the page size\n"
+	       "  -l  lazy init: leave the inode store, block bitmaps and\n"
+	       "      reference counts for the kernel to initialize on first use,\n"
+	       "      and do not zero the journal\n"
+	       "  -m  put the inode store, the block bitmaps, the journal and\n"
+	       "      the directories on another (faster) device. Mount with\n"
+	       "      -o meta_path=metadata-device.\n"
+	       "  -d  populate the image with the contents of dir\n"
+	       "  -t  populate the image from a tar stream on stdin\n");
+}
+
 int main(int argc, char *argv[])
 {
-	int fd;
+	int fd, opt;
 	ssize_t ret;
+	uint64_t bytes, meta_bytes = 0, count = 0;
+	struct used_runs runs = {0};
+	struct mkfs_options opts = {
+		.block_size = SIMPLEFS_DEFAULT_BLOCK_SIZE,
+	};
+	struct simplefs_super_block sb;
+	struct simplefs_inode *inodes = NULL;
 
 	char welcomefile_body[] = "Love is God. God is Love. Anbe Murugan.\n";
-	struct simplefs_inode welcome = {
-		.mode = S_IFREG,
-		.inode_no = WELCOMEFILE_INODE_NUMBER,
-		.data_block_number = WELCOMEFILE_DATABLOCK_NUMBER,
-		.file_size = sizeof(welcomefile_body),
+	struct simplefs_inode welcome_inodes[3] = {
+		{
+			.mode = S_IFDIR,
+			.inode_no = SIMPLEFS_ROOTDIR_INODE_NUMBER,
+			.dir_children_count = 1,
+		},
+		{
+			.inode_no = SIMPLEFS_JOURNAL_INODE_NUMBER,
+		},
+		{
+			.mode = S_IFREG,
+			.inode_no = WELCOMEFILE_INODE_NUMBER,
+			.file_size = sizeof(welcomefile_body),
+		},
 	};
 	struct simplefs_dir_record record = {
 		.filename = "vanakkam",
-		.inode_no = WELCOMEFILE_INODE_NUMBER,
+		.inode_no = cpu_to_le64(WELCOMEFILE_INODE_NUMBER),
 	};
 
-	if (argc != 2) {
-		printf("Usage: mkfs-simplefs <device>\n");
+	while ((opt = getopt(argc, argv, "b:i:g:j:lm:d:t")) != -1) {
+		switch (opt) {
+		case 'b':
+			opts.block_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'i':
+			opts.inodes = strtoull(optarg, NULL, 0);
+			break;
+		case 'g':
+			opts.group_blocks = strtoull(optarg, NULL, 0);
+			break;
+		case 'j':
+			opts.journal_blocks = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			opts.lazy_init = 1;
+			break;
+		case 'm':
+			opts.meta_dev = optarg;
+			break;
+		case 'd':
+			opts.source_dir = optarg;
+			break;
+		case 't':
+			opts.source_tar = 1;
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1 || (opts.source_dir && opts.source_tar)) {
+		usage();
+		return -1;
+	}
+
+	if (!simplefs_block_size_valid(opts.block_size)) {
+		printf("The block size must be a power of two between %d and %d\n",
+		       SIMPLEFS_MIN_BLOCK_SIZE, SIMPLEFS_MAX_BLOCK_SIZE);
+		return -1;
+	}
+	/* The kernel module reads and writes a block with a buffer head,
+	 * which cannot be larger than a page */
+	if (opts.block_size > (uint64_t)sysconf(_SC_PAGESIZE)) {
+		printf("The block size must not be larger than the page size (%ld)\n",
+		       sysconf(_SC_PAGESIZE));
 		return -1;
 	}
 
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("Error opening the device");
 		return -1;
 	}
+	if (opts.meta_dev) {
+		meta_fd = open(opts.meta_dev, O_RDWR);
+		if (meta_fd == -1) {
+			perror("Error opening the metadata device");
+			close(fd);
+			return -1;
+		}
+	}
 
 	ret = 1;
 	do {
-		if (write_superblock(fd))
+		if (device_size(fd, &bytes) ||
+		    (opts.meta_dev && device_size(meta_fd, &meta_bytes))) {
+			perror("Error getting the size of the device");
 			break;
-
-		if (write_root_inode(fd))
-			break;
-		if (write_journal_inode(fd))
+		}
+		if (opts.meta_dev && !meta_bytes) {
+			printf("The metadata device is empty\n");
 			break;
-		if (write_welcome_inode(fd, &welcome))
+		}
+		if (compute_geometry(bytes, meta_bytes, &opts, &sb))
 			break;
 
-		if (write_journal(fd))
-			break;
+		if (opts.source_dir || opts.source_tar) {
+			if (populate(fd, &sb, &opts, &inodes, &count, &runs))
+				break;
+		} else {
+			for (count = 0; count < 3; count++) {
+				welcome_inodes[count].links_count = 1;
+				welcome_inodes[count].atime = welcome_inodes[count].mtime =
+					welcome_inodes[count].ctime = now_ns();
+			}
+
+			/* The welcome file goes right after the super block
+			 * when it has the data device to itself */
+			welcome_inodes[0].data_block_number = sb.data_block;
+			welcome_inodes[1].data_block_number = sb.journal_block;
+			welcome_inodes[1].file_size = sb.journal_blocks * sb.block_size;
+			welcome_inodes[2].data_block_number =
+				sb.meta_block ? simplefs_sb_file_block(&sb) : sb.data_block + 1;
+
+			if (write_dirent(fd, &sb, welcome_inodes[0].data_block_number, &record))
+				break;
+			if (write_block(fd, &sb, welcome_inodes[2].data_block_number,
+					welcomefile_body, welcome_inodes[2].file_size))
+				break;
 
-		if (write_dirent(fd, &record))
+			count = 3;
+			runs.files_end = sb.meta_block ? simplefs_sb_file_block(&sb) + 1 :
+							 sb.data_block;
+			runs.dirs_end = sb.meta_block ? sb.data_block + 1 : sb.data_block + 2;
+		}
+
+		sb.inodes_count = count;
+		sb.free_blocks_count -= used_blocks(&sb, &runs);
+		sb.inode_table_initialized = sb.inode_table_blocks;
+		if (opts.lazy_init)
+			sb.inode_table_initialized = (count - 1) /
+				simplefs_inodes_per_block(&sb) + 1;
+
+		if (write_groups(fd, &sb, &runs, opts.lazy_init))
+			break;
+		if (write_journal(fd, &sb, opts.lazy_init))
 			break;
-		if (write_block(fd, welcomefile_body, welcome.file_size))
+		if (write_inode_store(fd, &sb, inodes ? inodes : welcome_inodes, count))
+			break;
+
+		/* Last, so that an image is never mountable half written */
+		if (write_superblock(fd, &sb))
 			break;
 
 		ret = 0;
 	} while (0);
 
+	free(inodes);
+	if (meta_fd != -1)
+		close(meta_fd);
 	close(fd);
 	return ret;
 }
@@ -18,8 +18,22 @@
 #include <linux/jbd2.h>
 #include <linux/parser.h>
 #include <linux/blkdev.h>
+#include <linux/statfs.h>
+#include <linux/mount.h>
+#include <linux/mm.h>
+#include <linux/lz4.h>
+#include <linux/fiemap.h>
 
 #include "super.h"
+#include "format.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/* Where the latency of an operation is measured from, taken only while
+ * its tracepoint is enabled. See trace.h. */
+#define simplefs_trace_clock(event) \
+	(trace_##event##_enabled() ? ktime_get_ns() : 0)
 
 #ifndef f_dentry
 #define f_dentry f_path.dentry
@@ -41,418 +55,4112 @@ static DEFINE_MUTEX(simplefs_directory_children_update_lock);
 
 static struct kmem_cache *sfs_inode_cachep;
 
-void simplefs_sb_sync(struct super_block *vsb)
+/* mutex_lock_interruptible, counting for the stats in sysfs how often,
+ * and for how long, the lock was already held by someone else */
+static int simplefs_lock(struct super_block *vsb, struct mutex *lock,
+			 enum simplefs_lock which)
 {
-	struct buffer_head *bh = NULL;
-	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	struct simplefs_stats __percpu *stats = SIMPLEFS_SB_INFO(vsb)->stats;
+	u64 start;
+	int ret;
 
-	bh = sb_bread(vsb, SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER);
-	BUG_ON(!bh);
+	if (mutex_trylock(lock))
+		return 0;
 
-	bh->b_data = (char *)sb;
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
+	start = ktime_get_ns();
+	ret = mutex_lock_interruptible(lock);
+	this_cpu_inc(stats->lock_contended[which]);
+	this_cpu_add(stats->lock_wait_ns[which], ktime_get_ns() - start);
+	return ret;
 }
 
-struct simplefs_inode *simplefs_inode_search(struct super_block *sb,
-		struct simplefs_inode *start,
-		struct simplefs_inode *search)
+/* Whether a range conflicts with one already held: they overlap, and
+ * one of them is written to */
+static bool simplefs_range_busy(struct simplefs_inode_info *info,
+				struct simplefs_range *range)
 {
-	uint64_t count = 0;
-	while (start->inode_no != search->inode_no
-			&& count < SIMPLEFS_SB(sb)->inodes_count) {
-		count++;
-		start++;
-	}
+	struct simplefs_range *held;
 
-	if (start->inode_no == search->inode_no) {
-		return start;
+	list_for_each_entry(held, &info->ranges, list)
+		if (held->start <= range->end && range->start <= held->end &&
+		    (held->write || range->write))
+			return true;
+	return false;
+}
+
+/* Lock the bytes [start, end] of a file, for reading or writing, so that
+ * reads and writes of the same file that do not overlap need not wait
+ * for each other. They all hold the inode lock shared. Whatever moves
+ * the file or changes how it is stored takes the inode lock itself,
+ * which waits for all of them. */
+static void simplefs_range_lock(struct inode *inode, struct simplefs_range *range,
+				loff_t start, loff_t end, bool write)
+{
+	struct simplefs_inode_info *info = SIMPLEFS_INODE_INFO(inode);
+	struct simplefs_stats __percpu *stats = SIMPLEFS_SB_INFO(inode->i_sb)->stats;
+	u64 wait_start;
+
+	range->start = start;
+	range->end = end;
+	range->write = write;
+
+	spin_lock(&info->ranges_lock);
+	if (simplefs_range_busy(info, range)) {
+		wait_start = ktime_get_ns();
+		wait_event_cmd(info->ranges_wait, !simplefs_range_busy(info, range),
+			       spin_unlock(&info->ranges_lock),
+			       spin_lock(&info->ranges_lock));
+		this_cpu_inc(stats->lock_contended[SIMPLEFS_LOCK_RANGE]);
+		this_cpu_add(stats->lock_wait_ns[SIMPLEFS_LOCK_RANGE],
+			     ktime_get_ns() - wait_start);
 	}
+	list_add(&range->list, &info->ranges);
+	spin_unlock(&info->ranges_lock);
+}
 
-	return NULL;
+static void simplefs_range_unlock(struct inode *inode, struct simplefs_range *range)
+{
+	struct simplefs_inode_info *info = SIMPLEFS_INODE_INFO(inode);
+
+	spin_lock(&info->ranges_lock);
+	list_del(&range->list);
+	spin_unlock(&info->ranges_lock);
+	wake_up_all(&info->ranges_wait);
 }
 
-void simplefs_inode_add(struct super_block *vsb, struct simplefs_inode *inode)
+/* How many blocks simplefs_run_sync has in flight at once */
+#define SIMPLEFS_SYNC_BATCH 32
+
+/* Wait for what simplefs_run_write left dirty to be on the disk. The
+ * dirty blocks of a batch are all sent, as one plugged batch like in
+ * simplefs_run_readahead, before any of them is waited on. */
+static int simplefs_run_sync(struct super_block *sb, uint64_t start, uint64_t count)
 {
-	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
-	struct buffer_head *bh = NULL;
-	struct simplefs_inode *inode_iterator = NULL;
+	struct buffer_head *bhs[SIMPLEFS_SYNC_BATCH];
+	struct blk_plug plug;
+	uint64_t i, n;
+	int ret = 0;
 
-	if (mutex_lock_interruptible(&simplefs_inodes_mgmt_lock)) {
-		sfs_trace("Failed to acquire mutex lock\n");
-		return;
+	while (count && !ret) {
+		n = min_t(uint64_t, count, SIMPLEFS_SYNC_BATCH);
+
+		blk_start_plug(&plug);
+		for (i = 0; i < n; i++) {
+			bhs[i] = simplefs_getblk(sb, start + i);
+			if (!bhs[i]) {
+				ret = -EIO;
+				break;
+			}
+			if (buffer_dirty(bhs[i])) {
+				write_dirty_buffer(bhs[i], 0);
+				continue;
+			}
+			/* Nothing to wait for in one that is clean, unless
+			 * writeback already took it */
+			if (!buffer_locked(bhs[i])) {
+				brelse(bhs[i]);
+				bhs[i] = NULL;
+			}
+		}
+		blk_finish_plug(&plug);
+
+		/* Those sent before a failure are waited on all the same */
+		n = i;
+		for (i = 0; i < n; i++) {
+			if (!bhs[i])
+				continue;
+			wait_on_buffer(bhs[i]);
+			if (!buffer_uptodate(bhs[i]))
+				ret = -EIO;
+			brelse(bhs[i]);
+		}
+
+		start += n;
+		count -= n;
 	}
+	return ret;
+}
+
+void simplefs_sb_sync(struct super_block *vsb)
+{
+	struct buffer_head *bh = NULL;
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
 
-	bh = sb_bread(vsb, SIMPLEFS_INODESTORE_BLOCK_NUMBER);
+	bh = simplefs_bread(vsb, SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER);
 	BUG_ON(!bh);
 
-	inode_iterator = (struct simplefs_inode *)bh->b_data;
+	/* The copy kept in sbi goes into the buffer, the rest of the block
+	 * stays as it is on the disk */
+	lock_buffer(bh);
+	simplefs_sb_store(bh->b_data, sb);
+	unlock_buffer(bh);
+	simplefs_mark_buffer_dirty(vsb, bh);
+	sync_dirty_buffer(bh);
+	brelse(bh);
+}
 
-	if (mutex_lock_interruptible(&simplefs_sb_lock)) {
-		sfs_trace("Failed to acquire mutex lock\n");
-		return;
+/* Check the checksum of a block of the inode store or of a directory,
+ * once after it comes in from the disk. Whoever changes the block after
+ * that sets it again under lock_buffer, see simplefs_block_csum_update. */
+static int simplefs_block_verify(struct super_block *vsb, struct buffer_head *bh)
+{
+	int ok;
+
+	if (buffer_simplefs_verified(bh) || !simplefs_sb_has_csum(SIMPLEFS_SB(vsb)))
+		return 0;
+
+	lock_buffer(bh);
+	ok = buffer_simplefs_verified(bh) ||
+	     simplefs_block_csum_verify(SIMPLEFS_SB(vsb), bh->b_data);
+	if (ok)
+		set_buffer_simplefs_verified(bh);
+	unlock_buffer(bh);
+
+	if (unlikely(!ok)) {
+		printk(KERN_ERR "simplefs: block %llu has a wrong checksum\n",
+		       simplefs_bh_block(vsb, bh));
+		return -EBADMSG;
 	}
+	return 0;
+}
 
-	/* Append the new inode in the end in the inode store */
-	inode_iterator += sb->inodes_count;
+/* Must be called with the buffer locked, after changing it */
+static void simplefs_block_csum_update(struct super_block *vsb, struct buffer_head *bh)
+{
+	simplefs_block_csum_set(SIMPLEFS_SB(vsb), bh->b_data);
+	set_buffer_simplefs_verified(bh);
+}
 
-	memcpy(inode_iterator, inode, sizeof(struct simplefs_inode));
-	sb->inodes_count++;
+/* Read the block of the inode store that holds the given inode.
+ * On success, *out points to the inode inside the returned bh, as it is
+ * on the disk (see simplefs_inode_load). */
+static struct buffer_head *simplefs_inode_bread(struct super_block *vsb,
+						uint64_t inode_no, void **out)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	uint64_t slot = simplefs_inode_slot(inode_no);
+	uint64_t block, offset;
+	struct buffer_head *bh;
 
-	mark_buffer_dirty(bh);
-	simplefs_sb_sync(vsb);
-	brelse(bh);
+	if (unlikely(slot >= sb->inodes_count))
+		return NULL;
 
-	mutex_unlock(&simplefs_sb_lock);
-	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	simplefs_inode_locate(sb, slot, &block, &offset);
+	bh = simplefs_bread(vsb, block);
+	if (!bh)
+		return NULL;
+	if (simplefs_block_verify(vsb, bh)) {
+		brelse(bh);
+		return NULL;
+	}
+
+	*out = bh->b_data + offset;
+	return bh;
 }
 
-/* This function returns a blocknumber which is free.
- * The block will be removed from the freeblock list.
- *
- * In an ideal, production-ready filesystem, we will not be dealing with blocks,
- * and instead we will be using extents
- *
- * If for some reason, the file creation/deletion failed, the block number
- * will still be marked as non-free. You need fsck to fix this.*/
-int simplefs_sb_get_a_freeblock(struct super_block *vsb, uint64_t * out)
+/* Append count inodes to the inode store, in the order given. Each
+ * block of the inode store they go in is read and written once, so
+ * that a batch of them (see simplefs_bulk_create) costs a write for
+ * every block, not for every inode. */
+static int simplefs_inodes_add(struct super_block *vsb,
+			       const struct simplefs_inode *inodes, uint64_t count)
 {
 	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
-	int i;
-	int ret = 0;
+	uint64_t block, offset, i, first = 0;
+	struct buffer_head *bh = NULL;
+	int ret = 0, err;
 
-	if (mutex_lock_interruptible(&simplefs_sb_lock)) {
+	if (simplefs_lock(vsb, &simplefs_inodes_mgmt_lock, SIMPLEFS_LOCK_INODES)) {
 		sfs_trace("Failed to acquire mutex lock\n");
-		ret = -EINTR;
-		goto end;
+		return -EINTR;
 	}
 
-	/* Loop until we find a free block. We start the loop from 3,
-	 * as all prior blocks will always be in use */
-	for (i = 3; i < SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++) {
-		if (sb->free_blocks & (1 << i)) {
-			break;
-		}
+	if (simplefs_lock(vsb, &simplefs_sb_lock, SIMPLEFS_LOCK_SB)) {
+		mutex_unlock(&simplefs_inodes_mgmt_lock);
+		sfs_trace("Failed to acquire mutex lock\n");
+		return -EINTR;
 	}
 
-	if (unlikely(i == SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)) {
-		printk(KERN_ERR "No more free blocks available");
-		ret = -ENOSPC;
-		goto end;
-	}
+	for (i = 0; i < count; i++) {
+		/* Append the new inode in the end in the inode store */
+		simplefs_inode_locate(sb, sb->inodes_count, &block, &offset);
+		if (!i)
+			first = block;
+
+		/* Sent together with the others, below */
+		if (bh && simplefs_bh_block(vsb, bh) != block) {
+			simplefs_mark_buffer_dirty(vsb, bh);
+			brelse(bh);
+			bh = NULL;
+		}
 
-	*out = i;
+		if (!bh && block - sb->inode_table_block >= sb->inode_table_initialized) {
+			/* mkfs left this part of the inode store uninitialized,
+			 * so there is nothing worth reading from the disk */
+			bh = simplefs_getblk(vsb, block);
+			BUG_ON(!bh);
+
+			lock_buffer(bh);
+			memset(bh->b_data, 0, bh->b_size);
+			set_buffer_uptodate(bh);
+			unlock_buffer(bh);
+
+			sb->inode_table_initialized = block - sb->inode_table_block + 1;
+		} else if (!bh) {
+			bh = simplefs_bread(vsb, block);
+			BUG_ON(!bh);
+			ret = simplefs_block_verify(vsb, bh);
+			if (ret) {
+				brelse(bh);
+				bh = NULL;
+				break;
+			}
+		}
 
-	/* Remove the identified block from the free list */
-	sb->free_blocks &= ~(1 << i);
+		lock_buffer(bh);
+		simplefs_inode_store(sb, bh->b_data + offset, &inodes[i]);
+		simplefs_block_csum_update(vsb, bh);
+		unlock_buffer(bh);
+		sb->inodes_count++;
+		percpu_counter_dec(&SIMPLEFS_SB_INFO(vsb)->free_inodes);
+		simplefs_stat_inc(vsb, SIMPLEFS_STAT_INODES_ALLOCATED);
+	}
 
+	if (bh) {
+		simplefs_mark_buffer_dirty(vsb, bh);
+		brelse(bh);
+	}
+	/* The inode store is contiguous, and the blocks written to are
+	 * those from the first inode added to the last */
+	if (i) {
+		simplefs_inode_locate(sb, sb->inodes_count - 1, &block, &offset);
+		err = simplefs_run_sync(vsb, first, block - first + 1);
+		if (!ret)
+			ret = err;
+	}
+	/* All of them or none: the slots of those written are taken again
+	 * by the next ones added */
+	if (ret) {
+		sb->inodes_count -= i;
+		percpu_counter_add(&SIMPLEFS_SB_INFO(vsb)->free_inodes, i);
+	}
 	simplefs_sb_sync(vsb);
 
-end:
 	mutex_unlock(&simplefs_sb_lock);
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
 	return ret;
 }
 
-static int simplefs_sb_get_objects_count(struct super_block *vsb,
-					 uint64_t * out)
+int simplefs_inode_add(struct super_block *vsb, struct simplefs_inode *inode)
+{
+	return simplefs_inodes_add(vsb, inode, 1);
+}
+
+/* Take the last count inodes added to the inode store back out, when
+ * what they were added for failed. Their slots are taken again by the
+ * next ones added. The caller keeps any other inode from being added
+ * in between, by holding simplefs_directory_children_update_lock. */
+static void simplefs_inodes_drop(struct super_block *vsb, uint64_t count)
 {
 	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
 
-	if (mutex_lock_interruptible(&simplefs_inodes_mgmt_lock)) {
-		sfs_trace("Failed to acquire mutex lock\n");
-		return -EINTR;
-	}
-	*out = sb->inodes_count;
+	mutex_lock(&simplefs_inodes_mgmt_lock);
+	mutex_lock(&simplefs_sb_lock);
+	sb->inodes_count -= count;
+	percpu_counter_add(&SIMPLEFS_SB_INFO(vsb)->free_inodes, count);
+	simplefs_sb_sync(vsb);
+	mutex_unlock(&simplefs_sb_lock);
 	mutex_unlock(&simplefs_inodes_mgmt_lock);
-
-	return 0;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
-static int simplefs_iterate(struct file *filp, struct dir_context *ctx)
-#else
-static int simplefs_readdir(struct file *filp, void *dirent, filldir_t filldir)
-#endif
+/* Bring a group whose bitmap was never written by mkfs into use */
+static struct buffer_head *simplefs_group_bitmap_init_bh(struct super_block *vsb,
+							 uint64_t group)
 {
-	loff_t pos;
-	struct inode *inode;
-	struct super_block *sb;
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
 	struct buffer_head *bh;
-	struct simplefs_inode *sfs_inode;
-	struct simplefs_dir_record *record;
-	int i;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
-	pos = ctx->pos;
-#else
-	pos = filp->f_pos;
-#endif
-	inode = filp->f_dentry->d_inode;
-	sb = inode->i_sb;
+	bh = simplefs_getblk(vsb, sb->bitmap_block + group);
+	if (!bh)
+		return NULL;
 
-	if (pos) {
-		/* FIXME: We use a hack of reading pos to figure if we have filled in all data.
-		 * We should probably fix this to work in a cursor based model and
-		 * use the tokens correctly to not fill too many data in each cursor based call */
-		return 0;
-	}
+	lock_buffer(bh);
+	simplefs_group_bitmap_init(sb, group, (unsigned char *)bh->b_data);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
 
-	sfs_inode = SIMPLEFS_INODE(inode);
+	return bh;
+}
 
-	if (unlikely(!S_ISDIR(sfs_inode->mode))) {
-		printk(KERN_ERR
-		       "inode [%llu][%lu] for fs object [%s] not a directory\n",
-		       sfs_inode->inode_no, inode->i_ino,
-		       filp->f_dentry->d_name.name);
-		return -ENOTDIR;
-	}
+/* Read the bitmap of a group that is on the disk. Its checksum is
+ * checked against the one in the descriptor of the group once after it
+ * comes in. Must be called with simplefs_sb_lock held, as must
+ * simplefs_bitmap_csum_update, after changing the bitmap. */
+static struct buffer_head *simplefs_bitmap_bread(struct super_block *vsb, uint64_t group,
+						 const struct simplefs_group_desc *desc)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	struct buffer_head *bh;
 
-	bh = sb_bread(sb, sfs_inode->data_block_number);
-	BUG_ON(!bh);
+	bh = simplefs_bread(vsb, sb->bitmap_block + group);
+	if (!bh || buffer_simplefs_verified(bh))
+		return bh;
 
-	record = (struct simplefs_dir_record *)bh->b_data;
-	for (i = 0; i < sfs_inode->dir_children_count; i++) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
-		dir_emit(ctx, record->filename, SIMPLEFS_FILENAME_MAXLEN,
-			record->inode_no, DT_UNKNOWN);
-		ctx->pos += sizeof(struct simplefs_dir_record);
-#else
-		filldir(dirent, record->filename, SIMPLEFS_FILENAME_MAXLEN, pos,
-			record->inode_no, DT_UNKNOWN);
-		filp->f_pos += sizeof(struct simplefs_dir_record);
-#endif
-		pos += sizeof(struct simplefs_dir_record);
-		record++;
+	if (unlikely(!simplefs_bitmap_csum_verify(sb, desc, (unsigned char *)bh->b_data))) {
+		printk(KERN_ERR "simplefs: the block bitmap of group %llu has a wrong checksum\n",
+		       group);
+		brelse(bh);
+		return NULL;
 	}
-	brelse(bh);
-
-	return 0;
+	set_buffer_simplefs_verified(bh);
+	return bh;
 }
 
-/* This functions returns a simplefs_inode with the given inode_no
- * from the inode store, if it exists. */
-struct simplefs_inode *simplefs_get_inode(struct super_block *sb,
-					  uint64_t inode_no)
+static void simplefs_bitmap_csum_update(struct super_block *vsb,
+					struct simplefs_group_desc *desc,
+					struct buffer_head *bh)
 {
-	struct simplefs_super_block *sfs_sb = SIMPLEFS_SB(sb);
-	struct simplefs_inode *sfs_inode = NULL;
-	struct simplefs_inode *inode_buffer = NULL;
+	simplefs_bitmap_csum_set(SIMPLEFS_SB(vsb), desc, (unsigned char *)bh->b_data);
+	set_buffer_simplefs_verified(bh);
+}
 
-	int i;
-	struct buffer_head *bh;
+/* Blocks written through the journal must not be handed out again while
+ * it still has them, or replaying it after a crash would write their old
+ * contents over whatever they hold by then. The bitmaps are not in the
+ * journal, so waiting for the transaction that gives them back to commit
+ * is not enough: they are kept out of use until the journal no longer
+ * has any transaction from before then (see simplefs_busy_add). They are
+ * free on the disk already, so a crash leaks none of them. Must be
+ * called with simplefs_sb_lock held, as must the rest of these. */
+static void simplefs_busy_prune(struct super_block *vsb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(vsb);
+	struct simplefs_busy_run *busy, *next;
+	tid_t tail;
 
-	/* The inode store can be read once and kept in memory permanently while mounting.
-	 * But such a model will not be scalable in a filesystem with
-	 * millions or billions of files (inodes) */
-	bh = sb_bread(sb, SIMPLEFS_INODESTORE_BLOCK_NUMBER);
-	BUG_ON(!bh);
+	if (list_empty(&sbi->busy_runs))
+		return;
 
-	sfs_inode = (struct simplefs_inode *)bh->b_data;
+	read_lock(&sbi->journal->j_state_lock);
+	tail = sbi->journal->j_tail_sequence;
+	read_unlock(&sbi->journal->j_state_lock);
 
-#if 0
-	if (mutex_lock_interruptible(&simplefs_inodes_mgmt_lock)) {
-		printk(KERN_ERR "Failed to acquire mutex lock %s +%d\n",
-		       __FILE__, __LINE__);
-		return NULL;
+	list_for_each_entry_safe(busy, next, &sbi->busy_runs, list) {
+		if (!tid_geq(tail, busy->tid))
+			continue;
+		list_del(&busy->list);
+		kfree(busy);
 	}
-#endif
-	for (i = 0; i < sfs_sb->inodes_count; i++) {
-		if (sfs_inode->inode_no == inode_no) {
-			inode_buffer = kmem_cache_alloc(sfs_inode_cachep, GFP_KERNEL);
-			memcpy(inode_buffer, sfs_inode, sizeof(*inode_buffer));
+}
 
-			break;
-		}
-		sfs_inode++;
-	}
-//      mutex_unlock(&simplefs_inodes_mgmt_lock);
+/* Empty the journal, so that no block given back is busy any more, see
+ * simplefs_busy_prune */
+static int simplefs_journal_flush(struct super_block *vsb)
+{
+	journal_t *journal = SIMPLEFS_SB_INFO(vsb)->journal;
+	int ret;
 
-	brelse(bh);
-	return inode_buffer;
+	if (!journal)
+		return 0;
+
+	jbd2_journal_lock_updates(journal);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0)
+	ret = jbd2_journal_flush(journal, 0);
+#else
+	ret = jbd2_journal_flush(journal);
+#endif
+	jbd2_journal_unlock_updates(journal);
+	return ret;
 }
 
-ssize_t simplefs_read(struct file * filp, char __user * buf, size_t len,
-		      loff_t * ppos)
+/* Keep count blocks from start on out of use, in busy, until the
+ * transactions the journal has now are all checkpointed */
+static void simplefs_busy_add(struct super_block *vsb, struct simplefs_busy_run *busy,
+			      uint64_t start, uint64_t count)
 {
-	/* After the commit dd37978c5 in the upstream linux kernel,
-	 * we can use just filp->f_inode instead of the
-	 * f->f_path.dentry->d_inode redirection */
-	struct simplefs_inode *inode =
-	    SIMPLEFS_INODE(filp->f_path.dentry->d_inode);
-	struct buffer_head *bh;
+	journal_t *journal = SIMPLEFS_SB_INFO(vsb)->journal;
+
+	busy->start = start;
+	busy->count = count;
+	read_lock(&journal->j_state_lock);
+	busy->tid = journal->j_transaction_sequence;
+	read_unlock(&journal->j_state_lock);
+	list_add_tail(&busy->list, &SIMPLEFS_SB_INFO(vsb)->busy_runs);
+}
 
-	char *buffer;
-	int nbytes;
+/* Whether some of the count blocks from start on are kept out of use,
+ * and if so, the block after the last of those */
+static bool simplefs_busy_skip(struct super_block *vsb, uint64_t start,
+			       uint64_t count, uint64_t *next)
+{
+	struct simplefs_busy_run *busy;
+	bool ret = false;
 
-	if (*ppos >= inode->file_size) {
-		/* Read request with offset beyond the filesize */
-		return 0;
+	list_for_each_entry(busy, &SIMPLEFS_SB_INFO(vsb)->busy_runs, list) {
+		if (busy->start >= start + count || busy->start + busy->count <= start)
+			continue;
+		if (!ret || busy->start + busy->count > *next)
+			*next = busy->start + busy->count;
+		ret = true;
 	}
+	return ret;
+}
 
-	bh = sb_bread(filp->f_path.dentry->d_inode->i_sb,
-					    inode->data_block_number);
-
-	if (!bh) {
-		printk(KERN_ERR "Reading the block number [%llu] failed.",
-		       inode->data_block_number);
-		return 0;
-	}
+/* Take the first run of count free blocks from block from on, in the
+ * first group that has one, if it starts before the block below. Must be
+ * called with simplefs_sb_lock held. */
+static int simplefs_group_get_a_freerun(struct super_block *vsb, uint64_t count,
+					uint64_t from, uint64_t below, uint64_t *out)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	struct buffer_head *desc_bh = NULL, *bitmap_bh;
+	struct simplefs_group_desc *desc;
+	uint64_t group, block, offset, skip;
+	int ret = -ENOSPC, uninit;
+
+	for (group = from / sb->group_blocks; group < sb->groups_count &&
+	     ret == -ENOSPC && group * sb->group_blocks < below; group++) {
+		simplefs_group_desc_locate(sb, group, &block, &offset);
+		if (!desc_bh || simplefs_bh_block(vsb, desc_bh) != block) {
+			brelse(desc_bh);
+			desc_bh = simplefs_bread(vsb, block);
+			if (!desc_bh)
+				return -EIO;
+		}
 
-	buffer = (char *)bh->b_data;
-	nbytes = min((size_t) inode->file_size, len);
+		desc = (struct simplefs_group_desc *)(desc_bh->b_data + offset);
+		if (le64_to_cpu(desc->free_blocks_count) < count)
+			continue;
 
-	if (copy_to_user(buf, buffer, nbytes)) {
-		brelse(bh);
-		printk(KERN_ERR
-		       "Error copying file contents to the userspace buffer\n");
-		return -EFAULT;
-	}
+		uninit = le32_to_cpu(desc->flags) & SIMPLEFS_GROUP_BLOCK_UNINIT;
+		if (uninit) {
+			bitmap_bh = simplefs_group_bitmap_init_bh(vsb, group);
+			desc->flags &= ~cpu_to_le32(SIMPLEFS_GROUP_BLOCK_UNINIT);
+		} else {
+			bitmap_bh = simplefs_bitmap_bread(vsb, group, desc);
+		}
+		if (!bitmap_bh) {
+			brelse(desc_bh);
+			return -EIO;
+		}
 
-	brelse(bh);
+		/* Past the runs the journal may still write over */
+		skip = from;
+		while (!simplefs_group_find_run(sb, group, (unsigned char *)bitmap_bh->b_data,
+						skip, count, &block) &&
+		       simplefs_busy_skip(vsb, block, count, &skip))
+			;
+
+		/* A longer run may not fit in between the blocks in use,
+		 * and is looked for in the next group. The bitmap of the
+		 * group is written anyway if it was just built. */
+		ret = simplefs_group_alloc_run_below(sb, group, desc,
+						     (unsigned char *)bitmap_bh->b_data,
+						     skip, below, count, out);
+		if (ret == -EIO && skip != from)
+			ret = -ENOSPC;
+		if (unlikely(ret == -EIO))
+			printk(KERN_ERR
+			       "Group %llu has no free block but claims %llu free blocks\n",
+			       group, le64_to_cpu(desc->free_blocks_count));
+
+		/* The bitmap goes out before the descriptor and the sb, so that a
+		 * crash in between can only leak the block, never hand it out twice */
+		if (!ret || uninit) {
+			simplefs_bitmap_csum_update(vsb, desc, bitmap_bh);
+			simplefs_mark_buffer_dirty(vsb, bitmap_bh);
+			sync_dirty_buffer(bitmap_bh);
+			simplefs_mark_buffer_dirty(vsb, desc_bh);
+			sync_dirty_buffer(desc_bh);
+		}
 
-	*ppos += nbytes;
+		brelse(bitmap_bh);
+	}
 
-	return nbytes;
+	brelse(desc_bh);
+	return ret;
 }
 
-/* Save the modified inode */
-int simplefs_inode_save(struct super_block *sb, struct simplefs_inode *sfs_inode)
+/* Whether count blocks are free besides those reserved for files with
+ * delayed allocation (see simplefs_delalloc_claim). The per-CPU counters
+ * are only summed up when they are close. */
+static bool simplefs_blocks_available(struct super_block *vsb, s64 count)
 {
-	struct simplefs_inode *inode_iterator;
-	struct buffer_head *bh;
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(vsb);
+	s64 slack = 2 * (s64)percpu_counter_batch * num_online_cpus();
+
+	if (percpu_counter_read_positive(&sbi->free_blocks) -
+	    percpu_counter_read_positive(&sbi->delalloc_blocks) >= count + slack)
+		return true;
+	return percpu_counter_sum_positive(&sbi->free_blocks) -
+	       percpu_counter_sum_positive(&sbi->delalloc_blocks) >= count;
+}
 
-	bh = sb_bread(sb, SIMPLEFS_INODESTORE_BLOCK_NUMBER);
-	BUG_ON(!bh);
+/* This function returns the first of count contiguous blocks which are
+ * free, from block from on, as long as it is before the block below.
+ * The blocks will be removed from the freeblock list. The first reserved
+ * of them are taken out of those reserved for a file with delayed
+ * allocation, which no one else gets.
+ *
+ * In an ideal, production-ready filesystem, we will not be dealing with blocks,
+ * and instead we will be using extents
+ *
+ * If for some reason, the file creation/deletion failed, the block number
+ * will still be marked as non-free. You need fsck to fix this.*/
+static int __simplefs_sb_get_a_freerun_in(struct super_block *vsb, uint64_t count,
+					  uint64_t from, uint64_t below,
+					  uint64_t reserved, uint64_t *out)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	u64 start = simplefs_trace_clock(simplefs_alloc_block);
+	uint64_t skip;
+	bool flushed = false, busy;
+	int ret = 0;
 
-	if (mutex_lock_interruptible(&simplefs_sb_lock)) {
+again:
+	if (simplefs_lock(vsb, &simplefs_sb_lock, SIMPLEFS_LOCK_SB)) {
 		sfs_trace("Failed to acquire mutex lock\n");
 		return -EINTR;
 	}
+	simplefs_busy_prune(vsb);
 
-	inode_iterator = simplefs_inode_search(sb,
-		(struct simplefs_inode *)bh->b_data,
-		sfs_inode);
+	if (!simplefs_blocks_available(vsb, count - reserved)) {
+		ret = -ENOSPC;
+		goto end;
+	}
 
-	if (likely(inode_iterator)) {
-		memcpy(inode_iterator, sfs_inode, sizeof(*inode_iterator));
-		printk(KERN_INFO "The inode updated\n");
+	if (sb->groups_count) {
+		ret = simplefs_group_get_a_freerun(vsb, count, from, below, out);
+		if (!ret)
+			simplefs_sb_sync(vsb);
+		goto end;
+	}
 
-		mark_buffer_dirty(bh);
-		sync_dirty_buffer(bh);
-	} else {
-		mutex_unlock(&simplefs_sb_lock);
-		printk(KERN_ERR
-		       "The new filesize could not be stored to the inode.");
-		return -EIO;
+	/* Images without a bitmap only ever hand out single blocks, the
+	 * first free one, which is given back while it is busy */
+	ret = count == 1 ? simplefs_legacy_alloc(sb, out) : -ENOSPC;
+	if (!ret && simplefs_busy_skip(vsb, *out, 1, &skip)) {
+		sb->free_blocks |= 1ULL << *out;
+		ret = -ENOSPC;
 	}
+	if (unlikely(ret))
+		goto end;
 
-	brelse(bh);
+	simplefs_sb_sync(vsb);
 
+end:
+	/* Still under the lock, so that simplefs_sync_fs cannot reset the
+	 * counter between the two updates */
+	if (!ret) {
+		percpu_counter_sub(&SIMPLEFS_SB_INFO(vsb)->free_blocks, count);
+		percpu_counter_sub(&SIMPLEFS_SB_INFO(vsb)->delalloc_blocks, reserved);
+	}
+	busy = !list_empty(&SIMPLEFS_SB_INFO(vsb)->busy_runs);
 	mutex_unlock(&simplefs_sb_lock);
 
-	return 0;
+	/* The space may only be in runs still busy: once the journal is
+	 * emptied, they are not any more */
+	if (ret == -ENOSPC && busy && !flushed) {
+		flushed = true;
+		ret = simplefs_journal_flush(vsb);
+		if (!ret)
+			goto again;
+	}
+	if (!ret)
+		simplefs_stat_add(vsb, SIMPLEFS_STAT_BLOCKS_ALLOCATED, count);
+	trace_simplefs_alloc_block(vsb, ret ? 0 : *out, count, ret, start);
+	return ret;
 }
 
-/* FIXME: The write support is rudimentary. I have not figured out a way to do writes
- * from particular offsets (even though I have written some untested code for this below) efficiently. */
-ssize_t simplefs_write(struct file * filp, const char __user * buf, size_t len,
-		       loff_t * ppos)
+static int simplefs_sb_get_a_freerun_in(struct super_block *vsb, uint64_t count,
+					uint64_t from, uint64_t below, uint64_t *out)
+{
+	return __simplefs_sb_get_a_freerun_in(vsb, count, from, below, 0, out);
+}
+
+/* File contents stay on the data device, when there is a metadata
+ * device */
+int simplefs_sb_get_a_freerun(struct super_block *vsb, uint64_t count,
+			      uint64_t *out)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	uint64_t end = sb->meta_block ? sb->meta_block : U64_MAX;
+	int ret;
+
+	ret = simplefs_sb_get_a_freerun_in(vsb, count, 0, end, out);
+	if (ret == -ENOSPC)
+		printk(KERN_ERR "No more free blocks available");
+	return ret;
+}
+
+int simplefs_sb_get_a_freeblock(struct super_block *vsb, uint64_t * out)
+{
+	return simplefs_sb_get_a_freerun(vsb, 1, out);
+}
+
+/* Directories go on the metadata device, if there is one, as long as
+ * it has room left */
+static int simplefs_sb_get_a_dirrun(struct super_block *vsb, uint64_t count,
+				    uint64_t *out)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	int ret;
+
+	if (sb->meta_block) {
+		ret = simplefs_sb_get_a_freerun_in(vsb, count, sb->meta_block,
+						   U64_MAX, out);
+		if (ret != -ENOSPC)
+			return ret;
+	}
+	return simplefs_sb_get_a_freerun(vsb, count, out);
+}
+
+/* Copy the bitmap of a group into bitmap, as it is on the disk, or as
+ * mkfs would have written it for a group it never wrote one for. Must be
+ * called with simplefs_sb_lock held. */
+static int simplefs_group_bitmap_copy(struct super_block *vsb, uint64_t group,
+				      unsigned char *bitmap)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	struct simplefs_group_desc *desc;
+	struct buffer_head *desc_bh, *bh;
+	uint64_t block, offset;
+
+	simplefs_group_desc_locate(sb, group, &block, &offset);
+	desc_bh = simplefs_bread(vsb, block);
+	if (!desc_bh)
+		return -EIO;
+	desc = (struct simplefs_group_desc *)(desc_bh->b_data + offset);
+
+	if (le32_to_cpu(desc->flags) & SIMPLEFS_GROUP_BLOCK_UNINIT) {
+		brelse(desc_bh);
+		simplefs_group_bitmap_init(sb, group, bitmap);
+		return 0;
+	}
+
+	bh = simplefs_bitmap_bread(vsb, group, desc);
+	brelse(desc_bh);
+	if (!bh)
+		return -EIO;
+	memcpy(bitmap, bh->b_data, sb->block_size);
+	brelse(bh);
+	return 0;
+}
+
+/* Where simplefs_sb_get_a_freerun_in from 0 would find its run, without
+ * taking it. -ENOSPC when it would not. */
+static int simplefs_sb_find_a_freerun_below(struct super_block *vsb, uint64_t count,
+					    uint64_t below, uint64_t *out)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	unsigned char *bitmap;
+	uint64_t group;
+	int ret = -ENOSPC;
+
+	bitmap = kmalloc(sb->block_size, GFP_KERNEL);
+	if (!bitmap)
+		return -ENOMEM;
+
+	if (simplefs_lock(vsb, &simplefs_sb_lock, SIMPLEFS_LOCK_SB)) {
+		kfree(bitmap);
+		return -EINTR;
+	}
+	for (group = 0; group < sb->groups_count && ret == -ENOSPC &&
+	     group * sb->group_blocks < below; group++) {
+		ret = simplefs_group_bitmap_copy(vsb, group, bitmap);
+		if (!ret)
+			ret = simplefs_group_find_run(sb, group, bitmap, 0, count, out);
+	}
+	mutex_unlock(&simplefs_sb_lock);
+
+	kfree(bitmap);
+	if (!ret && *out >= below)
+		ret = -ENOSPC;
+	return ret;
+}
+
+/* The runs of free blocks of the whole device by length, see
+ * simplefs_group_free_extents. For /sys/fs/simplefs/<dev>/free_extents. */
+int simplefs_sb_free_extents(struct super_block *vsb, u64 *counts)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	unsigned char *bitmap;
+	uint64_t group;
+	int ret = 0;
+
+	if (!sb->groups_count)
+		return -EOPNOTSUPP;
+
+	bitmap = kmalloc(sb->block_size, GFP_KERNEL);
+	if (!bitmap)
+		return -ENOMEM;
+
+	if (simplefs_lock(vsb, &simplefs_sb_lock, SIMPLEFS_LOCK_SB)) {
+		kfree(bitmap);
+		return -EINTR;
+	}
+	for (group = 0; group < sb->groups_count && !ret; group++) {
+		ret = simplefs_group_bitmap_copy(vsb, group, bitmap);
+		if (!ret)
+			simplefs_group_free_extents(sb, bitmap, counts);
+	}
+	mutex_unlock(&simplefs_sb_lock);
+
+	kfree(bitmap);
+	return ret;
+}
+
+/* Done with a block of the reference count table, which goes out to
+ * the disk if it was changed (marked dirty) */
+static void simplefs_refcount_put(struct buffer_head *bh)
+{
+	if (!bh)
+		return;
+	sync_dirty_buffer(bh);
+	brelse(bh);
+}
+
+/* The reference count of a block. The block of the table holding it is
+ * read into *bh, unless *bh already is that block, so that walking a run
+ * reads each block of the table once. Whatever *bh held before is put.
+ * The part of the table of a group that mkfs left uninitialized is
+ * zeroed first. Must be called with simplefs_sb_lock held. */
+static __le16 *simplefs_refcount_get(struct super_block *vsb, uint64_t block,
+				     struct buffer_head **bh)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	struct buffer_head *desc_bh, *table_bh;
+	struct simplefs_group_desc *desc;
+	uint64_t group = block / sb->group_blocks;
+	uint64_t table_block, offset, first, i;
+
+	simplefs_refcount_locate(sb, block, &table_block, &offset);
+	if (*bh && simplefs_bh_block(vsb, *bh) == table_block)
+		return (__le16 *)((*bh)->b_data + offset);
+
+	simplefs_refcount_put(*bh);
+	*bh = NULL;
+
+	simplefs_group_desc_locate(sb, group, &first, &i);
+	desc_bh = simplefs_bread(vsb, first);
+	if (!desc_bh)
+		return NULL;
+	desc = (struct simplefs_group_desc *)(desc_bh->b_data + i);
+
+	if (le32_to_cpu(desc->flags) & SIMPLEFS_GROUP_REFCOUNT_UNINIT) {
+		first = sb->refcount_block + group * simplefs_refcount_group_blocks(sb);
+		for (i = 0; i < simplefs_refcount_group_blocks(sb); i++) {
+			table_bh = simplefs_getblk(vsb, first + i);
+			if (!table_bh) {
+				brelse(desc_bh);
+				return NULL;
+			}
+			lock_buffer(table_bh);
+			memset(table_bh->b_data, 0, table_bh->b_size);
+			set_buffer_uptodate(table_bh);
+			unlock_buffer(table_bh);
+			simplefs_mark_buffer_dirty(vsb, table_bh);
+			simplefs_refcount_put(table_bh);
+		}
+
+		desc->flags &= ~cpu_to_le32(SIMPLEFS_GROUP_REFCOUNT_UNINIT);
+		simplefs_mark_buffer_dirty(vsb, desc_bh);
+		sync_dirty_buffer(desc_bh);
+	}
+	brelse(desc_bh);
+
+	*bh = simplefs_bread(vsb, table_block);
+	if (!*bh)
+		return NULL;
+	return (__le16 *)((*bh)->b_data + offset);
+}
+
+/* Whether any of the blocks of a run is shared with another file */
+static int simplefs_run_shared(struct super_block *vsb, uint64_t start,
+			       uint64_t count)
+{
+	struct buffer_head *bh = NULL;
+	__le16 *refcount;
+	uint64_t block;
+	int ret = 0;
+
+	if (!SIMPLEFS_SB(vsb)->refcount_blocks)
+		return 0;
+
+	if (simplefs_lock(vsb, &simplefs_sb_lock, SIMPLEFS_LOCK_SB))
+		return -EINTR;
+	for (block = start; block < start + count && !ret; block++) {
+		refcount = simplefs_refcount_get(vsb, block, &bh);
+		if (!refcount)
+			ret = -EIO;
+		else if (le16_to_cpu(*refcount))
+			ret = 1;
+	}
+	simplefs_refcount_put(bh);
+	mutex_unlock(&simplefs_sb_lock);
+
+	return ret;
+}
+
+/* Add a file to the users of a run of blocks. Must be called with
+ * simplefs_sb_lock held. */
+static int __simplefs_run_share(struct super_block *vsb, uint64_t start,
+				uint64_t count)
+{
+	struct buffer_head *bh = NULL;
+	__le16 *refcount;
+	uint64_t block;
+	int ret = 0;
+
+	/* All or nothing, so that a failure leaves nothing to undo */
+	for (block = start; block < start + count && !ret; block++) {
+		refcount = simplefs_refcount_get(vsb, block, &bh);
+		if (!refcount)
+			ret = -EIO;
+		else if (le16_to_cpu(*refcount) == SIMPLEFS_REFCOUNT_MAX)
+			ret = -EMLINK;
+	}
+	for (block = start; block < start + count && !ret; block++) {
+		refcount = simplefs_refcount_get(vsb, block, &bh);
+		if (!refcount) {
+			ret = -EIO;
+			break;
+		}
+		le16_add_cpu(refcount, 1);
+		simplefs_mark_buffer_dirty(vsb, bh);
+	}
+	simplefs_refcount_put(bh);
+
+	return ret;
+}
+
+static int simplefs_run_share(struct super_block *vsb, uint64_t start,
+			      uint64_t count)
+{
+	int ret;
+
+	if (simplefs_lock(vsb, &simplefs_sb_lock, SIMPLEFS_LOCK_SB))
+		return -EINTR;
+	ret = __simplefs_run_share(vsb, start, count);
+	mutex_unlock(&simplefs_sb_lock);
+	return ret;
+}
+
+/* Forget the slots of the dedup index (see simplefs_dedup_find) of the
+ * runs that have some of count blocks from start on. Does no I/O. */
+static void simplefs_dedup_forget_run(struct super_block *sb, u64 start, u64 count)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+	struct simplefs_dedup_entry *slot;
+
+	if (!sbi->dedup)
+		return;
+
+	spin_lock(&sbi->dedup_lock);
+	for (slot = sbi->dedup; slot < sbi->dedup + (1 << SIMPLEFS_DEDUP_BITS); slot++)
+		if (slot->start && slot->start < start + count &&
+		    start < slot->start + slot->blocks)
+			slot->start = 0;
+	spin_unlock(&sbi->dedup_lock);
+}
+
+/* Before a file writes to its run in place: no other file can take it up
+ * from the index any more. Only looks through the index the first time.
+ * Must be called with the inode locked. */
+static void simplefs_dedup_forget(struct inode *inode)
+{
+	struct simplefs_inode_info *info = SIMPLEFS_INODE_INFO(inode);
+	struct simplefs_inode *sfs_inode = &info->disk;
+
+	if (!SIMPLEFS_SB_INFO(inode->i_sb)->dedup || info->dedup_unlisted ||
+	    !sfs_inode->data_block_number)
+		return;
+
+	simplefs_dedup_forget_run(inode->i_sb, sfs_inode->data_block_number,
+				  simplefs_inode_blocks(sfs_inode, inode->i_sb->s_blocksize));
+	info->dedup_unlisted = true;
+}
+
+/* Give up the use of a run of blocks by a file: those shared with other
+ * files lose a reference, the others go back to the free blocks. The
+ * inode must no longer point to them on the disk. */
+static int simplefs_run_release(struct super_block *vsb, uint64_t start,
+				uint64_t count)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	struct buffer_head *refcount_bh = NULL, *desc_bh = NULL, *bitmap_bh = NULL;
+	struct simplefs_group_desc *desc = NULL;
+	struct simplefs_busy_run *busy = NULL;
+	uint64_t block, group = 0, desc_block, offset, freed = 0;
+	__le16 *refcount;
+	int ret = 0;
+
+	/* Without the memory to keep them busy, the journal is emptied
+	 * first instead, as it may have them */
+	if (SIMPLEFS_SB_INFO(vsb)->journal) {
+		busy = kmalloc(sizeof(*busy), GFP_NOFS);
+		if (!busy)
+			ret = simplefs_journal_flush(vsb);
+		if (ret)
+			return ret;
+	}
+
+	if (simplefs_lock(vsb, &simplefs_sb_lock, SIMPLEFS_LOCK_SB)) {
+		kfree(busy);
+		return -EINTR;
+	}
+
+	for (block = start; block < start + count; block++) {
+		if (sb->refcount_blocks) {
+			refcount = simplefs_refcount_get(vsb, block, &refcount_bh);
+			if (!refcount) {
+				ret = -EIO;
+				break;
+			}
+			if (le16_to_cpu(*refcount)) {
+				le16_add_cpu(refcount, -1);
+				simplefs_mark_buffer_dirty(vsb, refcount_bh);
+				continue;
+			}
+		}
+
+		if (!sb->groups_count) {
+			sb->free_blocks |= 1ULL << block;
+			freed++;
+			continue;
+		}
+
+		/* The bitmap goes out before the descriptor and the sb here
+		 * too, a crash in between leaves a wrong free block count */
+		if (!bitmap_bh || block / sb->group_blocks != group) {
+			if (bitmap_bh) {
+				simplefs_bitmap_csum_update(vsb, desc, bitmap_bh);
+				sync_dirty_buffer(bitmap_bh);
+				sync_dirty_buffer(desc_bh);
+				brelse(bitmap_bh);
+				brelse(desc_bh);
+				bitmap_bh = NULL;
+			}
+
+			group = block / sb->group_blocks;
+			simplefs_group_desc_locate(sb, group, &desc_block, &offset);
+			desc_bh = simplefs_bread(vsb, desc_block);
+			if (!desc_bh) {
+				ret = -EIO;
+				break;
+			}
+			desc = (struct simplefs_group_desc *)(desc_bh->b_data + offset);
+
+			/* Nothing was ever handed out of such a group */
+			if (WARN_ON(le32_to_cpu(desc->flags) & SIMPLEFS_GROUP_BLOCK_UNINIT))
+				bitmap_bh = NULL;
+			else
+				bitmap_bh = simplefs_bitmap_bread(vsb, group, desc);
+			if (!bitmap_bh) {
+				brelse(desc_bh);
+				ret = -EIO;
+				break;
+			}
+		}
+
+		ret = simplefs_group_free(sb, group, desc,
+					  (unsigned char *)bitmap_bh->b_data, block);
+		if (WARN_ON(ret))
+			break;
+		simplefs_mark_buffer_dirty(vsb, bitmap_bh);
+		simplefs_mark_buffer_dirty(vsb, desc_bh);
+		freed++;
+	}
+
+	if (bitmap_bh) {
+		simplefs_bitmap_csum_update(vsb, desc, bitmap_bh);
+		sync_dirty_buffer(bitmap_bh);
+		sync_dirty_buffer(desc_bh);
+		brelse(bitmap_bh);
+		brelse(desc_bh);
+	}
+	simplefs_refcount_put(refcount_bh);
+	simplefs_sb_sync(vsb);
+
+	/* What the blocks hold may change from now on, or they may go to
+	 * another file */
+	simplefs_dedup_forget_run(vsb, start, count);
+
+	/* Before anyone else can take them, as the lock is still held */
+	if (freed && busy) {
+		simplefs_busy_prune(vsb);
+		simplefs_busy_add(vsb, busy, start, count);
+		busy = NULL;
+	}
+	kfree(busy);
+
+	percpu_counter_add(&SIMPLEFS_SB_INFO(vsb)->free_blocks, freed);
+	mutex_unlock(&simplefs_sb_lock);
+
+	return ret;
+}
+
+static int simplefs_sb_get_objects_count(struct super_block *vsb,
+					 uint64_t * out)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+
+	if (simplefs_lock(vsb, &simplefs_inodes_mgmt_lock, SIMPLEFS_LOCK_INODES)) {
+		sfs_trace("Failed to acquire mutex lock\n");
+		return -EINTR;
+	}
+	*out = sb->inodes_count;
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
+static int simplefs_iterate(struct file *filp, struct dir_context *ctx)
+#else
+static int simplefs_readdir(struct file *filp, void *dirent, filldir_t filldir)
+#endif
+{
+	loff_t pos;
+	struct inode *inode;
+	struct super_block *sb;
+	struct buffer_head *bh;
+	struct simplefs_inode *sfs_inode;
+	struct simplefs_dir_record *record;
+	uint64_t i, block, offset;
+	int ret = 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
+	pos = ctx->pos;
+#else
+	pos = filp->f_pos;
+#endif
+	inode = filp->f_dentry->d_inode;
+	sb = inode->i_sb;
+
+	sfs_inode = SIMPLEFS_INODE(inode);
+
+	if (unlikely(!S_ISDIR(sfs_inode->mode))) {
+		printk(KERN_ERR
+		       "inode [%llu][%lu] for fs object [%s] not a directory\n",
+		       sfs_inode->inode_no, inode->i_ino,
+		       filp->f_dentry->d_name.name);
+		return -ENOTDIR;
+	}
+
+	bh = NULL;
+
+	/* Carry on from the record the last call stopped at, when the
+	 * buffer it was given had no room left */
+	for (i = simplefs_dir_pos_index(sfs_inode, pos);
+	     i < sfs_inode->dir_children_count; i++) {
+		simplefs_dir_record_locate(SIMPLEFS_SB(sb), sfs_inode, i,
+					   &block, &offset);
+		if (!bh || simplefs_bh_block(sb, bh) != block) {
+			brelse(bh);
+			bh = simplefs_bread(sb, block);
+			BUG_ON(!bh);
+			ret = simplefs_block_verify(sb, bh);
+			if (ret)
+				break;
+		}
+		record = (struct simplefs_dir_record *)(bh->b_data + offset);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
+		if (!dir_emit(ctx, record->filename,
+			      strnlen(record->filename, SIMPLEFS_FILENAME_MAXLEN),
+			      le64_to_cpu(record->inode_no), DT_UNKNOWN))
+			break;
+		ctx->pos = simplefs_dir_index_pos(i + 1);
+#else
+		if (filldir(dirent, record->filename,
+			    strnlen(record->filename, SIMPLEFS_FILENAME_MAXLEN),
+			    simplefs_dir_index_pos(i), le64_to_cpu(record->inode_no),
+			    DT_UNKNOWN))
+			break;
+		filp->f_pos = simplefs_dir_index_pos(i + 1);
+#endif
+	}
+	brelse(bh);
+
+	return ret;
+}
+
+/* This functions returns a simplefs_inode with the given inode_no
+ * from the inode store, if it exists. */
+struct simplefs_inode *simplefs_get_inode(struct super_block *sb,
+					  uint64_t inode_no)
+{
+	struct simplefs_inode sfs_inode;
+	struct simplefs_inode *inode_buffer = NULL;
+	struct buffer_head *bh;
+	void *disk;
+
+	/* The inode store can be read once and kept in memory permanently while mounting.
+	 * But such a model will not be scalable in a filesystem with
+	 * millions or billions of files (inodes) */
+	bh = simplefs_inode_bread(sb, inode_no, &disk);
+	if (!bh)
+		return NULL;
+
+	simplefs_inode_load(SIMPLEFS_SB(sb), disk, &sfs_inode);
+	if (likely(sfs_inode.inode_no == inode_no)) {
+		inode_buffer = kmem_cache_alloc(sfs_inode_cachep, GFP_KERNEL);
+		if (inode_buffer)
+			*inode_buffer = sfs_inode;
+	}
+
+	brelse(bh);
+	return inode_buffer;
+}
+
+/* The most a read returns per call, and how far ahead a run of blocks
+ * is read when it is copied. There is no page cache to read into, but
+ * the blocks of a run are asked for all at once (see
+ * simplefs_run_readahead), so this is what the device gets in a few
+ * large requests rather than one block at a time. */
+#define SIMPLEFS_IO_MAX_BYTES (2 << 20)
+
+/* Start reading count blocks from start in. They are sent as one
+ * plugged batch, which the block layer merges into large requests, and
+ * simplefs_bread of each then finds it there, or waits for it. */
+static void simplefs_run_readahead(struct super_block *sb, uint64_t start,
+				   uint64_t count)
+{
+	struct blk_plug plug;
+	uint64_t i;
+
+	/* Nothing to merge */
+	if (count < 2)
+		return;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < count; i++)
+		simplefs_breadahead(sb, start + i);
+	blk_finish_plug(&plug);
+}
+
+/* Copy len bytes, from pos bytes into the run of blocks at start */
+static int simplefs_run_read(struct super_block *sb, uint64_t start, loff_t pos,
+			     void *to, size_t len)
+{
+	struct buffer_head *bh;
+	size_t offset, nbytes;
+
+	if (len)
+		simplefs_run_readahead(sb, start + (pos >> sb->s_blocksize_bits),
+				       ((pos + len - 1) >> sb->s_blocksize_bits) -
+				       (pos >> sb->s_blocksize_bits) + 1);
+
+	/* The bytes need not be aligned to the blocks */
+	while (len) {
+		bh = simplefs_bread(sb, start + (pos >> sb->s_blocksize_bits));
+		if (!bh)
+			return -EIO;
+
+		offset = pos & (sb->s_blocksize - 1);
+		nbytes = min_t(size_t, len, sb->s_blocksize - offset);
+		memcpy(to, bh->b_data + offset, nbytes);
+		brelse(bh);
+
+		to += nbytes;
+		pos += nbytes;
+		len -= nbytes;
+	}
+	return 0;
+}
+
+/* The size of the contents of a compressed file, see simplefs_compress_header */
+static int simplefs_compress_size(struct super_block *sb,
+				  struct simplefs_inode *sfs_inode, uint64_t *size)
+{
+	struct simplefs_compress_header header;
+	int ret;
+
+	ret = simplefs_run_read(sb, sfs_inode->data_block_number, 0,
+				&header, sizeof(header));
+	if (!ret)
+		*size = le64_to_cpu(header.size);
+	return ret;
+}
+
+/* Read the cluster of a compressed file at start that is len bytes long
+ * once decompressed, into to. tmp must have room for a cluster. */
+static int simplefs_compress_cluster_read(struct super_block *sb, uint64_t start,
+					  const struct simplefs_compress_cluster *cluster,
+					  char *to, size_t len, char *tmp)
+{
+	int ret;
+
+	/* Stored as it is */
+	if (cluster->length == len)
+		return simplefs_run_read(sb, start, cluster->offset, to, len);
+	if (cluster->length > len)
+		return -EIO;
+
+	ret = simplefs_run_read(sb, start, cluster->offset, tmp, cluster->length);
+	if (ret)
+		return ret;
+	if (LZ4_decompress_safe(tmp, to, cluster->length, len) != len)
+		return -EIO;
+	return 0;
+}
+
+/* Reads of a compressed file return at most a cluster per call. Writes
+ * move the clusters around (see simplefs_compress_update), so this must
+ * be called with the inode locked, shared at least. */
+static ssize_t simplefs_compress_read(struct inode *inode, char __user *buf,
+				      size_t len, loff_t *ppos)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct simplefs_compress_cluster cluster;
+	uint64_t index = *ppos / SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+	size_t offset = *ppos % SIMPLEFS_COMPRESS_CLUSTER_SIZE, clen, nbytes;
+	loff_t size;
+	char *data = NULL;
+	ssize_t ret;
+
+	size = i_size_read(inode);
+	if (*ppos >= size) {
+		ret = 0;
+		goto out;
+	}
+	clen = min_t(loff_t, SIMPLEFS_COMPRESS_CLUSTER_SIZE,
+		     size - index * SIMPLEFS_COMPRESS_CLUSTER_SIZE);
+
+	data = kvmalloc(2 * SIMPLEFS_COMPRESS_CLUSTER_SIZE, GFP_KERNEL);
+	if (!data) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = simplefs_run_read(sb, sfs_inode->data_block_number,
+				simplefs_compress_table_size(index),
+				&cluster, sizeof(cluster));
+	simplefs_compress_table_load(&cluster, 1);
+	if (!ret)
+		ret = simplefs_compress_cluster_read(sb, sfs_inode->data_block_number,
+						     &cluster, data, clen,
+						     data + SIMPLEFS_COMPRESS_CLUSTER_SIZE);
+	if (ret)
+		goto out;
+
+	nbytes = min_t(size_t, len, clen - offset);
+	if (copy_to_user(buf, data + offset, nbytes)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	*ppos += nbytes;
+	ret = nbytes;
+out:
+	kvfree(data);
+	return ret;
+}
+
+static ssize_t __simplefs_read(struct file * filp, char __user * buf, size_t len,
+			       loff_t * ppos)
+{
+	/* After the commit dd37978c5 in the upstream linux kernel,
+	 * we can use just filp->f_inode instead of the
+	 * f->f_path.dentry->d_inode redirection */
+	struct simplefs_inode *inode =
+	    SIMPLEFS_INODE(filp->f_path.dentry->d_inode);
+	struct super_block *sb = filp->f_path.dentry->d_inode->i_sb;
+	struct buffer_head *bh;
+	uint64_t block, run_first, count;
+	loff_t size;
+
+	char *buffer;
+	size_t offset, nbytes, done;
+
+	if (inode->mode & SIMPLEFS_INODE_COMPRESSED)
+		return simplefs_compress_read(filp->f_path.dentry->d_inode, buf,
+					      len, ppos);
+
+	/* Not written out yet, see simplefs_delalloc_write */
+	if (!inode->data_block_number && !(inode->mode & SIMPLEFS_INODE_SPARSE)) {
+		size = i_size_read(filp->f_path.dentry->d_inode);
+		if (*ppos >= size)
+			return 0;
+		nbytes = min_t(loff_t, len, size - *ppos);
+		buffer = SIMPLEFS_INODE_INFO(filp->f_path.dentry->d_inode)->delalloc;
+		if (copy_to_user(buf, buffer + *ppos, nbytes))
+			return -EFAULT;
+		*ppos += nbytes;
+		return nbytes;
+	}
+
+	if (*ppos >= inode->file_size) {
+		/* Read request with offset beyond the filesize */
+		return 0;
+	}
+
+	/* Up to SIMPLEFS_IO_MAX_BYTES are returned per call, from the
+	 * run or from a hole. The caller comes back for the rest. */
+	block = *ppos >> sb->s_blocksize_bits;
+	offset = *ppos & (sb->s_blocksize - 1);
+	len = min_t(u64, len, inode->file_size - *ppos);
+	len = min_t(size_t, len, SIMPLEFS_IO_MAX_BYTES - offset);
+	if (!len)
+		return 0;
+
+	/* A hole of a sparse file, up to the run or the end */
+	run_first = simplefs_inode_run_first(inode);
+	count = simplefs_inode_blocks(inode, sb->s_blocksize);
+	if (block < run_first || block >= run_first + count) {
+		if (block < run_first)
+			len = min_t(u64, len, (run_first << sb->s_blocksize_bits) - *ppos);
+		if (clear_user(buf, len))
+			return -EFAULT;
+		*ppos += len;
+		return len;
+	}
+	len = min_t(u64, len, ((run_first + count) << sb->s_blocksize_bits) - *ppos);
+
+	block = inode->data_block_number + block - run_first;
+	count = ((offset + len - 1) >> sb->s_blocksize_bits) + 1;
+	simplefs_run_readahead(sb, block, count);
+
+	for (done = 0; done < len; block++, offset = 0) {
+		bh = simplefs_bread(sb, block);
+		if (!bh) {
+			printk(KERN_ERR "Reading the block number [%llu] failed.",
+			       block);
+			break;
+		}
+
+		buffer = (char *)bh->b_data + offset;
+		nbytes = min_t(size_t, len - done, sb->s_blocksize - offset);
+
+		if (copy_to_user(buf + done, buffer, nbytes)) {
+			brelse(bh);
+			printk(KERN_ERR
+			       "Error copying file contents to the userspace buffer\n");
+			if (!done)
+				return -EFAULT;
+			break;
+		}
+
+		brelse(bh);
+		done += nbytes;
+	}
+
+	*ppos += done;
+
+	return done;
+}
+
+ssize_t simplefs_read(struct file * filp, char __user * buf, size_t len,
+		      loff_t * ppos)
+{
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	struct simplefs_range range;
+	u64 start = ktime_get_ns();
+	loff_t pos = *ppos;
+	ssize_t ret;
+
+	/* Writes may move the file to another run of blocks, and give the
+	 * old one up (see simplefs_run_move), with the inode locked. Those
+	 * that do not only lock what they write. */
+	inode_lock_shared(inode);
+	simplefs_range_lock(inode, &range, pos,
+			    pos + min_t(u64, len ? len - 1 : 0, LLONG_MAX - pos),
+			    false);
+	ret = __simplefs_read(filp, buf, len, ppos);
+	simplefs_range_unlock(inode, &range);
+	inode_unlock_shared(inode);
+	simplefs_stat_latency(inode->i_sb, SIMPLEFS_OP_READ, start);
+	trace_simplefs_read(inode, pos, len, ret, start);
+	return ret;
+}
+
+/* Copy the times of the VFS inode into the simplefs one, for the next
+ * simplefs_inode_save */
+static void simplefs_inode_set_times(struct inode *inode)
+{
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+
+	sfs_inode->atime = timespec64_to_ns(&inode->i_atime);
+	sfs_inode->mtime = timespec64_to_ns(&inode->i_mtime);
+	sfs_inode->ctime = timespec64_to_ns(&inode->i_ctime);
+}
+
+/* Turn a feature on, in one of the feature masks of the super block,
+ * before the first thing that needs it goes out. Version 1 images have
+ * no feature flags. */
+static int simplefs_sb_feature_set(struct super_block *vsb, uint64_t *features,
+				   uint64_t feature)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+
+	if (sb->version < SIMPLEFS_VERSION_2 || READ_ONCE(*features) & feature)
+		return 0;
+
+	if (simplefs_lock(vsb, &simplefs_sb_lock, SIMPLEFS_LOCK_SB))
+		return -EINTR;
+	*features |= feature;
+	simplefs_sb_sync(vsb);
+	mutex_unlock(&simplefs_sb_lock);
+	return 0;
+}
+
+/* Save the modified inode */
+int simplefs_inode_save(struct super_block *sb, struct simplefs_inode *sfs_inode)
+{
+	struct simplefs_inode inode_iterator;
+	struct buffer_head *bh;
+	u64 start = ktime_get_ns();
+	void *disk;
+
+	if (simplefs_lock(sb, &simplefs_sb_lock, SIMPLEFS_LOCK_SB)) {
+		sfs_trace("Failed to acquire mutex lock\n");
+		return -EINTR;
+	}
+
+	bh = simplefs_inode_bread(sb, sfs_inode->inode_no, &disk);
+	if (bh)
+		simplefs_inode_load(SIMPLEFS_SB(sb), disk, &inode_iterator);
+
+	if (likely(bh && inode_iterator.inode_no == sfs_inode->inode_no)) {
+		lock_buffer(bh);
+		simplefs_inode_store(SIMPLEFS_SB(sb), disk, sfs_inode);
+		simplefs_block_csum_update(sb, bh);
+		unlock_buffer(bh);
+
+		simplefs_mark_buffer_dirty(sb, bh);
+		sync_dirty_buffer(bh);
+	} else {
+		brelse(bh);
+		mutex_unlock(&simplefs_sb_lock);
+		printk(KERN_ERR
+		       "The new filesize could not be stored to the inode.");
+		simplefs_stat_latency(sb, SIMPLEFS_OP_INODE_SAVE, start);
+		trace_simplefs_inode_save(sb, sfs_inode, -EIO);
+		return -EIO;
+	}
+
+	brelse(bh);
+
+	mutex_unlock(&simplefs_sb_lock);
+
+	simplefs_stat_latency(sb, SIMPLEFS_OP_INODE_SAVE, start);
+	trace_simplefs_inode_save(sb, sfs_inode, 0);
+	return 0;
+}
+
+/* Fills len bytes of a block with what is written at done bytes into
+ * a write, see simplefs_write_range */
+typedef int (*simplefs_fill_t)(char *to, size_t done, size_t len, void *data);
+
+/* Move the contents of a file to the run of blocks at new, just taken
+ * for it, and give the old run up. The new run holds count blocks of the
+ * contents from first on, which may be more than the old one did (see
+ * simplefs_sparse_extend): those are zeroed. The inode only points to the
+ * new run once all of it is on the disk, so a crash leaves either run in
+ * use. The new run is given back on failure. Must be called with the
+ * inode locked. */
+static int simplefs_run_move(struct inode *inode, uint64_t new, uint64_t first,
+			     uint64_t count)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode), saved;
+	uint64_t old_count = simplefs_inode_blocks(sfs_inode, sb->s_blocksize);
+	uint64_t old_first = simplefs_inode_run_first(sfs_inode);
+	uint64_t old = sfs_inode->data_block_number, i, lo, hi;
+	uint64_t window = SIMPLEFS_IO_MAX_BYTES >> sb->s_blocksize_bits;
+	struct buffer_head *from = NULL, *to;
+	int ret = 0;
+
+	/* The new run is not reachable before the inode is saved, so
+	 * it is written in place rather than through the journal */
+	for (i = 0; i < count; i++) {
+		if (!(i % window)) {
+			lo = max(first + i, old_first);
+			hi = min(first + i + window, old_first + old_count);
+			if (lo < hi)
+				simplefs_run_readahead(sb, old + lo - old_first, hi - lo);
+		}
+		if (first + i >= old_first && first + i < old_first + old_count) {
+			from = simplefs_bread(sb, old + first + i - old_first);
+			if (!from) {
+				ret = -EIO;
+				goto release;
+			}
+		}
+		to = simplefs_getblk(sb, new + i);
+		if (!to) {
+			brelse(from);
+			ret = -EIO;
+			goto release;
+		}
+
+		lock_buffer(to);
+		if (from)
+			memcpy(to->b_data, from->b_data, sb->s_blocksize);
+		else
+			memset(to->b_data, 0, sb->s_blocksize);
+		set_buffer_uptodate(to);
+		unlock_buffer(to);
+		simplefs_mark_buffer_dirty(sb, to);
+
+		brelse(to);
+		brelse(from);
+		from = NULL;
+
+		/* A window at a time, sent together */
+		if ((i + 1) % window && i + 1 != count)
+			continue;
+		ret = simplefs_run_sync(sb, new + i - i % window, i % window + 1);
+		if (ret)
+			goto release;
+	}
+
+	if (simplefs_lock(sb, &simplefs_inodes_mgmt_lock, SIMPLEFS_LOCK_INODES)) {
+		ret = -EINTR;
+		goto release;
+	}
+	saved = *sfs_inode;
+	simplefs_inode_set_run(sfs_inode, sb->s_blocksize, new, first, count);
+	ret = simplefs_inode_save(sb, sfs_inode);
+	if (ret)
+		*sfs_inode = saved;
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	if (ret)
+		goto release;
+
+	return old_count ? simplefs_run_release(sb, old, old_count) : 0;
+
+release:
+	simplefs_run_release(sb, new, count);
+	return ret;
+}
+
+/* A file that shares blocks with others gets a run of its own, with the
+ * contents copied over, before the shared ones are written to: blocks
+ * first to last of its run, which are those of its contents only when
+ * it is not sparse. Blocks are only shared whole runs at a time (see
+ * simplefs_clone), so the run is copied as a whole too. Must be called
+ * with the inode locked. */
+static int simplefs_unshare(struct inode *inode, uint64_t first, uint64_t last)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	uint64_t new, count;
+	int ret;
+
+	/* Before the reference counts are looked at, see simplefs_dedup_find */
+	simplefs_dedup_forget(inode);
+	ret = simplefs_run_shared(sb, sfs_inode->data_block_number + first,
+				  last - first + 1);
+	if (ret <= 0)
+		return ret;
+
+	count = simplefs_inode_blocks(sfs_inode, sb->s_blocksize);
+	ret = simplefs_sb_get_a_freerun(sb, count, &new);
+	if (ret)
+		return ret;
+	return simplefs_run_move(inode, new, simplefs_inode_run_first(sfs_inode), count);
+}
+
+/* Move a file to the longer run simplefs_run_extend gives it, for a
+ * write to blocks first to last of its contents. What lies in between,
+ * and was a hole, is zeroed. Must be called with the inode locked. */
+static int simplefs_sparse_extend(struct inode *inode, uint64_t first, uint64_t last)
+{
+	struct super_block *sb = inode->i_sb;
+	uint64_t count, new;
+	int ret;
+
+	ret = simplefs_run_extend(SIMPLEFS_SB(sb), SIMPLEFS_INODE(inode), first, last,
+				  &first, &count);
+	if (ret)
+		return ret;
+
+	ret = simplefs_sb_feature_set(sb, &SIMPLEFS_SB(sb)->feature_incompat,
+				      SIMPLEFS_FEATURE_INCOMPAT_SPARSE);
+	if (ret)
+		return ret;
+	ret = simplefs_sb_get_a_freerun(sb, count, &new);
+	if (ret)
+		return ret;
+	return simplefs_run_move(inode, new, first, count);
+}
+
+/* The largest size a file can have, for s_maxbytes. A file is a single
+ * extent, its run of blocks, which is at most a group long. On images
+ * that have holes it can start anywhere before block U32_MAX of the file
+ * (see simplefs_sparse_extend), and those blocks are all the file has on
+ * the others. Images without groups give a file a single block. */
+static loff_t simplefs_max_bytes(struct super_block *sb)
+{
+	struct simplefs_super_block *sfs_sb = SIMPLEFS_SB(sb);
+
+	if (!sfs_sb->groups_count)
+		return sb->s_blocksize;
+	if (!simplefs_sparse_ok(sfs_sb))
+		return sfs_sb->group_blocks << sb->s_blocksize_bits;
+	return min_t(u64, MAX_LFS_FILESIZE, (u64)U32_MAX << sb->s_blocksize_bits);
+}
+
+/* SIMPLEFS_IOC_GETFRAG: where the run of a file is, and the lowest free
+ * run it would fit in, if that is before it. Must be called with the
+ * inode locked. */
+static int simplefs_frag_get(struct inode *inode, struct simplefs_defrag *frag)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	int ret;
+
+	memset(frag, 0, sizeof(*frag));
+	frag->start = sfs_inode->data_block_number;
+	frag->blocks = simplefs_inode_blocks(sfs_inode, sb->s_blocksize);
+	frag->goal = frag->start;
+
+	/* Not written out yet, see simplefs_delalloc_write */
+	if (!frag->blocks)
+		return 0;
+
+	ret = simplefs_run_shared(sb, frag->start, frag->blocks);
+	if (ret)
+		frag->flags |= SIMPLEFS_DEFRAG_SHARED;
+	if (ret || !SIMPLEFS_SB(sb)->groups_count)
+		return min(ret, 0);
+
+	ret = simplefs_sb_find_a_freerun_below(sb, frag->blocks, frag->start,
+					       &frag->goal);
+	if (ret == -ENOSPC) {
+		frag->goal = frag->start;
+		ret = 0;
+	}
+	return ret;
+}
+
+/* SIMPLEFS_IOC_DEFRAG: move a file down into the lowest free run it fits
+ * in, if that is before it. Each file already is a single run of blocks,
+ * so what gets fragmented is the free space in between, which a file
+ * must find a long enough run in to be created or to be rewritten.
+ * Moving the files down, from the first one on, leaves it all at the
+ * end. Shared runs stay where they are, as moving one would unshare it.
+ * Must be called with the inode locked. */
+static int simplefs_defrag(struct inode *inode, struct simplefs_defrag *frag)
+{
+	struct super_block *sb = inode->i_sb;
+	uint64_t old = SIMPLEFS_INODE(inode)->data_block_number, new;
+	int ret;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if (!SIMPLEFS_SB(sb)->groups_count)
+		return -EOPNOTSUPP;
+
+	ret = simplefs_frag_get(inode, frag);
+	if (ret || frag->goal == frag->start)
+		return ret;
+
+	/* Someone may have taken the run in the meantime */
+	ret = simplefs_sb_get_a_freerun_in(sb, frag->blocks, 0, frag->start, &new);
+	if (ret == -ENOSPC)
+		return 0;
+	if (!ret)
+		ret = simplefs_run_move(inode, new,
+					simplefs_inode_run_first(SIMPLEFS_INODE(inode)),
+					frag->blocks);
+	if (!ret)
+		frag->start = frag->goal = new;
+
+	trace_simplefs_defrag(inode, old, frag->start, frag->blocks, ret);
+	return ret;
+}
+
+/* The buffer head of a block about to be written to. A block that is
+ * written whole is not read from the disk first: if it is not in memory,
+ * it is zeroed instead. */
+static struct buffer_head *simplefs_bread_to_write(struct super_block *sb,
+						   uint64_t block, bool whole)
+{
+	struct buffer_head *bh;
+
+	if (!whole)
+		return simplefs_bread(sb, block);
+
+	bh = simplefs_getblk(sb, block);
+	if (bh && !buffer_uptodate(bh)) {
+		lock_buffer(bh);
+		if (!buffer_uptodate(bh)) {
+			memset(bh->b_data, 0, sb->s_blocksize);
+			set_buffer_uptodate(bh);
+		}
+		unlock_buffer(bh);
+	}
+	return bh;
+}
+
+/* Write into the run of blocks at start, through the journal when given
+ * a handle. Without one the blocks are only marked dirty, for
+ * simplefs_run_sync: that is for a run that no inode points to yet, and
+ * the blocks that were not in memory are zeroed rather than read. */
+static int simplefs_run_write(struct super_block *sb, handle_t *handle,
+			      uint64_t start, loff_t pos, const void *from, size_t len)
+{
+	struct buffer_head *bh;
+	size_t offset, nbytes;
+	int ret = 0;
+
+	if (len)
+		simplefs_cbt_mark(sb, start + (pos >> sb->s_blocksize_bits),
+				  ((pos + len - 1) >> sb->s_blocksize_bits) -
+				  (pos >> sb->s_blocksize_bits) + 1);
+
+	while (len && !ret) {
+		offset = pos & (sb->s_blocksize - 1);
+		nbytes = min_t(size_t, len, sb->s_blocksize - offset);
+
+		if (handle) {
+			bh = simplefs_bread_to_write(sb, start + (pos >> sb->s_blocksize_bits),
+						     nbytes == sb->s_blocksize);
+			if (!bh)
+				return -EIO;
+			ret = jbd2_journal_get_write_access(handle, bh);
+			if (!ret) {
+				memcpy(bh->b_data + offset, from, nbytes);
+				ret = jbd2_journal_dirty_metadata(handle, bh);
+			}
+		} else {
+			bh = simplefs_getblk(sb, start + (pos >> sb->s_blocksize_bits));
+			if (!bh)
+				return -EIO;
+			lock_buffer(bh);
+			if (!buffer_uptodate(bh)) {
+				memset(bh->b_data, 0, sb->s_blocksize);
+				set_buffer_uptodate(bh);
+			}
+			memcpy(bh->b_data + offset, from, nbytes);
+			unlock_buffer(bh);
+			mark_buffer_dirty(bh);
+		}
+		brelse(bh);
+
+		from += nbytes;
+		pos += nbytes;
+		len -= nbytes;
+	}
+	return ret;
+}
+
+/* Changed block tracking (see simplefs_cbt_header). Blocks are marked in
+ * the bitmap of the current epoch before they are written to: those of
+ * the metadata as they are marked dirty (see simplefs_mark_buffer_dirty),
+ * and those of file contents a whole write at a time. The bitmaps are
+ * only written out by sync_fs and at unmount, so the header is not
+ * marked clean for as long as the image is mounted. One found that way
+ * at mount was not unmounted cleanly, and its current epoch may have
+ * missed blocks. */
+static struct simplefs_cbt_header *simplefs_cbt_header(struct super_block *vsb)
+{
+	return (struct simplefs_cbt_header *)SIMPLEFS_SB_INFO(vsb)->cbt_bh->b_data;
+}
+
+/* The first block of the bitmap of the current epoch, or of the one
+ * before */
+static u64 simplefs_cbt_bitmap(struct super_block *vsb, bool previous)
+{
+	struct simplefs_cbt_header *header = simplefs_cbt_header(vsb);
+
+	return SIMPLEFS_SB(vsb)->cbt_block + 1 +
+	       (le64_to_cpu(header->current_bitmap) ^ previous) *
+	       le64_to_cpu(header->bitmap_blocks);
+}
+
+/* Set the bits of count blocks from block on, in the bitmap at bitmap */
+static void __simplefs_cbt_mark(struct super_block *vsb, u64 bitmap,
+				u64 block, u64 count)
+{
+	u64 bits = vsb->s_blocksize * 8;
+	u64 end = min(block + count, SIMPLEFS_SB(vsb)->blocks_count);
+	u64 next;
+	struct buffer_head *bh;
+	bool changed;
+
+	while (block < end) {
+		next = min(end, block - block % bits + bits);
+		bh = simplefs_bread(vsb, bitmap + block / bits);
+		if (!bh) {
+			WRITE_ONCE(SIMPLEFS_SB_INFO(vsb)->cbt_missed, true);
+			return;
+		}
+
+		changed = false;
+		for (; block < next; block++)
+			if (!test_bit_le(block % bits, bh->b_data) &&
+			    !test_and_set_bit_le(block % bits, bh->b_data))
+				changed = true;
+		if (changed)
+			mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+}
+
+void simplefs_cbt_mark(struct super_block *vsb, u64 block, u64 count)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(vsb);
+
+	/* Only turned on with cbt_sem held for writing, and only turned
+	 * off at unmount */
+	if (!READ_ONCE(sbi->cbt_bh))
+		return;
+
+	down_read(&sbi->cbt_sem);
+	__simplefs_cbt_mark(vsb, simplefs_cbt_bitmap(vsb, false), block, count);
+	up_read(&sbi->cbt_sem);
+}
+
+/* At mount, on images with changed block tracking, and once it is
+ * turned on */
+static int simplefs_cbt_load(struct super_block *vsb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(vsb);
+	struct simplefs_super_block *sb = sbi->sb;
+	struct simplefs_cbt_header *header;
+	struct buffer_head *bh;
+	int ret;
+
+	bh = simplefs_bread(vsb, sb->cbt_block);
+	if (!bh)
+		return -EIO;
+
+	header = (struct simplefs_cbt_header *)bh->b_data;
+	if (le64_to_cpu(header->magic) != SIMPLEFS_CBT_MAGIC ||
+	    le64_to_cpu(header->current_bitmap) > 1 ||
+	    le64_to_cpu(header->bitmap_blocks) != simplefs_cbt_bitmap_blocks(sb)) {
+		printk(KERN_ERR "simplefs: the changed block tracking header is invalid, run fsck-simplefs\n");
+		brelse(bh);
+		return -EINVAL;
+	}
+
+	/* Also on read-only mounts, as jbd2 writes to the journal all the
+	 * same. A device that cannot be written to stays as it is. */
+	if (!bdev_read_only(vsb->s_bdev)) {
+		if (!(le64_to_cpu(header->flags) & SIMPLEFS_CBT_CLEAN))
+			header->flags |= cpu_to_le64(SIMPLEFS_CBT_INCOMPLETE);
+		header->flags &= ~cpu_to_le64(SIMPLEFS_CBT_CLEAN);
+		mark_buffer_dirty(bh);
+		ret = sync_dirty_buffer(bh);
+		if (ret) {
+			brelse(bh);
+			return ret;
+		}
+	}
+
+	WRITE_ONCE(sbi->cbt_bh, bh);
+	__simplefs_cbt_mark(vsb, simplefs_cbt_bitmap(vsb, false),
+			    sb->journal_block, sb->journal_blocks);
+	return 0;
+}
+
+/* At unmount, and after the journal is done with: the bitmaps are all
+ * on the disk once the header is marked clean */
+static void simplefs_cbt_unload(struct super_block *vsb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(vsb);
+	struct simplefs_cbt_header *header;
+
+	if (!sbi->cbt_bh)
+		return;
+
+	header = simplefs_cbt_header(vsb);
+	if (!bdev_read_only(vsb->s_bdev) &&
+	    !simplefs_run_sync(vsb, simplefs_cbt_bitmap(vsb, false),
+			       le64_to_cpu(header->bitmap_blocks))) {
+		if (sbi->cbt_missed)
+			header->flags |= cpu_to_le64(SIMPLEFS_CBT_INCOMPLETE);
+		header->flags |= cpu_to_le64(SIMPLEFS_CBT_CLEAN);
+		mark_buffer_dirty(sbi->cbt_bh);
+		sync_dirty_buffer(sbi->cbt_bh);
+	}
+
+	brelse(sbi->cbt_bh);
+	sbi->cbt_bh = NULL;
+}
+
+/* Write out the bitmap of the current epoch, for sync_fs */
+static int simplefs_cbt_sync(struct super_block *vsb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(vsb);
+	int ret;
+
+	if (!READ_ONCE(sbi->cbt_bh))
+		return 0;
+
+	down_read(&sbi->cbt_sem);
+	ret = simplefs_run_sync(vsb, simplefs_cbt_bitmap(vsb, false),
+				le64_to_cpu(simplefs_cbt_header(vsb)->bitmap_blocks));
+	up_read(&sbi->cbt_sem);
+	return ret;
+}
+
+/* Turn tracking on, with a run of blocks for it. What was written before
+ * is all in epoch 0, which is then incomplete. Must be called with
+ * cbt_sem held for writing. */
+static int simplefs_cbt_enable(struct super_block *vsb)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	struct simplefs_cbt_header *header;
+	struct buffer_head *bh;
+	u64 blocks = simplefs_cbt_blocks(sb), start, i;
+	int ret;
+
+	/* Images without feature flags cannot tell others about it */
+	if (sb->version < SIMPLEFS_VERSION_2)
+		return -EOPNOTSUPP;
+
+	ret = simplefs_sb_get_a_freerun(vsb, blocks, &start);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < blocks; i++) {
+		bh = simplefs_getblk(vsb, start + i);
+		if (!bh)
+			return -EIO;
+		lock_buffer(bh);
+		memset(bh->b_data, 0, vsb->s_blocksize);
+		if (!i) {
+			header = (struct simplefs_cbt_header *)bh->b_data;
+			header->magic = cpu_to_le64(SIMPLEFS_CBT_MAGIC);
+			header->bitmap_blocks = cpu_to_le64(simplefs_cbt_bitmap_blocks(sb));
+			header->flags = cpu_to_le64(SIMPLEFS_CBT_INCOMPLETE);
+		}
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+	ret = simplefs_run_sync(vsb, start, blocks);
+	if (ret)
+		return ret;
+
+	if (simplefs_lock(vsb, &simplefs_sb_lock, SIMPLEFS_LOCK_SB))
+		return -EINTR;
+	sb->cbt_block = start;
+	sb->feature_ro_compat |= SIMPLEFS_FEATURE_RO_COMPAT_CBT;
+	simplefs_sb_sync(vsb);
+	mutex_unlock(&simplefs_sb_lock);
+
+	return simplefs_cbt_load(vsb);
+}
+
+/* SIMPLEFS_IOC_CBT_EPOCH. The bitmap of the epoch that ends is written
+ * out, and that of the epoch before it is cleared for the new one. */
+static int simplefs_cbt_new_epoch(struct super_block *vsb,
+				  struct simplefs_cbt_epoch *epoch)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(vsb);
+	struct simplefs_cbt_header *header;
+	struct buffer_head *bh;
+	u64 bitmap, i;
+	int ret = 0;
+
+	down_write(&sbi->cbt_sem);
+	if (!sbi->cbt_bh)
+		ret = simplefs_cbt_enable(vsb);
+	if (ret)
+		goto unlock;
+	header = simplefs_cbt_header(vsb);
+
+	ret = simplefs_run_sync(vsb, simplefs_cbt_bitmap(vsb, false),
+				le64_to_cpu(header->bitmap_blocks));
+	if (ret)
+		goto unlock;
+
+	bitmap = simplefs_cbt_bitmap(vsb, true);
+	for (i = 0; i < le64_to_cpu(header->bitmap_blocks); i++) {
+		bh = simplefs_getblk(vsb, bitmap + i);
+		if (!bh) {
+			ret = -EIO;
+			goto unlock;
+		}
+		lock_buffer(bh);
+		memset(bh->b_data, 0, vsb->s_blocksize);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+
+	header->flags &= ~cpu_to_le64(SIMPLEFS_CBT_PREV_INCOMPLETE);
+	if (le64_to_cpu(header->flags) & SIMPLEFS_CBT_INCOMPLETE || sbi->cbt_missed)
+		header->flags |= cpu_to_le64(SIMPLEFS_CBT_PREV_INCOMPLETE);
+	header->flags &= ~cpu_to_le64(SIMPLEFS_CBT_INCOMPLETE);
+	header->current_bitmap = cpu_to_le64(!le64_to_cpu(header->current_bitmap));
+	le64_add_cpu(&header->epoch, 1);
+	sbi->cbt_missed = false;
+	mark_buffer_dirty(sbi->cbt_bh);
+	ret = sync_dirty_buffer(sbi->cbt_bh);
+
+	__simplefs_cbt_mark(vsb, bitmap, SIMPLEFS_SB(vsb)->journal_block,
+			    SIMPLEFS_SB(vsb)->journal_blocks);
+
+	epoch->epoch = le64_to_cpu(header->epoch);
+	epoch->flags = le64_to_cpu(header->flags) & SIMPLEFS_CBT_PREV_INCOMPLETE ?
+		       SIMPLEFS_CBT_INCOMPLETE : 0;
+unlock:
+	up_write(&sbi->cbt_sem);
+	return ret;
+}
+
+/* SIMPLEFS_IOC_CBT_RANGES */
+static int simplefs_cbt_get_ranges(struct super_block *vsb,
+				   struct simplefs_cbt_ranges *req)
+{
+	struct simplefs_cbt_range __user *out = u64_to_user_ptr(req->ranges);
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(vsb);
+	struct simplefs_cbt_range range = { 0 };
+	struct simplefs_cbt_header *header;
+	unsigned long bits = vsb->s_blocksize * 8, limit, bit, next;
+	u64 end = sbi->sb->blocks_count, bitmap, base, block, filled = 0;
+	u64 epoch, flags;
+	struct buffer_head *bh;
+	int ret = -ENOENT;
+
+	down_read(&sbi->cbt_sem);
+	if (!sbi->cbt_bh)
+		goto unlock;
+
+	header = simplefs_cbt_header(vsb);
+	epoch = le64_to_cpu(header->epoch);
+	flags = le64_to_cpu(header->flags);
+	if (req->epoch == epoch) {
+		bitmap = simplefs_cbt_bitmap(vsb, false);
+		req->flags = flags & SIMPLEFS_CBT_INCOMPLETE ||
+			     READ_ONCE(sbi->cbt_missed) ? SIMPLEFS_CBT_INCOMPLETE : 0;
+	} else if (epoch && req->epoch == epoch - 1) {
+		bitmap = simplefs_cbt_bitmap(vsb, true);
+		req->flags = flags & SIMPLEFS_CBT_PREV_INCOMPLETE ?
+			     SIMPLEFS_CBT_INCOMPLETE : 0;
+	} else {
+		goto unlock;
+	}
+
+	ret = 0;
+	for (block = req->start; block < end && filled < req->count;
+	     block = base + limit) {
+		base = block - block % bits;
+		limit = min_t(u64, bits, end - base);
+		bh = simplefs_bread(vsb, bitmap + base / bits);
+		if (!bh) {
+			ret = -EIO;
+			goto unlock;
+		}
+
+		/* A range that reached the end of the block before goes on
+		 * from the start of this one */
+		for (bit = block - base; bit < limit; bit = next) {
+			if (!range.blocks) {
+				bit = find_next_bit_le(bh->b_data, limit, bit);
+				if (bit >= limit)
+					break;
+				range.start = base + bit;
+			}
+			next = find_next_zero_bit_le(bh->b_data, limit, bit);
+			range.blocks = base + next - range.start;
+			if (next == limit)
+				break;
+
+			if (copy_to_user(&out[filled], &range, sizeof(range))) {
+				brelse(bh);
+				ret = -EFAULT;
+				goto unlock;
+			}
+			range.blocks = 0;
+			if (++filled == req->count)
+				break;
+		}
+		brelse(bh);
+	}
+
+	/* One that goes up to the end of the image */
+	if (range.blocks && filled < req->count) {
+		if (copy_to_user(&out[filled], &range, sizeof(range)))
+			ret = -EFAULT;
+		filled++;
+	}
+	req->count = filled;
+
+unlock:
+	up_read(&sbi->cbt_sem);
+	return ret;
+}
+
+/* Delayed allocation. A file created with it gets no blocks at all (see
+ * simplefs_inode_blocks), and what is written to it is kept in memory.
+ * The inode only points to a run of its whole length once it is written
+ * out: by the writeback of the inode (simplefs_write_inode), by fsync,
+ * or before its blocks are cloned. A file appended to in many small
+ * writes ends up in a single run this way, and one truncated to nothing
+ * before then never takes one.
+ *
+ * What a file has in memory is only counted against the free blocks at
+ * write time (see simplefs_delalloc_claim), which the allocators keep
+ * clear of. Its run is picked when it is written out. That can still
+ * fail when the free blocks are all there but not in one run, and the
+ * contents then stay in memory for the next try.
+ *
+ * A file does not grow beyond its run, so it only grows this way before
+ * it is first written out, up to a group, and as long as all the files
+ * together keep no more than SIMPLEFS_DELALLOC_MAX_BYTES in memory. A
+ * write past that writes it out first, and it grows like any other file
+ * from then on (see simplefs_write_range). */
+
+/* The most all the files of a mount keep in memory together */
+#define SIMPLEFS_DELALLOC_MAX_BYTES (64 << 20)
+
+/* The most a file keeps in memory: a group, the longest run there can
+ * be */
+static size_t simplefs_delalloc_max(struct super_block *sb)
+{
+	return SIMPLEFS_SB(sb)->group_blocks << sb->s_blocksize_bits;
+}
+
+/* Reserve count more blocks for what files with delayed allocation have
+ * in memory, out of the free blocks that are not reserved yet. Like the
+ * free blocks of ext4 for its delayed allocation, two files reserving the
+ * last ones at the same time may both get them. */
+static int simplefs_delalloc_claim(struct super_block *sb, u64 count)
+{
+	if (!simplefs_blocks_available(sb, count))
+		return -ENOSPC;
+	percpu_counter_add(&SIMPLEFS_SB_INFO(sb)->delalloc_blocks, count);
+	return 0;
+}
+
+static void simplefs_delalloc_unclaim(struct super_block *sb, u64 count)
+{
+	percpu_counter_sub(&SIMPLEFS_SB_INFO(sb)->delalloc_blocks, count);
+}
+
+/* Reserve the blocks for the first size bytes of a file with no run yet,
+ * and make room for them in memory. Must be called with the inode
+ * locked. */
+static int simplefs_delalloc_reserve(struct inode *inode, loff_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+	struct simplefs_inode_info *info = SIMPLEFS_INODE_INFO(inode);
+	u64 blocks = DIV_ROUND_UP(size, sb->s_blocksize);
+	size_t capacity;
+	char *buffer;
+	int ret;
+
+	if (size > simplefs_delalloc_max(sb))
+		return -EFBIG;
+
+	/* Twice as much room each time, so that appends do not copy all
+	 * of it over every time */
+	if (size > info->delalloc_capacity) {
+		capacity = max_t(size_t, blocks << sb->s_blocksize_bits,
+				 2 * info->delalloc_capacity);
+		capacity = min_t(size_t, capacity, simplefs_delalloc_max(sb));
+		if (atomic64_add_return(capacity - info->delalloc_capacity,
+					&sbi->delalloc_bytes) > SIMPLEFS_DELALLOC_MAX_BYTES) {
+			atomic64_sub(capacity - info->delalloc_capacity,
+				     &sbi->delalloc_bytes);
+			return -EFBIG;
+		}
+		buffer = kvzalloc(capacity, GFP_KERNEL);
+		if (!buffer) {
+			atomic64_sub(capacity - info->delalloc_capacity,
+				     &sbi->delalloc_bytes);
+			return -ENOMEM;
+		}
+		if (info->delalloc)
+			memcpy(buffer, info->delalloc, i_size_read(inode));
+		kvfree(info->delalloc);
+		info->delalloc = buffer;
+		info->delalloc_capacity = capacity;
+	}
+
+	if (blocks > info->delalloc_blocks) {
+		ret = simplefs_delalloc_claim(sb, blocks - info->delalloc_blocks);
+		if (ret)
+			return ret;
+		info->delalloc_blocks = blocks;
+	}
+	return 0;
+}
+
+/* Forget what a file has in memory beyond its first size bytes, which
+ * must not be more than it has, with the blocks reserved for it. Does
+ * no I/O, for simplefs_destroy_inode. Must be called with the inode
+ * locked, before i_size changes. */
+static void simplefs_delalloc_release(struct inode *inode, loff_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode_info *info = SIMPLEFS_INODE_INFO(inode);
+	u64 blocks = DIV_ROUND_UP(size, sb->s_blocksize);
+
+	if (blocks < info->delalloc_blocks) {
+		simplefs_delalloc_unclaim(sb, info->delalloc_blocks - blocks);
+		info->delalloc_blocks = blocks;
+	}
+
+	if (!size) {
+		kvfree(info->delalloc);
+		atomic64_sub(info->delalloc_capacity,
+			     &SIMPLEFS_SB_INFO(sb)->delalloc_bytes);
+		info->delalloc = NULL;
+		info->delalloc_capacity = 0;
+	} else if (size < i_size_read(inode)) {
+		memset(info->delalloc + size, 0, i_size_read(inode) - size);
+	}
+}
+
+/* Write len bytes at pos of a file with no run yet, into memory. Must be
+ * called with the inode locked. */
+static ssize_t simplefs_delalloc_write(struct inode *inode, loff_t pos, size_t len,
+				       simplefs_fill_t fill, void *data)
+{
+	struct simplefs_inode_info *info = SIMPLEFS_INODE_INFO(inode);
+	loff_t size = max_t(loff_t, i_size_read(inode), pos + len);
+	int ret;
+
+	ret = simplefs_delalloc_reserve(inode, size);
+	if (!ret)
+		ret = fill(info->delalloc + pos, 0, len, data);
+	if (ret) {
+		/* What was filled in past the end must be zeroes again */
+		if (size > i_size_read(inode) && info->delalloc)
+			memset(info->delalloc + i_size_read(inode), 0,
+			       min_t(size_t, size, info->delalloc_capacity) -
+			       i_size_read(inode));
+		simplefs_delalloc_release(inode, i_size_read(inode));
+		return ret;
+	}
+
+	i_size_write(inode, size);
+	/* For simplefs_write_inode to write it out */
+	mark_inode_dirty(inode);
+	return len;
+}
+
+/* Deduplication (-o dedup). When a file with delayed allocation is
+ * written out, the crc32c of its contents is looked up in an index of
+ * the runs written out before it. If one of them still holds the same
+ * contents, the file shares that run as a clone would (see
+ * simplefs_clone), and nothing is written at all. The first write to
+ * any of the files sharing it copies the run (simplefs_unshare).
+ *
+ * The index only knows about runs of blocks, not about the files they
+ * belong to, and keeps one per slot, the last one written out. A slot is
+ * just a hint: the run is compared on the disk with what the file has in
+ * memory before it is shared. For the run to still be what was compared
+ * then, a slot is forgotten before any of its blocks can change: when
+ * they are given back (simplefs_run_release), and before a file that may
+ * own them writes to them in place (simplefs_dedup_forget, from
+ * simplefs_unshare). simplefs_dedup_share only shares a run whose slot
+ * is still there, under simplefs_sb_lock, which such a writer only takes
+ * after that, to find the run shared and copy it instead.
+ *
+ * Images with room for it keep the index in a run of its own across
+ * clean unmounts (see simplefs_dedup_header). */
+
+static struct simplefs_dedup_entry *simplefs_dedup_slot(struct super_block *sb,
+							u32 hash, u64 blocks)
+{
+	return &SIMPLEFS_SB_INFO(sb)->dedup[(hash ^ blocks) &
+					    ((1 << SIMPLEFS_DEDUP_BITS) - 1)];
+}
+
+/* Remember that a file has its contents in the run at start */
+static void simplefs_dedup_add(struct inode *inode, u32 hash, u64 start, u64 blocks)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(inode->i_sb);
+	struct simplefs_dedup_entry *slot = simplefs_dedup_slot(inode->i_sb, hash, blocks);
+
+	spin_lock(&sbi->dedup_lock);
+	slot->start = start;
+	slot->blocks = blocks;
+	slot->hash = hash;
+	spin_unlock(&sbi->dedup_lock);
+}
+
+/* Add a file to the users of the run of a slot, if the slot is still
+ * there, see above */
+static int simplefs_dedup_share(struct super_block *sb,
+				const struct simplefs_dedup_entry *entry)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+	struct simplefs_dedup_entry *slot = simplefs_dedup_slot(sb, entry->hash, entry->blocks);
+	bool there;
+	int ret;
+
+	if (simplefs_lock(sb, &simplefs_sb_lock, SIMPLEFS_LOCK_SB))
+		return -EINTR;
+	spin_lock(&sbi->dedup_lock);
+	there = slot->start == entry->start && slot->blocks == entry->blocks &&
+		slot->hash == entry->hash;
+	spin_unlock(&sbi->dedup_lock);
+	ret = there ? __simplefs_run_share(sb, entry->start, entry->blocks) : -ESTALE;
+	mutex_unlock(&simplefs_sb_lock);
+	return ret;
+}
+
+/* Find a run written out before with the same contents as the first
+ * blocks blocks of what a file with delayed allocation has in memory,
+ * and add the file to its users. Returns whether it did, and the start
+ * of the run. Must be called with the inode locked. */
+static bool simplefs_dedup_find(struct inode *inode, u32 hash, u64 blocks,
+				u64 *start)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+	struct simplefs_dedup_entry entry;
+	struct buffer_head *bh;
+	u64 i;
+
+	spin_lock(&sbi->dedup_lock);
+	entry = *simplefs_dedup_slot(sb, hash, blocks);
+	spin_unlock(&sbi->dedup_lock);
+	if (!entry.start || entry.hash != hash || entry.blocks != blocks)
+		return false;
+
+	/* Whole blocks: beyond the end of the file, the run must hold the
+	 * zeroes this one has in memory too */
+	simplefs_run_readahead(sb, entry.start, blocks);
+	for (i = 0; i < blocks; i++) {
+		bh = simplefs_bread(sb, entry.start + i);
+		if (!bh)
+			return false;
+		if (memcmp(bh->b_data, SIMPLEFS_INODE_INFO(inode)->delalloc +
+			   (i << sb->s_blocksize_bits), sb->s_blocksize)) {
+			brelse(bh);
+			return false;
+		}
+		brelse(bh);
+	}
+
+	/* Failing that, even because the run has too many users or changed
+	 * since, it is written out as usual */
+	if (simplefs_dedup_share(sb, &entry))
+		return false;
+	*start = entry.start;
+	simplefs_stat_add(sb, SIMPLEFS_STAT_BLOCKS_DEDUPLICATED, blocks);
+	return true;
+}
+
+/* At mount, on images with an index: with -o dedup, its slots are taken
+ * in if they are clean. Either way, they are not once the image is
+ * written to, until the index goes out again at unmount. */
+static int simplefs_dedup_load(struct super_block *vsb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(vsb);
+	struct simplefs_super_block *sb = sbi->sb;
+	size_t size = sizeof(struct simplefs_dedup_disk_entry) << SIMPLEFS_DEDUP_BITS;
+	struct simplefs_dedup_disk_entry *disk;
+	struct simplefs_dedup_header *header;
+	struct buffer_head *bh;
+	u64 i, start, blocks;
+	int ret;
+
+	bh = simplefs_bread(vsb, sb->dedup_block);
+	if (!bh)
+		return -EIO;
+
+	header = (struct simplefs_dedup_header *)bh->b_data;
+	if (le64_to_cpu(header->magic) != SIMPLEFS_DEDUP_MAGIC) {
+		printk(KERN_ERR "simplefs: the dedup index header is invalid, run fsck-simplefs\n");
+		brelse(bh);
+		return -EINVAL;
+	}
+
+	/* Slots that point out of where file contents go are left empty */
+	if (sbi->dedup && le64_to_cpu(header->flags) & SIMPLEFS_DEDUP_CLEAN &&
+	    le64_to_cpu(header->entries) == 1 << SIMPLEFS_DEDUP_BITS) {
+		disk = kvmalloc(size, GFP_KERNEL);
+		if (disk && !simplefs_run_read(vsb, sb->dedup_block + 1, 0, disk, size)) {
+			for (i = 0; i < 1 << SIMPLEFS_DEDUP_BITS; i++) {
+				start = le64_to_cpu(disk[i].start);
+				blocks = le32_to_cpu(disk[i].blocks);
+				if (start < simplefs_sb_file_block(sb) ||
+				    start + blocks > simplefs_sb_file_end(sb))
+					continue;
+				sbi->dedup[i].start = start;
+				sbi->dedup[i].blocks = blocks;
+				sbi->dedup[i].hash = le32_to_cpu(disk[i].hash);
+			}
+		}
+		kvfree(disk);
+	}
+
+	/* Also on read-only mounts, like changed block tracking */
+	if (!bdev_read_only(vsb->s_bdev)) {
+		header->flags &= ~cpu_to_le64(SIMPLEFS_DEDUP_CLEAN);
+		mark_buffer_dirty(bh);
+		ret = sync_dirty_buffer(bh);
+		if (ret) {
+			brelse(bh);
+			return ret;
+		}
+	}
+
+	sbi->dedup_bh = bh;
+	return 0;
+}
+
+/* Give the image a run for the index, the first time it is mounted with
+ * -o dedup */
+static int simplefs_dedup_enable(struct super_block *vsb)
+{
+	struct simplefs_super_block *sb = SIMPLEFS_SB(vsb);
+	struct simplefs_dedup_header *header;
+	struct buffer_head *bh;
+	u64 blocks = simplefs_dedup_blocks(sb), start, i;
+	int ret;
+
+	ret = simplefs_sb_get_a_freerun(vsb, blocks, &start);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < blocks; i++) {
+		bh = simplefs_getblk(vsb, start + i);
+		if (!bh)
+			return -EIO;
+		lock_buffer(bh);
+		memset(bh->b_data, 0, vsb->s_blocksize);
+		if (!i) {
+			header = (struct simplefs_dedup_header *)bh->b_data;
+			header->magic = cpu_to_le64(SIMPLEFS_DEDUP_MAGIC);
+			header->entries = cpu_to_le64(1 << SIMPLEFS_DEDUP_BITS);
+		}
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+	ret = simplefs_run_sync(vsb, start, blocks);
+	if (ret)
+		return ret;
+
+	if (simplefs_lock(vsb, &simplefs_sb_lock, SIMPLEFS_LOCK_SB))
+		return -EINTR;
+	sb->dedup_block = start;
+	sb->feature_ro_compat |= SIMPLEFS_FEATURE_RO_COMPAT_DEDUP;
+	simplefs_sb_sync(vsb);
+	mutex_unlock(&simplefs_sb_lock);
+
+	return simplefs_dedup_load(vsb);
+}
+
+/* At unmount, once no file is left to change the runs of the slots: with
+ * -o dedup, the slots go out, and the header is marked clean after
+ * them */
+static void simplefs_dedup_unload(struct super_block *vsb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(vsb);
+	size_t size = sizeof(struct simplefs_dedup_disk_entry) << SIMPLEFS_DEDUP_BITS;
+	struct simplefs_dedup_disk_entry *disk;
+	struct simplefs_dedup_header *header;
+	u64 i;
+
+	if (!sbi->dedup_bh)
+		return;
+
+	disk = sbi->dedup && !bdev_read_only(vsb->s_bdev) ?
+	       kvmalloc(size, GFP_KERNEL) : NULL;
+	if (disk) {
+		for (i = 0; i < 1 << SIMPLEFS_DEDUP_BITS; i++) {
+			disk[i].start = cpu_to_le64(sbi->dedup[i].start);
+			disk[i].blocks = cpu_to_le32(sbi->dedup[i].blocks);
+			disk[i].hash = cpu_to_le32(sbi->dedup[i].hash);
+		}
+		header = (struct simplefs_dedup_header *)sbi->dedup_bh->b_data;
+		if (!simplefs_run_write(vsb, NULL, sbi->sb->dedup_block + 1, 0, disk, size) &&
+		    !simplefs_run_sync(vsb, sbi->sb->dedup_block + 1,
+				       simplefs_dedup_blocks(sbi->sb) - 1)) {
+			header->flags |= cpu_to_le64(SIMPLEFS_DEDUP_CLEAN);
+			mark_buffer_dirty(sbi->dedup_bh);
+			sync_dirty_buffer(sbi->dedup_bh);
+		}
+		kvfree(disk);
+	}
+
+	brelse(sbi->dedup_bh);
+	sbi->dedup_bh = NULL;
+}
+
+/* Write the contents of a file written to with delayed allocation out to
+ * a run taken for them out of the blocks reserved, and point the inode
+ * to it. Does nothing for other files. Like simplefs_run_move, the inode
+ * only points to the run once all of it is on the disk. On failure, the
+ * contents stay in memory, with the blocks reserved for them, for the
+ * next try. With -o dedup, the file may share the run of another one
+ * instead, see simplefs_dedup_find. Must be called with the inode
+ * locked. */
+static int simplefs_delalloc_flush(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode_info *info = SIMPLEFS_INODE_INFO(inode);
+	struct simplefs_inode *sfs_inode = &info->disk;
+	struct simplefs_super_block *sfs_sb = SIMPLEFS_SB(sb);
+	u64 blocks = info->delalloc_blocks, start = 0;
+	u64 end = sfs_sb->meta_block ? sfs_sb->meta_block : U64_MAX;
+	bool dedup = SIMPLEFS_SB_INFO(sb)->dedup != NULL, shared = false;
+	u32 hash = 0;
+	int ret;
+
+	if (!blocks)
+		return 0;
+
+	if (dedup) {
+		hash = simplefs_crc32c(~0U, info->delalloc,
+				       blocks << sb->s_blocksize_bits);
+		shared = simplefs_dedup_find(inode, hash, blocks, &start);
+	}
+
+	if (!shared) {
+		ret = __simplefs_sb_get_a_freerun_in(sb, blocks, 0, end, blocks, &start);
+		if (ret)
+			goto out;
+		ret = simplefs_run_write(sb, NULL, start, 0, info->delalloc,
+					 blocks << sb->s_blocksize_bits);
+		if (!ret)
+			ret = simplefs_run_sync(sb, start, blocks);
+		if (ret)
+			goto release;
+	}
+
+	if (simplefs_lock(sb, &simplefs_inodes_mgmt_lock, SIMPLEFS_LOCK_INODES)) {
+		ret = -EINTR;
+		goto release;
+	}
+	sfs_inode->data_block_number = start;
+	sfs_inode->file_size = i_size_read(inode);
+	simplefs_inode_set_times(inode);
+	ret = simplefs_inode_save(sb, sfs_inode);
+	if (ret) {
+		sfs_inode->data_block_number = 0;
+		sfs_inode->file_size = 0;
+	}
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	if (ret)
+		goto release;
+
+	/* The blocks reserved for the file are its run now, unless it
+	 * shares another, which leaves them to the others. Either way, a
+	 * slot of the index points to its run. */
+	if (!shared)
+		info->delalloc_blocks = 0;
+	simplefs_delalloc_release(inode, 0);
+	if (dedup && !shared)
+		simplefs_dedup_add(inode, hash, start, blocks);
+	info->dedup_unlisted = false;
+	goto out;
+
+release:
+	/* The reference simplefs_dedup_find took goes, or the run taken for
+	 * the file, which is reserved for it again for the next try */
+	simplefs_run_release(sb, start, blocks);
+	if (!shared)
+		percpu_counter_add(&SIMPLEFS_SB_INFO(sb)->delalloc_blocks, blocks);
+out:
+	trace_simplefs_delalloc_flush(inode, start, blocks, ret);
+	return ret;
+}
+
+/* Everything simplefs_compress_update works with, a cluster each for
+ * the contents and the compressed data that is read back, the LZ4 work
+ * area and the newly compressed clusters */
+struct simplefs_compress_buf {
+	char raw[SIMPLEFS_COMPRESS_CLUSTER_SIZE];
+	char tmp[SIMPLEFS_COMPRESS_CLUSTER_SIZE];
+	char wrkmem[LZ4_MEM_COMPRESS];
+	char out[SIMPLEFS_COMPRESS_MAX_CLUSTERS][SIMPLEFS_COMPRESS_CLUSTER_SIZE];
+};
+
+/* Pack a compressed file into a new run, laid out by
+ * simplefs_compress_layout. The clusters that were not rewritten are
+ * copied over as they are. */
+static int simplefs_compress_repack(struct inode *inode,
+				    struct simplefs_compress_cluster *table,
+				    uint64_t clusters, uint64_t first, uint64_t count,
+				    struct simplefs_compress_buf *buf, uint64_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct simplefs_compress_header header = { .size = cpu_to_le64(size) };
+	struct simplefs_compress_cluster *old;
+	uint64_t start = sfs_inode->data_block_number, new, blocks, i;
+	uint64_t old_blocks = simplefs_inode_blocks(sfs_inode, sb->s_blocksize);
+	uint64_t old_size = sfs_inode->file_size;
+	int ret;
+
+	old = kvmalloc_array(clusters ? clusters : 1, sizeof(*old), GFP_KERNEL);
+	if (!old)
+		return -ENOMEM;
+	memcpy(old, table, clusters * sizeof(*old));
+
+	blocks = simplefs_compress_layout(table, clusters, sb->s_blocksize);
+	ret = simplefs_sb_get_a_freerun(sb, blocks, &new);
+	if (ret)
+		goto out;
+
+	ret = simplefs_run_write(sb, NULL, new, 0, &header, sizeof(header));
+	if (!ret) {
+		simplefs_compress_table_store(table, clusters);
+		ret = simplefs_run_write(sb, NULL, new, sizeof(header), table,
+					 clusters * sizeof(*table));
+		simplefs_compress_table_load(table, clusters);
+	}
+	for (i = 0; i < clusters && !ret; i++) {
+		if (i >= first && i < first + count) {
+			ret = simplefs_run_write(sb, NULL, new, table[i].offset,
+						 buf->out[i - first], table[i].length);
+			continue;
+		}
+		ret = simplefs_run_read(sb, start, old[i].offset, buf->tmp, old[i].length);
+		if (!ret)
+			ret = simplefs_run_write(sb, NULL, new, table[i].offset,
+						 buf->tmp, table[i].length);
+	}
+	if (!ret)
+		ret = simplefs_run_sync(sb, new, blocks);
+	if (ret)
+		goto release;
+
+	if (simplefs_lock(sb, &simplefs_inodes_mgmt_lock, SIMPLEFS_LOCK_INODES)) {
+		ret = -EINTR;
+		goto release;
+	}
+	sfs_inode->data_block_number = new;
+	sfs_inode->file_size = blocks << sb->s_blocksize_bits;
+	ret = simplefs_inode_save(sb, sfs_inode);
+	if (ret) {
+		sfs_inode->data_block_number = start;
+		sfs_inode->file_size = old_size;
+	}
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	if (ret)
+		goto release;
+
+	ret = simplefs_run_release(sb, start, old_blocks);
+	goto out;
+
+release:
+	simplefs_run_release(sb, new, blocks);
+out:
+	kvfree(old);
+	return ret;
+}
+
+/* Write the clusters from first on, and the header, where they were */
+static int simplefs_compress_write_in_place(struct inode *inode,
+					    struct simplefs_compress_cluster *table,
+					    uint64_t first, uint64_t count,
+					    struct simplefs_compress_buf *buf, uint64_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct simplefs_compress_header header = { .size = cpu_to_le64(size) };
+	uint64_t start, credits, i;
+	handle_t *handle;
+	int ret, err;
+	u64 clock;
+
+	ret = simplefs_unshare(inode, 0,
+			       simplefs_inode_blocks(sfs_inode, sb->s_blocksize) - 1);
+	if (ret)
+		return ret;
+	start = sfs_inode->data_block_number;
+
+	/* A block for the header, and the blocks of the table entries and
+	 * of the clusters that get written */
+	credits = 1;
+	if (count) {
+		credits += (simplefs_compress_table_size(first + count) - 1) / sb->s_blocksize -
+			   simplefs_compress_table_size(first) / sb->s_blocksize + 1;
+		credits += (table[first + count - 1].offset +
+			    table[first + count - 1].length - 1) / sb->s_blocksize -
+			   table[first].offset / sb->s_blocksize + 1;
+	}
+
+	clock = simplefs_trace_clock(simplefs_journal_stop);
+	trace_simplefs_journal_start(inode, credits);
+	handle = jbd2_journal_start(SIMPLEFS_SB_INFO(sb)->journal, credits);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	simplefs_stat_inc(sb, SIMPLEFS_STAT_JOURNAL_HANDLES);
+
+	ret = simplefs_run_write(sb, handle, start, 0, &header, sizeof(header));
+	if (!ret && count) {
+		simplefs_compress_table_store(table + first, count);
+		ret = simplefs_run_write(sb, handle, start,
+					 simplefs_compress_table_size(first),
+					 table + first, count * sizeof(*table));
+		simplefs_compress_table_load(table + first, count);
+	}
+	for (i = 0; i < count && !ret; i++)
+		ret = simplefs_run_write(sb, handle, start, table[first + i].offset,
+					 buf->out[i], table[first + i].length);
+	WARN_ON(ret);
+
+	if (!ret)
+		handle->h_sync = 1;
+	err = jbd2_journal_stop(handle);
+	trace_simplefs_journal_stop(inode, ret ? ret : err, clock);
+	return ret ? ret : err;
+}
+
+/* Compressed files are rewritten a cluster at a time. The clusters a
+ * change touches are read back and decompressed, changed, and compressed
+ * again. If they still fit where they were, they are written in place,
+ * in a single journal handle. If not, the whole file moves to a new run.
+ *
+ * Writes len bytes at pos, from what fill puts in each cluster, and
+ * makes the file size bytes long. No more than
+ * SIMPLEFS_COMPRESS_MAX_CLUSTERS clusters may change, counting those
+ * the file grows by. The whole cluster table is read each time, which
+ * is 16 bytes for each cluster of the file. Must be called with the
+ * inode locked. */
+static int simplefs_compress_update(struct inode *inode, loff_t pos, size_t len,
+				    loff_t size, simplefs_fill_t fill, void *data)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct simplefs_compress_cluster *table;
+	struct simplefs_compress_buf *buf;
+	loff_t old_size = i_size_read(inode), from, to;
+	uint64_t old_clusters = simplefs_compress_clusters(old_size);
+	uint64_t clusters = simplefs_compress_clusters(size);
+	uint64_t first = clusters, last = 0, count, i, start, run_bytes, blocks;
+	size_t olen, clen;
+	int ret, clength, moved = 0;
+
+	if (len) {
+		first = pos / SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+		last = (pos + len - 1) / SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+	}
+	/* The cluster the file ends in changes length, and so does
+	 * everything it grows by */
+	i = min(old_size, size) / SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+	if (size != old_size && i < clusters) {
+		first = min(first, i);
+		last = max(last, clusters - 1);
+	}
+	count = first < clusters ? last - first + 1 : 0;
+	if (WARN_ON(count > SIMPLEFS_COMPRESS_MAX_CLUSTERS))
+		return -EINVAL;
+
+	start = sfs_inode->data_block_number;
+	run_bytes = simplefs_inode_blocks(sfs_inode, sb->s_blocksize) << sb->s_blocksize_bits;
+
+	buf = kvmalloc(sizeof(*buf), GFP_KERNEL);
+	table = kvmalloc_array(max3(old_clusters, clusters, 1ULL), sizeof(*table),
+			       GFP_KERNEL);
+	if (!buf || !table) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = simplefs_run_read(sb, start, sizeof(struct simplefs_compress_header),
+				table, old_clusters * sizeof(*table));
+	if (ret)
+		goto out;
+	simplefs_compress_table_load(table, old_clusters);
+
+	for (i = 0; i < count; i++) {
+		from = (first + i) * SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+		olen = from < old_size ? min_t(loff_t, old_size - from,
+					       SIMPLEFS_COMPRESS_CLUSTER_SIZE) : 0;
+		clen = min_t(loff_t, size - from, SIMPLEFS_COMPRESS_CLUSTER_SIZE);
+
+		if (olen) {
+			ret = simplefs_compress_cluster_read(sb, start, &table[first + i],
+							     buf->raw, olen, buf->tmp);
+			if (ret)
+				goto out;
+		}
+		if (clen > olen)
+			memset(buf->raw + olen, 0, clen - olen);
+
+		to = min_t(loff_t, pos + len, from + clen);
+		if (len && max(pos, from) < to) {
+			ret = fill(buf->raw + max(pos, from) - from,
+				   max(pos, from) - pos, to - max(pos, from), data);
+			if (ret)
+				goto out;
+		}
+
+		/* Kept as it is unless it gets smaller */
+		clength = LZ4_compress_default(buf->raw, buf->out[i], clen, clen - 1,
+					       buf->wrkmem);
+		if (clength <= 0) {
+			memcpy(buf->out[i], buf->raw, clen);
+			clength = clen;
+		}
+		table[first + i].length = clength;
+	}
+
+	if (simplefs_compress_fit(table, old_clusters, clusters, first, run_bytes)) {
+		ret = simplefs_compress_write_in_place(inode, table, first, count,
+						       buf, size);
+	} else {
+		ret = simplefs_compress_repack(inode, table, clusters, first, count,
+					       buf, size);
+		moved = 1;
+	}
+	if (ret)
+		goto out;
+	i_size_write(inode, size);
+
+	/* Give up what a truncation left unused at the end of the run */
+	blocks = simplefs_compress_used_blocks(table, clusters, sb->s_blocksize);
+	start = sfs_inode->data_block_number;
+	i = simplefs_inode_blocks(sfs_inode, sb->s_blocksize);
+	if (size < old_size && blocks < i) {
+		if (simplefs_lock(sb, &simplefs_inodes_mgmt_lock, SIMPLEFS_LOCK_INODES)) {
+			ret = -EINTR;
+			goto out;
+		}
+		sfs_inode->file_size = blocks << sb->s_blocksize_bits;
+		ret = simplefs_inode_save(sb, sfs_inode);
+		mutex_unlock(&simplefs_inodes_mgmt_lock);
+		if (!ret)
+			ret = simplefs_run_release(sb, start + blocks, i - blocks);
+	}
+out:
+	trace_simplefs_compress(inode, first, count, moved, ret);
+	kvfree(table);
+	kvfree(buf);
+	return ret;
+}
+
+/* Fill a compressed file with zeroes from its end up to size, a few
+ * clusters at a time */
+static int simplefs_compress_extend(struct inode *inode, loff_t size)
+{
+	loff_t step;
+	int ret = 0;
+
+	while (!ret && i_size_read(inode) < size) {
+		step = round_down(i_size_read(inode), SIMPLEFS_COMPRESS_CLUSTER_SIZE) +
+		       SIMPLEFS_COMPRESS_MAX_CLUSTERS * SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+		ret = simplefs_compress_update(inode, 0, 0, min(size, step), NULL, NULL);
+	}
+	return ret;
+}
+
+static ssize_t simplefs_compress_write(struct inode *inode, loff_t pos, size_t len,
+				       simplefs_fill_t fill, void *data)
+{
+	int ret;
+
+	ret = simplefs_compress_extend(inode, pos);
+	if (ret)
+		return ret;
+
+	len = min_t(size_t, len, SIMPLEFS_COMPRESS_MAX_CLUSTERS * SIMPLEFS_COMPRESS_CLUSTER_SIZE -
+				 pos % SIMPLEFS_COMPRESS_CLUSTER_SIZE);
+	ret = simplefs_compress_update(inode, pos, len,
+				       max_t(loff_t, i_size_read(inode), pos + len),
+				       fill, data);
+	return ret ? ret : len;
+}
+
+static int simplefs_compress_truncate(struct inode *inode, loff_t size)
+{
+	if (size > i_size_read(inode))
+		return simplefs_compress_extend(inode, size);
+	return simplefs_compress_update(inode, 0, 0, size, NULL, NULL);
+}
+
+/* Turn the single block of a new or empty file into an empty compressed
+ * file. The inode is saved by the caller. */
+static int simplefs_compress_init(struct super_block *sb,
+				  struct simplefs_inode *sfs_inode)
+{
+	struct simplefs_compress_header header = { 0 };
+	int ret;
+
+	ret = simplefs_run_write(sb, NULL, sfs_inode->data_block_number, 0,
+				 &header, sizeof(header));
+	if (!ret)
+		ret = simplefs_run_sync(sb, sfs_inode->data_block_number, 1);
+	if (!ret)
+		sfs_inode->file_size = sb->s_blocksize;
+	return ret;
+}
+
+/* FS_COMPR_FL, from chattr +c and -c. A directory passes it on to what
+ * is created in it from then on. A file only takes it, or gives it up,
+ * while it is empty. Must be called with the inode locked. */
+static int simplefs_set_compressed(struct inode *inode, int compressed)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	uint64_t old_size = sfs_inode->file_size, blocks;
+	uint64_t old_start = sfs_inode->data_block_number;
+	mode_t old_mode = sfs_inode->mode;
+	int ret = 0;
+
+	if (!(old_mode & SIMPLEFS_INODE_COMPRESSED) == !compressed)
+		return 0;
+	if (compressed) {
+		ret = simplefs_sb_feature_set(sb, &SIMPLEFS_SB(sb)->feature_incompat,
+					      SIMPLEFS_FEATURE_INCOMPAT_COMPRESS);
+		if (ret)
+			return ret;
+	}
+
+	blocks = simplefs_inode_blocks(sfs_inode, sb->s_blocksize);
+	if (S_ISREG(old_mode)) {
+		if (i_size_read(inode))
+			return -EINVAL;
+		/* An empty file created with delayed allocation has no
+		 * block for the header yet */
+		if (compressed && !old_start)
+			ret = simplefs_sb_get_a_freeblock(sb, &sfs_inode->data_block_number);
+		if (!ret && compressed)
+			ret = simplefs_compress_init(sb, sfs_inode);
+		else if (!ret)
+			sfs_inode->file_size = 0;
+		if (ret)
+			goto undo;
+	}
+
+	if (simplefs_lock(sb, &simplefs_inodes_mgmt_lock, SIMPLEFS_LOCK_INODES)) {
+		ret = -EINTR;
+		goto undo;
+	}
+	sfs_inode->mode ^= SIMPLEFS_INODE_COMPRESSED;
+	/* An empty sparse file has no run, and gets one like the above */
+	sfs_inode->mode &= ~SIMPLEFS_INODE_SPARSE;
+	ret = simplefs_inode_save(sb, sfs_inode);
+	if (ret)
+		sfs_inode->mode = old_mode;
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	if (ret)
+		goto undo;
+
+	/* An empty compressed file may still have a longer run */
+	if (S_ISREG(old_mode) && blocks > 1)
+		ret = simplefs_run_release(sb, sfs_inode->data_block_number + 1,
+					   blocks - 1);
+	return ret;
+
+undo:
+	sfs_inode->file_size = old_size;
+	if (sfs_inode->data_block_number != old_start) {
+		simplefs_run_release(sb, sfs_inode->data_block_number, 1);
+		sfs_inode->data_block_number = old_start;
+	}
+	return ret;
+}
+
+/* A directory has a run just long enough for its records (see
+ * simplefs_inode_blocks). One that has no room for more of them moves to
+ * a longer run, with its records copied over, as simplefs_run_move does
+ * for files. The new records are written there, and the inode only
+ * points to it once it is saved with their count too, see
+ * simplefs_dir_children_add. *start is where the run of the directory
+ * is to be, which is where it is when the records fit. Must be called
+ * with simplefs_directory_children_update_lock held. */
+static int simplefs_dir_grow(struct super_block *sb, struct simplefs_inode *dir,
+			     uint64_t more, uint64_t *start)
+{
+	uint64_t per_block = simplefs_dir_records_per_block(sb->s_blocksize);
+	uint64_t old_blocks = simplefs_inode_blocks(dir, sb->s_blocksize);
+	uint64_t blocks = DIV_ROUND_UP(dir->dir_children_count + more, per_block);
+	struct buffer_head *from, *to;
+	uint64_t i;
+	int ret;
+
+	*start = dir->data_block_number;
+	if (blocks <= old_blocks)
+		return 0;
+	if (blocks > SIMPLEFS_SB(sb)->group_blocks)
+		return -ENOSPC;
+
+	ret = simplefs_sb_get_a_dirrun(sb, blocks, start);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < blocks; i++) {
+		from = NULL;
+		if (i * per_block < dir->dir_children_count) {
+			from = simplefs_bread(sb, dir->data_block_number + i);
+			ret = from ? simplefs_block_verify(sb, from) : -EIO;
+			if (ret) {
+				brelse(from);
+				goto release;
+			}
+		}
+		to = simplefs_getblk(sb, *start + i);
+		if (!to) {
+			brelse(from);
+			ret = -EIO;
+			goto release;
+		}
+
+		lock_buffer(to);
+		if (from)
+			memcpy(to->b_data, from->b_data, sb->s_blocksize);
+		else
+			memset(to->b_data, 0, sb->s_blocksize);
+		set_buffer_uptodate(to);
+		unlock_buffer(to);
+		simplefs_mark_buffer_dirty(sb, to);
+		brelse(to);
+		brelse(from);
+	}
+
+	ret = simplefs_run_sync(sb, *start, blocks);
+	if (!ret)
+		return 0;
+
+release:
+	simplefs_run_release(sb, *start, blocks);
+	*start = dir->data_block_number;
+	return ret;
+}
+
+/* Give back the run simplefs_dir_grow took for more records of a
+ * directory, when they could not be added after all */
+static void simplefs_dir_grow_undo(struct super_block *sb,
+				   const struct simplefs_inode *dir, uint64_t more,
+				   uint64_t start)
+{
+	uint64_t per_block = simplefs_dir_records_per_block(sb->s_blocksize);
+
+	if (start != dir->data_block_number)
+		simplefs_run_release(sb, start,
+				     DIV_ROUND_UP(dir->dir_children_count + more,
+						  per_block));
+}
+
+/* Count more records, written to the run at start, in a directory, and
+ * give back the run it had, if that was another one. On failure, the
+ * new run is given back instead. */
+static int simplefs_dir_children_add(struct super_block *sb,
+				     struct simplefs_inode *dir, uint64_t more,
+				     uint64_t start)
+{
+	struct simplefs_inode saved = *dir;
+	int ret;
+
+	if (simplefs_lock(sb, &simplefs_inodes_mgmt_lock, SIMPLEFS_LOCK_INODES)) {
+		sfs_trace("Failed to acquire mutex lock\n");
+		simplefs_dir_grow_undo(sb, dir, more, start);
+		return -EINTR;
+	}
+	dir->dir_children_count += more;
+	dir->data_block_number = start;
+	ret = simplefs_inode_save(sb, dir);
+	if (ret)
+		*dir = saved;
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+
+	if (ret)
+		simplefs_dir_grow_undo(sb, dir, more, start);
+	else if (start != saved.data_block_number)
+		simplefs_run_release(sb, saved.data_block_number,
+				     simplefs_inode_blocks(&saved, sb->s_blocksize));
+	return ret;
+}
+
+/* SIMPLEFS_IOC_BULK_CREATE goes through the files a chunk at a time.
+ * For each chunk it keeps the entries, their names, how many blocks each
+ * takes and their inodes, a block of contents on its way from userspace,
+ * and a table of the names, open addressed with twice as many slots as
+ * there are names, to find those given twice or already in the
+ * directory. */
+#define SIMPLEFS_BULK_CHUNK 256
+#define SIMPLEFS_BULK_SLOTS (2 * SIMPLEFS_BULK_CHUNK)
+
+struct simplefs_bulk_buf {
+	struct simplefs_bulk_entry entries[SIMPLEFS_BULK_CHUNK];
+	char names[SIMPLEFS_BULK_CHUNK][SIMPLEFS_FILENAME_MAXLEN];
+	size_t lens[SIMPLEFS_BULK_CHUNK];
+	uint64_t blocks[SIMPLEFS_BULK_CHUNK];
+	struct simplefs_inode inodes[SIMPLEFS_BULK_CHUNK];
+	char block[SIMPLEFS_MAX_BLOCK_SIZE];
+	s16 slots[SIMPLEFS_BULK_SLOTS];
+};
+
+/* The slot of the table holding a name, or the empty one it goes in */
+static s16 *simplefs_bulk_slot(struct simplefs_bulk_buf *buf, const char *name,
+			       size_t len)
+{
+	u32 i = simplefs_crc32c(~0U, name, len);
+	s16 *slot;
+
+	for (;; i++) {
+		slot = &buf->slots[i & (SIMPLEFS_BULK_SLOTS - 1)];
+		if (*slot < 0 || (buf->lens[*slot] == len &&
+				  !memcmp(buf->names[*slot], name, len)))
+			return slot;
+	}
+}
+
+/* Read the next chunk of the entries in: as many as there are, up to a
+ * chunk, and as long as their contents fit in a group together. Returns
+ * how many, with the blocks they take in *total, or an error. */
+static int simplefs_bulk_load(struct super_block *sb, struct simplefs_bulk_buf *buf,
+			      const struct simplefs_bulk_entry __user *entries,
+			      uint64_t count, uint64_t *total)
+{
+	uint64_t group_blocks = SIMPLEFS_SB(sb)->group_blocks, blocks, n, i;
+	struct simplefs_bulk_entry *entry;
+	char *name;
+	s16 *slot;
+	long len;
+
+	n = min_t(uint64_t, count, SIMPLEFS_BULK_CHUNK);
+	if (copy_from_user(buf->entries, entries, n * sizeof(*entries)))
+		return -EFAULT;
+
+	memset(buf->slots, 0xff, sizeof(buf->slots));
+	*total = 0;
+	for (i = 0; i < n; i++) {
+		entry = &buf->entries[i];
+		name = buf->names[i];
+
+		if ((entry->mode & S_IFMT && !S_ISREG(entry->mode)) || entry->reserved)
+			return -EINVAL;
+		if (entry->size > group_blocks << sb->s_blocksize_bits)
+			return -EFBIG;
+
+		/* The name is stored NUL terminated in the directory record */
+		len = strncpy_from_user(name, u64_to_user_ptr(entry->name),
+					SIMPLEFS_FILENAME_MAXLEN);
+		if (len < 0)
+			return len;
+		if (len >= SIMPLEFS_FILENAME_MAXLEN)
+			return -ENAMETOOLONG;
+		if (!len || memchr(name, '/', len))
+			return -EINVAL;
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			return -EEXIST;
+
+		/* As simplefs_create_fs_object gives them */
+		blocks = DIV_ROUND_UP(entry->size, sb->s_blocksize);
+		if (!blocks && !SIMPLEFS_SB_INFO(sb)->delalloc)
+			blocks = 1;
+		if (*total + blocks > group_blocks)
+			break;
+
+		slot = simplefs_bulk_slot(buf, name, len);
+		if (*slot >= 0)
+			return -EEXIST;
+		*slot = i;
+		buf->lens[i] = len;
+		buf->blocks[i] = blocks;
+		*total += blocks;
+	}
+	return i;
+}
+
+/* Whether a name of the chunk is in the directory already. Must be
+ * called with simplefs_directory_children_update_lock held. */
+static int simplefs_bulk_check(struct inode *dir, struct simplefs_bulk_buf *buf)
+{
+	struct simplefs_inode *sfs_dir = SIMPLEFS_INODE(dir);
+	struct super_block *sb = dir->i_sb;
+	struct buffer_head *bh = NULL;
+	struct simplefs_dir_record *record = NULL;
+	uint64_t per_block = simplefs_dir_records_per_block(sb->s_blocksize), i;
+	int ret = 0;
+
+	if (sfs_dir->dir_children_count)
+		simplefs_run_readahead(sb, sfs_dir->data_block_number,
+				       DIV_ROUND_UP(sfs_dir->dir_children_count, per_block));
+
+	for (i = 0; i < sfs_dir->dir_children_count && !ret; i++, record++) {
+		if (i % per_block == 0) {
+			brelse(bh);
+			bh = simplefs_bread(sb, sfs_dir->data_block_number + i / per_block);
+			if (!bh)
+				return -EIO;
+			ret = simplefs_block_verify(sb, bh);
+			record = (struct simplefs_dir_record *)bh->b_data;
+		}
+		if (!ret && *simplefs_bulk_slot(buf, record->filename,
+						strnlen(record->filename,
+							SIMPLEFS_FILENAME_MAXLEN)) >= 0)
+			ret = -EEXIST;
+	}
+	brelse(bh);
+	return ret;
+}
+
+/* Write the contents of a file of the chunk into its run, from userspace
+ * a block at a time. The blocks are only marked dirty, for
+ * simplefs_run_sync to write them all out together. */
+static int simplefs_bulk_write(struct super_block *sb, struct simplefs_bulk_buf *buf,
+			       const struct simplefs_bulk_entry *entry, uint64_t start)
+{
+	const char __user *data = u64_to_user_ptr(entry->data);
+	size_t pos, nbytes;
+	int ret = 0;
+
+	for (pos = 0; pos < entry->size && !ret; pos += nbytes) {
+		nbytes = min_t(size_t, entry->size - pos, sb->s_blocksize);
+		if (copy_from_user(buf->block, data + pos, nbytes))
+			return -EFAULT;
+		ret = simplefs_run_write(sb, NULL, start, pos, buf->block, nbytes);
+	}
+	return ret;
+}
+
+/* Append the records of the files of the chunk to the run of the
+ * directory at start (see simplefs_dir_grow), and count them in its
+ * inode. Every block of the directory they go in is written once. Must
+ * be called with simplefs_directory_children_update_lock held. */
+static int simplefs_bulk_link(struct inode *dir, struct simplefs_bulk_buf *buf,
+			      uint64_t n, uint64_t start)
+{
+	struct simplefs_inode *sfs_dir = SIMPLEFS_INODE(dir);
+	struct simplefs_inode grown = *sfs_dir;
+	struct super_block *sb = dir->i_sb;
+	struct buffer_head *bh = NULL;
+	uint64_t block, offset, i, first = 0;
+	int ret = 0;
+
+	grown.data_block_number = start;
+	for (i = 0; i < n; i++) {
+		simplefs_dir_record_locate(SIMPLEFS_SB(sb), &grown,
+					   sfs_dir->dir_children_count + i,
+					   &block, &offset);
+		if (!i)
+			first = block;
+		/* Sent together with the others, below */
+		if (bh && simplefs_bh_block(sb, bh) != block) {
+			lock_buffer(bh);
+			simplefs_block_csum_update(sb, bh);
+			unlock_buffer(bh);
+			simplefs_mark_buffer_dirty(sb, bh);
+			brelse(bh);
+			bh = NULL;
+		}
+		if (!bh) {
+			bh = simplefs_bread(sb, block);
+			if (!bh) {
+				ret = -EIO;
+				goto undo;
+			}
+			/* A block without records yet has nothing to check */
+			ret = offset ? simplefs_block_verify(sb, bh) : 0;
+			if (ret) {
+				brelse(bh);
+				goto undo;
+			}
+		}
+
+		lock_buffer(bh);
+		simplefs_dir_record_init((struct simplefs_dir_record *)(bh->b_data + offset),
+					 buf->names[i], buf->lens[i],
+					 buf->inodes[i].inode_no);
+		unlock_buffer(bh);
+	}
+	if (bh) {
+		lock_buffer(bh);
+		simplefs_block_csum_update(sb, bh);
+		unlock_buffer(bh);
+		simplefs_mark_buffer_dirty(sb, bh);
+		brelse(bh);
+	}
+	/* The records go in the run of the directory, from the first
+	 * block written to the last */
+	if (n) {
+		ret = simplefs_run_sync(sb, first, block - first + 1);
+		if (ret)
+			goto undo;
+	}
+
+	return simplefs_dir_children_add(sb, sfs_dir, n, start);
+
+undo:
+	simplefs_dir_grow_undo(sb, sfs_dir, n, start);
+	return ret;
+}
+
+/* Make the next chunk of the files of SIMPLEFS_IOC_BULK_CREATE, in the
+ * order of simplefs_create_fs_object, a step at a time for all of them:
+ * a single run of blocks for all their contents, written out together,
+ * then their inodes, then their directory records and the directory
+ * inode. A crash in between leaves blocks and inodes that no directory
+ * points to, which fsck-simplefs gives back. Returns how many files it
+ * made, or an error. Must be called with the directory locked. */
+static int simplefs_bulk_chunk(struct inode *dir, struct simplefs_bulk_buf *buf,
+			       const struct simplefs_bulk_entry __user *entries,
+			       uint64_t count)
 {
-	/* After the commit dd37978c5 in the upstream linux kernel,
-	 * we can use just filp->f_inode instead of the
-	 * f->f_path.dentry->d_inode redirection */
-	struct inode *inode;
-	struct simplefs_inode *sfs_inode;
-	struct buffer_head *bh;
-	struct super_block *sb;
-	struct simplefs_super_block *sfs_sb;
-	handle_t *handle;
+	struct super_block *sb = dir->i_sb;
+	struct simplefs_super_block *sfs_sb = SIMPLEFS_SB(sb);
+	struct simplefs_inode *sfs_dir = SIMPLEFS_INODE(dir), *sfs_inode;
+	uint64_t total, start = 0, dir_start, at, inodes, n, i;
+	u64 now = ktime_get_real_ns();
+	bool delalloc = false;
+	int ret;
 
-	char *buffer;
+	ret = simplefs_bulk_load(sb, buf, entries, count, &total);
+	if (ret < 0)
+		return ret;
+	n = ret;
+
+	if (simplefs_lock(sb, &simplefs_directory_children_update_lock,
+			  SIMPLEFS_LOCK_DIR))
+		return -EINTR;
+
+	ret = simplefs_sb_get_objects_count(sb, &inodes);
+	if (ret)
+		goto unlock;
+	if (inodes + n > sfs_sb->inodes_max) {
+		ret = -ENOSPC;
+		goto unlock;
+	}
+	ret = simplefs_bulk_check(dir, buf);
+	if (ret)
+		goto unlock;
+
+	if (total) {
+		ret = simplefs_sb_get_a_freerun(sb, total, &start);
+		if (ret)
+			goto unlock;
+	}
+
+	for (at = start, i = 0; i < n && !ret; at += buf->blocks[i], i++) {
+		sfs_inode = &buf->inodes[i];
+		memset(sfs_inode, 0, sizeof(*sfs_inode));
+		sfs_inode->mode = S_IFREG | (buf->entries[i].mode & ~current_umask() &
+					     S_IALLUGO);
+		sfs_inode->links_count = 1;
+		sfs_inode->inode_no = simplefs_inode_no(inodes + i);
+		sfs_inode->data_block_number = buf->blocks[i] ? at : 0;
+		sfs_inode->file_size = buf->entries[i].size;
+		sfs_inode->atime = sfs_inode->mtime = sfs_inode->ctime = now;
+		delalloc |= !buf->blocks[i];
+
+		if (buf->entries[i].size)
+			ret = simplefs_bulk_write(sb, buf, &buf->entries[i], at);
+	}
+	if (!ret && total)
+		ret = simplefs_run_sync(sb, start, total);
+	if (!ret && delalloc)
+		ret = simplefs_sb_feature_set(sb, &sfs_sb->feature_ro_compat,
+					      SIMPLEFS_FEATURE_RO_COMPAT_DELALLOC);
+	if (!ret)
+		ret = simplefs_inodes_add(sb, buf->inodes, n);
+	if (ret)
+		goto release;
+
+	/* The directory takes a longer run, if its records would not fit */
+	ret = simplefs_dir_grow(sb, sfs_dir, n, &dir_start);
+	if (!ret)
+		ret = simplefs_bulk_link(dir, buf, n, dir_start);
+	if (!ret)
+		goto unlock;
+
+	/* None of the files is in the directory, so none of them is kept */
+	simplefs_inodes_drop(sb, n);
+release:
+	if (total)
+		simplefs_run_release(sb, start, total);
+unlock:
+	mutex_unlock(&simplefs_directory_children_update_lock);
+	return ret ? ret : n;
+}
+
+/* SIMPLEFS_IOC_BULK_CREATE: make many files in a directory in one call,
+ * without a lookup and a create for each, and with a write for every
+ * block of metadata they share rather than for every file. simplefs_lookup
+ * does not keep the names it did not find, so there are no negative
+ * dentries to drop. Must be called with the directory locked. */
+static int simplefs_bulk_create(struct inode *dir, struct simplefs_bulk_create *bulk)
+{
+	const struct simplefs_bulk_entry __user *entries = u64_to_user_ptr(bulk->entries);
+	struct simplefs_bulk_buf *buf;
+	int ret = 0;
+
+	bulk->created = 0;
+
+	/* Their contents would have to be compressed, and images without a
+	 * block bitmap hand out a block at a time */
+	if (SIMPLEFS_INODE(dir)->mode & SIMPLEFS_INODE_COMPRESSED ||
+	    SIMPLEFS_SB_INFO(dir->i_sb)->compress ||
+	    !SIMPLEFS_SB(dir->i_sb)->groups_count)
+		return -EOPNOTSUPP;
+
+	buf = kvmalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	while (bulk->created < bulk->count) {
+		ret = simplefs_bulk_chunk(dir, buf, entries + bulk->created,
+					  bulk->count - bulk->created);
+		if (ret < 0)
+			break;
+		bulk->created += ret;
+		ret = 0;
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+	}
+
+	kvfree(buf);
+	return ret;
+}
+
+/* FS_IOC_GETFLAGS and FS_IOC_SETFLAGS (lsattr and chattr), of which
+ * only FS_COMPR_FL is kept, and SIMPLEFS_IOC_GETFRAG and
+ * SIMPLEFS_IOC_DEFRAG (defrag-simplefs) */
+static long simplefs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct simplefs_bulk_create bulk;
+	struct simplefs_cbt_ranges ranges;
+	struct simplefs_cbt_epoch epoch;
+	struct simplefs_defrag frag;
+	unsigned int flags;
+	int ret;
+
+	switch (cmd) {
+	case FS_IOC_GETFLAGS:
+		flags = SIMPLEFS_INODE(inode)->mode & SIMPLEFS_INODE_COMPRESSED ?
+			FS_COMPR_FL : 0;
+		return put_user(flags, (int __user *)arg);
+
+	case FS_IOC_SETFLAGS:
+		if (get_user(flags, (int __user *)arg))
+			return -EFAULT;
+		if (flags & ~FS_COMPR_FL)
+			return -EOPNOTSUPP;
+		if (!inode_owner_or_capable(inode))
+			return -EPERM;
+
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		inode_lock(inode);
+		ret = simplefs_set_compressed(inode, flags & FS_COMPR_FL);
+		inode_unlock(inode);
+		mnt_drop_write_file(filp);
+		return ret;
+
+	case SIMPLEFS_IOC_BULK_CREATE:
+		if (!S_ISDIR(SIMPLEFS_INODE(inode)->mode))
+			return -ENOTDIR;
+		if (copy_from_user(&bulk, (void __user *)arg, sizeof(bulk)))
+			return -EFAULT;
+		ret = inode_permission(inode, MAY_WRITE | MAY_EXEC);
+		if (ret)
+			return ret;
+
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		inode_lock(inode);
+		ret = simplefs_bulk_create(inode, &bulk);
+		inode_unlock(inode);
+		mnt_drop_write_file(filp);
+
+		/* Also when it failed part of the way */
+		if (put_user(bulk.created,
+			     &((struct simplefs_bulk_create __user *)arg)->created))
+			ret = -EFAULT;
+		return ret;
+
+	/* They are about the whole filesystem, not the file they are
+	 * called on */
+	case SIMPLEFS_IOC_CBT_EPOCH:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		ret = simplefs_cbt_new_epoch(inode->i_sb, &epoch);
+		mnt_drop_write_file(filp);
+
+		if (!ret && copy_to_user((void __user *)arg, &epoch, sizeof(epoch)))
+			ret = -EFAULT;
+		return ret;
+
+	case SIMPLEFS_IOC_CBT_RANGES:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&ranges, (void __user *)arg, sizeof(ranges)))
+			return -EFAULT;
+
+		ret = simplefs_cbt_get_ranges(inode->i_sb, &ranges);
+		if (!ret && copy_to_user((void __user *)arg, &ranges, sizeof(ranges)))
+			ret = -EFAULT;
+		return ret;
+
+	case SIMPLEFS_IOC_GETFRAG:
+		inode_lock_shared(inode);
+		ret = simplefs_frag_get(inode, &frag);
+		inode_unlock_shared(inode);
+		break;
+
+	case SIMPLEFS_IOC_DEFRAG:
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		inode_lock(inode);
+		ret = simplefs_defrag(inode, &frag);
+		inode_unlock(inode);
+		mnt_drop_write_file(filp);
+		break;
+
+	default:
+		return -ENOTTY;
+	}
+
+	if (!ret && copy_to_user((void __user *)arg, &frag, sizeof(frag)))
+		ret = -EFAULT;
+	return ret;
+}
 
+/* Write len bytes at pos of a file, from what fill puts in each block.
+ * Files grow beyond the run of blocks they already have by moving to a
+ * longer one (see simplefs_sparse_extend), compressed ones a cluster at
+ * a time (see simplefs_compress_update), and those that have none yet in
+ * memory (see simplefs_delalloc_write). Must be called with the inode
+ * locked, or locked shared with the bytes written range locked when they
+ * are in the run of the file and before its end, and it is neither
+ * compressed nor shared (see simplefs_write_in_run). */
+static ssize_t simplefs_write_range(struct inode *inode, loff_t pos, size_t len,
+				    simplefs_fill_t fill, void *data)
+{
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	handle_t *handle;
+	uint64_t first, last, block, run_first;
+	size_t offset, nbytes, written;
 	int retval;
+	u64 start;
+
+	if (sfs_inode->mode & SIMPLEFS_INODE_COMPRESSED)
+		return simplefs_compress_write(inode, pos, len, fill, data);
+	if (!sfs_inode->data_block_number && !(sfs_inode->mode & SIMPLEFS_INODE_SPARSE)) {
+		retval = simplefs_delalloc_write(inode, pos, len, fill, data);
+		if (retval != -EFBIG)
+			return retval;
+		/* Too much to keep in memory: what is there goes out to a
+		 * run first, which then grows like that of any other file */
+		retval = simplefs_delalloc_flush(inode);
+		if (retval)
+			return retval;
+	}
 
-	sb = filp->f_path.dentry->d_inode->i_sb;
-	sfs_sb = SIMPLEFS_SB(sb);
+	first = pos >> sb->s_blocksize_bits;
+	last = (pos + len - 1) >> sb->s_blocksize_bits;
+	run_first = simplefs_inode_run_first(sfs_inode);
+	if (first < run_first ||
+	    last >= run_first + simplefs_inode_blocks(sfs_inode, sb->s_blocksize)) {
+		retval = simplefs_sparse_extend(inode, first, last);
+		if (retval)
+			return retval;
+		run_first = simplefs_inode_run_first(sfs_inode);
+	}
 
-	handle = jbd2_journal_start(sfs_sb->journal, 1);
-	if (IS_ERR(handle))
-		return PTR_ERR(handle);
-	retval = generic_write_checks(filp, ppos, &len, 0);
+	retval = simplefs_unshare(inode, first - run_first, last - run_first);
 	if (retval)
 		return retval;
 
-	inode = filp->f_path.dentry->d_inode;
-	sfs_inode = SIMPLEFS_INODE(inode);
+	simplefs_cbt_mark(sb, sfs_inode->data_block_number + first - run_first,
+			  last - first + 1);
 
-	bh = sb_bread(filp->f_path.dentry->d_inode->i_sb,
-					    sfs_inode->data_block_number);
+	start = simplefs_trace_clock(simplefs_journal_stop);
+	trace_simplefs_journal_start(inode, last - first + 1);
+	handle = jbd2_journal_start(SIMPLEFS_SB_INFO(sb)->journal, last - first + 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+	simplefs_stat_inc(sb, SIMPLEFS_STAT_JOURNAL_HANDLES);
+
+	for (written = 0, block = first; block <= last; block++) {
+		offset = (pos + written) & (sb->s_blocksize - 1);
+		nbytes = min_t(size_t, len - written, sb->s_blocksize - offset);
+
+		bh = simplefs_bread_to_write(sb, sfs_inode->data_block_number + block -
+					     run_first, nbytes == sb->s_blocksize);
+		if (!bh) {
+			printk(KERN_ERR "Reading the block number [%llu] failed.",
+			       sfs_inode->data_block_number + block - run_first);
+			retval = -EIO;
+			goto stop;
+		}
 
-	if (!bh) {
-		printk(KERN_ERR "Reading the block number [%llu] failed.",
-		       sfs_inode->data_block_number);
-		return 0;
-	}
-	buffer = (char *)bh->b_data;
+		retval = jbd2_journal_get_write_access(handle, bh);
+		if (WARN_ON(retval)) {
+			brelse(bh);
+			sfs_trace("Can't get write access for bh\n");
+			goto stop;
+		}
 
-	/* Move the pointer until the required byte offset */
-	buffer += *ppos;
+		retval = fill((char *)bh->b_data + offset, written, nbytes, data);
+		if (retval) {
+			brelse(bh);
+			goto stop;
+		}
 
-	retval = jbd2_journal_get_write_access(handle, bh);
-	if (WARN_ON(retval)) {
+		retval = jbd2_journal_dirty_metadata(handle, bh);
 		brelse(bh);
-		sfs_trace("Can't get write access for bh\n");
+		if (WARN_ON(retval))
+			goto stop;
+
+		written += nbytes;
+	}
+
+	handle->h_sync = 1;
+	retval = jbd2_journal_stop(handle);
+	trace_simplefs_journal_stop(inode, retval, start);
+	if (WARN_ON(retval))
 		return retval;
+
+	/* A write in the middle of the file leaves its size alone. Files
+	 * overwritten with a shorter buffer are truncated first, on open
+	 * (see simplefs_setattr). Only writes past the end, which have the
+	 * whole file locked, save the inode. */
+	if (pos + len <= READ_ONCE(sfs_inode->file_size))
+		return len;
+	if (simplefs_lock(sb, &simplefs_inodes_mgmt_lock, SIMPLEFS_LOCK_INODES)) {
+		sfs_trace("Failed to acquire mutex lock\n");
+		return -EINTR;
 	}
+	if (pos + len > sfs_inode->file_size) {
+		sfs_inode->file_size = pos + len;
+		retval = simplefs_inode_save(sb, sfs_inode);
+		if (retval)
+			len = retval;
+		else
+			i_size_write(inode, sfs_inode->file_size);
+	}
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
 
-	if (copy_from_user(buffer, buf, len)) {
-		brelse(bh);
+	return len;
+
+stop:
+	trace_simplefs_journal_stop(inode, jbd2_journal_stop(handle), start);
+	return retval;
+}
+
+static int simplefs_fill_from_user(char *to, size_t done, size_t len, void *data)
+{
+	if (copy_from_user(to, (const char __user *)data + done, len)) {
 		printk(KERN_ERR
 		       "Error copying file contents from the userspace buffer to the kernel space\n");
 		return -EFAULT;
 	}
-	*ppos += len;
+	return 0;
+}
 
-	retval = jbd2_journal_dirty_metadata(handle, bh);
-	if (WARN_ON(retval)) {
-		brelse(bh);
-		return retval;
-	}
-	handle->h_sync = 1;
-	retval = jbd2_journal_stop(handle);
-	if (WARN_ON(retval)) {
-		brelse(bh);
-		return retval;
+static int simplefs_fill_zero(char *to, size_t done, size_t len, void *data)
+{
+	memset(to, 0, len);
+	return 0;
+}
+
+/* Whether a write of len bytes at pos can go on with only those bytes
+ * locked: they are in the run the file already has, and it is neither
+ * compressed nor shared. Must be called with the inode locked, shared at
+ * least. */
+static bool simplefs_write_in_run(struct inode *inode, loff_t pos, size_t len)
+{
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct super_block *sb = inode->i_sb;
+	uint64_t first, last, run_first;
+
+	first = pos >> sb->s_blocksize_bits;
+	last = (pos + len - 1) >> sb->s_blocksize_bits;
+	run_first = simplefs_inode_run_first(sfs_inode);
+	return !(sfs_inode->mode & SIMPLEFS_INODE_COMPRESSED) &&
+	       sfs_inode->data_block_number &&
+	       first >= run_first &&
+	       last < run_first + simplefs_inode_blocks(sfs_inode, sb->s_blocksize) &&
+	       !simplefs_run_shared(sb, sfs_inode->data_block_number + first - run_first,
+				    last - first + 1);
+}
+
+/* FIXME: The write support is rudimentary. I have not figured out a way to do writes
+ * from particular offsets (even though I have written some untested code for this below) efficiently. */
+static ssize_t __simplefs_write(struct file * filp, const char __user * buf,
+				size_t len, loff_t * ppos)
+{
+	/* After the commit dd37978c5 in the upstream linux kernel,
+	 * we can use just filp->f_inode instead of the
+	 * f->f_path.dentry->d_inode redirection */
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	struct simplefs_range range;
+	bool excl, in_run;
+	ssize_t retval;
+
+	/* Overwrites of the run the file already has only lock the bytes
+	 * they write, so that those to other parts of the file go on at the
+	 * same time. Appends and writes past the end, which change the size,
+	 * lock the whole file, as do writes to compressed files, which are
+	 * rewritten a cluster at a time, to shared ones, which are moved to
+	 * another run first (see simplefs_unshare), to outside the run (see
+	 * simplefs_sparse_extend), and to files with no run yet, which are
+	 * written to memory (see simplefs_delalloc_write). The size and the
+	 * position are checked with the lock held. */
+	excl = filp->f_flags & O_APPEND || *ppos + len > i_size_read(inode);
+again:
+	if (excl)
+		inode_lock(inode);
+	else
+		inode_lock_shared(inode);
+
+	retval = generic_write_checks(filp, ppos, &len, 0);
+	if (retval || !len)
+		goto unlock;
+	if (!excl && (*ppos + len > i_size_read(inode) ||
+		      !simplefs_write_in_run(inode, *ppos, len))) {
+		inode_unlock_shared(inode);
+		excl = true;
+		goto again;
 	}
 
-	mark_buffer_dirty(bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
+	retval = file_update_time(filp);
+	if (retval)
+		goto unlock;
 
-	/* Set new size
-	 * sfs_inode->file_size = max(sfs_inode->file_size, *ppos);
-	 *
-	 * FIXME: What to do if someone writes only some parts in between ?
-	 * The above code will also fail in case a file is overwritten with
-	 * a shorter buffer */
-	if (mutex_lock_interruptible(&simplefs_inodes_mgmt_lock)) {
-		sfs_trace("Failed to acquire mutex lock\n");
-		return -EINTR;
+	if (excl) {
+		retval = simplefs_write_range(inode, *ppos, len,
+					      simplefs_fill_from_user,
+					      (void __force *)buf);
+	} else {
+		simplefs_range_lock(inode, &range, *ppos, *ppos + len - 1, true);
+		/* Again, with the bytes locked */
+		in_run = simplefs_write_in_run(inode, *ppos, len);
+		if (in_run)
+			retval = simplefs_write_range(inode, *ppos, len,
+						      simplefs_fill_from_user,
+						      (void __force *)buf);
+		simplefs_range_unlock(inode, &range);
+		if (!in_run) {
+			inode_unlock_shared(inode);
+			excl = true;
+			goto again;
+		}
 	}
-	sfs_inode->file_size = *ppos;
-	retval = simplefs_inode_save(sb, sfs_inode);
-	if (retval) {
-		len = retval;
+	if (retval > 0)
+		*ppos += retval;
+
+unlock:
+	if (excl)
+		inode_unlock(inode);
+	else
+		inode_unlock_shared(inode);
+	return retval;
+}
+
+ssize_t simplefs_write(struct file * filp, const char __user * buf, size_t len,
+		       loff_t * ppos)
+{
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	u64 start = ktime_get_ns();
+	loff_t pos = *ppos;
+	ssize_t ret;
+
+	ret = __simplefs_write(filp, buf, len, ppos);
+	simplefs_stat_latency(inode->i_sb, SIMPLEFS_OP_WRITE, start);
+	trace_simplefs_write(inode, pos, len, ret, start);
+	return ret;
+}
+
+/* Make dst a clone of len bytes of src from pos_in on, sharing the blocks
+ * they are in until either file is written to. A file is a single run of
+ * blocks, so only what a run can describe is possible: the clone starts
+ * at the start of a block of src and at the start of dst, it ends at the
+ * end of a block or at the end of src, and it replaces all of dst. Both
+ * inodes must be locked. */
+static int simplefs_clone(struct inode *src, loff_t pos_in, struct inode *dst,
+			  loff_t pos_out, u64 len)
+{
+	struct super_block *sb = src->i_sb;
+	struct simplefs_inode *from = SIMPLEFS_INODE(src), *to = SIMPLEFS_INODE(dst), saved;
+	uint64_t start, count, old_start, old_count;
+	int ret;
+
+	/* Images made before the reference count table cannot share, the
+	 * clusters of compressed files do not line up with the blocks, and
+	 * the run of a sparse one not with its contents */
+	if (!SIMPLEFS_SB(sb)->refcount_blocks ||
+	    (from->mode | to->mode) & SIMPLEFS_INODE_COMPRESSED ||
+	    from->mode & SIMPLEFS_INODE_SPARSE)
+		return -EOPNOTSUPP;
+
+	if (src == dst || pos_out || pos_in & (sb->s_blocksize - 1) ||
+	    pos_in + len > from->file_size ||
+	    (pos_in + len < from->file_size && len & (sb->s_blocksize - 1)) ||
+	    i_size_read(dst) > len)
+		return -EOPNOTSUPP;
+
+	start = from->data_block_number + (pos_in >> sb->s_blocksize_bits);
+	count = DIV_ROUND_UP(len, sb->s_blocksize);
+
+	ret = simplefs_run_share(sb, start, count);
+	if (ret)
+		goto out;
+
+	old_start = to->data_block_number;
+	old_count = simplefs_inode_blocks(to, sb->s_blocksize);
+
+	if (simplefs_lock(sb, &simplefs_inodes_mgmt_lock, SIMPLEFS_LOCK_INODES)) {
+		simplefs_run_release(sb, start, count);
+		ret = -EINTR;
+		goto out;
 	}
+	saved = *to;
+	to->data_block_number = start;
+	to->file_size = len;
+	/* The run of dst is all of it now */
+	to->mode &= ~SIMPLEFS_INODE_SPARSE;
+	to->run_first = to->run_blocks = 0;
+	ret = simplefs_inode_save(sb, to);
+	if (ret)
+		*to = saved;
 	mutex_unlock(&simplefs_inodes_mgmt_lock);
 
-	return len;
+	if (ret) {
+		simplefs_run_release(sb, start, count);
+		goto out;
+	}
+
+	/* Whatever dst had in memory, see simplefs_delalloc_write. A slot
+	 * of the dedup index may point to the run it shares now. */
+	simplefs_delalloc_release(dst, 0);
+	SIMPLEFS_INODE_INFO(dst)->dedup_unlisted = false;
+	i_size_write(dst, len);
+	ret = simplefs_run_release(sb, old_start, old_count);
+out:
+	trace_simplefs_clone(src, dst, start, count, ret);
+	return ret;
+}
+
+/* FICLONE and FICLONERANGE. What simplefs_clone cannot do is
+ * -EOPNOTSUPP, for cp --reflink=auto to copy instead. */
+static loff_t simplefs_remap_file_range(struct file *file_in, loff_t pos_in,
+					struct file *file_out, loff_t pos_out,
+					loff_t len, unsigned int remap_flags)
+{
+	struct inode *src = file_inode(file_in), *dst = file_inode(file_out);
+	int ret;
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+		return -EINVAL;
+	/* That needs the contents compared first */
+	if (remap_flags & REMAP_FILE_DEDUP)
+		return -EOPNOTSUPP;
+
+	lock_two_nondirectories(src, dst);
+
+	/* The sizes, the alignment, and a length of 0 for up to the end of
+	 * src */
+	ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+					    &len, remap_flags);
+	if (ret < 0 || !len)
+		goto out;
+
+	/* What is shared are the blocks, see simplefs_delalloc_flush */
+	ret = simplefs_delalloc_flush(src);
+	if (!ret)
+		ret = simplefs_clone(src, pos_in, dst, pos_out, len);
+out:
+	unlock_two_nondirectories(src, dst);
+	return ret < 0 ? ret : len;
+}
+
+static int simplefs_fill_from_buffer(char *to, size_t done, size_t len, void *data)
+{
+	memcpy(to, (const char *)data + done, len);
+	return 0;
+}
+
+/* copy_file_range clones when it can, and otherwise copies the blocks
+ * in the kernel, this many at most per call, which is one journal handle */
+#define SIMPLEFS_COPY_MAX_BLOCKS 64
+
+static ssize_t simplefs_copy_file_range(struct file *file_in, loff_t pos_in,
+					struct file *file_out, loff_t pos_out,
+					size_t len, unsigned int flags)
+{
+	struct inode *src = file_inode(file_in), *dst = file_inode(file_out);
+	struct simplefs_inode *from = SIMPLEFS_INODE(src);
+	struct super_block *sb = src->i_sb;
+	void *buf;
+	ssize_t ret;
+
+	if (src->i_sb != dst->i_sb)
+		return -EXDEV;
+
+	lock_two_nondirectories(src, dst);
+
+	/* Cloned or copied, it is read from its blocks */
+	ret = simplefs_delalloc_flush(src);
+	if (ret)
+		goto out;
+
+	if (pos_in >= i_size_read(src)) {
+		ret = 0;
+		goto out;
+	}
+	len = min_t(u64, len, i_size_read(src) - pos_in);
+
+	/* As for a write, see __simplefs_write */
+	ret = generic_write_checks(file_out, &pos_out, &len, 0);
+	if (ret || !len)
+		goto out;
+	ret = file_update_time(file_out);
+	if (ret)
+		goto out;
+
+	ret = simplefs_clone(src, pos_in, dst, pos_out, len);
+	if (!ret) {
+		ret = len;
+		goto out;
+	}
+	/* The blocks of a compressed source are not its contents, nor are
+	 * those of a sparse one all of them. The caller reads and writes
+	 * instead. */
+	if (ret != -EOPNOTSUPP ||
+	    from->mode & (SIMPLEFS_INODE_COMPRESSED | SIMPLEFS_INODE_SPARSE))
+		goto out;
+
+	len = min_t(size_t, len, SIMPLEFS_COPY_MAX_BLOCKS * sb->s_blocksize -
+			      (pos_out & (sb->s_blocksize - 1)));
+	buf = kvmalloc(len, GFP_KERNEL);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	/* All of it is read before any of it is written, as the write may
+	 * move the run of src, when it is dst as well (see simplefs_unshare
+	 * and simplefs_sparse_extend) */
+	ret = simplefs_run_read(sb, from->data_block_number, pos_in, buf, len);
+	if (!ret)
+		ret = simplefs_write_range(dst, pos_out, len,
+					   simplefs_fill_from_buffer, buf);
+	kvfree(buf);
+out:
+	unlock_two_nondirectories(src, dst);
+	return ret;
+}
+
+/* The metadata goes out as soon as it changes, and what is written to
+ * the runs of the files through the journal, so what is left is what
+ * delayed allocation still has in memory, and the times */
+static int simplefs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file_inode(file);
+	int ret;
+
+	inode_lock(inode);
+	ret = simplefs_delalloc_flush(inode);
+	inode_unlock(inode);
+	if (!ret && !datasync)
+		ret = sync_inode_metadata(inode, 1);
+	return ret;
+}
+
+/* The bytes of a file that are in its run of blocks, from start up to
+ * end. That is all of them, but for sparse files. Must be called with
+ * the inode locked, shared at least. */
+static void simplefs_data_range(struct inode *inode, loff_t *start, loff_t *end)
+{
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct super_block *sb = inode->i_sb;
+	loff_t size = i_size_read(inode);
+	uint64_t run_first = simplefs_inode_run_first(sfs_inode);
+
+	*start = 0;
+	*end = size;
+	if (!(sfs_inode->mode & SIMPLEFS_INODE_SPARSE))
+		return;
+
+	*start = min_t(u64, run_first << sb->s_blocksize_bits, size);
+	*end = min_t(u64, (run_first + simplefs_inode_blocks(sfs_inode, sb->s_blocksize)) <<
+			  sb->s_blocksize_bits, size);
+	if (*start >= *end)
+		*start = *end = size;
+}
+
+/* SEEK_DATA and SEEK_HOLE, for cp --sparse, tar -S and the like. A file
+ * has at most one range of data, its run of blocks, with holes before
+ * and after it. */
+static loff_t simplefs_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(file);
+	loff_t start, end, size;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return generic_file_llseek(file, offset, whence);
+
+	/* The run only moves with the inode locked, see simplefs_run_move */
+	inode_lock_shared(inode);
+	size = i_size_read(inode);
+	simplefs_data_range(inode, &start, &end);
+	inode_unlock_shared(inode);
+
+	if (offset < 0 || offset >= size)
+		return -ENXIO;
+	if (whence == SEEK_DATA) {
+		if (offset >= end)
+			return -ENXIO;
+		offset = max(offset, start);
+	} else if (offset >= start && offset < end) {
+		offset = end;
+	}
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/* Map block iblock of the contents of a file to the block of the image
+ * it is in. Holes, files with no run yet and compressed files, whose
+ * clusters do not line up with the blocks, are left unmapped: this only
+ * looks up, it never gives a file blocks. */
+static int simplefs_get_block(struct inode *inode, sector_t iblock,
+			      struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	uint64_t run_first = simplefs_inode_run_first(sfs_inode);
+
+	if (sfs_inode->mode & SIMPLEFS_INODE_COMPRESSED || iblock < run_first ||
+	    iblock >= run_first + simplefs_inode_blocks(sfs_inode, sb->s_blocksize))
+		return 0;
+
+	map_bh(bh_result, sb, sfs_inode->data_block_number + iblock - run_first);
+	return 0;
+}
+
+/* How jbd2 finds the blocks of the journal inode, and FIBMAP */
+static sector_t simplefs_bmap(struct address_space *mapping, sector_t block)
+{
+	return generic_block_bmap(mapping, block, simplefs_get_block);
 }
 
+/* Files are read and written through buffer heads, not the page cache,
+ * so there is nothing here but bmap: no read_folio or writepages, and no
+ * folios, large or not. The kernels this builds against predate folios.
+ * What is read or written a run of blocks at a time instead is in
+ * simplefs_run_readahead and simplefs_run_sync. */
+static const struct address_space_operations simplefs_aops = {
+	.bmap = simplefs_bmap,
+};
+
 const struct file_operations simplefs_file_operations = {
+	.llseek = simplefs_llseek,
 	.read = simplefs_read,
 	.write = simplefs_write,
+	.fsync = simplefs_fsync,
+	.unlocked_ioctl = simplefs_ioctl,
+	.remap_file_range = simplefs_remap_file_range,
+	.copy_file_range = simplefs_copy_file_range,
 };
 
 const struct file_operations simplefs_dir_operations = {
@@ -462,6 +4170,7 @@ const struct file_operations simplefs_dir_operations = {
 #else
 	.readdir = simplefs_readdir,
 #endif
+	.unlocked_ioctl = simplefs_ioctl,
 };
 
 struct dentry *simplefs_lookup(struct inode *parent_inode,
@@ -473,29 +4182,212 @@ static int simplefs_create(struct inode *dir, struct dentry *dentry,
 static int simplefs_mkdir(struct inode *dir, struct dentry *dentry,
 			  umode_t mode);
 
-static struct inode_operations simplefs_inode_ops = {
-	.create = simplefs_create,
-	.lookup = simplefs_lookup,
-	.mkdir = simplefs_mkdir,
-};
+static int simplefs_setattr(
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+			    struct mnt_idmap *idmap,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+			    struct user_namespace *mnt_userns,
+#endif
+			    struct dentry *dentry, struct iattr *attr);
+
+/* FIEMAP, with the single extent an object has at most: its run of
+ * blocks. Compressed files report it as encoded, and files that delayed
+ * allocation still has in memory as such, unless asked to sync first. */
+static int simplefs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+			   u64 start, u64 len)
+{
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	u64 logical, phys = 0, length, blocks;
+	u32 flags = FIEMAP_EXTENT_LAST;
+	int ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	ret = fiemap_prep(inode, fieinfo, start, &len, FIEMAP_FLAG_SYNC);
+#else
+	ret = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC);
+#endif
+	if (ret)
+		return ret;
+
+	inode_lock(inode);
+	if (fieinfo->fi_flags & FIEMAP_FLAG_SYNC) {
+		ret = simplefs_delalloc_flush(inode);
+		if (ret)
+			goto out;
+	}
+
+	blocks = simplefs_inode_blocks(sfs_inode, sb->s_blocksize);
+	logical = simplefs_inode_run_first(sfs_inode) << sb->s_blocksize_bits;
+	length = blocks << sb->s_blocksize_bits;
+	if (sfs_inode->data_block_number) {
+		phys = sfs_inode->data_block_number << sb->s_blocksize_bits;
+		if (sfs_inode->mode & SIMPLEFS_INODE_COMPRESSED)
+			flags |= FIEMAP_EXTENT_ENCODED;
+		if (simplefs_run_shared(sb, sfs_inode->data_block_number, blocks) > 0)
+			flags |= FIEMAP_EXTENT_SHARED;
+	} else if (S_ISREG(sfs_inode->mode) && !(sfs_inode->mode & SIMPLEFS_INODE_SPARSE) &&
+		   i_size_read(inode)) {
+		length = round_up(i_size_read(inode), sb->s_blocksize);
+		flags |= FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_UNKNOWN;
+	} else {
+		goto out;
+	}
+
+	if (logical + length > start && (logical < start || logical - start < len))
+		ret = fiemap_fill_next_extent(fieinfo, logical, phys, length, flags);
+out:
+	inode_unlock(inode);
+	return ret < 0 ? ret : 0;
+}
+
+static struct inode_operations simplefs_inode_ops = {
+	.create = simplefs_create,
+	.lookup = simplefs_lookup,
+	.mkdir = simplefs_mkdir,
+	.setattr = simplefs_setattr,
+	.fiemap = simplefs_fiemap,
+};
+
+/* The first argument setattr_prepare and setattr_copy take since 5.12:
+ * simplefs is not mounted with an idmapping */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define SIMPLEFS_NOP_IDMAP &nop_mnt_idmap,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+#define SIMPLEFS_NOP_IDMAP &init_user_ns,
+#else
+#define SIMPLEFS_NOP_IDMAP
+#endif
+
+/* Truncation (truncate(2), or an open with O_TRUNC) sets the size
+ * recorded in the inode. What is past the run of blocks of a file is a
+ * hole, which makes it sparse, see simplefs_sparse_extend. Without those,
+ * on version 1 images, the size must fit in the run. The tail of the run
+ * that is no longer needed is given up, and the rest of its last block
+ * zeroed, for when the file grows again. Compressed files can grow, see
+ * simplefs_compress_update, and so can those that have no run yet, see
+ * simplefs_delalloc_write, as long as they fit in a group. */
+static int simplefs_setattr(
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+			    struct mnt_idmap *idmap,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+			    struct user_namespace *mnt_userns,
+#endif
+			    struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_inode saved;
+	uint64_t old_blocks, new_blocks, old_start, run_first, end;
+	loff_t old_size;
+	int ret;
+
+	ret = setattr_prepare(SIMPLEFS_NOP_IDMAP dentry, attr);
+	if (ret)
+		return ret;
+
+	if (attr->ia_valid & ATTR_SIZE && S_ISREG(sfs_inode->mode) &&
+	    sfs_inode->mode & SIMPLEFS_INODE_COMPRESSED) {
+		ret = simplefs_compress_truncate(inode, attr->ia_size);
+		if (ret)
+			return ret;
+	} else if (attr->ia_valid & ATTR_SIZE && S_ISREG(sfs_inode->mode) &&
+		   !sfs_inode->data_block_number &&
+		   !(sfs_inode->mode & SIMPLEFS_INODE_SPARSE) &&
+		   (attr->ia_size <= i_size_read(inode) ||
+		    !simplefs_sparse_ok(SIMPLEFS_SB(sb)))) {
+		if (attr->ia_size > i_size_read(inode))
+			ret = simplefs_delalloc_reserve(inode, attr->ia_size);
+		else
+			simplefs_delalloc_release(inode, attr->ia_size);
+		if (ret)
+			return ret;
+		i_size_write(inode, attr->ia_size);
+		if (attr->ia_size)
+			mark_inode_dirty(inode);
+	} else if (attr->ia_valid & ATTR_SIZE) {
+		if (S_ISDIR(sfs_inode->mode))
+			return -EISDIR;
+		/* What delayed allocation has in memory goes to a run first,
+		 * and the file grows into a hole after it */
+		ret = simplefs_delalloc_flush(inode);
+		if (ret)
+			return ret;
+
+		old_size = i_size_read(inode);
+		old_blocks = simplefs_inode_blocks(sfs_inode, sb->s_blocksize);
+		run_first = simplefs_inode_run_first(sfs_inode);
+		end = DIV_ROUND_UP(attr->ia_size, sb->s_blocksize);
+		if (end > run_first + old_blocks) {
+			if (!simplefs_sparse_ok(SIMPLEFS_SB(sb)))
+				return -ENOSPC;
+			ret = simplefs_sb_feature_set(sb, &SIMPLEFS_SB(sb)->feature_incompat,
+						      SIMPLEFS_FEATURE_INCOMPAT_SPARSE);
+			if (ret)
+				return ret;
+		}
+
+		/* Zeroes where the file may grow into again */
+		if (attr->ia_size < old_size && attr->ia_size & (sb->s_blocksize - 1) &&
+		    end - 1 >= run_first && end - 1 < run_first + old_blocks) {
+			ret = simplefs_write_range(inode, attr->ia_size,
+						   min_t(loff_t, old_size,
+							 end << sb->s_blocksize_bits) -
+						   attr->ia_size,
+						   simplefs_fill_zero, NULL);
+			if (ret < 0)
+				return ret;
+		}
+
+		/* Which that may have moved, see simplefs_unshare */
+		old_start = sfs_inode->data_block_number;
+		if (simplefs_lock(sb, &simplefs_inodes_mgmt_lock, SIMPLEFS_LOCK_INODES))
+			return -EINTR;
+		saved = *sfs_inode;
+		simplefs_inode_resize(sfs_inode, sb->s_blocksize, attr->ia_size);
+		ret = simplefs_inode_save(sb, sfs_inode);
+		if (ret)
+			*sfs_inode = saved;
+		mutex_unlock(&simplefs_inodes_mgmt_lock);
+		if (ret)
+			return ret;
+		i_size_write(inode, attr->ia_size);
+
+		new_blocks = simplefs_inode_blocks(sfs_inode, sb->s_blocksize);
+		if (new_blocks < old_blocks) {
+			ret = simplefs_run_release(sb, old_start + new_blocks,
+						   old_blocks - new_blocks);
+			if (ret)
+				return ret;
+		}
+	}
+
+	setattr_copy(SIMPLEFS_NOP_IDMAP inode, attr);
 
-static int simplefs_create_fs_object(struct inode *dir, struct dentry *dentry,
-				     umode_t mode)
+	if (attr->ia_valid & (ATTR_ATIME | ATTR_MTIME | ATTR_CTIME))
+		mark_inode_dirty(inode);
+	return 0;
+}
+
+static int __simplefs_create_fs_object(struct inode *dir, struct dentry *dentry,
+				       umode_t mode)
 {
 	struct inode *inode;
 	struct simplefs_inode *sfs_inode;
 	struct super_block *sb;
-	struct simplefs_inode *parent_dir_inode;
+	struct simplefs_inode *parent_dir_inode, grown;
 	struct buffer_head *bh;
 	struct simplefs_dir_record *dir_contents_datablock;
-	uint64_t count;
+	uint64_t count, block, offset, dir_start;
 	int ret;
 
-	if (mutex_lock_interruptible(&simplefs_directory_children_update_lock)) {
+	sb = dir->i_sb;
+	if (simplefs_lock(sb, &simplefs_directory_children_update_lock,
+			  SIMPLEFS_LOCK_DIR)) {
 		sfs_trace("Failed to acquire mutex lock\n");
 		return -EINTR;
 	}
-	sb = dir->i_sb;
 
 	ret = simplefs_sb_get_objects_count(sb, &count);
 	if (ret < 0) {
@@ -503,7 +4395,7 @@ static int simplefs_create_fs_object(struct inode *dir, struct dentry *dentry,
 		return ret;
 	}
 
-	if (unlikely(count >= SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)) {
+	if (unlikely(count >= SIMPLEFS_SB(sb)->inodes_max)) {
 		/* The above condition can be just == instead of the >= */
 		printk(KERN_ERR
 		       "Maximum number of objects supported by simplefs is already reached");
@@ -518,6 +4410,13 @@ static int simplefs_create_fs_object(struct inode *dir, struct dentry *dentry,
 		return -EINVAL;
 	}
 
+	/* The name is stored NUL terminated in the directory record */
+	if (dentry->d_name.len >= SIMPLEFS_FILENAME_MAXLEN) {
+		mutex_unlock(&simplefs_directory_children_update_lock);
+		return -ENAMETOOLONG;
+	}
+
+	parent_dir_inode = SIMPLEFS_INODE(dir);
 	inode = new_inode(sb);
 	if (!inode) {
 		mutex_unlock(&simplefs_directory_children_update_lock);
@@ -527,21 +4426,33 @@ static int simplefs_create_fs_object(struct inode *dir, struct dentry *dentry,
 	inode->i_sb = sb;
 	inode->i_op = &simplefs_inode_ops;
 	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-	inode->i_ino = (count + SIMPLEFS_START_INO - SIMPLEFS_RESERVED_INODES + 1);
+	inode->i_ino = simplefs_inode_next_no(SIMPLEFS_SB(sb));
 
 	sfs_inode = kmem_cache_alloc(sfs_inode_cachep, GFP_KERNEL);
+	if (!sfs_inode) {
+		ret = -ENOMEM;
+		goto out_iput;
+	}
+	memset(sfs_inode, 0, sizeof(*sfs_inode));
 	sfs_inode->inode_no = inode->i_ino;
+	/* From here on, the iput on failure frees it with the inode */
 	inode->i_private = sfs_inode;
 	sfs_inode->mode = mode;
+	sfs_inode->links_count = 1;
+	simplefs_inode_set_times(inode);
+	/* Directories pass compression on, and the compress mount option
+	 * turns it on for every new file */
+	if (parent_dir_inode->mode & SIMPLEFS_INODE_COMPRESSED ||
+	    (S_ISREG(mode) && SIMPLEFS_SB_INFO(sb)->compress))
+		sfs_inode->mode |= SIMPLEFS_INODE_COMPRESSED;
 
 	if (S_ISDIR(mode)) {
-		printk(KERN_INFO "New directory creation request\n");
 		sfs_inode->dir_children_count = 0;
 		inode->i_fop = &simplefs_dir_operations;
 	} else if (S_ISREG(mode)) {
-		printk(KERN_INFO "New file creation request\n");
 		sfs_inode->file_size = 0;
 		inode->i_fop = &simplefs_file_operations;
+		inode->i_mapping->a_ops = &simplefs_aops;
 	}
 
 	/* First get a free block and update the free map,
@@ -550,57 +4461,115 @@ static int simplefs_create_fs_object(struct inode *dir, struct dentry *dentry,
 	 *
 	 * The above ordering helps us to maintain fs consistency
 	 * even in most crashes
+	 *
+	 * With delayed allocation, files get no block here, but a run once
+	 * they are written out (see simplefs_delalloc_flush).
 	 */
-	ret = simplefs_sb_get_a_freeblock(sb, &sfs_inode->data_block_number);
+	if (S_ISDIR(mode))
+		ret = simplefs_sb_get_a_dirrun(sb, 1, &sfs_inode->data_block_number);
+	else if (sfs_inode->mode & SIMPLEFS_INODE_COMPRESSED ||
+		 !SIMPLEFS_SB_INFO(sb)->delalloc)
+		ret = simplefs_sb_get_a_freeblock(sb, &sfs_inode->data_block_number);
+	else
+		ret = simplefs_sb_feature_set(sb, &SIMPLEFS_SB(sb)->feature_ro_compat,
+					      SIMPLEFS_FEATURE_RO_COMPAT_DELALLOC);
 	if (ret < 0) {
 		printk(KERN_ERR "simplefs could not get a freeblock");
-		mutex_unlock(&simplefs_directory_children_update_lock);
-		return ret;
+		sfs_inode->data_block_number = 0;
+		goto out_iput;
 	}
 
-	simplefs_inode_add(sb, sfs_inode);
+	if (S_ISREG(mode) && sfs_inode->mode & SIMPLEFS_INODE_COMPRESSED) {
+		ret = simplefs_sb_feature_set(sb, &SIMPLEFS_SB(sb)->feature_incompat,
+					      SIMPLEFS_FEATURE_INCOMPAT_COMPRESS);
+		if (!ret)
+			ret = simplefs_compress_init(sb, sfs_inode);
+		if (ret)
+			goto out_release;
+	}
 
-	parent_dir_inode = SIMPLEFS_INODE(dir);
-	bh = sb_bread(sb, parent_dir_inode->data_block_number);
-	BUG_ON(!bh);
+	ret = simplefs_inode_add(sb, sfs_inode);
+	if (ret)
+		goto out_release;
 
-	dir_contents_datablock = (struct simplefs_dir_record *)bh->b_data;
+	/* A directory with no room for another record moves to a longer
+	 * run, which it only points to once the record is counted */
+	ret = simplefs_dir_grow(sb, parent_dir_inode, 1, &dir_start);
+	if (ret) {
+		printk(KERN_ERR
+		       "The directory data blocks have no room for another child");
+		goto out_drop;
+	}
 
 	/* Navigate to the last record in the directory contents */
-	dir_contents_datablock += parent_dir_inode->dir_children_count;
+	grown = *parent_dir_inode;
+	grown.data_block_number = dir_start;
+	simplefs_dir_record_locate(SIMPLEFS_SB(sb), &grown,
+				   parent_dir_inode->dir_children_count,
+				   &block, &offset);
+	bh = simplefs_bread(sb, block);
+	BUG_ON(!bh);
+
+	/* A block without records yet has nothing to check */
+	ret = offset ? simplefs_block_verify(sb, bh) : 0;
+	if (ret) {
+		brelse(bh);
+		goto out_grown;
+	}
 
-	dir_contents_datablock->inode_no = sfs_inode->inode_no;
-	strcpy(dir_contents_datablock->filename, dentry->d_name.name);
+	lock_buffer(bh);
+	dir_contents_datablock = (struct simplefs_dir_record *)(bh->b_data + offset);
+	simplefs_dir_record_init(dir_contents_datablock, dentry->d_name.name,
+				 dentry->d_name.len, sfs_inode->inode_no);
+	simplefs_block_csum_update(sb, bh);
+	unlock_buffer(bh);
 
-	mark_buffer_dirty(bh);
+	simplefs_mark_buffer_dirty(sb, bh);
 	sync_dirty_buffer(bh);
 	brelse(bh);
 
-	if (mutex_lock_interruptible(&simplefs_inodes_mgmt_lock)) {
-		mutex_unlock(&simplefs_directory_children_update_lock);
-		sfs_trace("Failed to acquire mutex lock\n");
-		return -EINTR;
-	}
-
-	parent_dir_inode->dir_children_count++;
-	ret = simplefs_inode_save(sb, parent_dir_inode);
-	if (ret) {
-		mutex_unlock(&simplefs_inodes_mgmt_lock);
-		mutex_unlock(&simplefs_directory_children_update_lock);
-
-		/* TODO: Remove the newly created inode from the disk and in-memory inode store
-		 * and also update the superblock, freemaps etc. to reflect the same.
-		 * Basically, Undo all actions done during this create call */
-		return ret;
-	}
+	/* The record written above is past the count until this is saved,
+	 * so it is left where it is when that fails */
+	ret = simplefs_dir_children_add(sb, parent_dir_inode, 1, dir_start);
+	if (ret)
+		goto out_drop;
 
-	mutex_unlock(&simplefs_inodes_mgmt_lock);
 	mutex_unlock(&simplefs_directory_children_update_lock);
 
 	inode_init_owner(inode, dir, mode);
+	/* For writeback, see simplefs_write_inode */
+	insert_inode_hash(inode);
 	d_add(dentry, inode);
 
 	return 0;
+
+	/* Undo all actions done during this create call. The inode is the
+	 * last one in the inode store, as the lock held all along keeps any
+	 * other from being added. */
+out_grown:
+	simplefs_dir_grow_undo(sb, parent_dir_inode, 1, dir_start);
+out_drop:
+	simplefs_inodes_drop(sb, 1);
+out_release:
+	if (sfs_inode->data_block_number)
+		simplefs_run_release(sb, sfs_inode->data_block_number, 1);
+out_iput:
+	mutex_unlock(&simplefs_directory_children_update_lock);
+	clear_nlink(inode);
+	iput(inode);
+	return ret;
+}
+
+static int simplefs_create_fs_object(struct inode *dir, struct dentry *dentry,
+				     umode_t mode)
+{
+	u64 start = ktime_get_ns();
+	int ret;
+
+	ret = __simplefs_create_fs_object(dir, dentry, mode);
+	simplefs_stat_latency(dir->i_sb, SIMPLEFS_OP_CREATE, start);
+	trace_simplefs_create(dir, dentry, mode, ret, start);
+	return ret;
 }
 
 static int simplefs_mkdir(struct inode *dir, struct dentry *dentry,
@@ -617,31 +4586,63 @@ static int simplefs_create(struct inode *dir, struct dentry *dentry,
 	return simplefs_create_fs_object(dir, dentry, mode);
 }
 
-static struct inode *simplefs_iget(struct super_block *sb, int ino)
+/* The inode in the inode cache, or read from the inode store. A file
+ * written to with delayed allocation only has its contents in the one
+ * in the cache, which stays there until it is written out. The inode
+ * store keeps no owner, so one read in takes it from dir, like a new
+ * one; a cached one keeps what it has. */
+static struct inode *simplefs_iget(struct super_block *sb, struct inode *dir,
+				   int ino)
 {
 	struct inode *inode;
 	struct simplefs_inode *sfs_inode;
+	uint64_t size;
 
+	inode = iget_locked(sb, ino);
+	if (!(inode->i_state & I_NEW))
+		return inode;
+
+	/* Never written, or with a wrong checksum */
 	sfs_inode = simplefs_get_inode(sb, ino);
+	if (unlikely(!sfs_inode)) {
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
 
-	inode = new_inode(sb);
-	inode->i_ino = ino;
 	inode->i_sb = sb;
 	inode->i_op = &simplefs_inode_ops;
+	inode_init_owner(inode, dir, sfs_inode->mode);
 
-	if (S_ISDIR(sfs_inode->mode))
+	if (S_ISDIR(sfs_inode->mode)) {
 		inode->i_fop = &simplefs_dir_operations;
-	else if (S_ISREG(sfs_inode->mode) || ino == SIMPLEFS_JOURNAL_INODE_NUMBER)
+	} else if (S_ISREG(sfs_inode->mode) || ino == SIMPLEFS_JOURNAL_INODE_NUMBER) {
 		inode->i_fop = &simplefs_file_operations;
-	else
+		inode->i_mapping->a_ops = &simplefs_aops;
+		/* copy_file_range and the clone ioctls go by i_size */
+		size = sfs_inode->file_size;
+		if (sfs_inode->mode & SIMPLEFS_INODE_COMPRESSED &&
+		    simplefs_compress_size(sb, sfs_inode, &size))
+			printk(KERN_ERR "Reading the size of the compressed inode [%d] failed",
+			       ino);
+		i_size_write(inode, size);
+	} else {
 		printk(KERN_ERR
 					 "Unknown inode type. Neither a directory nor a file");
+	}
 
-	/* FIXME: We should store these times to disk and retrieve them */
-	inode->i_atime = inode->i_mtime = inode->i_ctime =
-			current_time(inode);
+	/* Version 1 images have no times to give */
+	if (sfs_inode->ctime) {
+		inode->i_atime = ns_to_timespec64(sfs_inode->atime);
+		inode->i_mtime = ns_to_timespec64(sfs_inode->mtime);
+		inode->i_ctime = ns_to_timespec64(sfs_inode->ctime);
+	} else {
+		inode->i_atime = inode->i_mtime = inode->i_ctime =
+				current_time(inode);
+	}
+	set_nlink(inode, sfs_inode->links_count);
 
 	inode->i_private = sfs_inode;
+	unlock_new_inode(inode);
 
 	return inode;
 }
@@ -651,38 +4652,51 @@ struct dentry *simplefs_lookup(struct inode *parent_inode,
 {
 	struct simplefs_inode *parent = SIMPLEFS_INODE(parent_inode);
 	struct super_block *sb = parent_inode->i_sb;
-	struct buffer_head *bh;
-	struct simplefs_dir_record *record;
-	int i;
-
-	bh = sb_bread(sb, parent->data_block_number);
-	BUG_ON(!bh);
-	sfs_trace("Lookup in: ino=%llu, b=%llu\n",
-				parent->inode_no, parent->data_block_number);
+	struct buffer_head *bh = NULL;
+	struct simplefs_dir_record *record = NULL;
+	uint64_t per_block = simplefs_dir_records_per_block(sb->s_blocksize);
+	u64 start = ktime_get_ns();
+	int i, ret;
 
-	record = (struct simplefs_dir_record *)bh->b_data;
 	for (i = 0; i < parent->dir_children_count; i++) {
-		sfs_trace("Have file: '%s' (ino=%llu)\n",
-					record->filename, record->inode_no);
-
-		if (!strcmp(record->filename, child_dentry->d_name.name)) {
-			/* FIXME: There is a corner case where if an allocated inode,
-			 * is not written to the inode store, but the inodes_count is
-			 * incremented. Then if the random string on the disk matches
-			 * with the filename that we are comparing above, then we
-			 * will use an invalid uninitialized inode */
-
-			struct inode *inode = simplefs_iget(sb, record->inode_no);
-			inode_init_owner(inode, parent_inode, SIMPLEFS_INODE(inode)->mode);
+		if (i % per_block == 0) {
+			brelse(bh);
+			bh = simplefs_bread(sb, parent->data_block_number + i / per_block);
+			BUG_ON(!bh);
+			ret = simplefs_block_verify(sb, bh);
+			if (ret) {
+				brelse(bh);
+				return ERR_PTR(ret);
+			}
+			record = (struct simplefs_dir_record *)bh->b_data;
+		}
+		if (simplefs_dir_record_match(record, child_dentry->d_name.name,
+					      child_dentry->d_name.len)) {
+			/* The record and the inode store are checked against
+			 * their checksums, and an inode that was counted but
+			 * never written to the inode store does not have the
+			 * number the record has: both fail here rather than
+			 * give an uninitialized inode */
+			struct inode *inode = simplefs_iget(sb, parent_inode,
+							    le64_to_cpu(record->inode_no));
+			brelse(bh);
+			if (IS_ERR(inode))
+				return ERR_CAST(inode);
 			d_add(child_dentry, inode);
+			simplefs_stat_inc(sb, SIMPLEFS_STAT_LOOKUP_HITS);
+			simplefs_stat_latency(sb, SIMPLEFS_OP_LOOKUP, start);
+			trace_simplefs_lookup(parent_inode, child_dentry,
+					      inode->i_ino, start);
 			return NULL;
 		}
 		record++;
 	}
+	brelse(bh);
 
-	printk(KERN_ERR
-	       "No inode found for the filename [%s]\n",
-	       child_dentry->d_name.name);
+	/* A miss is the normal case for every create */
+	simplefs_stat_inc(sb, SIMPLEFS_STAT_LOOKUP_MISSES);
+	simplefs_stat_latency(sb, SIMPLEFS_OP_LOOKUP, start);
+	trace_simplefs_lookup(parent_inode, child_dentry, 0, start);
 
 	return NULL;
 }
@@ -693,24 +4707,144 @@ struct dentry *simplefs_lookup(struct inode *parent_inode,
  */
 void simplefs_destroy_inode(struct inode *inode)
 {
-	struct simplefs_inode *sfs_inode = SIMPLEFS_INODE(inode);
+	struct simplefs_inode_info *info = SIMPLEFS_INODE_INFO(inode);
+
+	trace_simplefs_destroy_inode(inode);
+
+	/* Those that could not be read in (see simplefs_iget) have none */
+	if (!info)
+		return;
 
-	printk(KERN_INFO "Freeing private data of inode %p (%lu)\n",
-	       sfs_inode, inode->i_ino);
-	kmem_cache_free(sfs_inode_cachep, sfs_inode);
+	/* Dirty inodes are written out before they are evicted, and that
+	 * only fails on an I/O error, see simplefs_delalloc_flush */
+	if (info->delalloc_blocks)
+		printk(KERN_ERR "simplefs: the contents of inode [%lu] were never written out\n",
+		       inode->i_ino);
+	simplefs_delalloc_release(inode, 0);
+	info->dedup_unlisted = false;
+
+	kmem_cache_free(sfs_inode_cachep, info);
+}
+
+/* Destroy the journal, which drops its inode, if it is in one, and
+ * close the device it is on, if it has one of its own. On unmount, and
+ * when a mount fails once it was loaded. */
+static void simplefs_journal_release(struct super_block *sb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+	struct simplefs_busy_run *busy, *next;
+
+	if (sbi->journal)
+		WARN_ON(jbd2_journal_destroy(sbi->journal) < 0);
+	sbi->journal = NULL;
+	/* Which has nothing left to replay */
+	list_for_each_entry_safe(busy, next, &sbi->busy_runs, list) {
+		list_del(&busy->list);
+		kfree(busy);
+	}
+	if (sbi->journal_bdev) {
+		blkdev_put(sbi->journal_bdev, FMODE_READ|FMODE_WRITE|FMODE_EXCL);
+		sbi->journal_bdev = NULL;
+	}
 }
 
 static void simplefs_put_super(struct super_block *sb)
 {
-	struct simplefs_super_block *sfs_sb = SIMPLEFS_SB(sb);
-	if (sfs_sb->journal)
-		WARN_ON(jbd2_journal_destroy(sfs_sb->journal) < 0);
-	sfs_sb->journal = NULL;
+	simplefs_journal_release(sb);
+	simplefs_cbt_unload(sb);
+	simplefs_dedup_unload(sb);
+}
+
+/* Called for every df, so it only reads the per-CPU counters. What it
+ * reports can be off by a little for as long as allocations are going
+ * on at the same time on other CPUs. */
+static int simplefs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+	buf->f_type = SIMPLEFS_MAGIC;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = sbi->sb->blocks_count;
+	/* The blocks between the two devices do not exist */
+	if (sbi->sb->meta_block)
+		buf->f_blocks -= sbi->sb->meta_block - sbi->sb->data_dev_blocks;
+	/* Those reserved for delayed allocation are as good as taken */
+	buf->f_bfree = max_t(s64, percpu_counter_read_positive(&sbi->free_blocks) -
+			     percpu_counter_read_positive(&sbi->delalloc_blocks), 0);
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = sbi->sb->inodes_max;
+	buf->f_ffree = percpu_counter_read_positive(&sbi->free_inodes);
+	buf->f_namelen = SIMPLEFS_FILENAME_MAXLEN - 1;
+	buf->f_fsid.val[0] = (u32)id;
+	buf->f_fsid.val[1] = (u32)(id >> 32);
+
+	return 0;
+}
+
+/* Bring the counters back in line with the on-disk counts, which are
+ * only ever changed with simplefs_sb_lock held */
+static void simplefs_sb_reset_counters(struct super_block *vsb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(vsb);
+
+	percpu_counter_set(&sbi->free_blocks, simplefs_sb_free_blocks(sbi->sb));
+	percpu_counter_set(&sbi->free_inodes,
+			   sbi->sb->inodes_max - sbi->sb->inodes_count);
+}
+
+static int simplefs_sync_fs(struct super_block *vsb, int wait)
+{
+	mutex_lock(&simplefs_sb_lock);
+	simplefs_sb_reset_counters(vsb);
+	mutex_unlock(&simplefs_sb_lock);
+
+	return simplefs_cbt_sync(vsb);
+}
+
+/* Inodes are marked dirty for their times, and for what delayed
+ * allocation has in memory, which is written out here: everything else
+ * is saved as soon as it changes */
+static int simplefs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+	struct super_block *sb = inode->i_sb;
+	int ret;
+
+	if (READ_ONCE(SIMPLEFS_INODE_INFO(inode)->delalloc_blocks)) {
+		/* Background writeback does not wait for writers: the
+		 * inode is written out on a later pass instead */
+		if (wbc->sync_mode == WB_SYNC_ALL) {
+			inode_lock(inode);
+		} else if (!inode_trylock(inode)) {
+			mark_inode_dirty(inode);
+			return 0;
+		}
+		ret = simplefs_delalloc_flush(inode);
+		inode_unlock(inode);
+		if (ret) {
+			mark_inode_dirty(inode);
+			return ret;
+		}
+	}
+
+	if (SIMPLEFS_SB(sb)->version < SIMPLEFS_VERSION_2)
+		return 0;
+
+	if (simplefs_lock(sb, &simplefs_inodes_mgmt_lock, SIMPLEFS_LOCK_INODES))
+		return -EINTR;
+	simplefs_inode_set_times(inode);
+	ret = simplefs_inode_save(sb, SIMPLEFS_INODE(inode));
+	mutex_unlock(&simplefs_inodes_mgmt_lock);
+	return ret;
 }
 
 static const struct super_operations simplefs_sops = {
 	.destroy_inode = simplefs_destroy_inode,
+	.write_inode = simplefs_write_inode,
 	.put_super = simplefs_put_super,
+	.statfs = simplefs_statfs,
+	.sync_fs = simplefs_sync_fs,
 };
 
 static int simplefs_load_journal(struct super_block *sb, int devnum)
@@ -720,51 +4854,144 @@ static int simplefs_load_journal(struct super_block *sb, int devnum)
 	dev_t dev;
 	struct block_device *bdev;
 	int hblock, blocksize, len;
-	struct simplefs_super_block *sfs_sb = SIMPLEFS_SB(sb);
 
 	dev = new_decode_dev(devnum);
 	printk(KERN_INFO "Journal device is: %s\n", __bdevname(dev, b));
 
+	if (SIMPLEFS_SB_INFO(sb)->journal) {
+		printk(KERN_ERR "simplefs: the journal was given twice\n");
+		return -EINVAL;
+	}
+
 	bdev = blkdev_get_by_dev(dev, FMODE_READ|FMODE_WRITE|FMODE_EXCL, sb);
 	if (IS_ERR(bdev))
-		return 1;
+		return PTR_ERR(bdev);
 	blocksize = sb->s_blocksize;
 	hblock = bdev_logical_block_size(bdev);
 	len = SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED;
 
 	journal = jbd2_journal_init_dev(bdev, sb->s_bdev, 1, -1, blocksize);
-	if (!journal) {
+	if (IS_ERR_OR_NULL(journal)) {
 		printk(KERN_ERR "Can't load journal\n");
-		return 1;
+		blkdev_put(bdev, FMODE_READ|FMODE_WRITE|FMODE_EXCL);
+		return journal ? PTR_ERR(journal) : -EINVAL;
 	}
 	journal->j_private = sb;
 
-	sfs_sb->journal = journal;
+	SIMPLEFS_SB_INFO(sb)->journal = journal;
+	SIMPLEFS_SB_INFO(sb)->journal_bdev = bdev;
 
 	return 0;
 }
+/* The journal in a file: the journal inode of the image, which
+ * mkfs-simplefs lays out in one run with a jbd2 super block first, or a
+ * file given with -o journal_path=. jbd2 finds its blocks with bmap.
+ * Takes the reference to the inode, which jbd2 drops when the journal
+ * is destroyed. */
 static int simplefs_sb_load_journal(struct super_block *sb, struct inode *inode)
 {
 	struct journal_s *journal;
-	struct simplefs_super_block *sfs_sb = SIMPLEFS_SB(sb);
 
+	if (SIMPLEFS_SB_INFO(sb)->journal) {
+		printk(KERN_ERR "simplefs: the journal was given twice\n");
+		iput(inode);
+		return -EINVAL;
+	}
+
+	/* Since 6.6 an error pointer, NULL before */
 	journal = jbd2_journal_init_inode(inode);
-	if (!journal) {
+	if (IS_ERR_OR_NULL(journal)) {
 		printk(KERN_ERR "Can't load journal\n");
-		return 1;
+		iput(inode);
+		return journal ? PTR_ERR(journal) : -EINVAL;
 	}
 	journal->j_private = sb;
 
-	sfs_sb->journal = journal;
+	SIMPLEFS_SB_INFO(sb)->journal = journal;
+
+	return 0;
+}
+
+/* Open the metadata device of an image made with mkfs-simplefs -m. Its
+ * first block has a copy of the super block, which must be that of the
+ * image being mounted. */
+static int simplefs_load_meta_dev(struct super_block *sb, dev_t dev)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+	struct simplefs_super_block *sfs_sb = sbi->sb;
+	struct simplefs_super_block_disk *copy;
+	struct block_device *bdev;
+	struct buffer_head *bh;
+	char b[BDEVNAME_SIZE];
+	u64 bytes;
+	int ret = -EINVAL;
+
+	printk(KERN_INFO "Metadata device is: %s\n", __bdevname(dev, b));
 
+	if (!sfs_sb->meta_block || sbi->meta_bdev) {
+		printk(KERN_ERR "simplefs: the image has no metadata device, or it was given twice\n");
+		return -EINVAL;
+	}
+
+	bdev = blkdev_get_by_dev(dev, FMODE_READ|FMODE_WRITE|FMODE_EXCL, sb);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	bytes = bdev_nr_bytes(bdev);
+#else
+	bytes = i_size_read(bdev->bd_inode);
+#endif
+	if (bytes / sb->s_blocksize < sfs_sb->blocks_count - sfs_sb->meta_block) {
+		printk(KERN_ERR "simplefs: the metadata device is too small\n");
+		goto fail;
+	}
+	if (set_blocksize(bdev, sb->s_blocksize)) {
+		printk(KERN_ERR "simplefs: the metadata device does not support a block size of [%lu]\n",
+		       sb->s_blocksize);
+		goto fail;
+	}
+
+	bh = __bread(bdev, 0, sb->s_blocksize);
+	if (!bh) {
+		ret = -EIO;
+		goto fail;
+	}
+	copy = (struct simplefs_super_block_disk *)bh->b_data;
+	if (le64_to_cpu(copy->magic) != SIMPLEFS_MAGIC ||
+	    le64_to_cpu(copy->blocks_count) != sfs_sb->blocks_count ||
+	    le64_to_cpu(copy->meta_block) != sfs_sb->meta_block ||
+	    le64_to_cpu(copy->data_dev_blocks) != sfs_sb->data_dev_blocks ||
+	    le64_to_cpu(copy->group_desc_block) != sfs_sb->group_desc_block) {
+		printk(KERN_ERR "simplefs: this is not the metadata device of the image\n");
+		brelse(bh);
+		goto fail;
+	}
+	brelse(bh);
+
+	sbi->meta_bdev = bdev;
 	return 0;
+
+fail:
+	blkdev_put(bdev, FMODE_READ|FMODE_WRITE|FMODE_EXCL);
+	return ret;
 }
 
 #define SIMPLEFS_OPT_JOURNAL_DEV 1
 #define SIMPLEFS_OPT_JOURNAL_PATH 2
+#define SIMPLEFS_OPT_COMPRESS 3
+#define SIMPLEFS_OPT_META_DEV 4
+#define SIMPLEFS_OPT_META_PATH 5
+#define SIMPLEFS_OPT_NODELALLOC 6
+#define SIMPLEFS_OPT_DEDUP 7
 static const match_table_t tokens = {
 	{SIMPLEFS_OPT_JOURNAL_DEV, "journal_dev=%u"},
 	{SIMPLEFS_OPT_JOURNAL_PATH, "journal_path=%s"},
+	{SIMPLEFS_OPT_COMPRESS, "compress"},
+	{SIMPLEFS_OPT_META_DEV, "meta_dev=%u"},
+	{SIMPLEFS_OPT_META_PATH, "meta_path=%s"},
+	{SIMPLEFS_OPT_NODELALLOC, "nodelalloc"},
+	{SIMPLEFS_OPT_DEDUP, "dedup"},
 };
 static int simplefs_parse_options(struct super_block *sb, char *options)
 {
@@ -794,30 +5021,84 @@ static int simplefs_parse_options(struct super_block *sb, char *options)
 				struct inode *journal_inode;
 				struct path path;
 
-				BUG_ON(!(journal_path = match_strdup(&args[0])));
+				journal_path = match_strdup(&args[0]);
+				if (!journal_path)
+					return -ENOMEM;
 				ret = kern_path(journal_path, LOOKUP_FOLLOW, &path);
+				kfree(journal_path);
 				if (ret) {
 					printk(KERN_ERR "could not find journal device path: error %d\n", ret);
-					kfree(journal_path);
+					return ret;
 				}
 
 				journal_inode = path.dentry->d_inode;
-
-				path_put(&path);
-				kfree(journal_path);
-
 				if (S_ISBLK(journal_inode->i_mode)) {
 					unsigned long journal_devnum = new_encode_dev(journal_inode->i_rdev);
+					path_put(&path);
 					if ((ret = simplefs_load_journal(sb, journal_devnum)))
 						return ret;
 				} else {
-					/** Seems didn't work properly */
+					/* The file is used long after the path
+					 * is put: it needs a reference of its own */
+					ihold(journal_inode);
+					path_put(&path);
 					if ((ret = simplefs_sb_load_journal(sb, journal_inode)))
 						return ret;
 				}
 
 				break;
 			}
+
+			case SIMPLEFS_OPT_COMPRESS:
+				SIMPLEFS_SB_INFO(sb)->compress = true;
+				break;
+
+			case SIMPLEFS_OPT_NODELALLOC:
+				SIMPLEFS_SB_INFO(sb)->delalloc = false;
+				break;
+
+			case SIMPLEFS_OPT_DEDUP:
+				if (SIMPLEFS_SB_INFO(sb)->dedup)
+					break;
+				SIMPLEFS_SB_INFO(sb)->dedup =
+					kvcalloc(1 << SIMPLEFS_DEDUP_BITS,
+						 sizeof(struct simplefs_dedup_entry),
+						 GFP_KERNEL);
+				if (!SIMPLEFS_SB_INFO(sb)->dedup)
+					return -ENOMEM;
+				spin_lock_init(&SIMPLEFS_SB_INFO(sb)->dedup_lock);
+				break;
+
+			case SIMPLEFS_OPT_META_DEV:
+				if (args->from && match_int(args, &arg))
+					return 1;
+				if ((ret = simplefs_load_meta_dev(sb, new_decode_dev(arg))))
+					return ret;
+				break;
+
+			case SIMPLEFS_OPT_META_PATH:
+			{
+				char *meta_path;
+				struct path path;
+				dev_t dev;
+
+				meta_path = match_strdup(&args[0]);
+				if (!meta_path)
+					return -ENOMEM;
+				ret = kern_path(meta_path, LOOKUP_FOLLOW, &path);
+				kfree(meta_path);
+				if (ret) {
+					printk(KERN_ERR "could not find metadata device path: error %d\n", ret);
+					return ret;
+				}
+
+				dev = path.dentry->d_inode->i_rdev;
+				ret = S_ISBLK(path.dentry->d_inode->i_mode) ? 0 : -ENOTBLK;
+				path_put(&path);
+				if (ret || (ret = simplefs_load_meta_dev(sb, dev)))
+					return ret;
+				break;
+			}
 		}
 	}
 
@@ -830,30 +5111,90 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct inode *root_inode;
 	struct buffer_head *bh;
-	struct simplefs_super_block *sb_disk;
+	struct simplefs_super_block_disk *disk;
+	struct simplefs_super_block *sb_disk, loaded;
+	struct simplefs_sb_info *sbi;
+	struct journal_s *journal;
+	const char *invalid;
 	int ret = -EPERM;
 
+	uint64_t block_size;
+
+	/* The block size is only known after reading the super block, which
+	 * fits in the smallest block size we support. Read it with that. */
+	if (!sb_min_blocksize(sb, SIMPLEFS_MIN_BLOCK_SIZE)) {
+		printk(KERN_ERR "simplefs could not set the initial block size");
+		return -EINVAL;
+	}
+
 	bh = sb_bread(sb, SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER);
 	BUG_ON(!bh);
 
-	sb_disk = (struct simplefs_super_block *)bh->b_data;
+	disk = (struct simplefs_super_block_disk *)bh->b_data;
 
 	printk(KERN_INFO "The magic number obtained in disk is: [%llu]\n",
-	       sb_disk->magic);
+	       le64_to_cpu(disk->magic));
 
-	if (unlikely(sb_disk->magic != SIMPLEFS_MAGIC)) {
+	if (unlikely(le64_to_cpu(disk->magic) != SIMPLEFS_MAGIC)) {
 		printk(KERN_ERR
 		       "The filesystem that you try to mount is not of type simplefs. Magicnumber mismatch.");
 		goto release;
 	}
 
-	if (unlikely(sb_disk->block_size != SIMPLEFS_DEFAULT_BLOCK_SIZE)) {
+	block_size = le64_to_cpu(disk->block_size);
+	if (unlikely(!simplefs_block_size_valid(block_size))) {
 		printk(KERN_ERR
 		       "simplefs seem to be formatted using a non-standard block size.");
 		goto release;
 	}
-	/** XXX: Avoid this hack, by adding one more sb wrapper, but non-disk */
-	sb_disk->journal = NULL;
+
+	/* A buffer head cannot be larger than a page, which mkfs-simplefs
+	 * keeps to */
+	if (unlikely(block_size > PAGE_SIZE)) {
+		printk(KERN_ERR
+		       "simplefs block size [%llu] is larger than the page size.",
+		       block_size);
+		goto release;
+	}
+
+	if (block_size != sb->s_blocksize) {
+		brelse(bh);
+		if (!sb_set_blocksize(sb, block_size)) {
+			printk(KERN_ERR
+			       "The device does not support a block size of [%llu]",
+			       block_size);
+			return -EINVAL;
+		}
+
+		bh = sb_bread(sb, SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER);
+		BUG_ON(!bh);
+		disk = (struct simplefs_super_block_disk *)bh->b_data;
+	}
+
+	simplefs_sb_load(disk, &loaded);
+	sb_disk = &loaded;
+
+	/* Images without a block bitmap keep tracking free blocks in
+	 * the free_blocks mask */
+	if (!sb_disk->groups_count)
+		simplefs_sb_legacy_geometry(sb_disk);
+
+	invalid = simplefs_sb_check(sb_disk);
+	if (unlikely(invalid)) {
+		printk(KERN_ERR "simplefs: %s\n", invalid);
+		goto release;
+	}
+
+	/* Features this version does not know, but can read */
+	if (simplefs_sb_read_only(sb_disk) && !sb_rdonly(sb)) {
+		printk(KERN_ERR "simplefs: the image has features this version can only read, mount it read-only\n");
+		goto release;
+	}
+
+	if (unlikely(!simplefs_sb_csum_verify(sb_disk, disk))) {
+		printk(KERN_ERR "simplefs: the super block has a wrong checksum, run fsck-simplefs\n");
+		goto release;
+	}
 
 	printk(KERN_INFO
 	       "simplefs filesystem of version [%llu] formatted with a block size of [%llu] detected in the device.\n",
@@ -862,12 +5203,68 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 	/* A magic number that uniquely identifies our filesystem type */
 	sb->s_magic = SIMPLEFS_MAGIC;
 
-	/* For all practical purposes, we will be using this s_fs_info as the super block */
-	sb->s_fs_info = sb_disk;
+	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+	if (!sbi) {
+		ret = -ENOMEM;
+		goto release;
+	}
+	sb->s_fs_info = sbi;
+
+	/* For all practical purposes, we will be using this as the super
+	 * block. It is a copy, as the buffer is released once mounted. */
+	sbi->sb = kmemdup(sb_disk, sizeof(*sb_disk), GFP_KERNEL);
+	if (!sbi->sb) {
+		ret = -ENOMEM;
+		goto release;
+	}
+	sb_disk = sbi->sb;
+	sbi->vsb = sb;
+	init_rwsem(&sbi->cbt_sem);
+	INIT_LIST_HEAD(&sbi->busy_runs);
+
+	if (percpu_counter_init(&sbi->free_blocks, 0, GFP_KERNEL) ||
+	    percpu_counter_init(&sbi->free_inodes, 0, GFP_KERNEL) ||
+	    percpu_counter_init(&sbi->delalloc_blocks, 0, GFP_KERNEL)) {
+		ret = -ENOMEM;
+		goto release;
+	}
+	simplefs_sb_reset_counters(sb);
+
+	sbi->stats = alloc_percpu(struct simplefs_stats);
+	if (!sbi->stats) {
+		ret = -ENOMEM;
+		goto release;
+	}
+	if ((ret = simplefs_sysfs_register(sb)))
+		goto release;
 
-	sb->s_maxbytes = SIMPLEFS_DEFAULT_BLOCK_SIZE;
+	sb->s_maxbytes = simplefs_max_bytes(sb);
 	sb->s_op = &simplefs_sops;
 
+	/* Images without feature flags cannot tell older kernels that some
+	 * files have no blocks, and those without a bitmap cannot give
+	 * a run of more than a block */
+	sbi->delalloc = sb_disk->version >= SIMPLEFS_VERSION_2 && sb_disk->groups_count;
+
+	/* Before anything is read from the metadata device */
+	if ((ret = simplefs_parse_options(sb, data)))
+		goto out_journal;
+
+	/* Files share their runs like clones, and only when first written
+	 * out */
+	if (sbi->dedup && (!sb_disk->refcount_blocks || !sbi->delalloc)) {
+		printk(KERN_ERR "simplefs: -o dedup needs the reference count table and delayed allocation\n");
+		ret = -EINVAL;
+		goto out_journal;
+	}
+
+	if (sb_disk->meta_block && !sbi->meta_bdev) {
+		printk(KERN_ERR
+		       "simplefs: the image has its metadata on another device, mount it with -o meta_path= or meta_dev=\n");
+		ret = -EINVAL;
+		goto out_journal;
+	}
+
 	root_inode = new_inode(sb);
 	root_inode->i_ino = SIMPLEFS_ROOTDIR_INODE_NUMBER;
 	inode_init_owner(root_inode, NULL, S_IFDIR);
@@ -879,6 +5276,12 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 
 	root_inode->i_private =
 	    simplefs_get_inode(sb, SIMPLEFS_ROOTDIR_INODE_NUMBER);
+	if (!root_inode->i_private) {
+		printk(KERN_ERR "simplefs: the root directory inode could not be read\n");
+		iput(root_inode);
+		ret = -EIO;
+		goto out_journal;
+	}
 
 	/* TODO: move such stuff into separate header. */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 3, 0)
@@ -891,21 +5294,76 @@ int simplefs_fill_super(struct super_block *sb, void *data, int silent)
 
 	if (!sb->s_root) {
 		ret = -ENOMEM;
-		goto release;
+		goto out_journal;
 	}
 
-	if ((ret = simplefs_parse_options(sb, data)))
-		goto release;
+	/* Unless another journal was given, the one mkfs-simplefs made,
+	 * which older images have no room for */
+	if (!sbi->journal && sb_disk->journal_blocks < SIMPLEFS_MIN_JOURNAL_BLOCKS) {
+		printk(KERN_ERR
+		       "simplefs: the image has no internal journal, mount it with -o journal_dev= or journal_path=\n");
+		ret = -EINVAL;
+		goto out_journal;
+	}
 
-	if (!sb_disk->journal) {
+	if (!sbi->journal && sbi->meta_bdev) {
+		/* The journal inode maps its blocks as if they were on the
+		 * data device, while they are on the metadata device */
+		journal = jbd2_journal_init_dev(sbi->meta_bdev, sb->s_bdev,
+						sb_disk->journal_block - sb_disk->meta_block,
+						sb_disk->journal_blocks, sb->s_blocksize);
+		if (IS_ERR_OR_NULL(journal)) {
+			printk(KERN_ERR "Can't load journal\n");
+			ret = journal ? PTR_ERR(journal) : -EINVAL;
+			goto out_journal;
+		}
+		journal->j_private = sb;
+		sbi->journal = journal;
+	} else if (!sbi->journal) {
 		struct inode *journal_inode;
-		journal_inode = simplefs_iget(sb, SIMPLEFS_JOURNAL_INODE_NUMBER);
+		journal_inode = simplefs_iget(sb, NULL, SIMPLEFS_JOURNAL_INODE_NUMBER);
+		if (IS_ERR(journal_inode)) {
+			ret = PTR_ERR(journal_inode);
+			goto out_journal;
+		}
 
-		ret = simplefs_sb_load_journal(sb, journal_inode);
-		goto release;
+		if ((ret = simplefs_sb_load_journal(sb, journal_inode)))
+			goto out_journal;
 	}
-	ret = jbd2_journal_load(sb_disk->journal);
 
+	/* Replays what a crash left in it */
+	ret = jbd2_journal_load(sbi->journal);
+	if (ret)
+		goto out_journal;
+
+	if (simplefs_sb_cbt_block(sb_disk) && (ret = simplefs_cbt_load(sb)))
+		goto out_journal;
+
+	/* Images without feature flags cannot tell others about the index,
+	 * which is then only kept while mounted */
+	if (simplefs_sb_dedup_block(sb_disk))
+		ret = simplefs_dedup_load(sb);
+	else if (sbi->dedup && !sb_rdonly(sb) && sb_disk->version >= SIMPLEFS_VERSION_2)
+		ret = simplefs_dedup_enable(sb);
+	if (ret)
+		goto out_journal;
+
+	brelse(bh);
+	return 0;
+
+	/* Given back here rather than left to the tear down of the super
+	 * block, which only destroys the journal once there is a root */
+out_journal:
+	brelse(sbi->cbt_bh);
+	sbi->cbt_bh = NULL;
+	brelse(sbi->dedup_bh);
+	sbi->dedup_bh = NULL;
+	simplefs_journal_release(sb);
+	if (sbi->meta_bdev) {
+		sync_blockdev(sbi->meta_bdev);
+		blkdev_put(sbi->meta_bdev, FMODE_READ|FMODE_WRITE|FMODE_EXCL);
+		sbi->meta_bdev = NULL;
+	}
 release:
 	brelse(bh);
 
@@ -931,12 +5389,31 @@ static struct dentry *simplefs_mount(struct file_system_type *fs_type,
 
 static void simplefs_kill_superblock(struct super_block *sb)
 {
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+
 	printk(KERN_INFO
 	       "simplefs superblock is destroyed. Unmount succesful.\n");
-	/* This is just a dummy function as of now. As our filesystem gets matured,
-	 * we will do more meaningful operations here */
+
+	/* Before the super block is torn down, as the files in there read
+	 * it. Also reached when simplefs_fill_super failed half way. */
+	if (sbi && sbi->kobj.state_in_sysfs)
+		simplefs_sysfs_unregister(sb);
 
 	kill_block_super(sb);
+
+	if (sbi) {
+		if (sbi->meta_bdev) {
+			sync_blockdev(sbi->meta_bdev);
+			blkdev_put(sbi->meta_bdev, FMODE_READ|FMODE_WRITE|FMODE_EXCL);
+		}
+		kvfree(sbi->dedup);
+		free_percpu(sbi->stats);
+		percpu_counter_destroy(&sbi->free_blocks);
+		percpu_counter_destroy(&sbi->free_inodes);
+		percpu_counter_destroy(&sbi->delalloc_blocks);
+		kfree(sbi->sb);
+		kfree(sbi);
+	}
 	return;
 }
 
@@ -948,24 +5425,49 @@ struct file_system_type simplefs_fs_type = {
 	.fs_flags = FS_REQUIRES_DEV,
 };
 
+/* Objects of sfs_inode_cachep are freed with no range locked, and with
+ * nothing left for delayed allocation, so this only needs doing once for
+ * each */
+static void simplefs_inode_init_once(void *p)
+{
+	struct simplefs_inode_info *info = p;
+
+	spin_lock_init(&info->ranges_lock);
+	INIT_LIST_HEAD(&info->ranges);
+	init_waitqueue_head(&info->ranges_wait);
+	info->delalloc = NULL;
+	info->delalloc_capacity = 0;
+	info->delalloc_blocks = 0;
+	info->dedup_unlisted = false;
+}
+
 static int simplefs_init(void)
 {
 	int ret;
 
 	sfs_inode_cachep = kmem_cache_create("sfs_inode_cache",
-	                                     sizeof(struct simplefs_inode),
+	                                     sizeof(struct simplefs_inode_info),
 	                                     0,
 	                                     (SLAB_RECLAIM_ACCOUNT| SLAB_MEM_SPREAD),
-	                                     NULL);
+	                                     simplefs_inode_init_once);
 	if (!sfs_inode_cachep) {
 		return -ENOMEM;
 	}
 
+	ret = simplefs_sysfs_init();
+	if (ret) {
+		kmem_cache_destroy(sfs_inode_cachep);
+		return ret;
+	}
+
 	ret = register_filesystem(&simplefs_fs_type);
-	if (likely(ret == 0))
+	if (likely(ret == 0)) {
 		printk(KERN_INFO "Successfully registered simplefs\n");
-	else
+	} else {
 		printk(KERN_ERR "Failed to register simplefs. Error:[%d]", ret);
+		simplefs_sysfs_exit();
+		kmem_cache_destroy(sfs_inode_cachep);
+	}
 
 	return ret;
 }
@@ -975,6 +5477,7 @@ static void simplefs_exit(void)
 	int ret;
 
 	ret = unregister_filesystem(&simplefs_fs_type);
+	simplefs_sysfs_exit();
 	kmem_cache_destroy(sfs_inode_cachep);
 
 	if (likely(ret == 0))
@@ -988,4 +5491,6 @@ module_init(simplefs_init);
 module_exit(simplefs_exit);
 
 MODULE_LICENSE("CC0");
+/* For the checksums, see simplefs_crc32c */
+MODULE_SOFTDEP("pre: crc32c");
 MODULE_AUTHOR("Sankar P");
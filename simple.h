@@ -1,9 +1,50 @@
+#ifndef SIMPLEFS_H
+#define SIMPLEFS_H
+
 
 
 #define SIMPLEFS_MAGIC 0x10032013
+
+/* simplefs_super_block.version. Images made before version 2 all have 1,
+ * whatever else changed since. */
+#define SIMPLEFS_VERSION_1 1
+#define SIMPLEFS_VERSION_2 2
+#define SIMPLEFS_VERSION SIMPLEFS_VERSION_2
+
+/* All that is on the disk is little-endian, whatever the host. The
+ * fields of the structures below that are on the disk are __le16,
+ * __le32 and __le64, read with le64_to_cpu and the like, and written
+ * with cpu_to_le64. The super block and the inodes are worked with in a
+ * copy in the byte order of the host, see simplefs_sb_load and
+ * simplefs_inode_load. */
+#ifndef __KERNEL__
+#include <stdint.h>
+#include <linux/types.h>
+
+/* Not le64toh and the like, which depend on the feature test macros */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define le16_to_cpu(x) ((uint16_t)(x))
+#define le32_to_cpu(x) ((uint32_t)(x))
+#define le64_to_cpu(x) ((uint64_t)(x))
+#else
+#define le16_to_cpu(x) __builtin_bswap16(x)
+#define le32_to_cpu(x) __builtin_bswap32(x)
+#define le64_to_cpu(x) __builtin_bswap64(x)
+#endif
+#define cpu_to_le16(x) le16_to_cpu(x)
+#define cpu_to_le32(x) le32_to_cpu(x)
+#define cpu_to_le64(x) le64_to_cpu(x)
+
+static inline void le64_add_cpu(__le64 *var, uint64_t val)
+{
+	*var = cpu_to_le64(le64_to_cpu(*var) + val);
+}
+#endif
 #define SIMPLEFS_JOURNAL_MAGIC = 0x20032013
 
 #define SIMPLEFS_DEFAULT_BLOCK_SIZE 4096
+#define SIMPLEFS_MIN_BLOCK_SIZE 1024
+#define SIMPLEFS_MAX_BLOCK_SIZE 65536
 #define SIMPLEFS_FILENAME_MAXLEN 255
 #define SIMPLEFS_START_INO 10
 /**
@@ -26,22 +67,35 @@
 #endif
 
 /* Hard-coded inode number for the root directory */
-const int SIMPLEFS_ROOTDIR_INODE_NUMBER = 1;
+#define SIMPLEFS_ROOTDIR_INODE_NUMBER 1
 
 /* The disk block where super block is stored */
-const int SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER = 0;
+#define SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER 0
 
 /* The disk block where the inodes are stored */
-const int SIMPLEFS_INODESTORE_BLOCK_NUMBER = 1;
+#define SIMPLEFS_INODESTORE_BLOCK_NUMBER 1
 
 /** Journal settings */
-const int SIMPLEFS_JOURNAL_INODE_NUMBER = 2;
-const int SIMPLEFS_JOURNAL_BLOCK_NUMBER = 2;
-const int SIMPLEFS_JOURNAL_BLOCKS = 2;
+#define SIMPLEFS_JOURNAL_INODE_NUMBER 2
+#define SIMPLEFS_JOURNAL_BLOCK_NUMBER 2
+#define SIMPLEFS_JOURNAL_BLOCKS 2
+
+/* mkfs-simplefs sizes the inode store with one inode for every
+ * SIMPLEFS_DEFAULT_INODE_RATIO bytes of the device, and the journal
+ * with one block for every SIMPLEFS_DEFAULT_JOURNAL_RATIO blocks,
+ * unless told otherwise on the command line */
+#define SIMPLEFS_DEFAULT_INODE_RATIO 16384
+#define SIMPLEFS_DEFAULT_JOURNAL_RATIO 256
+#define SIMPLEFS_MAX_JOURNAL_BLOCKS 32768
+
+/* The shortest journal jbd2 loads (JBD2_MIN_JOURNAL_BLOCKS). Images
+ * with a shorter one, as made before mkfs-simplefs wrote a journal
+ * super block, need -o journal_dev= or journal_path=. */
+#define SIMPLEFS_MIN_JOURNAL_BLOCKS 1024
 
 /* The disk block where the name+inode_number pairs of the
  * contents of the root directory are stored */
-const int SIMPLEFS_ROOTDIR_DATABLOCK_NUMBER = 4;
+#define SIMPLEFS_ROOTDIR_DATABLOCK_NUMBER 4
 
 #define SIMPLEFS_LAST_RESERVED_BLOCK SIMPLEFS_ROOTDIR_DATABLOCK_NUMBER
 #define SIMPLEFS_LAST_RESERVED_INODE SIMPLEFS_JOURNAL_INODE_NUMBER
@@ -50,31 +104,351 @@ const int SIMPLEFS_ROOTDIR_DATABLOCK_NUMBER = 4;
  * This gets stored as the data for a directory */
 struct simplefs_dir_record {
 	char filename[SIMPLEFS_FILENAME_MAXLEN];
-	uint64_t inode_no;
+	__le64 inode_no;
 };
 
+/* An inode, as the code works with it. Version 2 images store it as
+ * simplefs_inode_v2, and version 1 images as simplefs_inode_v1, see
+ * simplefs_inode_load. */
 struct simplefs_inode {
-	mode_t mode;
+	/* The type and permissions, and SIMPLEFS_INODE_* flags above them */
+	uint32_t mode;
+	uint32_t links_count;
 	uint64_t inode_no;
+
+	/* The root of the block map of the object. As its contents are a
+	 * single run of blocks (see simplefs_inode_blocks), that is the
+	 * first block of the run. */
 	uint64_t data_block_number;
 
 	union {
 		uint64_t file_size;
 		uint64_t dir_children_count;
 	};
+
+	/* Nanoseconds since the epoch, zero on version 1 images */
+	int64_t atime;
+	int64_t mtime;
+	int64_t ctime;
+
+	/* Of a sparse file (SIMPLEFS_INODE_SPARSE): the block of the
+	 * contents its run starts at, and how many blocks long the run is.
+	 * Zero on other objects, see simplefs_inode_blocks. */
+	uint32_t run_first;
+	uint32_t run_blocks;
 };
 
-const int SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;
+/* The inode of version 2 images, with the fields of simplefs_inode:
+ * fixed size, no implicit padding */
+struct simplefs_inode_v2 {
+	__le32 mode;
+	__le32 links_count;
+	__le64 inode_no;
+	__le64 data_block_number;
+
+	union {
+		__le64 file_size;
+		__le64 dir_children_count;
+	};
+
+	__le64 atime;
+	__le64 mtime;
+	__le64 ctime;
+
+	__le32 run_first;
+	__le32 run_blocks;
+};
+
+/* A cache line, so that inodes never straddle one */
+#define SIMPLEFS_INODE_SIZE 64
+
+/* The inode of version 1 images, with the layout of the (little-endian,
+ * 64 bit) hosts that made them: mode_t, then padding up to inode_no. It
+ * has no times, and one link. */
+struct simplefs_inode_v1 {
+	__le32 mode;
+	__le32 padding;
+	__le64 inode_no;
+	__le64 data_block_number;
+
+	union {
+		__le64 file_size;
+		__le64 dir_children_count;
+	};
+};
+
+/* Only the low 16 bits of simplefs_inode.mode are the type and the
+ * permissions of the object. The bits above are flags, which images
+ * made before there were any have all cleared. */
+#define SIMPLEFS_INODE_MODE_MASK 0xffff
+
+/* The contents of the file are compressed, see simplefs_compress_header.
+ * On a directory, the objects created in it get the flag too. */
+#define SIMPLEFS_INODE_COMPRESSED 0x10000
+
+/* The run of blocks of the file covers only some of its contents, given
+ * by run_first and run_blocks. The rest are holes, which read as zeroes
+ * and have no blocks. Only version 2 images have those fields. */
+#define SIMPLEFS_INODE_SPARSE 0x20000
+
+/* A compressed file is split into clusters of this many bytes (the last
+ * one may be shorter), each compressed with LZ4 on its own */
+#define SIMPLEFS_COMPRESS_CLUSTER_SIZE 16384
+
+/* The run of blocks of a compressed file starts with this header, then
+ * one simplefs_compress_cluster for each cluster. The clusters follow,
+ * in order, with room to spare after some of them. file_size in the
+ * inode is then the size of the run, and the size of the contents is
+ * kept in here. */
+struct simplefs_compress_header {
+	__le64 size;
+	__le64 reserved;
+};
+
+/* Where a cluster is, in bytes from the start of the run. A cluster that
+ * does not get any smaller is stored as it is, and then its length is
+ * that of its contents. The table is worked with in the byte order of
+ * the host, see simplefs_compress_table_load. */
+struct simplefs_compress_cluster {
+	uint64_t offset;
+	uint64_t length;
+};
+
+/* What SIMPLEFS_IOC_GETFRAG and SIMPLEFS_IOC_DEFRAG return about an
+ * open file: its run of blocks, and where the lowest free run it fits in
+ * starts, if that is before it, or start again. After a defrag, start
+ * is where the file went. */
+struct simplefs_defrag {
+	uint64_t start;
+	uint64_t blocks;
+	uint64_t goal;
+	uint64_t flags;
+};
+
+/* The run is shared with other files (see simplefs_clone), and is not
+ * moved */
+#define SIMPLEFS_DEFRAG_SHARED 0x1
+
+/* A file for SIMPLEFS_IOC_BULK_CREATE to make: a regular file named by
+ * the NUL terminated string at name, with the permissions in mode, less
+ * the umask, and size bytes of contents from data. Both are userspace
+ * addresses. reserved must be zero. */
+struct simplefs_bulk_entry {
+	uint64_t name;
+	uint64_t data;
+	uint64_t size;
+	uint32_t mode;
+	uint32_t reserved;
+};
+
+/* SIMPLEFS_IOC_BULK_CREATE makes the count files of the array at entries
+ * in the directory it is called on, and sets created to how many it
+ * made: the first ones, in order, also when it fails on the next. */
+struct simplefs_bulk_create {
+	uint64_t entries;
+	uint64_t count;
+	uint64_t created;
+};
+
+/* Changed block tracking, for incremental backups. The run of blocks at
+ * simplefs_super_block.cbt_block starts with this, followed by two
+ * bitmaps of bitmap_blocks blocks each, with a bit for every block of
+ * the image, in little endian bit order: that of the current epoch,
+ * and that of the epoch before it. A bit is set once its block has
+ * been written to in the epoch. The journal is in every epoch, as jbd2
+ * writes to it on its own, and the run itself is in none. */
+struct simplefs_cbt_header {
+	__le64 magic;
+	/* The current epoch, 0 before the first SIMPLEFS_IOC_CBT_EPOCH */
+	__le64 epoch;
+	/* Which of the two bitmaps is that of the current epoch */
+	__le64 current_bitmap;
+	__le64 bitmap_blocks;
+	/* SIMPLEFS_CBT_* */
+	__le64 flags;
+};
+
+#define SIMPLEFS_CBT_MAGIC 0x30032013
+
+/* The bitmaps were written out when the image was last unmounted.
+ * Cleared while it is mounted. */
+#define SIMPLEFS_CBT_CLEAN 0x1
+/* Some blocks written to in the current epoch may not be in its bitmap:
+ * the image was not unmounted cleanly, or something else than the
+ * kernel wrote to it (simplefs-fuse, fsck-simplefs -y). A backup of the
+ * epoch must read all of the image. */
+#define SIMPLEFS_CBT_INCOMPLETE 0x2
+/* The same, for the epoch before */
+#define SIMPLEFS_CBT_PREV_INCOMPLETE 0x4
+
+/* A run of blocks of the image written to in an epoch. Those from
+ * simplefs_super_block.meta_block on are on the metadata device. */
+struct simplefs_cbt_range {
+	uint64_t start;
+	uint64_t blocks;
+};
+
+/* The index of -o dedup, in a run of blocks of its own so that it
+ * outlives the mount: this header in the first block, and the slots from
+ * the second one on, as simplefs_dedup_disk_entry. */
+struct simplefs_dedup_header {
+	__le64 magic;
+	/* The number of slots, 1 << SIMPLEFS_DEDUP_BITS */
+	__le64 entries;
+	/* SIMPLEFS_DEDUP_* */
+	__le64 flags;
+};
+
+#define SIMPLEFS_DEDUP_MAGIC 0x20131030
+
+/* The slots are those the kernel had when the image was last unmounted.
+ * Cleared while it is mounted, and by anything else that writes to the
+ * image, as they may point to blocks that hold something else since. */
+#define SIMPLEFS_DEDUP_CLEAN 0x1
+
+/* The number of slots of the index, as a power of two */
+#define SIMPLEFS_DEDUP_BITS 12
+
+/* A run of blocks holding what a file had when it was written out, in
+ * the slot of the crc32c of its contents. start is 0 in an empty slot. */
+struct simplefs_dedup_disk_entry {
+	__le64 start;
+	__le32 blocks;
+	__le32 hash;
+};
+
+/* SIMPLEFS_IOC_CBT_EPOCH ends the current epoch and starts the next
+ * one, turning tracking on first if it was off. It returns the new
+ * epoch, and in flags SIMPLEFS_CBT_INCOMPLETE if the one it ended
+ * missed some blocks. Freeze the filesystem around it for the end of
+ * the epoch to be a consistent point. */
+struct simplefs_cbt_epoch {
+	uint64_t epoch;
+	uint64_t flags;
+};
+
+/* SIMPLEFS_IOC_CBT_RANGES fills the array of count ranges at ranges, a
+ * userspace address, with those of the blocks written to in epoch from
+ * block start on, in order, and sets count to how many it filled: fewer
+ * than there was room for once there are no more. Only the current
+ * epoch and the one before are kept. flags gets
+ * SIMPLEFS_CBT_INCOMPLETE if the epoch missed some blocks. */
+struct simplefs_cbt_ranges {
+	uint64_t epoch;
+	uint64_t start;
+	uint64_t count;
+	uint64_t flags;
+	uint64_t ranges;
+};
+
+#define SIMPLEFS_IOC_GETFRAG _IOR('s', 1, struct simplefs_defrag)
+#define SIMPLEFS_IOC_DEFRAG _IOR('s', 2, struct simplefs_defrag)
+#define SIMPLEFS_IOC_BULK_CREATE _IOWR('s', 3, struct simplefs_bulk_create)
+#define SIMPLEFS_IOC_CBT_EPOCH _IOR('s', 4, struct simplefs_cbt_epoch)
+#define SIMPLEFS_IOC_CBT_RANGES _IOWR('s', 5, struct simplefs_cbt_ranges)
+
+#define SIMPLEFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED 64
 /* min (
-		SIMPLEFS_DEFAULT_BLOCK_SIZE / sizeof(struct simplefs_inode),
+		SIMPLEFS_DEFAULT_BLOCK_SIZE / sizeof(struct simplefs_inode_v1),
 		sizeof(uint64_t) //The free_blocks tracker in the sb
- 	); */
+ 	);
+ * This is only the limit for images without a block bitmap
+ * (see simplefs_super_block.groups_count). Newer images are
+ * limited by the inodes_max chosen at mkfs time. */
+
+/* Inodes are appended to the inode store in creation order and new inode
+ * numbers are derived from the same counter (see simplefs_create_fs_object),
+ * so the slot of an inode in the store follows from its number. */
+static inline uint64_t simplefs_inode_slot(uint64_t inode_no)
+{
+	if (inode_no <= SIMPLEFS_RESERVED_INODES)
+		return inode_no - 1;
+	return inode_no - (SIMPLEFS_START_INO - SIMPLEFS_RESERVED_INODES + 1);
+}
+
+/* The inverse of simplefs_inode_slot */
+static inline uint64_t simplefs_inode_no(uint64_t slot)
+{
+	if (slot < SIMPLEFS_RESERVED_INODES)
+		return slot + 1;
+	return slot + (SIMPLEFS_START_INO - SIMPLEFS_RESERVED_INODES + 1);
+}
+
+/* A directory record never straddles two blocks, nor reaches into the
+ * last four bytes of one, where its checksum goes on images with
+ * SIMPLEFS_FEATURE_INCOMPAT_CSUM */
+static inline uint64_t simplefs_dir_records_per_block(uint64_t block_size)
+{
+	return block_size / sizeof(struct simplefs_dir_record);
+}
+
+/* The contents of a file or directory are kept in a contiguous run of
+ * blocks starting at data_block_number. The run is just long enough
+ * for the contents, but never shorter than the one block every object
+ * gets when it is created. The exceptions are files created with delayed
+ * allocation, which get no run at all before their contents are first
+ * written out: they are empty on the disk until then, and have a
+ * data_block_number of 0, where the super block is. And sparse files,
+ * whose run is where run_first and run_blocks say, if they have one. */
+static inline uint64_t simplefs_inode_blocks(const struct simplefs_inode *inode,
+					     uint64_t block_size)
+{
+	uint64_t blocks, per_block;
+
+	if (!inode->data_block_number)
+		return 0;
+	if (inode->mode & SIMPLEFS_INODE_SPARSE)
+		return inode->run_blocks;
+
+	if (S_ISDIR(inode->mode)) {
+		per_block = simplefs_dir_records_per_block(block_size);
+		blocks = (inode->dir_children_count + per_block - 1) / per_block;
+	} else {
+		blocks = (inode->file_size + block_size - 1) / block_size;
+	}
+
+	return blocks ? blocks : 1;
+}
+
+/* The block of the contents the run of blocks starts with */
+static inline uint64_t simplefs_inode_run_first(const struct simplefs_inode *inode)
+{
+	return inode->mode & SIMPLEFS_INODE_SPARSE ? inode->run_first : 0;
+}
+
+/* The blocks of a device are split into allocation groups of
+ * simplefs_super_block.group_blocks blocks each. Every group has one
+ * block of the block bitmap (a set bit means the block is in use)
+ * and one of these descriptors in the group descriptor table. */
+struct simplefs_group_desc {
+	__le64 free_blocks_count;
+	__le32 flags;
+	/* crc32c of the block bitmap of the group, on images with
+	 * SIMPLEFS_FEATURE_INCOMPAT_CSUM. Before, this was the upper half
+	 * of flags, which no flag ever used. */
+	__le32 bitmap_checksum;
+};
+
+/* The bitmap block of the group was never written by mkfs-simplefs.
+ * Everything but the blocks below simplefs_super_block.data_block
+ * is free, and the kernel writes out the bitmap on first use. */
+#define SIMPLEFS_GROUP_BLOCK_UNINIT 0x1
+
+/* The part of the reference count table (see simplefs_refcount_locate)
+ * that covers the group was never written by mkfs-simplefs. Nothing in
+ * the group is shared yet, and the kernel zeroes it on first use. */
+#define SIMPLEFS_GROUP_REFCOUNT_UNINIT 0x2
+
+/* Blocks can be shared by several files (reflinks, see simplefs_clone
+ * in simple.c). The reference count table has one of these for every
+ * block, an __le16: the number of files using it besides the first.
+ * A block owned by a single file, or by none, has 0. */
+#define SIMPLEFS_REFCOUNT_MAX 0xffff
 
 /* FIXME: Move the struct to its own file and not expose the members
  * Always access using the simplefs_sb_* functions and
  * do not access the members directly */
 
-struct journal_s;
 struct simplefs_super_block {
 	uint64_t version;
 	uint64_t magic;
@@ -85,8 +459,188 @@ struct simplefs_super_block {
 
 	uint64_t free_blocks;
 
-	/** FIXME: move this into separate struct */
-	struct journal_s *journal;
+	/* The run of changed block tracking, on version 2 images with
+	 * SIMPLEFS_FEATURE_RO_COMPAT_CBT (see simplefs_cbt_header). The
+	 * kernel kept a pointer to its journal here, and wrote it out with
+	 * the rest, so version 1 images may have anything in there. */
+	uint64_t cbt_block;
 
-	char padding[4048];
+	/* The geometry below is chosen by mkfs-simplefs. Images made before
+	 * it existed have all of it zeroed, and only know the hard-coded
+	 * layout described by the constants above. */
+	uint64_t blocks_count;
+	uint64_t free_blocks_count;
+
+	uint64_t inodes_max;
+	uint64_t inode_table_block;
+	uint64_t inode_table_blocks;
+	/* Only this many blocks of the inode store were zeroed by mkfs.
+	 * The kernel zeroes each of the rest before its first use. */
+	uint64_t inode_table_initialized;
+
+	uint64_t journal_block;
+	uint64_t journal_blocks;
+
+	uint64_t group_blocks;
+	uint64_t groups_count;
+	uint64_t group_desc_block;
+	uint64_t bitmap_block;
+
+	/* The first block not used by any of the above */
+	uint64_t data_block;
+
+	/* Between the block bitmaps and the inode store. Images made before
+	 * it existed have none, and cannot share blocks between files. */
+	uint64_t refcount_block;
+	uint64_t refcount_blocks;
+
+	/* The metadata can be on a device of its own (mkfs-simplefs -m, and
+	 * the meta_dev= mount option), then the blocks from meta_block on
+	 * are on it, block meta_block being its first block. That one has a
+	 * copy of the super block, and everything from group_desc_block up
+	 * to data_block follows. The rest of it goes to directories. The
+	 * data device keeps the super block, and file contents in the rest
+	 * of its data_dev_blocks blocks. The blocks between its end and
+	 * meta_block, which starts a group, do not exist. Images without a
+	 * metadata device have both at zero. */
+	uint64_t meta_block;
+	uint64_t data_dev_blocks;
+
+	/* The run of the index of -o dedup, on version 2 images with
+	 * SIMPLEFS_FEATURE_RO_COMPAT_DEDUP (see simplefs_dedup_header) */
+	uint64_t dedup_block;
+
+	/* SIMPLEFS_FEATURE_*, on version 2 images. Version 1 images have
+	 * whatever features their geometry implies. */
+	uint64_t feature_compat;
+	uint64_t feature_ro_compat;
+	uint64_t feature_incompat;
+
+	/* crc32c of all of the above, on images with
+	 * SIMPLEFS_FEATURE_INCOMPAT_CSUM (see simplefs_sb_csum_set) */
+	uint64_t checksum;
+};
+
+/* The super block as it is on the disk, with the fields of
+ * simplefs_super_block in the same order (see simplefs_sb_load) */
+struct simplefs_super_block_disk {
+	__le64 version;
+	__le64 magic;
+	__le64 block_size;
+	__le64 inodes_count;
+	__le64 free_blocks;
+	__le64 cbt_block;
+	__le64 blocks_count;
+	__le64 free_blocks_count;
+	__le64 inodes_max;
+	__le64 inode_table_block;
+	__le64 inode_table_blocks;
+	__le64 inode_table_initialized;
+	__le64 journal_block;
+	__le64 journal_blocks;
+	__le64 group_blocks;
+	__le64 groups_count;
+	__le64 group_desc_block;
+	__le64 bitmap_block;
+	__le64 data_block;
+	__le64 refcount_block;
+	__le64 refcount_blocks;
+	__le64 meta_block;
+	__le64 data_dev_blocks;
+	__le64 dedup_block;
+	__le64 feature_compat;
+	__le64 feature_ro_compat;
+	__le64 feature_incompat;
+	__le64 checksum;
+
+	/* The super block must fit in the smallest block size, as it is read
+	 * with that before the real block size of the image is known */
+	char padding[SIMPLEFS_MIN_BLOCK_SIZE - 28 * sizeof(__le64)];
 };
+
+/* Features of the image that not every kernel or tool knows about. One
+ * that does not know a compat feature can use the image all the same,
+ * one that does not know a ro_compat one can only read it, and one that
+ * does not know an incompat one must not touch it at all. */
+
+/* There are none yet */
+#define SIMPLEFS_FEATURE_COMPAT_SUPP 0
+
+/* Blocks may be shared, see simplefs_super_block.refcount_block */
+#define SIMPLEFS_FEATURE_RO_COMPAT_REFCOUNT 0x1
+/* Empty files may have no run of blocks at all yet, see
+ * simplefs_inode_blocks. Set by the kernel when it creates the first
+ * one with delayed allocation. */
+#define SIMPLEFS_FEATURE_RO_COMPAT_DELALLOC 0x2
+/* Blocks written to are tracked, see simplefs_super_block.cbt_block.
+ * Set by the kernel on the first SIMPLEFS_IOC_CBT_EPOCH. */
+#define SIMPLEFS_FEATURE_RO_COMPAT_CBT 0x4
+/* The index of -o dedup is kept across mounts, see
+ * simplefs_super_block.dedup_block */
+#define SIMPLEFS_FEATURE_RO_COMPAT_DEDUP 0x8
+#define SIMPLEFS_FEATURE_RO_COMPAT_SUPP (SIMPLEFS_FEATURE_RO_COMPAT_REFCOUNT | \
+					 SIMPLEFS_FEATURE_RO_COMPAT_DELALLOC | \
+					 SIMPLEFS_FEATURE_RO_COMPAT_CBT | \
+					 SIMPLEFS_FEATURE_RO_COMPAT_DEDUP)
+
+/* The metadata is on a device of its own, see
+ * simplefs_super_block.meta_block */
+#define SIMPLEFS_FEATURE_INCOMPAT_META_DEV 0x1
+/* Some files are compressed (SIMPLEFS_INODE_COMPRESSED). Set by the
+ * kernel when it makes the first one. */
+#define SIMPLEFS_FEATURE_INCOMPAT_COMPRESS 0x2
+/* Some files are sparse (SIMPLEFS_INODE_SPARSE). Set by the kernel when
+ * it makes the first one. */
+#define SIMPLEFS_FEATURE_INCOMPAT_SPARSE 0x4
+/* The super block, the block bitmaps and the blocks of the inode store
+ * and of directories have crc32c checksums, see simplefs_sb_csum_set
+ * and the ones after it. The inode store has one inode less per block
+ * for it (see simplefs_inodes_per_block). */
+#define SIMPLEFS_FEATURE_INCOMPAT_CSUM 0x8
+#define SIMPLEFS_FEATURE_INCOMPAT_SUPP (SIMPLEFS_FEATURE_INCOMPAT_META_DEV | \
+					SIMPLEFS_FEATURE_INCOMPAT_COMPRESS | \
+					SIMPLEFS_FEATURE_INCOMPAT_SPARSE | \
+					SIMPLEFS_FEATURE_INCOMPAT_CSUM)
+
+/* Whether a block is never handed out: the metadata, and the blocks that
+ * do not exist, past the end of the device(s) */
+static inline int simplefs_block_reserved(const struct simplefs_super_block *sb,
+					  uint64_t block)
+{
+	if (block >= sb->blocks_count)
+		return 1;
+	if (sb->meta_block)
+		return block == SIMPLEFS_SUPERBLOCK_BLOCK_NUMBER ||
+		       (block >= sb->data_dev_blocks && block < sb->data_block);
+	return block < sb->data_block;
+}
+
+/* Fill in the bitmap of a group that has never been used: only the
+ * reserved blocks (see simplefs_block_reserved) are in use. Returns the
+ * number of blocks marked as in use. */
+static inline uint64_t simplefs_group_bitmap_init(const struct simplefs_super_block *sb,
+						  uint64_t group, unsigned char *bitmap)
+{
+	uint64_t start = group * sb->group_blocks;
+	uint64_t end = start + sb->group_blocks;
+	uint64_t block, free_end, used = 0;
+
+	memset(bitmap, 0, sb->block_size);
+
+	for (block = start; block < end; block++) {
+		if (simplefs_block_reserved(sb, block)) {
+			bitmap[(block - start) / 8] |= 1 << ((block - start) % 8);
+			used++;
+			continue;
+		}
+
+		/* Skip over the free range the block starts */
+		free_end = sb->meta_block && block < sb->data_dev_blocks ?
+			   sb->data_dev_blocks : sb->blocks_count;
+		block = (free_end < end ? free_end : end) - 1;
+	}
+
+	return used;
+}
+
+#endif
@@ -0,0 +1,1997 @@
+/*
+ * simplefs in userspace, on top of FUSE.
+ *
+ * Serves a simplefs image without the kernel module, using the same
+ * on-disk format code (format.c). Requests are handled by a pool of
+ * threads, and the kernel is asked to cache writes (writeback cache).
+ *
+ * Files grow, move and are compressed by the same rules as in the
+ * kernel module, which format.c has for both of them. Blocks shared
+ * between files (reflinks) are left alone: they are only copied on write
+ * by the kernel module, so writing to or truncating a file that has any
+ * fails with EOPNOTSUPP here.
+ *
+ * License: Creative Commons Zero License - http://creativecommons.org/publicdomain/zero/1.0/
+ */
+
+#define FUSE_USE_VERSION 34
+
+#include <fuse_lowlevel.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+#include <lz4.h>
+
+#include "format.h"
+
+/* The journal is only replayed by the kernel module */
+#define JBD2_MAGIC_NUMBER 0xc03b3998U
+
+/* simplefs keeps no owners on the disk, and version 1 images no times
+ * either. Everything belongs to whoever mounted it, and inodes without
+ * times are as of the time it was mounted. */
+struct simplefs {
+	int fd;
+	/* With -o meta=, the device the blocks from sb.meta_block on are on */
+	int meta_fd;
+	struct simplefs_super_block sb;
+	uid_t uid;
+	gid_t gid;
+	struct timespec mounted;
+	/* Room for a block of the inode store, under inodes_lock */
+	unsigned char *inode_block;
+
+	/* Held shared while the contents of a file are read or written in
+	 * place, and exclusively while a file moves to another run or has
+	 * its run cut short, and while a compressed file is written to: the
+	 * inode lock of the kernel module, for all files at once */
+	pthread_rwlock_t run_lock;
+
+	/* The same locks as the kernel module, see simple.c. Taken in this
+	 * order: run_lock, then dir_lock, then sb_lock, then inodes_lock. */
+	pthread_mutex_t sb_lock;
+	pthread_mutex_t inodes_lock;
+	pthread_mutex_t dir_lock;
+};
+
+static struct simplefs *simplefs_fs(fuse_req_t req)
+{
+	return fuse_req_userdata(req);
+}
+
+static int64_t timespec_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static struct timespec ns_timespec(int64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	if (ts.tv_nsec < 0) {
+		ts.tv_sec--;
+		ts.tv_nsec += 1000000000;
+	}
+	return ts;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return timespec_ns(&ts);
+}
+
+/* The device a block is on, and where on it */
+static int fd_at(struct simplefs *fs, uint64_t *block)
+{
+	if (fs->sb.meta_block && *block >= fs->sb.meta_block) {
+		*block -= fs->sb.meta_block;
+		return fs->meta_fd;
+	}
+	return fs->fd;
+}
+
+static int read_at(struct simplefs *fs, void *buf, size_t len,
+		   uint64_t block, uint64_t offset)
+{
+	ssize_t ret;
+	int fd = fd_at(fs, &block);
+
+	ret = pread(fd, buf, len, block * fs->sb.block_size + offset);
+	if (ret != (ssize_t)len)
+		return -EIO;
+	return 0;
+}
+
+static int write_at(struct simplefs *fs, const void *buf, size_t len,
+		    uint64_t block, uint64_t offset)
+{
+	ssize_t ret;
+	int fd = fd_at(fs, &block);
+
+	ret = pwrite(fd, buf, len, block * fs->sb.block_size + offset);
+	if (ret != (ssize_t)len)
+		return -EIO;
+	return 0;
+}
+
+/* A block of the inode store or of a directory, checked against its
+ * checksum (see simplefs_block_csum_verify) */
+static int read_meta_block(struct simplefs *fs, void *buf, uint64_t block)
+{
+	int ret;
+
+	ret = read_at(fs, buf, fs->sb.block_size, block, 0);
+	if (!ret && !simplefs_block_csum_verify(&fs->sb, buf)) {
+		fprintf(stderr, "simplefs: block %llu has a wrong checksum\n",
+			(unsigned long long)block);
+		ret = -EBADMSG;
+	}
+	return ret;
+}
+
+static int write_meta_block(struct simplefs *fs, void *buf, uint64_t block)
+{
+	simplefs_block_csum_set(&fs->sb, buf);
+	return write_at(fs, buf, fs->sb.block_size, block, 0);
+}
+
+/* Must be called with sb_lock held */
+static int sb_sync(struct simplefs *fs)
+{
+	struct simplefs_super_block_disk disk = { 0 };
+	ssize_t ret;
+
+	simplefs_sb_store(&disk, &fs->sb);
+	ret = pwrite(fs->fd, &disk, sizeof(disk), 0);
+	if (ret != sizeof(disk))
+		return -EIO;
+	return 0;
+}
+
+/* Must be called with inodes_lock held */
+static int read_inode(struct simplefs *fs, uint64_t inode_no,
+		      struct simplefs_inode *inode)
+{
+	uint64_t slot = simplefs_inode_slot(inode_no), block, offset;
+	int ret;
+
+	if (slot >= fs->sb.inodes_count)
+		return -ENOENT;
+
+	/* The whole block, for its checksum */
+	simplefs_inode_locate(&fs->sb, slot, &block, &offset);
+	ret = read_meta_block(fs, fs->inode_block, block);
+	if (ret)
+		return ret;
+	simplefs_inode_load(&fs->sb, fs->inode_block + offset, inode);
+	if (inode->inode_no != inode_no)
+		ret = -EIO;
+	return ret;
+}
+
+static int get_inode(struct simplefs *fs, uint64_t inode_no,
+		     struct simplefs_inode *inode)
+{
+	int ret;
+
+	pthread_mutex_lock(&fs->inodes_lock);
+	ret = read_inode(fs, inode_no, inode);
+	pthread_mutex_unlock(&fs->inodes_lock);
+
+	return ret;
+}
+
+/* Must be called with inodes_lock held */
+static int save_inode(struct simplefs *fs, const struct simplefs_inode *inode)
+{
+	uint64_t block, offset;
+	int ret;
+
+	simplefs_inode_locate(&fs->sb, simplefs_inode_slot(inode->inode_no),
+			      &block, &offset);
+	ret = read_meta_block(fs, fs->inode_block, block);
+	if (ret)
+		return ret;
+	simplefs_inode_store(&fs->sb, fs->inode_block + offset, inode);
+	return write_meta_block(fs, fs->inode_block, block);
+}
+
+/* Append a new inode to the inode store. Must be called with sb_lock held. */
+static int add_inode(struct simplefs *fs, const struct simplefs_inode *inode)
+{
+	uint64_t block, offset;
+	int ret;
+
+	pthread_mutex_lock(&fs->inodes_lock);
+	simplefs_inode_locate(&fs->sb, fs->sb.inodes_count, &block, &offset);
+
+	if (block - fs->sb.inode_table_block >= fs->sb.inode_table_initialized) {
+		/* mkfs left this part of the inode store uninitialized */
+		memset(fs->inode_block, 0, fs->sb.block_size);
+		ret = write_meta_block(fs, fs->inode_block, block);
+		if (ret)
+			goto out;
+		fs->sb.inode_table_initialized = block - fs->sb.inode_table_block + 1;
+	}
+
+	ret = save_inode(fs, inode);
+	if (ret)
+		goto out;
+
+	fs->sb.inodes_count++;
+	ret = sb_sync(fs);
+out:
+	pthread_mutex_unlock(&fs->inodes_lock);
+	return ret;
+}
+
+/* Take the first run of count free blocks from block from on, in the
+ * first group that has one, if it starts before the block below, as
+ * simplefs_group_get_a_freerun does. There is no journal here to keep
+ * blocks busy for. Must be called with sb_lock held. */
+static int group_get_a_freerun(struct simplefs *fs, uint64_t count, uint64_t from,
+			       uint64_t below, uint64_t *out)
+{
+	struct simplefs_super_block *sb = &fs->sb;
+	struct simplefs_group_desc desc;
+	unsigned char *bitmap;
+	uint64_t group, block, offset;
+	int ret = -ENOSPC, err, uninit;
+
+	bitmap = malloc(sb->block_size);
+	if (!bitmap)
+		return -ENOMEM;
+
+	for (group = from / sb->group_blocks; group < sb->groups_count &&
+	     ret == -ENOSPC && group * sb->group_blocks < below; group++) {
+		simplefs_group_desc_locate(sb, group, &block, &offset);
+		ret = read_at(fs, &desc, sizeof(desc), block, offset);
+		if (ret)
+			break;
+		ret = -ENOSPC;
+		if (le64_to_cpu(desc.free_blocks_count) < count)
+			continue;
+
+		uninit = le32_to_cpu(desc.flags) & SIMPLEFS_GROUP_BLOCK_UNINIT;
+		if (uninit) {
+			simplefs_group_bitmap_init(sb, group, bitmap);
+			desc.flags &= ~cpu_to_le32(SIMPLEFS_GROUP_BLOCK_UNINIT);
+		} else {
+			ret = read_at(fs, bitmap, sb->block_size, sb->bitmap_block + group, 0);
+			if (!ret && !simplefs_bitmap_csum_verify(sb, &desc, bitmap)) {
+				fprintf(stderr, "simplefs: the block bitmap of group %llu has a wrong checksum\n",
+					(unsigned long long)group);
+				ret = -EBADMSG;
+			}
+			if (ret)
+				break;
+		}
+
+		ret = simplefs_group_alloc_run_below(sb, group, &desc, bitmap, from, below,
+						     count, out);
+		if (ret == -EIO)
+			fprintf(stderr, "simplefs: group %llu has no free block but claims %llu free blocks\n",
+				(unsigned long long)group,
+				(unsigned long long)le64_to_cpu(desc.free_blocks_count));
+
+		/* The bitmap goes out before the descriptor and the sb, so that a
+		 * crash in between can only leak the block, never hand it out twice */
+		if (!ret || uninit) {
+			simplefs_bitmap_csum_set(sb, &desc, bitmap);
+			err = write_at(fs, bitmap, sb->block_size, sb->bitmap_block + group, 0);
+			if (!err)
+				err = write_at(fs, &desc, sizeof(desc), block, offset);
+			if (err)
+				ret = err;
+		}
+	}
+
+	free(bitmap);
+	return ret;
+}
+
+/* As in the kernel module, directories go on the metadata device as long
+ * as it has room left, and file contents on the data device. Images
+ * without a bitmap only ever hand out single blocks. */
+static int get_a_freerun(struct simplefs *fs, int dir, uint64_t count, uint64_t *out)
+{
+	uint64_t meta_block = fs->sb.meta_block;
+	int ret = -ENOSPC;
+
+	pthread_mutex_lock(&fs->sb_lock);
+	if (fs->sb.groups_count) {
+		if (meta_block && dir)
+			ret = group_get_a_freerun(fs, count, meta_block, UINT64_MAX, out);
+		if (ret == -ENOSPC)
+			ret = group_get_a_freerun(fs, count, 0,
+						  meta_block ? meta_block : UINT64_MAX, out);
+	} else if (count == 1) {
+		ret = simplefs_legacy_alloc(&fs->sb, out);
+	}
+	if (!ret)
+		ret = sb_sync(fs);
+	pthread_mutex_unlock(&fs->sb_lock);
+
+	return ret;
+}
+
+/* Give back count blocks from start, which no file points to any more
+ * and no other file shares */
+static int run_free(struct simplefs *fs, uint64_t start, uint64_t count)
+{
+	struct simplefs_super_block *sb = &fs->sb;
+	struct simplefs_group_desc desc;
+	unsigned char *bitmap = NULL;
+	uint64_t group, block, table_block, offset;
+	int ret = 0, err;
+
+	pthread_mutex_lock(&fs->sb_lock);
+	if (!sb->groups_count) {
+		for (block = start; block < start + count; block++)
+			sb->free_blocks |= 1ULL << block;
+		goto sync;
+	}
+
+	bitmap = malloc(sb->block_size);
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (block = start; block < start + count && !ret;) {
+		group = block / sb->group_blocks;
+		simplefs_group_desc_locate(sb, group, &table_block, &offset);
+		ret = read_at(fs, &desc, sizeof(desc), table_block, offset);
+		if (ret)
+			break;
+		if (le32_to_cpu(desc.flags) & SIMPLEFS_GROUP_BLOCK_UNINIT) {
+			simplefs_group_bitmap_init(sb, group, bitmap);
+			desc.flags &= ~cpu_to_le32(SIMPLEFS_GROUP_BLOCK_UNINIT);
+		} else {
+			ret = read_at(fs, bitmap, sb->block_size, sb->bitmap_block + group, 0);
+			if (!ret && !simplefs_bitmap_csum_verify(sb, &desc, bitmap))
+				ret = -EBADMSG;
+			if (ret)
+				break;
+		}
+
+		for (; block < start + count && block / sb->group_blocks == group; block++) {
+			if (simplefs_group_free(sb, group, &desc, bitmap, block)) {
+				fprintf(stderr, "simplefs: block %llu was given back but is not in use\n",
+					(unsigned long long)block);
+				ret = -EIO;
+				break;
+			}
+		}
+
+		/* What was given back until then goes out all the same */
+		simplefs_bitmap_csum_set(sb, &desc, bitmap);
+		err = write_at(fs, bitmap, sb->block_size, sb->bitmap_block + group, 0);
+		if (!err)
+			err = write_at(fs, &desc, sizeof(desc), table_block, offset);
+		if (err)
+			ret = err;
+	}
+
+sync:
+	err = sb_sync(fs);
+	if (err)
+		ret = err;
+out:
+	pthread_mutex_unlock(&fs->sb_lock);
+	free(bitmap);
+	return ret;
+}
+
+/* Turn a feature of a version 2 image on, as simplefs_sb_feature_set
+ * does, once something on the image uses it */
+static int feature_set(struct simplefs *fs, uint64_t *features, uint64_t feature)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&fs->sb_lock);
+	if (fs->sb.version >= SIMPLEFS_VERSION_2 && !(*features & feature)) {
+		*features |= feature;
+		ret = sb_sync(fs);
+	}
+	pthread_mutex_unlock(&fs->sb_lock);
+	return ret;
+}
+
+/* The size of a compressed file, from the header at the start of its
+ * run. Its inode has the size of the run instead. */
+static int compress_size(struct simplefs *fs, const struct simplefs_inode *inode,
+			 uint64_t *size)
+{
+	struct simplefs_compress_header header;
+	int ret;
+
+	ret = read_at(fs, &header, sizeof(header), inode->data_block_number, 0);
+	if (!ret)
+		*size = le64_to_cpu(header.size);
+	return ret;
+}
+
+static int fill_attr(struct simplefs *fs, const struct simplefs_inode *inode,
+		     struct stat *st)
+{
+	uint64_t blocks = simplefs_inode_blocks(inode, fs->sb.block_size), size;
+	int ret;
+
+	size = S_ISDIR(inode->mode) ? blocks * fs->sb.block_size : inode->file_size;
+	if (S_ISREG(inode->mode) && inode->mode & SIMPLEFS_INODE_COMPRESSED) {
+		ret = compress_size(fs, inode, &size);
+		if (ret)
+			return ret;
+	}
+
+	memset(st, 0, sizeof(*st));
+	st->st_ino = inode->inode_no;
+	st->st_mode = inode->mode & SIMPLEFS_INODE_MODE_MASK;
+	st->st_nlink = S_ISDIR(inode->mode) ? 2 : 1;
+	st->st_uid = fs->uid;
+	st->st_gid = fs->gid;
+	st->st_size = size;
+	st->st_blksize = fs->sb.block_size;
+	st->st_blocks = blocks * (fs->sb.block_size / 512);
+	if (inode->ctime) {
+		st->st_atim = ns_timespec(inode->atime);
+		st->st_mtim = ns_timespec(inode->mtime);
+		st->st_ctim = ns_timespec(inode->ctime);
+	} else {
+		st->st_atim = st->st_mtim = st->st_ctim = fs->mounted;
+	}
+	return 0;
+}
+
+/* Look for a name in a directory. Returns the inode number, 0 if there
+ * is no such name, or a negative error. */
+static int64_t dir_find(struct simplefs *fs, const struct simplefs_inode *dir,
+			const char *name)
+{
+	uint64_t per_block = simplefs_dir_records_per_block(fs->sb.block_size);
+	struct simplefs_dir_record *records;
+	uint64_t i, n;
+	size_t len = strlen(name);
+	int64_t ret = 0;
+
+	records = malloc(fs->sb.block_size);
+	if (!records)
+		return -ENOMEM;
+
+	for (i = 0; i * per_block < dir->dir_children_count && !ret; i++) {
+		ret = read_meta_block(fs, records, dir->data_block_number + i);
+		if (ret)
+			break;
+		for (n = 0; n < per_block && i * per_block + n < dir->dir_children_count; n++) {
+			if (simplefs_dir_record_match(&records[n], name, len)) {
+				ret = le64_to_cpu(records[n].inode_no);
+				break;
+			}
+		}
+	}
+
+	free(records);
+	return ret;
+}
+
+static void reply_entry(fuse_req_t req, struct simplefs *fs,
+			const struct simplefs_inode *inode)
+{
+	struct fuse_entry_param e;
+	int ret;
+
+	memset(&e, 0, sizeof(e));
+	e.ino = inode->inode_no;
+	e.attr_timeout = 1.0;
+	e.entry_timeout = 1.0;
+	ret = fill_attr(fs, inode, &e.attr);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void simplefs_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void)userdata;
+
+	/* Let the kernel batch small writes in the page cache */
+	if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	/* Reads come straight from the image (see simplefs_read), and with
+	 * these the pages go to the kernel without a copy in between */
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+		conn->want |= FUSE_CAP_SPLICE_MOVE;
+}
+
+static void simplefs_destroy(void *userdata)
+{
+	struct simplefs *fs = userdata;
+
+	pthread_mutex_lock(&fs->sb_lock);
+	sb_sync(fs);
+	pthread_mutex_unlock(&fs->sb_lock);
+	fsync(fs->fd);
+	if (fs->meta_fd != -1)
+		fsync(fs->meta_fd);
+}
+
+static void simplefs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct simplefs *fs = simplefs_fs(req);
+	struct simplefs_inode dir, inode;
+	int64_t inode_no;
+	int ret;
+
+	ret = get_inode(fs, parent, &dir);
+	if (ret)
+		goto err;
+	if (!S_ISDIR(dir.mode)) {
+		ret = -ENOTDIR;
+		goto err;
+	}
+
+	inode_no = dir_find(fs, &dir, name);
+	if (inode_no <= 0) {
+		ret = inode_no ? inode_no : -ENOENT;
+		goto err;
+	}
+
+	/* An entry pointing to an inode that was never written, which
+	 * the kernel module can leave behind, shows up as an I/O error.
+	 * The size of a compressed file is in its run, which stays put. */
+	pthread_rwlock_rdlock(&fs->run_lock);
+	ret = get_inode(fs, inode_no, &inode);
+	if (!ret)
+		reply_entry(req, fs, &inode);
+	pthread_rwlock_unlock(&fs->run_lock);
+	if (ret)
+		goto err;
+	return;
+err:
+	fuse_reply_err(req, -ret);
+}
+
+static void simplefs_getattr(fuse_req_t req, fuse_ino_t ino,
+			     struct fuse_file_info *fi)
+{
+	struct simplefs *fs = simplefs_fs(req);
+	struct simplefs_inode inode;
+	struct stat st;
+	int ret;
+
+	(void)fi;
+
+	/* The size of a compressed file is in its run, which stays put */
+	pthread_rwlock_rdlock(&fs->run_lock);
+	ret = get_inode(fs, ino, &inode);
+	if (!ret)
+		ret = fill_attr(fs, &inode, &st);
+	pthread_rwlock_unlock(&fs->run_lock);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fuse_reply_attr(req, &st, 1.0);
+}
+
+/* Whether any of count blocks from start is used by more than one file.
+ * Must be called with run_lock held, so that the run cannot change. */
+static int run_shared(struct simplefs *fs, uint64_t start, uint64_t count)
+{
+	struct simplefs_super_block *sb = &fs->sb;
+	struct simplefs_group_desc desc;
+	uint64_t block, table_block, offset;
+	__le16 refcount;
+	int ret;
+
+	if (!sb->refcount_blocks)
+		return 0;
+
+	for (block = start; block < start + count; block++) {
+		simplefs_group_desc_locate(sb, block / sb->group_blocks,
+					   &table_block, &offset);
+		ret = read_at(fs, &desc, sizeof(desc), table_block, offset);
+		if (ret)
+			return ret;
+		/* Nothing in the group was ever shared */
+		if (le32_to_cpu(desc.flags) & SIMPLEFS_GROUP_REFCOUNT_UNINIT) {
+			block = (block / sb->group_blocks + 1) * sb->group_blocks - 1;
+			continue;
+		}
+
+		simplefs_refcount_locate(sb, block, &table_block, &offset);
+		ret = read_at(fs, &refcount, sizeof(refcount), table_block, offset);
+		if (ret)
+			return ret;
+		if (le16_to_cpu(refcount))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* The same, for the whole run of a file, which is then left alone */
+static int file_shared(struct simplefs *fs, const struct simplefs_inode *inode)
+{
+	int ret;
+
+	ret = run_shared(fs, inode->data_block_number,
+			 simplefs_inode_blocks(inode, fs->sb.block_size));
+	return ret > 0 ? -EOPNOTSUPP : ret;
+}
+
+/* The most blocks run_copy has in memory at once */
+#define RUN_COPY_BLOCKS 256
+
+/* Write count blocks of the contents of a file, from block first of them
+ * on, to the run at to. They come from the run at from, which has
+ * from_count blocks of them from from_first on, and are zeroed where it
+ * has none. File contents are on the data device, which is synced once
+ * all of them are there. */
+static int run_copy(struct simplefs *fs, uint64_t from, uint64_t from_first,
+		    uint64_t from_count, uint64_t to, uint64_t first, uint64_t count)
+{
+	uint64_t block_size = fs->sb.block_size, i, n, lo, hi;
+	char *buf;
+	int ret = 0;
+
+	buf = malloc(RUN_COPY_BLOCKS * block_size);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < count && !ret; i += n) {
+		n = count - i < RUN_COPY_BLOCKS ? count - i : RUN_COPY_BLOCKS;
+		lo = first + i > from_first ? first + i : from_first;
+		hi = first + i + n < from_first + from_count ? first + i + n :
+							       from_first + from_count;
+		memset(buf, 0, n * block_size);
+		if (lo < hi)
+			ret = read_at(fs, buf + (lo - first - i) * block_size,
+				      (hi - lo) * block_size, from + lo - from_first, 0);
+		if (!ret)
+			ret = write_at(fs, buf, n * block_size, to + i, 0);
+	}
+	free(buf);
+
+	if (!ret && fdatasync(fs->fd))
+		ret = -errno;
+	return ret;
+}
+
+/* Move the contents of a file to the run of blocks at new, just taken
+ * for it, and give the old run up, as simplefs_run_move does: the new run
+ * holds count blocks of the contents from first on. The inode only
+ * points to the new run once all of it is on the disk, so a crash leaves
+ * either run in use. The new run is given back on failure. Must be
+ * called with run_lock held exclusively. */
+static int run_move(struct simplefs *fs, struct simplefs_inode *inode, uint64_t new,
+		    uint64_t first, uint64_t count)
+{
+	uint64_t old = inode->data_block_number;
+	uint64_t old_count = simplefs_inode_blocks(inode, fs->sb.block_size);
+	int ret;
+
+	ret = run_copy(fs, old, simplefs_inode_run_first(inode), old_count,
+		       new, first, count);
+	if (!ret) {
+		pthread_mutex_lock(&fs->inodes_lock);
+		ret = read_inode(fs, inode->inode_no, inode);
+		if (!ret) {
+			simplefs_inode_set_run(inode, fs->sb.block_size, new, first, count);
+			ret = save_inode(fs, inode);
+		}
+		pthread_mutex_unlock(&fs->inodes_lock);
+	}
+	if (ret) {
+		run_free(fs, new, count);
+		return ret;
+	}
+
+	return old_count ? run_free(fs, old, old_count) : 0;
+}
+
+/* Move a file to the longer run simplefs_run_extend gives it, for a
+ * write to blocks first to last of its contents, as
+ * simplefs_sparse_extend does. Must be called with run_lock held
+ * exclusively. */
+static int file_extend(struct simplefs *fs, struct simplefs_inode *inode,
+		       uint64_t first, uint64_t last)
+{
+	uint64_t count, new;
+	int ret;
+
+	ret = simplefs_run_extend(&fs->sb, inode, first, last, &first, &count);
+	if (!ret)
+		ret = file_shared(fs, inode);
+	if (!ret)
+		ret = feature_set(fs, &fs->sb.feature_incompat,
+				  SIMPLEFS_FEATURE_INCOMPAT_SPARSE);
+	if (!ret)
+		ret = get_a_freerun(fs, 0, count, &new);
+	if (!ret)
+		ret = run_move(fs, inode, new, first, count);
+	return ret;
+}
+
+/* Files the kernel created with delayed allocation have no run of blocks
+ * before their contents are first written out. Such a file gets one here
+ * as simplefs_delalloc_flush gives it, just long enough for its contents
+ * up to size bytes, zeroed, which is then its size. Must be called with
+ * run_lock held exclusively. */
+static int file_get_a_run(struct simplefs *fs, struct simplefs_inode *inode,
+			  uint64_t size)
+{
+	uint64_t count, block;
+	int ret;
+
+	if (size < inode->file_size)
+		size = inode->file_size;
+	count = (size + fs->sb.block_size - 1) / fs->sb.block_size;
+	if (!count)
+		count = 1;
+
+	ret = get_a_freerun(fs, 0, count, &block);
+	if (ret)
+		return ret;
+
+	ret = run_copy(fs, 0, 0, 0, block, 0, count);
+	if (!ret) {
+		pthread_mutex_lock(&fs->inodes_lock);
+		ret = read_inode(fs, inode->inode_no, inode);
+		if (!ret) {
+			inode->data_block_number = block;
+			inode->file_size = size;
+			ret = save_inode(fs, inode);
+		}
+		pthread_mutex_unlock(&fs->inodes_lock);
+	}
+	if (ret)
+		run_free(fs, block, count);
+	return ret;
+}
+
+/* Read the cluster of a compressed file at start that is len bytes long
+ * once decompressed, into to, as simplefs_compress_cluster_read does.
+ * tmp must have room for a cluster. */
+static int compress_cluster_read(struct simplefs *fs, uint64_t start,
+				 const struct simplefs_compress_cluster *cluster,
+				 char *to, size_t len, char *tmp)
+{
+	int ret;
+
+	/* Stored as it is */
+	if (cluster->length == len)
+		return read_at(fs, to, len, start, cluster->offset);
+	if (cluster->length > len)
+		return -EIO;
+
+	ret = read_at(fs, tmp, cluster->length, start, cluster->offset);
+	if (ret)
+		return ret;
+	if (LZ4_decompress_safe(tmp, to, cluster->length, len) != (int)len)
+		return -EIO;
+	return 0;
+}
+
+/* What compress_update works with, as simplefs_compress_buf in the
+ * kernel module. liblz4 needs no work area of its own. */
+struct compress_buf {
+	char raw[SIMPLEFS_COMPRESS_CLUSTER_SIZE];
+	char tmp[SIMPLEFS_COMPRESS_CLUSTER_SIZE];
+	char out[SIMPLEFS_COMPRESS_MAX_CLUSTERS][SIMPLEFS_COMPRESS_CLUSTER_SIZE];
+};
+
+/* Pack a compressed file into a new run, laid out by
+ * simplefs_compress_layout, as simplefs_compress_repack does. The
+ * clusters that were not rewritten are copied over as they are. */
+static int compress_repack(struct simplefs *fs, struct simplefs_inode *inode,
+			   struct simplefs_compress_cluster *table, uint64_t clusters,
+			   uint64_t first, uint64_t count, struct compress_buf *buf,
+			   uint64_t size)
+{
+	struct simplefs_compress_header header = { .size = cpu_to_le64(size) };
+	struct simplefs_compress_cluster *old;
+	uint64_t start = inode->data_block_number, new, blocks, i;
+	uint64_t old_blocks = simplefs_inode_blocks(inode, fs->sb.block_size);
+	int ret;
+
+	old = malloc((clusters ? clusters : 1) * sizeof(*old));
+	if (!old)
+		return -ENOMEM;
+	memcpy(old, table, clusters * sizeof(*old));
+
+	blocks = simplefs_compress_layout(table, clusters, fs->sb.block_size);
+	ret = get_a_freerun(fs, 0, blocks, &new);
+	if (ret)
+		goto out;
+
+	ret = write_at(fs, &header, sizeof(header), new, 0);
+	if (!ret) {
+		simplefs_compress_table_store(table, clusters);
+		ret = write_at(fs, table, clusters * sizeof(*table), new, sizeof(header));
+		simplefs_compress_table_load(table, clusters);
+	}
+	for (i = 0; i < clusters && !ret; i++) {
+		if (i >= first && i < first + count) {
+			ret = write_at(fs, buf->out[i - first], table[i].length,
+				       new, table[i].offset);
+			continue;
+		}
+		ret = read_at(fs, buf->tmp, old[i].length, start, old[i].offset);
+		if (!ret)
+			ret = write_at(fs, buf->tmp, table[i].length, new, table[i].offset);
+	}
+	if (!ret && fdatasync(fs->fd))
+		ret = -errno;
+
+	if (!ret) {
+		pthread_mutex_lock(&fs->inodes_lock);
+		ret = read_inode(fs, inode->inode_no, inode);
+		if (!ret) {
+			inode->data_block_number = new;
+			inode->file_size = blocks * fs->sb.block_size;
+			ret = save_inode(fs, inode);
+		}
+		pthread_mutex_unlock(&fs->inodes_lock);
+	}
+	if (ret) {
+		run_free(fs, new, blocks);
+		goto out;
+	}
+
+	ret = run_free(fs, start, old_blocks);
+out:
+	free(old);
+	return ret;
+}
+
+/* Write the clusters from first on, and the header, where they were. The
+ * kernel module does that in a single journal handle. There is no
+ * journal here, so they go in place, as everything else does. */
+static int compress_write_in_place(struct simplefs *fs,
+				   const struct simplefs_inode *inode,
+				   struct simplefs_compress_cluster *table,
+				   uint64_t first, uint64_t count,
+				   struct compress_buf *buf, uint64_t size)
+{
+	struct simplefs_compress_header header = { .size = cpu_to_le64(size) };
+	uint64_t start = inode->data_block_number, i;
+	int ret;
+
+	ret = write_at(fs, &header, sizeof(header), start, 0);
+	if (!ret && count) {
+		simplefs_compress_table_store(table + first, count);
+		ret = write_at(fs, table + first, count * sizeof(*table), start,
+			       simplefs_compress_table_size(first));
+		simplefs_compress_table_load(table + first, count);
+	}
+	for (i = 0; i < count && !ret; i++)
+		ret = write_at(fs, buf->out[i], table[first + i].length, start,
+			       table[first + i].offset);
+	return ret;
+}
+
+/* Rewrite a compressed file a few clusters at a time, as
+ * simplefs_compress_update does: write len bytes of data at pos, and
+ * make the file, old_size bytes long until then, size bytes long. No
+ * more than SIMPLEFS_COMPRESS_MAX_CLUSTERS clusters may change. Must be
+ * called with run_lock held exclusively. */
+static int compress_update(struct simplefs *fs, struct simplefs_inode *inode,
+			   uint64_t old_size, uint64_t pos, const char *data,
+			   size_t len, uint64_t size)
+{
+	uint64_t block_size = fs->sb.block_size;
+	uint64_t old_clusters = simplefs_compress_clusters(old_size);
+	uint64_t clusters = simplefs_compress_clusters(size);
+	uint64_t first = clusters, last = 0, count, i, from, at, to, start, blocks;
+	struct simplefs_compress_cluster *table;
+	struct compress_buf *buf;
+	size_t olen, clen;
+	int ret, clength;
+
+	if (len) {
+		first = pos / SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+		last = (pos + len - 1) / SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+	}
+	/* The cluster the file ends in changes length, and so does
+	 * everything it grows by */
+	i = (old_size < size ? old_size : size) / SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+	if (size != old_size && i < clusters) {
+		first = first < i ? first : i;
+		last = last > clusters - 1 ? last : clusters - 1;
+	}
+	count = first < clusters ? last - first + 1 : 0;
+	if (count > SIMPLEFS_COMPRESS_MAX_CLUSTERS)
+		return -EINVAL;
+
+	start = inode->data_block_number;
+	i = old_clusters > clusters ? old_clusters : clusters;
+	buf = malloc(sizeof(*buf));
+	table = malloc((i ? i : 1) * sizeof(*table));
+	if (!buf || !table) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = read_at(fs, table, old_clusters * sizeof(*table), start,
+		      sizeof(struct simplefs_compress_header));
+	if (ret)
+		goto out;
+	simplefs_compress_table_load(table, old_clusters);
+
+	for (i = 0; i < count; i++) {
+		from = (first + i) * SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+		olen = from < old_size ? old_size - from : 0;
+		if (olen > SIMPLEFS_COMPRESS_CLUSTER_SIZE)
+			olen = SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+		clen = size - from < SIMPLEFS_COMPRESS_CLUSTER_SIZE ? size - from :
+								      SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+
+		if (olen) {
+			ret = compress_cluster_read(fs, start, &table[first + i],
+						    buf->raw, olen, buf->tmp);
+			if (ret)
+				goto out;
+		}
+		if (clen > olen)
+			memset(buf->raw + olen, 0, clen - olen);
+
+		at = pos > from ? pos : from;
+		to = pos + len < from + clen ? pos + len : from + clen;
+		if (len && at < to)
+			memcpy(buf->raw + at - from, data + at - pos, to - at);
+
+		/* Kept as it is unless it gets smaller */
+		clength = LZ4_compress_default(buf->raw, buf->out[i], clen, clen - 1);
+		if (clength <= 0) {
+			memcpy(buf->out[i], buf->raw, clen);
+			clength = clen;
+		}
+		table[first + i].length = clength;
+	}
+
+	if (simplefs_compress_fit(table, old_clusters, clusters, first,
+				  simplefs_inode_blocks(inode, block_size) * block_size))
+		ret = compress_write_in_place(fs, inode, table, first, count, buf, size);
+	else
+		ret = compress_repack(fs, inode, table, clusters, first, count, buf, size);
+	if (ret)
+		goto out;
+
+	/* Give up what a truncation left unused at the end of the run */
+	blocks = simplefs_compress_used_blocks(table, clusters, block_size);
+	start = inode->data_block_number;
+	i = simplefs_inode_blocks(inode, block_size);
+	if (size < old_size && blocks < i) {
+		pthread_mutex_lock(&fs->inodes_lock);
+		ret = read_inode(fs, inode->inode_no, inode);
+		if (!ret) {
+			inode->file_size = blocks * block_size;
+			ret = save_inode(fs, inode);
+		}
+		pthread_mutex_unlock(&fs->inodes_lock);
+		if (!ret)
+			ret = run_free(fs, start + blocks, i - blocks);
+	}
+out:
+	free(table);
+	free(buf);
+	return ret;
+}
+
+/* Fill a compressed file with zeroes from its end, at *size, up to
+ * new_size, a few clusters at a time, as simplefs_compress_extend does */
+static int compress_extend(struct simplefs *fs, struct simplefs_inode *inode,
+			   uint64_t *size, uint64_t new_size)
+{
+	uint64_t step;
+	int ret = 0;
+
+	while (!ret && *size < new_size) {
+		step = *size - *size % SIMPLEFS_COMPRESS_CLUSTER_SIZE +
+		       SIMPLEFS_COMPRESS_MAX_CLUSTERS * SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+		if (step > new_size)
+			step = new_size;
+		ret = compress_update(fs, inode, *size, 0, NULL, 0, step);
+		if (!ret)
+			*size = step;
+	}
+	return ret;
+}
+
+/* The kernel module writes a few clusters per call. FUSE wants all of
+ * a write done, so it is split up here instead. */
+static int compress_write(struct simplefs *fs, struct simplefs_inode *inode,
+			  const char *buf, size_t len, uint64_t pos)
+{
+	uint64_t size, end;
+	size_t done, n;
+	int ret;
+
+	ret = compress_size(fs, inode, &size);
+	if (!ret)
+		ret = compress_extend(fs, inode, &size, pos);
+
+	for (done = 0; !ret && done < len; done += n) {
+		n = SIMPLEFS_COMPRESS_MAX_CLUSTERS * SIMPLEFS_COMPRESS_CLUSTER_SIZE -
+		    (pos + done) % SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+		if (n > len - done)
+			n = len - done;
+		end = pos + done + n > size ? pos + done + n : size;
+		ret = compress_update(fs, inode, size, pos + done, buf + done, n, end);
+		if (!ret)
+			size = end;
+	}
+	return ret;
+}
+
+static int compress_truncate(struct simplefs *fs, struct simplefs_inode *inode,
+			     uint64_t new_size)
+{
+	uint64_t size;
+	int ret;
+
+	ret = compress_size(fs, inode, &size);
+	if (ret)
+		return ret;
+	if (new_size > size)
+		return compress_extend(fs, inode, &size, new_size);
+	return compress_update(fs, inode, size, 0, NULL, 0, new_size);
+}
+
+/* Turn the single block of a new file into an empty compressed file, as
+ * simplefs_compress_init does */
+static int compress_init(struct simplefs *fs, struct simplefs_inode *inode)
+{
+	struct simplefs_compress_header header = { 0 };
+	int ret;
+
+	ret = write_at(fs, &header, sizeof(header), inode->data_block_number, 0);
+	if (!ret && fdatasync(fs->fd))
+		ret = -errno;
+	if (!ret)
+		inode->file_size = fs->sb.block_size;
+	return ret;
+}
+
+/* Truncation sets the size as simplefs_setattr does. What is past the
+ * run of blocks of a file is a hole, on images that can have those. The
+ * tail of the run that is no longer needed is given up, and the rest of
+ * its last block zeroed, for when the file grows again. Must be called
+ * with run_lock held exclusively. */
+static int file_resize(struct simplefs *fs, fuse_ino_t ino, uint64_t size)
+{
+	uint64_t block_size = fs->sb.block_size;
+	uint64_t old_blocks, new_blocks, old_start, run_first, end, zero_end;
+	struct simplefs_inode inode;
+	char *zeroes;
+	int ret;
+
+	ret = get_inode(fs, ino, &inode);
+	if (ret)
+		return ret;
+	if (S_ISDIR(inode.mode))
+		return -EISDIR;
+	ret = file_shared(fs, &inode);
+	if (ret)
+		return ret;
+	if (inode.mode & SIMPLEFS_INODE_COMPRESSED)
+		return compress_truncate(fs, &inode, size);
+
+	old_blocks = simplefs_inode_blocks(&inode, block_size);
+	run_first = simplefs_inode_run_first(&inode);
+	end = (size + block_size - 1) / block_size;
+	if (end > run_first + old_blocks) {
+		/* Without holes, only a file with no run yet can get a
+		 * longer one, for all of its contents */
+		if (!simplefs_sparse_ok(&fs->sb))
+			return inode.data_block_number || inode.mode & SIMPLEFS_INODE_SPARSE ?
+			       -ENOSPC : file_get_a_run(fs, &inode, size);
+		ret = feature_set(fs, &fs->sb.feature_incompat,
+				  SIMPLEFS_FEATURE_INCOMPAT_SPARSE);
+		if (ret)
+			return ret;
+	}
+
+	/* Zeroes where the file may grow into again */
+	if (size < inode.file_size && size % block_size &&
+	    end - 1 >= run_first && end - 1 < run_first + old_blocks) {
+		zero_end = inode.file_size < end * block_size ? inode.file_size :
+								 end * block_size;
+		zeroes = calloc(1, zero_end - size);
+		ret = zeroes ? write_at(fs, zeroes, zero_end - size, inode.data_block_number,
+					size - run_first * block_size) : -ENOMEM;
+		free(zeroes);
+		if (ret)
+			return ret;
+	}
+
+	pthread_mutex_lock(&fs->inodes_lock);
+	ret = read_inode(fs, ino, &inode);
+	old_start = inode.data_block_number;
+	if (!ret) {
+		simplefs_inode_resize(&inode, block_size, size);
+		ret = save_inode(fs, &inode);
+	}
+	pthread_mutex_unlock(&fs->inodes_lock);
+	if (ret)
+		return ret;
+
+	new_blocks = simplefs_inode_blocks(&inode, block_size);
+	if (new_blocks < old_blocks)
+		ret = run_free(fs, old_start + new_blocks, old_blocks - new_blocks);
+	return ret;
+}
+
+/* Only the size, the permission bits and, on version 2 images, the
+ * times are stored */
+static void simplefs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			     int to_set, struct fuse_file_info *fi)
+{
+	struct simplefs *fs = simplefs_fs(req);
+	struct simplefs_inode inode;
+	struct stat st;
+	int ret = 0;
+
+	(void)fi;
+
+	pthread_rwlock_wrlock(&fs->run_lock);
+	if (to_set & FUSE_SET_ATTR_SIZE)
+		ret = file_resize(fs, ino, attr->st_size);
+	if (ret)
+		goto out;
+
+	pthread_mutex_lock(&fs->inodes_lock);
+	ret = read_inode(fs, ino, &inode);
+	if (ret)
+		goto unlock;
+
+	if (to_set & FUSE_SET_ATTR_MODE)
+		inode.mode = (inode.mode & ~07777) | (attr->st_mode & 07777);
+
+	if (fs->sb.version >= SIMPLEFS_VERSION_2) {
+		if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+			inode.atime = now_ns();
+		else if (to_set & FUSE_SET_ATTR_ATIME)
+			inode.atime = timespec_ns(&attr->st_atim);
+		if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+			inode.mtime = now_ns();
+		else if (to_set & FUSE_SET_ATTR_MTIME)
+			inode.mtime = timespec_ns(&attr->st_mtim);
+		inode.ctime = now_ns();
+	}
+
+	if (to_set & (FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_MODE |
+		      FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+		      FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))
+		ret = save_inode(fs, &inode);
+unlock:
+	pthread_mutex_unlock(&fs->inodes_lock);
+	if (!ret)
+		ret = fill_attr(fs, &inode, &st);
+out:
+	pthread_rwlock_unlock(&fs->run_lock);
+
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	fuse_reply_attr(req, &st, 1.0);
+}
+
+static void simplefs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			     off_t off, struct fuse_file_info *fi)
+{
+	struct simplefs *fs = simplefs_fs(req);
+	struct simplefs_dir_record *record;
+	struct simplefs_inode dir;
+	struct stat st;
+	uint64_t block, offset, i, loaded = 0;
+	size_t used = 0, len;
+	char *buf, *records;
+	int ret;
+
+	(void)fi;
+
+	ret = get_inode(fs, ino, &dir);
+	if (!ret && !S_ISDIR(dir.mode))
+		ret = -ENOTDIR;
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	buf = malloc(size);
+	records = malloc(fs->sb.block_size);
+	if (!buf || !records) {
+		free(buf);
+		free(records);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	/* Offsets 1 and 2 are . and .., the records follow from 3 */
+	memset(&st, 0, sizeof(st));
+	for (; (uint64_t)off < dir.dir_children_count + 2; off++) {
+		if (off < 2) {
+			st.st_ino = ino;
+			st.st_mode = S_IFDIR;
+			len = fuse_add_direntry(req, buf + used, size - used,
+						off ? ".." : ".", &st, off + 1);
+		} else {
+			i = off - 2;
+			simplefs_dir_record_locate(&fs->sb, &dir, i, &block, &offset);
+			if (block != loaded) {
+				ret = read_meta_block(fs, records, block);
+				if (ret)
+					break;
+				loaded = block;
+			}
+			record = (struct simplefs_dir_record *)(records + offset);
+			record->filename[SIMPLEFS_FILENAME_MAXLEN - 1] = '\0';
+			st.st_ino = le64_to_cpu(record->inode_no);
+			st.st_mode = 0;
+			len = fuse_add_direntry(req, buf + used, size - used,
+						record->filename, &st, off + 1);
+		}
+		if (len > size - used)
+			break;
+		used += len;
+	}
+
+	if (ret && !used)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, used);
+	free(buf);
+	free(records);
+}
+
+static void simplefs_open(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_file_info *fi)
+{
+	struct simplefs *fs = simplefs_fs(req);
+	struct simplefs_inode inode;
+	int ret;
+
+	ret = get_inode(fs, ino, &inode);
+	if (!ret && S_ISDIR(inode.mode))
+		ret = -EISDIR;
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	/* Nothing but this process changes the image */
+	fi->keep_cache = 1;
+	fuse_reply_open(req, fi);
+}
+
+/* A request that takes in a hole of a sparse file is put together in
+ * memory: zeroes, and what is in the run of blocks */
+static void read_sparse(fuse_req_t req, struct simplefs *fs,
+			const struct simplefs_inode *inode, size_t size, off_t off)
+{
+	uint64_t run_start = simplefs_inode_run_first(inode) * fs->sb.block_size;
+	uint64_t run_end = run_start +
+			   simplefs_inode_blocks(inode, fs->sb.block_size) * fs->sb.block_size;
+	uint64_t from = (uint64_t)off > run_start ? (uint64_t)off : run_start;
+	uint64_t to = off + size < run_end ? off + size : run_end;
+	char *data = calloc(1, size);
+	int ret = data ? 0 : -ENOMEM;
+
+	if (!ret && from < to)
+		ret = read_at(fs, data + (from - off), to - from,
+			      inode->data_block_number, from - run_start);
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, data, size);
+	free(data);
+}
+
+/* A compressed file is decompressed in memory, a cluster at a time, as
+ * simplefs_compress_read does */
+static void read_compressed(fuse_req_t req, struct simplefs *fs,
+			    const struct simplefs_inode *inode, size_t size, off_t off)
+{
+	struct simplefs_compress_cluster cluster;
+	uint64_t file_size, index, from, clen;
+	size_t done, offset, nbytes;
+	char *data = NULL, *raw = NULL;
+	int ret;
+
+	ret = compress_size(fs, inode, &file_size);
+	if (ret)
+		goto out;
+	if ((uint64_t)off >= file_size)
+		size = 0;
+	else if (size > file_size - off)
+		size = file_size - off;
+
+	data = malloc(size ? size : 1);
+	raw = malloc(2 * SIMPLEFS_COMPRESS_CLUSTER_SIZE);
+	if (!data || !raw) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (done = 0; done < size && !ret; done += nbytes) {
+		index = (off + done) / SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+		from = index * SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+		offset = off + done - from;
+		clen = file_size - from < SIMPLEFS_COMPRESS_CLUSTER_SIZE ? file_size - from :
+									   SIMPLEFS_COMPRESS_CLUSTER_SIZE;
+
+		ret = read_at(fs, &cluster, sizeof(cluster), inode->data_block_number,
+			      simplefs_compress_table_size(index));
+		simplefs_compress_table_load(&cluster, 1);
+		if (!ret)
+			ret = compress_cluster_read(fs, inode->data_block_number, &cluster,
+						    raw, clen, raw + SIMPLEFS_COMPRESS_CLUSTER_SIZE);
+
+		nbytes = size - done < clen - offset ? size - done : clen - offset;
+		if (!ret)
+			memcpy(data + done, raw + offset, nbytes);
+	}
+
+out:
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, data, size);
+	free(data);
+	free(raw);
+}
+
+/* A file is a contiguous run of blocks, so the whole request is served
+ * from one range of the image, spliced straight from it when possible */
+static void simplefs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			  off_t off, struct fuse_file_info *fi)
+{
+	struct simplefs *fs = simplefs_fs(req);
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+	struct simplefs_inode inode;
+	uint64_t run_start;
+	int ret;
+
+	(void)fi;
+
+	/* Until the reply is sent, the run cannot move and be reused */
+	pthread_rwlock_rdlock(&fs->run_lock);
+	ret = get_inode(fs, ino, &inode);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		goto out;
+	}
+
+	if (inode.mode & SIMPLEFS_INODE_COMPRESSED) {
+		read_compressed(req, fs, &inode, size, off);
+		goto out;
+	}
+
+	if ((uint64_t)off >= inode.file_size) {
+		fuse_reply_buf(req, NULL, 0);
+		goto out;
+	}
+	if (size > inode.file_size - off)
+		size = inode.file_size - off;
+
+	run_start = simplefs_inode_run_first(&inode) * fs->sb.block_size;
+	if ((uint64_t)off < run_start ||
+	    off + size > run_start + simplefs_inode_blocks(&inode, fs->sb.block_size) *
+				     fs->sb.block_size) {
+		read_sparse(req, fs, &inode, size, off);
+		goto out;
+	}
+
+	buf.buf[0].size = size;
+	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	buf.buf[0].fd = fs->fd;
+	buf.buf[0].pos = inode.data_block_number * fs->sb.block_size + off - run_start;
+
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+out:
+	pthread_rwlock_unlock(&fs->run_lock);
+}
+
+/* With the writeback cache, writes to different parts of a file can
+ * come in any order. The size only ever grows here. That of a compressed
+ * file is in its header instead. */
+static int write_done(struct simplefs *fs, fuse_ino_t ino, uint64_t end)
+{
+	struct simplefs_inode inode;
+	int grows = 0, ret;
+
+	pthread_mutex_lock(&fs->inodes_lock);
+	ret = read_inode(fs, ino, &inode);
+	if (!ret)
+		grows = !(inode.mode & SIMPLEFS_INODE_COMPRESSED) && end > inode.file_size;
+	if (!ret && (grows || fs->sb.version >= SIMPLEFS_VERSION_2)) {
+		if (fs->sb.version >= SIMPLEFS_VERSION_2)
+			inode.mtime = inode.ctime = now_ns();
+		if (grows)
+			inode.file_size = end;
+		ret = save_inode(fs, &inode);
+	}
+	pthread_mutex_unlock(&fs->inodes_lock);
+	return ret;
+}
+
+/* Writes to the run a file already has go in place, with run_lock held
+ * shared, so that those to different parts of it, or to other files, go
+ * on at the same time. Those past the run move the file to a longer one
+ * (see file_extend), and those to compressed files rewrite clusters of
+ * it (see compress_write), with run_lock held exclusively, as the
+ * kernel module holds the inode lock for them. */
+static void simplefs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+			   size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct simplefs *fs = simplefs_fs(req);
+	struct simplefs_inode inode;
+	uint64_t block_size = fs->sb.block_size, first, last, run_first;
+	int excl = 0, in_run, ret;
+
+	(void)fi;
+
+	if (!size) {
+		fuse_reply_write(req, 0);
+		return;
+	}
+	first = off / block_size;
+	last = (off + size - 1) / block_size;
+
+again:
+	if (excl)
+		pthread_rwlock_wrlock(&fs->run_lock);
+	else
+		pthread_rwlock_rdlock(&fs->run_lock);
+
+	ret = get_inode(fs, ino, &inode);
+	if (ret)
+		goto out;
+
+	run_first = simplefs_inode_run_first(&inode);
+	in_run = !(inode.mode & SIMPLEFS_INODE_COMPRESSED) && inode.data_block_number &&
+		 first >= run_first &&
+		 last < run_first + simplefs_inode_blocks(&inode, block_size);
+	if (!in_run && !excl) {
+		pthread_rwlock_unlock(&fs->run_lock);
+		excl = 1;
+		goto again;
+	}
+
+	if (inode.mode & SIMPLEFS_INODE_COMPRESSED) {
+		ret = file_shared(fs, &inode);
+		if (!ret)
+			ret = compress_write(fs, &inode, buf, size, off);
+		goto done;
+	}
+
+	if (!inode.data_block_number && !(inode.mode & SIMPLEFS_INODE_SPARSE)) {
+		ret = file_get_a_run(fs, &inode, off + size);
+		if (ret)
+			goto out;
+	}
+	run_first = simplefs_inode_run_first(&inode);
+	if (first < run_first ||
+	    last >= run_first + simplefs_inode_blocks(&inode, block_size)) {
+		ret = file_extend(fs, &inode, first, last);
+		if (ret)
+			goto out;
+		run_first = simplefs_inode_run_first(&inode);
+	}
+
+	ret = run_shared(fs, inode.data_block_number + first - run_first,
+			 last - first + 1);
+	if (ret) {
+		ret = ret < 0 ? ret : -EOPNOTSUPP;
+		goto out;
+	}
+
+	ret = write_at(fs, buf, size, inode.data_block_number,
+		       off - run_first * block_size);
+done:
+	if (!ret)
+		ret = write_done(fs, ino, off + size);
+out:
+	pthread_rwlock_unlock(&fs->run_lock);
+
+	if (ret)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, size);
+}
+
+/* The same steps, in the same order, as simplefs_create_fs_object */
+static int create_fs_object(struct simplefs *fs, fuse_ino_t parent,
+			    const char *name, mode_t mode,
+			    struct simplefs_inode *inode)
+{
+	struct simplefs_dir_record record;
+	struct simplefs_inode dir;
+	uint64_t block, offset;
+	char *records = NULL;
+	int64_t found;
+	int ret;
+
+	if (!S_ISDIR(mode) && !S_ISREG(mode))
+		return -EINVAL;
+
+	pthread_mutex_lock(&fs->dir_lock);
+
+	ret = get_inode(fs, parent, &dir);
+	if (ret)
+		goto out;
+	if (!S_ISDIR(dir.mode)) {
+		ret = -ENOTDIR;
+		goto out;
+	}
+
+	found = dir_find(fs, &dir, name);
+	if (found) {
+		ret = found > 0 ? -EEXIST : found;
+		goto out;
+	}
+
+	ret = simplefs_dir_record_init(&record, name, strlen(name), 0);
+	if (ret)
+		goto out;
+
+	/* Directories do not grow beyond the run of blocks they already have */
+	if (dir.dir_children_count >= simplefs_dir_capacity(&fs->sb, &dir)) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	/* Only creates add inodes, and they are serialized by dir_lock */
+	pthread_mutex_lock(&fs->sb_lock);
+	ret = fs->sb.inodes_count >= fs->sb.inodes_max ? -ENOSPC : 0;
+	pthread_mutex_unlock(&fs->sb_lock);
+	if (ret)
+		goto out;
+
+	memset(inode, 0, sizeof(*inode));
+	inode->mode = mode;
+	inode->links_count = 1;
+	inode->atime = inode->mtime = inode->ctime = now_ns();
+	/* Directories pass compression on */
+	if (dir.mode & SIMPLEFS_INODE_COMPRESSED)
+		inode->mode |= SIMPLEFS_INODE_COMPRESSED;
+
+	/* First get a free block and update the free map,
+	 * Then add inode to the inode store and update the sb inodes_count,
+	 * Then update the parent directory's inode with the new child. */
+	ret = get_a_freerun(fs, S_ISDIR(mode), 1, &inode->data_block_number);
+	if (ret)
+		goto out;
+
+	if (S_ISREG(mode) && inode->mode & SIMPLEFS_INODE_COMPRESSED) {
+		ret = feature_set(fs, &fs->sb.feature_incompat,
+				  SIMPLEFS_FEATURE_INCOMPAT_COMPRESS);
+		if (!ret)
+			ret = compress_init(fs, inode);
+		if (ret)
+			goto out;
+	}
+
+	pthread_mutex_lock(&fs->sb_lock);
+	inode->inode_no = simplefs_inode_next_no(&fs->sb);
+	ret = add_inode(fs, inode);
+	pthread_mutex_unlock(&fs->sb_lock);
+	if (ret)
+		goto out;
+
+	/* The record goes out with the rest of its block, for its checksum.
+	 * A block without records yet has nothing to check. */
+	record.inode_no = cpu_to_le64(inode->inode_no);
+	simplefs_dir_record_locate(&fs->sb, &dir, dir.dir_children_count,
+				   &block, &offset);
+	records = malloc(fs->sb.block_size);
+	if (!records) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = offset ? read_meta_block(fs, records, block) :
+		       read_at(fs, records, fs->sb.block_size, block, 0);
+	if (ret)
+		goto out;
+	memcpy(records + offset, &record, sizeof(record));
+	ret = write_meta_block(fs, records, block);
+	if (ret)
+		goto out;
+
+	pthread_mutex_lock(&fs->inodes_lock);
+	dir.dir_children_count++;
+	ret = save_inode(fs, &dir);
+	pthread_mutex_unlock(&fs->inodes_lock);
+out:
+	pthread_mutex_unlock(&fs->dir_lock);
+	free(records);
+	return ret;
+}
+
+static void simplefs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+			    mode_t mode, struct fuse_file_info *fi)
+{
+	struct simplefs *fs = simplefs_fs(req);
+	struct fuse_entry_param e;
+	struct simplefs_inode inode;
+	int ret;
+
+	ret = create_fs_object(fs, parent, name, S_IFREG | (mode & ~S_IFMT), &inode);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	memset(&e, 0, sizeof(e));
+	e.ino = inode.inode_no;
+	e.attr_timeout = 1.0;
+	e.entry_timeout = 1.0;
+	ret = fill_attr(fs, &inode, &e.attr);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fi->keep_cache = 1;
+	fuse_reply_create(req, &e, fi);
+}
+
+static void simplefs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+			   mode_t mode)
+{
+	struct simplefs *fs = simplefs_fs(req);
+	struct simplefs_inode inode;
+	int ret;
+
+	ret = create_fs_object(fs, parent, name, S_IFDIR | (mode & ~S_IFMT), &inode);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	reply_entry(req, fs, &inode);
+}
+
+static void simplefs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct simplefs *fs = simplefs_fs(req);
+	struct statvfs st;
+
+	(void)ino;
+
+	memset(&st, 0, sizeof(st));
+	pthread_mutex_lock(&fs->sb_lock);
+	st.f_bsize = fs->sb.block_size;
+	st.f_frsize = fs->sb.block_size;
+	st.f_blocks = fs->sb.blocks_count;
+	/* The blocks between the two devices do not exist */
+	if (fs->sb.meta_block)
+		st.f_blocks -= fs->sb.meta_block - fs->sb.data_dev_blocks;
+	st.f_bfree = simplefs_sb_free_blocks(&fs->sb);
+	st.f_bavail = st.f_bfree;
+	st.f_files = fs->sb.inodes_max;
+	st.f_ffree = fs->sb.inodes_max - fs->sb.inodes_count;
+	st.f_favail = st.f_ffree;
+	st.f_namemax = SIMPLEFS_FILENAME_MAXLEN - 1;
+	pthread_mutex_unlock(&fs->sb_lock);
+
+	fuse_reply_statfs(req, &st);
+}
+
+static void simplefs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			   struct fuse_file_info *fi)
+{
+	struct simplefs *fs = simplefs_fs(req);
+
+	(void)ino;
+	(void)fi;
+
+	if ((datasync ? fdatasync(fs->fd) : fsync(fs->fd)) ||
+	    (fs->meta_fd != -1 && (datasync ? fdatasync(fs->meta_fd) : fsync(fs->meta_fd))))
+		fuse_reply_err(req, errno);
+	else
+		fuse_reply_err(req, 0);
+}
+
+static const struct fuse_lowlevel_ops simplefs_ops = {
+	.init = simplefs_init,
+	.destroy = simplefs_destroy,
+	.lookup = simplefs_lookup,
+	.getattr = simplefs_getattr,
+	.setattr = simplefs_setattr,
+	.readdir = simplefs_readdir,
+	.open = simplefs_open,
+	.read = simplefs_read,
+	.write = simplefs_write,
+	.create = simplefs_create,
+	.mkdir = simplefs_mkdir,
+	.statfs = simplefs_statfs,
+	.fsync = simplefs_fsync,
+	.fsyncdir = simplefs_fsync,
+};
+
+/* The kernel module writes through jbd2. Whatever is still in the
+ * journal would be lost, or worse, replayed over our changes later. */
+static int journal_needs_recovery(struct simplefs *fs)
+{
+	struct simplefs_inode journal;
+	uint32_t header[8];
+
+	if (get_inode(fs, SIMPLEFS_JOURNAL_INODE_NUMBER, &journal))
+		return 0;
+	if (journal.data_block_number >= fs->sb.blocks_count ||
+	    read_at(fs, header, sizeof(header), journal.data_block_number, 0))
+		return 0;
+
+	/* jbd2 is big endian: h_magic, and then s_start */
+	return be32toh(header[0]) == JBD2_MAGIC_NUMBER && header[7];
+}
+
+/* What simplefs-fuse writes is not tracked, so the current epoch of
+ * changed block tracking (see simplefs_cbt_header) is marked as having
+ * missed some blocks */
+static int cbt_untracked(struct simplefs *fs)
+{
+	struct simplefs_cbt_header header;
+
+	if (read_at(fs, &header, sizeof(header), fs->sb.cbt_block, 0) ||
+	    le64_to_cpu(header.magic) != SIMPLEFS_CBT_MAGIC) {
+		printf("The changed block tracking header is invalid, run fsck-simplefs\n");
+		return -1;
+	}
+
+	header.flags |= cpu_to_le64(SIMPLEFS_CBT_INCOMPLETE);
+	if (write_at(fs, &header, sizeof(header), fs->sb.cbt_block, 0)) {
+		printf("Error writing the changed block tracking header\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Nor does the dedup index (see simplefs_dedup_header) learn of what
+ * simplefs-fuse changes, so its slots are not to be trusted after it */
+static int dedup_unclean(struct simplefs *fs)
+{
+	struct simplefs_dedup_header header;
+
+	if (read_at(fs, &header, sizeof(header), fs->sb.dedup_block, 0) ||
+	    le64_to_cpu(header.magic) != SIMPLEFS_DEDUP_MAGIC) {
+		printf("The dedup index header is invalid, run fsck-simplefs\n");
+		return -1;
+	}
+
+	header.flags &= ~cpu_to_le64(SIMPLEFS_DEDUP_CLEAN);
+	if (write_at(fs, &header, sizeof(header), fs->sb.dedup_block, 0)) {
+		printf("Error writing the dedup index header\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* The metadata device starts with a copy of the super block, as mkfs
+ * wrote it, which must be that of the image */
+static int load_meta(struct simplefs *fs, const char *meta)
+{
+	struct simplefs_super_block_disk copy;
+
+	if (!fs->sb.meta_block || !meta) {
+		printf(meta ? "The image has no metadata device\n" :
+		       "The metadata of the image is on another device, give it with -o meta=\n");
+		return -1;
+	}
+
+	fs->meta_fd = open(meta, O_RDWR);
+	if (fs->meta_fd == -1) {
+		perror(meta);
+		return -1;
+	}
+
+	if (pread(fs->meta_fd, &copy, sizeof(copy), 0) != sizeof(copy) ||
+	    le64_to_cpu(copy.magic) != fs->sb.magic ||
+	    le64_to_cpu(copy.blocks_count) != fs->sb.blocks_count ||
+	    le64_to_cpu(copy.meta_block) != fs->sb.meta_block ||
+	    le64_to_cpu(copy.data_dev_blocks) != fs->sb.data_dev_blocks ||
+	    le64_to_cpu(copy.group_desc_block) != fs->sb.group_desc_block) {
+		printf("%s is not the metadata device of the image\n", meta);
+		return -1;
+	}
+	return 0;
+}
+
+static int load_image(struct simplefs *fs, const char *image, const char *meta)
+{
+	struct simplefs_super_block_disk disk;
+	const char *invalid;
+	ssize_t ret;
+
+	fs->fd = open(image, O_RDWR);
+	if (fs->fd == -1) {
+		perror(image);
+		return -1;
+	}
+
+	ret = pread(fs->fd, &disk, sizeof(disk), 0);
+	if (ret != sizeof(disk)) {
+		printf("Error reading the super block\n");
+		return -1;
+	}
+	simplefs_sb_load(&disk, &fs->sb);
+
+	/* Images without a block bitmap keep tracking free blocks in
+	 * the free_blocks mask */
+	if (!fs->sb.groups_count)
+		simplefs_sb_legacy_geometry(&fs->sb);
+
+	invalid = simplefs_sb_check(&fs->sb);
+	if (invalid) {
+		printf("%s\n", invalid);
+		return -1;
+	}
+	if (simplefs_sb_read_only(&fs->sb)) {
+		printf("The image has features this version can only read\n");
+		return -1;
+	}
+	if (!simplefs_sb_csum_verify(&fs->sb, &disk)) {
+		printf("The super block has a wrong checksum, run fsck-simplefs\n");
+		return -1;
+	}
+
+	fs->inode_block = malloc(fs->sb.block_size);
+	if (!fs->inode_block) {
+		printf("Not enough memory\n");
+		return -1;
+	}
+
+	if ((fs->sb.meta_block || meta) && load_meta(fs, meta))
+		return -1;
+
+	if (journal_needs_recovery(fs)) {
+		printf("The journal needs to be recovered, mount %s with the kernel module first\n",
+		       image);
+		return -1;
+	}
+
+	if (simplefs_sb_cbt_block(&fs->sb) && cbt_untracked(fs))
+		return -1;
+	if (simplefs_sb_dedup_block(&fs->sb) && dedup_unclean(fs))
+		return -1;
+
+	return 0;
+}
+
+struct simplefs_args {
+	const char *image;
+	const char *meta;
+};
+
+static const struct fuse_opt simplefs_opts[] = {
+	{ "meta=%s", offsetof(struct simplefs_args, meta), 0 },
+	FUSE_OPT_END
+};
+
+static int simplefs_opt_proc(void *data, const char *arg, int key,
+			     struct fuse_args *outargs)
+{
+	struct simplefs_args *sargs = data;
+
+	(void)outargs;
+
+	/* The first argument that is not an option is the image,
+	 * the mount point is left for fuse_parse_cmdline */
+	if (key == FUSE_OPT_KEY_NONOPT && !sargs->image) {
+		sargs->image = arg;
+		return 0;
+	}
+	return 1;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options] <image> <mountpoint>\n\n"
+	       "    -o meta=<device>       the metadata device of an image made\n"
+	       "                           with mkfs-simplefs -m\n\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_loop_config config;
+	struct fuse_session *se;
+	struct simplefs_args sargs = { NULL, NULL };
+	struct simplefs fs = {
+		.fd = -1,
+		.meta_fd = -1,
+		.run_lock = PTHREAD_RWLOCK_INITIALIZER,
+		.sb_lock = PTHREAD_MUTEX_INITIALIZER,
+		.inodes_lock = PTHREAD_MUTEX_INITIALIZER,
+		.dir_lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	int ret = 1;
+
+	if (fuse_opt_parse(&args, &sargs, simplefs_opts, simplefs_opt_proc))
+		return 1;
+	if (fuse_parse_cmdline(&args, &opts))
+		return 1;
+
+	if (opts.show_help) {
+		usage(argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		ret = 0;
+		goto out;
+	}
+	if (opts.show_version) {
+		fuse_lowlevel_version();
+		ret = 0;
+		goto out;
+	}
+	if (!sargs.image || !opts.mountpoint) {
+		usage(argv[0]);
+		goto out;
+	}
+
+	if (load_image(&fs, sargs.image, sargs.meta))
+		goto out;
+	fs.uid = getuid();
+	fs.gid = getgid();
+	clock_gettime(CLOCK_REALTIME, &fs.mounted);
+
+	se = fuse_session_new(&args, &simplefs_ops, sizeof(simplefs_ops), &fs);
+	if (!se)
+		goto out;
+	if (fuse_set_signal_handlers(se))
+		goto destroy;
+	if (fuse_session_mount(se, opts.mountpoint))
+		goto remove_handlers;
+
+	fuse_daemonize(opts.foreground);
+
+	if (opts.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		config.clone_fd = opts.clone_fd;
+		config.max_idle_threads = opts.max_idle_threads;
+		ret = fuse_session_loop_mt(se, &config);
+	}
+
+	fuse_session_unmount(se);
+remove_handlers:
+	fuse_remove_signal_handlers(se);
+destroy:
+	fuse_session_destroy(se);
+out:
+	if (fs.fd != -1)
+		close(fs.fd);
+	if (fs.meta_fd != -1)
+		close(fs.meta_fd);
+	free(fs.inode_block);
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return ret ? 1 : 0;
+}
@@ -1,11 +1,296 @@
+#ifndef SIMPLEFS_SUPER_H
+#define SIMPLEFS_SUPER_H
+
+#include <linux/percpu_counter.h>
+#include <linux/kobject.h>
+#include <linux/completion.h>
+#include <linux/timekeeping.h>
+#include <linux/log2.h>
+#include <linux/buffer_head.h>
+#include <linux/jbd2.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/rwsem.h>
+
 #include "simple.h"
 
-static inline struct simplefs_super_block *SIMPLEFS_SB(struct super_block *sb)
+/* The per-mount counters in /sys/fs/simplefs/<dev>/ */
+enum simplefs_stat {
+	SIMPLEFS_STAT_LOOKUP_HITS,
+	SIMPLEFS_STAT_LOOKUP_MISSES,
+	SIMPLEFS_STAT_BLOCKS_ALLOCATED,
+	SIMPLEFS_STAT_INODES_ALLOCATED,
+	SIMPLEFS_STAT_JOURNAL_HANDLES,
+	SIMPLEFS_STAT_BLOCKS_DEDUPLICATED,
+	SIMPLEFS_STAT_COUNT,
+};
+
+/* The operations that get a latency histogram */
+enum simplefs_op {
+	SIMPLEFS_OP_LOOKUP,
+	SIMPLEFS_OP_CREATE,
+	SIMPLEFS_OP_READ,
+	SIMPLEFS_OP_WRITE,
+	SIMPLEFS_OP_INODE_SAVE,
+	SIMPLEFS_OP_COUNT,
+};
+
+/* The global locks in simple.c, for counting how often they were
+ * already held when a mount wanted them */
+enum simplefs_lock {
+	SIMPLEFS_LOCK_SB,
+	SIMPLEFS_LOCK_INODES,
+	SIMPLEFS_LOCK_DIR,
+	/* Not a global lock, but the range locks of all the files */
+	SIMPLEFS_LOCK_RANGE,
+	SIMPLEFS_LOCK_COUNT,
+};
+
+/* Bucket n counts the operations that took [2^n, 2^(n+1)) nanoseconds,
+ * the last one also all those that took longer */
+#define SIMPLEFS_LATENCY_BUCKETS 32
+
+/* Each CPU only ever updates its own copy. sysfs adds them up. */
+struct simplefs_stats {
+	u64 count[SIMPLEFS_STAT_COUNT];
+	u64 lock_contended[SIMPLEFS_LOCK_COUNT];
+	u64 lock_wait_ns[SIMPLEFS_LOCK_COUNT];
+	u64 latency[SIMPLEFS_OP_COUNT][SIMPLEFS_LATENCY_BUCKETS];
+};
+
+/* A run of blocks written out with -o dedup, in the slot of the crc32c
+ * of its contents, see simplefs_dedup_find. start is 0 in an empty
+ * slot. */
+struct simplefs_dedup_entry {
+	u64 start;
+	u32 blocks;
+	u32 hash;
+};
+
+/* A run of blocks given back while the journal may still have their old
+ * contents, which replaying it would write over whatever they hold by
+ * then. Not handed out again before the journal has no transaction
+ * older than tid left, see simplefs_busy_add. */
+struct simplefs_busy_run {
+	struct list_head list;
+	u64 start;
+	u64 count;
+	tid_t tid;
+};
+
+/* The in-memory super block, kept in s_fs_info */
+struct simplefs_sb_info {
+	/* The super block as it is on the disk */
+	struct simplefs_super_block *sb;
+
+	/* The VFS super block this is the s_fs_info of, for sysfs */
+	struct super_block *vsb;
+
+	/* Read by statfs without taking simplefs_sb_lock. The allocators
+	 * keep them in step, and they are set from the on-disk counts
+	 * at mount and on every sync. */
+	struct percpu_counter free_blocks;
+	struct percpu_counter free_inodes;
+
+	/* The blocks reserved for what files with delayed allocation have
+	 * in memory, which the allocators leave to them (see
+	 * simplefs_delalloc_claim), and the bytes of memory that takes */
+	struct percpu_counter delalloc_blocks;
+	atomic64_t delalloc_bytes;
+
+	/* New files get their blocks when their contents are written out,
+	 * not when they are created, see simplefs_delalloc_write. Off with
+	 * -o nodelalloc, and on images without feature flags or without a
+	 * block bitmap. */
+	bool delalloc;
+
+	struct simplefs_stats __percpu *stats;
+
+	/* The journal of file contents, see simplefs_write_range, and the
+	 * device it is on when mounted with -o journal_dev= or a
+	 * journal_path= that is a block device */
+	struct journal_s *journal;
+	struct block_device *journal_bdev;
+
+	/* The simplefs_busy_run of the journal, under simplefs_sb_lock */
+	struct list_head busy_runs;
+
+	/* Mounted with -o compress: every new file is compressed */
+	bool compress;
+
+	/* Mounted with -o dedup: the runs written out last, by the hash of
+	 * their contents, for the files written out after them to share.
+	 * NULL without it. The buffer of the header of the run the index
+	 * is kept in, on images with one. */
+	struct simplefs_dedup_entry *dedup;
+	spinlock_t dedup_lock;
+	struct buffer_head *dedup_bh;
+
+	/* Mounted with -o meta_dev= or meta_path=, the device the blocks
+	 * from simplefs_super_block.meta_block on are on */
+	struct block_device *meta_bdev;
+
+	/* Changed block tracking, see simplefs_cbt_mark: the buffer of its
+	 * header, kept for as long as the image is mounted, or NULL when it
+	 * is off. Taken for writing to change epochs. cbt_missed is set
+	 * when a block could not be marked. */
+	struct buffer_head *cbt_bh;
+	struct rw_semaphore cbt_sem;
+	bool cbt_missed;
+
+	/* /sys/fs/simplefs/<dev>/, see sysfs.c */
+	struct kobject kobj;
+	struct completion kobj_unregister;
+};
+
+static inline struct simplefs_sb_info *SIMPLEFS_SB_INFO(struct super_block *sb)
 {
 	return sb->s_fs_info;
 }
 
-static inline struct simplefs_inode *SIMPLEFS_INODE(struct inode *inode)
+static inline struct simplefs_super_block *SIMPLEFS_SB(struct super_block *sb)
+{
+	return SIMPLEFS_SB_INFO(sb)->sb;
+}
+
+/* sb_bread and sb_getblk for the blocks of the image, wherever they are:
+ * those from meta_block on are on the metadata device, if there is one */
+static inline struct buffer_head *simplefs_bread(struct super_block *sb, u64 block)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+
+	if (sbi->meta_bdev && block >= sbi->sb->meta_block)
+		return __bread(sbi->meta_bdev, block - sbi->sb->meta_block,
+			       sb->s_blocksize);
+	return sb_bread(sb, block);
+}
+
+static inline struct buffer_head *simplefs_getblk(struct super_block *sb, u64 block)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+
+	if (sbi->meta_bdev && block >= sbi->sb->meta_block)
+		return __getblk(sbi->meta_bdev, block - sbi->sb->meta_block,
+				sb->s_blocksize);
+	return sb_getblk(sb, block);
+}
+
+/* Start reading a block in, for simplefs_bread to find it there */
+static inline void simplefs_breadahead(struct super_block *sb, u64 block)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+
+	if (sbi->meta_bdev && block >= sbi->sb->meta_block)
+		__breadahead(sbi->meta_bdev, block - sbi->sb->meta_block,
+			     sb->s_blocksize);
+	else
+		sb_breadahead(sb, block);
+}
+
+/* The block of the image a buffer head of simplefs_bread holds */
+static inline u64 simplefs_bh_block(struct super_block *sb, struct buffer_head *bh)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+
+	if (sbi->meta_bdev && bh->b_bdev == sbi->meta_bdev)
+		return bh->b_blocknr + sbi->sb->meta_block;
+	return bh->b_blocknr;
+}
+
+void simplefs_cbt_mark(struct super_block *sb, u64 block, u64 count);
+
+/* mark_buffer_dirty for a block of the image, which changed block
+ * tracking takes note of */
+static inline void simplefs_mark_buffer_dirty(struct super_block *sb,
+					      struct buffer_head *bh)
+{
+	simplefs_cbt_mark(sb, simplefs_bh_block(sb, bh), 1);
+	mark_buffer_dirty(bh);
+}
+
+/* A block with a checksum (see simplefs_block_csum_verify) has it
+ * checked once after it comes in from the disk, and is then marked with
+ * this, as is one whose checksum was just set. The state bits before it
+ * are those of jbd2. */
+enum {
+	BH_SimplefsVerified = BH_JBDPrivateStart,
+};
+BUFFER_FNS(SimplefsVerified, simplefs_verified)
+
+static inline void simplefs_stat_inc(struct super_block *sb,
+				     enum simplefs_stat stat)
+{
+	this_cpu_inc(SIMPLEFS_SB_INFO(sb)->stats->count[stat]);
+}
+
+static inline void simplefs_stat_add(struct super_block *sb,
+				     enum simplefs_stat stat, u64 n)
+{
+	this_cpu_add(SIMPLEFS_SB_INFO(sb)->stats->count[stat], n);
+}
+
+/* Account an operation that started at start (ktime_get_ns) */
+static inline void simplefs_stat_latency(struct super_block *sb,
+					 enum simplefs_op op, u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+	unsigned int bucket = ns ? ilog2(ns) : 0;
+
+	if (bucket >= SIMPLEFS_LATENCY_BUCKETS)
+		bucket = SIMPLEFS_LATENCY_BUCKETS - 1;
+	this_cpu_inc(SIMPLEFS_SB_INFO(sb)->stats->latency[op][bucket]);
+}
+
+/* A range of bytes of a file locked by a reader or a writer, see
+ * simplefs_range_lock. end is the last byte of it. */
+struct simplefs_range {
+	struct list_head list;
+	loff_t start;
+	loff_t end;
+	bool write;
+};
+
+/* The in-memory inode, kept in i_private */
+struct simplefs_inode_info {
+	/* The inode as it is on the disk. It comes first, so that pointers
+	 * to it are pointers to all of this. */
+	struct simplefs_inode disk;
+
+	/* The ranges of the file being read or written by those holding
+	 * the inode lock shared, and those waiting for one of them */
+	spinlock_t ranges_lock;
+	struct list_head ranges;
+	wait_queue_head_t ranges_wait;
+
+	/* With delayed allocation, the contents of a file that has no run
+	 * of blocks yet, capacity bytes of room for them, and how many
+	 * blocks they take, which are reserved for them. Beyond i_size, it
+	 * is all zeroes. Only used with the inode locked. */
+	char *delalloc;
+	size_t delalloc_capacity;
+	u64 delalloc_blocks;
+
+	/* With -o dedup, no slot of the index points to the run of the
+	 * file, which can be written to in place without looking, see
+	 * simplefs_dedup_forget. Only used with the inode locked. */
+	bool dedup_unlisted;
+};
+
+static inline struct simplefs_inode_info *SIMPLEFS_INODE_INFO(struct inode *inode)
 {
 	return inode->i_private;
 }
+
+static inline struct simplefs_inode *SIMPLEFS_INODE(struct inode *inode)
+{
+	return &SIMPLEFS_INODE_INFO(inode)->disk;
+}
+
+int simplefs_sb_free_extents(struct super_block *vsb, u64 *counts);
+
+int simplefs_sysfs_init(void);
+void simplefs_sysfs_exit(void);
+int simplefs_sysfs_register(struct super_block *sb);
+void simplefs_sysfs_unregister(struct super_block *sb);
+
+#endif
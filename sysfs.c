@@ -0,0 +1,224 @@
+/*
+ * /sys/fs/simplefs/<dev>/: what a mount has been doing, for dashboards
+ * that do not want to attach a tracer.
+ *
+ * Each counter is a file holding a single number. Each *_latency file
+ * is a log2 histogram, one "<nanoseconds> <count>" line per bucket up to
+ * the last one that is not empty, where the bucket counts the operations
+ * that took at least that long and less than twice as long.
+ *
+ * free_extents is not a counter, but how fragmented the free space is
+ * right now: the same kind of histogram, of the runs of free blocks by
+ * length, one "<blocks> <count>" line per bucket. A file needs a run of
+ * its whole length, see simplefs_defrag and defrag-simplefs.
+ *
+ * License: Creative Commons Zero License - http://creativecommons.org/publicdomain/zero/1.0/
+ */
+
+#include <linux/fs.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/percpu.h>
+
+#include "super.h"
+#include "format.h"
+
+enum simplefs_attr_kind {
+	SIMPLEFS_ATTR_COUNT,
+	SIMPLEFS_ATTR_LOCK_CONTENDED,
+	SIMPLEFS_ATTR_LOCK_WAIT_NS,
+	SIMPLEFS_ATTR_LATENCY,
+	SIMPLEFS_ATTR_FREE_EXTENTS,
+};
+
+struct simplefs_attr {
+	struct attribute attr;
+	enum simplefs_attr_kind kind;
+	int index;
+};
+
+#define SIMPLEFS_ATTR(_name, _kind, _index)				\
+static struct simplefs_attr simplefs_attr_##_name = {			\
+	.attr = { .name = __stringify(_name), .mode = 0444 },		\
+	.kind = _kind,							\
+	.index = _index,						\
+}
+
+SIMPLEFS_ATTR(lookup_hits, SIMPLEFS_ATTR_COUNT, SIMPLEFS_STAT_LOOKUP_HITS);
+SIMPLEFS_ATTR(lookup_misses, SIMPLEFS_ATTR_COUNT, SIMPLEFS_STAT_LOOKUP_MISSES);
+SIMPLEFS_ATTR(blocks_allocated, SIMPLEFS_ATTR_COUNT, SIMPLEFS_STAT_BLOCKS_ALLOCATED);
+SIMPLEFS_ATTR(inodes_allocated, SIMPLEFS_ATTR_COUNT, SIMPLEFS_STAT_INODES_ALLOCATED);
+SIMPLEFS_ATTR(journal_handles, SIMPLEFS_ATTR_COUNT, SIMPLEFS_STAT_JOURNAL_HANDLES);
+SIMPLEFS_ATTR(blocks_deduplicated, SIMPLEFS_ATTR_COUNT, SIMPLEFS_STAT_BLOCKS_DEDUPLICATED);
+
+SIMPLEFS_ATTR(sb_lock_contended, SIMPLEFS_ATTR_LOCK_CONTENDED, SIMPLEFS_LOCK_SB);
+SIMPLEFS_ATTR(sb_lock_wait_ns, SIMPLEFS_ATTR_LOCK_WAIT_NS, SIMPLEFS_LOCK_SB);
+SIMPLEFS_ATTR(inodes_lock_contended, SIMPLEFS_ATTR_LOCK_CONTENDED, SIMPLEFS_LOCK_INODES);
+SIMPLEFS_ATTR(inodes_lock_wait_ns, SIMPLEFS_ATTR_LOCK_WAIT_NS, SIMPLEFS_LOCK_INODES);
+SIMPLEFS_ATTR(dir_lock_contended, SIMPLEFS_ATTR_LOCK_CONTENDED, SIMPLEFS_LOCK_DIR);
+SIMPLEFS_ATTR(dir_lock_wait_ns, SIMPLEFS_ATTR_LOCK_WAIT_NS, SIMPLEFS_LOCK_DIR);
+SIMPLEFS_ATTR(range_lock_contended, SIMPLEFS_ATTR_LOCK_CONTENDED, SIMPLEFS_LOCK_RANGE);
+SIMPLEFS_ATTR(range_lock_wait_ns, SIMPLEFS_ATTR_LOCK_WAIT_NS, SIMPLEFS_LOCK_RANGE);
+
+SIMPLEFS_ATTR(lookup_latency, SIMPLEFS_ATTR_LATENCY, SIMPLEFS_OP_LOOKUP);
+SIMPLEFS_ATTR(create_latency, SIMPLEFS_ATTR_LATENCY, SIMPLEFS_OP_CREATE);
+SIMPLEFS_ATTR(read_latency, SIMPLEFS_ATTR_LATENCY, SIMPLEFS_OP_READ);
+SIMPLEFS_ATTR(write_latency, SIMPLEFS_ATTR_LATENCY, SIMPLEFS_OP_WRITE);
+SIMPLEFS_ATTR(inode_save_latency, SIMPLEFS_ATTR_LATENCY, SIMPLEFS_OP_INODE_SAVE);
+
+SIMPLEFS_ATTR(free_extents, SIMPLEFS_ATTR_FREE_EXTENTS, 0);
+
+static struct attribute *simplefs_attrs[] = {
+	&simplefs_attr_lookup_hits.attr,
+	&simplefs_attr_lookup_misses.attr,
+	&simplefs_attr_blocks_allocated.attr,
+	&simplefs_attr_inodes_allocated.attr,
+	&simplefs_attr_journal_handles.attr,
+	&simplefs_attr_blocks_deduplicated.attr,
+	&simplefs_attr_sb_lock_contended.attr,
+	&simplefs_attr_sb_lock_wait_ns.attr,
+	&simplefs_attr_inodes_lock_contended.attr,
+	&simplefs_attr_inodes_lock_wait_ns.attr,
+	&simplefs_attr_dir_lock_contended.attr,
+	&simplefs_attr_dir_lock_wait_ns.attr,
+	&simplefs_attr_range_lock_contended.attr,
+	&simplefs_attr_range_lock_wait_ns.attr,
+	&simplefs_attr_lookup_latency.attr,
+	&simplefs_attr_create_latency.attr,
+	&simplefs_attr_read_latency.attr,
+	&simplefs_attr_write_latency.attr,
+	&simplefs_attr_inode_save_latency.attr,
+	&simplefs_attr_free_extents.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(simplefs);
+
+/* Add up what every CPU has for the u64 at the given offset of
+ * struct simplefs_stats */
+static u64 simplefs_stats_sum(struct simplefs_sb_info *sbi, size_t offset)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(u64 *)((char *)per_cpu_ptr(sbi->stats, cpu) + offset);
+	return sum;
+}
+
+/* This one reads the block bitmaps through the super block. Unmount
+ * holds s_umount for writing until it has removed the file, and waits
+ * for readers of it to finish, so it is only tried here. */
+static ssize_t simplefs_free_extents_show(struct simplefs_sb_info *sbi, char *buf)
+{
+	u64 counts[SIMPLEFS_FREE_EXTENT_BUCKETS] = { 0 };
+	struct super_block *sb = sbi->vsb;
+	ssize_t len = 0;
+	int i, last = -1, ret;
+
+	if (!down_read_trylock(&sb->s_umount))
+		return -EBUSY;
+	ret = sb->s_flags & SB_ACTIVE ? simplefs_sb_free_extents(sb, counts) : -ENODEV;
+	up_read(&sb->s_umount);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < SIMPLEFS_FREE_EXTENT_BUCKETS; i++)
+		if (counts[i])
+			last = i;
+	for (i = 0; i <= last; i++)
+		len += sysfs_emit_at(buf, len, "%llu %llu\n", 1ULL << i, counts[i]);
+	return len;
+}
+
+static ssize_t simplefs_attr_show(struct kobject *kobj,
+				  struct attribute *attr, char *buf)
+{
+	struct simplefs_sb_info *sbi = container_of(kobj, struct simplefs_sb_info, kobj);
+	struct simplefs_attr *a = container_of(attr, struct simplefs_attr, attr);
+	u64 counts[SIMPLEFS_LATENCY_BUCKETS];
+	ssize_t len = 0;
+	int i, last = -1;
+
+	switch (a->kind) {
+	case SIMPLEFS_ATTR_COUNT:
+		return sysfs_emit(buf, "%llu\n", simplefs_stats_sum(sbi,
+			offsetof(struct simplefs_stats, count[a->index])));
+	case SIMPLEFS_ATTR_LOCK_CONTENDED:
+		return sysfs_emit(buf, "%llu\n", simplefs_stats_sum(sbi,
+			offsetof(struct simplefs_stats, lock_contended[a->index])));
+	case SIMPLEFS_ATTR_LOCK_WAIT_NS:
+		return sysfs_emit(buf, "%llu\n", simplefs_stats_sum(sbi,
+			offsetof(struct simplefs_stats, lock_wait_ns[a->index])));
+	case SIMPLEFS_ATTR_FREE_EXTENTS:
+		return simplefs_free_extents_show(sbi, buf);
+	case SIMPLEFS_ATTR_LATENCY:
+		break;
+	}
+
+	for (i = 0; i < SIMPLEFS_LATENCY_BUCKETS; i++) {
+		counts[i] = simplefs_stats_sum(sbi,
+			offsetof(struct simplefs_stats, latency[a->index][i]));
+		if (counts[i])
+			last = i;
+	}
+	for (i = 0; i <= last; i++)
+		len += sysfs_emit_at(buf, len, "%llu %llu\n", 1ULL << i, counts[i]);
+	return len;
+}
+
+static const struct sysfs_ops simplefs_attr_ops = {
+	.show = simplefs_attr_show,
+};
+
+static void simplefs_sb_release(struct kobject *kobj)
+{
+	struct simplefs_sb_info *sbi = container_of(kobj, struct simplefs_sb_info, kobj);
+
+	complete(&sbi->kobj_unregister);
+}
+
+static struct kobj_type simplefs_sb_ktype = {
+	.default_groups = simplefs_groups,
+	.sysfs_ops = &simplefs_attr_ops,
+	.release = simplefs_sb_release,
+};
+
+/* /sys/fs/simplefs */
+static struct kset *simplefs_kset;
+
+int simplefs_sysfs_register(struct super_block *sb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+	int ret;
+
+	init_completion(&sbi->kobj_unregister);
+	sbi->kobj.kset = simplefs_kset;
+	ret = kobject_init_and_add(&sbi->kobj, &simplefs_sb_ktype, NULL,
+				   "%s", sb->s_id);
+	if (ret) {
+		kobject_put(&sbi->kobj);
+		wait_for_completion(&sbi->kobj_unregister);
+	}
+	return ret;
+}
+
+/* The stats must stay around until nobody has the files open anymore */
+void simplefs_sysfs_unregister(struct super_block *sb)
+{
+	struct simplefs_sb_info *sbi = SIMPLEFS_SB_INFO(sb);
+
+	kobject_del(&sbi->kobj);
+	kobject_put(&sbi->kobj);
+	wait_for_completion(&sbi->kobj_unregister);
+}
+
+int simplefs_sysfs_init(void)
+{
+	simplefs_kset = kset_create_and_add("simplefs", NULL, fs_kobj);
+	return simplefs_kset ? 0 : -ENOMEM;
+}
+
+void simplefs_sysfs_exit(void)
+{
+	kset_unregister(simplefs_kset);
+}
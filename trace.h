@@ -0,0 +1,375 @@
+/*
+ * Tracepoints for simplefs. They cost a static branch when disabled:
+ *
+ *	echo 1 > /sys/kernel/tracing/events/simplefs/enable
+ *	perf trace -e 'simplefs:*'
+ *	bpftrace -e 'tracepoint:simplefs:simplefs_write { @[args->latency] = count(); }'
+ *
+ * Latencies are in nanoseconds. Lookups, creates, reads, writes and
+ * inode saves are always timed, for the histograms in sysfs (sysfs.c).
+ * Block allocations and journal handles are only timed while their
+ * event is enabled (see simplefs_trace_clock() in simple.c), and show 0
+ * when it got enabled in the middle of one.
+ *
+ * License: Creative Commons Zero License - http://creativecommons.org/publicdomain/zero/1.0/
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM simplefs
+
+#if !defined(_SIMPLEFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SIMPLEFS_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/timekeeping.h>
+
+#include "super.h"
+
+#define simplefs_trace_latency(start) ((start) ? ktime_get_ns() - (start) : 0)
+
+TRACE_EVENT(simplefs_lookup,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, u64 ino, u64 start),
+
+	TP_ARGS(dir, dentry, ino, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, dir)
+		__field(u64, ino)
+		__field(u64, latency)
+		__string(name, dentry->d_name.name)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		__entry->latency = simplefs_trace_latency(start);
+		__assign_str(name, dentry->d_name.name);
+	),
+
+	/* ino 0 is a miss */
+	TP_printk("dev %d,%d dir %llu name %s ino %llu latency %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __get_str(name), __entry->ino, __entry->latency)
+);
+
+TRACE_EVENT(simplefs_create,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode, int ret,
+		 u64 start),
+
+	TP_ARGS(dir, dentry, mode, ret, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, dir)
+		__field(u64, ino)
+		__field(u64, block)
+		__field(u64, latency)
+		__field(umode_t, mode)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->ino = ret ? 0 : d_inode(dentry)->i_ino;
+		__entry->block = ret ? 0 :
+			SIMPLEFS_INODE(d_inode(dentry))->data_block_number;
+		__entry->latency = simplefs_trace_latency(start);
+		__entry->mode = mode;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d dir %llu ino %llu mode 0%o block %llu ret %d latency %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		  __entry->ino, __entry->mode, __entry->block, __entry->ret,
+		  __entry->latency)
+);
+
+/* block is the first of a run of count blocks */
+TRACE_EVENT(simplefs_alloc_block,
+	TP_PROTO(struct super_block *sb, u64 block, u64 count, int ret, u64 start),
+
+	TP_ARGS(sb, block, count, ret, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, block)
+		__field(u64, count)
+		__field(u64, latency)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->block = block;
+		__entry->count = count;
+		__entry->latency = simplefs_trace_latency(start);
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d block %llu count %llu ret %d latency %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->block,
+		  __entry->count, __entry->ret, __entry->latency)
+);
+
+DECLARE_EVENT_CLASS(simplefs_rw,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret,
+		 u64 start),
+
+	TP_ARGS(inode, pos, len, ret, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(loff_t, pos)
+		__field(size_t, len)
+		__field(ssize_t, ret)
+		__field(u64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->len = len;
+		__entry->ret = ret;
+		__entry->latency = simplefs_trace_latency(start);
+	),
+
+	TP_printk("dev %d,%d ino %llu pos %lld len %zu ret %zd latency %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->pos, __entry->len, __entry->ret, __entry->latency)
+);
+
+DEFINE_EVENT(simplefs_rw, simplefs_read,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret,
+		 u64 start),
+	TP_ARGS(inode, pos, len, ret, start)
+);
+
+DEFINE_EVENT(simplefs_rw, simplefs_write,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret,
+		 u64 start),
+	TP_ARGS(inode, pos, len, ret, start)
+);
+
+TRACE_EVENT(simplefs_inode_save,
+	TP_PROTO(struct super_block *sb, struct simplefs_inode *inode, int ret),
+
+	TP_ARGS(sb, inode, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u64, block)
+		__field(u64, size)
+		__field(int, ret)
+	),
+
+	/* size is the children count for a directory */
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = inode->inode_no;
+		__entry->block = inode->data_block_number;
+		__entry->size = inode->file_size;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d ino %llu block %llu size %llu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->block, __entry->size, __entry->ret)
+);
+
+TRACE_EVENT(simplefs_journal_start,
+	TP_PROTO(struct inode *inode, int nblocks),
+
+	TP_ARGS(inode, nblocks),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(int, nblocks)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->nblocks = nblocks;
+	),
+
+	TP_printk("dev %d,%d ino %llu nblocks %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->nblocks)
+);
+
+TRACE_EVENT(simplefs_journal_stop,
+	TP_PROTO(struct inode *inode, int ret, u64 start),
+
+	TP_ARGS(inode, ret, start),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u64, latency)
+		__field(int, ret)
+	),
+
+	/* The latency runs from the start of the handle, and so includes
+	 * the commit that a synchronous handle waits for */
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->latency = simplefs_trace_latency(start);
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d ino %llu ret %d latency %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->ret, __entry->latency)
+);
+
+/* A clone of the count blocks from block on, made by FICLONE, FICLONERANGE
+ * or copy_file_range. -EINVAL is a range that cannot be shared, which
+ * copy_file_range copies instead. */
+TRACE_EVENT(simplefs_clone,
+	TP_PROTO(struct inode *src, struct inode *dst, u64 block, u64 count,
+		 int ret),
+
+	TP_ARGS(src, dst, block, count, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, src)
+		__field(u64, dst)
+		__field(u64, block)
+		__field(u64, count)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = src->i_sb->s_dev;
+		__entry->src = src->i_ino;
+		__entry->dst = dst->i_ino;
+		__entry->block = block;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d src %llu dst %llu block %llu count %llu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->src,
+		  __entry->dst, __entry->block, __entry->count, __entry->ret)
+);
+
+/* A change to a compressed file, which rewrote count clusters from
+ * cluster on, in place or (moved) in a new run of blocks */
+TRACE_EVENT(simplefs_compress,
+	TP_PROTO(struct inode *inode, u64 cluster, u64 count, int moved, int ret),
+
+	TP_ARGS(inode, cluster, count, moved, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u64, cluster)
+		__field(u64, count)
+		__field(int, moved)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->cluster = cluster;
+		__entry->count = count;
+		__entry->moved = moved;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d ino %llu cluster %llu count %llu moved %d ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->cluster, __entry->count, __entry->moved, __entry->ret)
+);
+
+TRACE_EVENT(simplefs_defrag,
+	TP_PROTO(struct inode *inode, u64 from, u64 to, u64 count, int ret),
+
+	TP_ARGS(inode, from, to, count, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u64, from)
+		__field(u64, to)
+		__field(u64, count)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->from = from;
+		__entry->to = to;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d ino %llu from %llu to %llu count %llu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->from, __entry->to, __entry->count, __entry->ret)
+);
+
+TRACE_EVENT(simplefs_delalloc_flush,
+	TP_PROTO(struct inode *inode, u64 start, u64 count, int ret),
+
+	TP_ARGS(inode, start, count, ret),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+		__field(u64, start)
+		__field(u64, count)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->start = start;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+
+	TP_printk("dev %d,%d ino %llu start %llu count %llu ret %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		  __entry->start, __entry->count, __entry->ret)
+);
+
+TRACE_EVENT(simplefs_destroy_inode,
+	TP_PROTO(struct inode *inode),
+
+	TP_ARGS(inode),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ino)
+	),
+
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+	),
+
+	TP_printk("dev %d,%d ino %llu",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino)
+);
+
+#endif /* _SIMPLEFS_TRACE_H */
+
+/* This part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>